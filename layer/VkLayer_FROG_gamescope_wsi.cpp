@@ -21,6 +21,8 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "../src/messagey.h"
 
@@ -170,6 +172,29 @@ namespace GamescopeWSILayer {
     return s_minImageCount;
   }
 
+  // Opt-in "just-in-time" frame pacing.
+  // Delays the app's next frame start in AcquireNextImage so that its
+  // present lands just before gamescope's predicted latch, instead of
+  // rendering a frame early and having it sit in the FIFO queue.
+  static bool getLowLatencyPacing() {
+    static bool s_lowLatencyPacing = []() -> bool {
+      bool enabled = parseEnv<bool>("GAMESCOPE_WSI_LOW_LATENCY_PACING").value_or(false);
+      if (enabled)
+        fprintf(stderr, "[Gamescope WSI] Low latency pacing enabled by GAMESCOPE_WSI_LOW_LATENCY_PACING.\n");
+      return enabled;
+    }();
+    return s_lowLatencyPacing;
+  }
+
+  // Extra slack on top of the app's estimated frame time to account for
+  // gamescope's own latch redzone and scheduling jitter.
+  static uint64_t getLowLatencyPacingMarginNanos() {
+    static uint64_t s_marginNanos = []() -> uint64_t {
+      return uint64_t(parseEnv<uint32_t>("GAMESCOPE_WSI_LOW_LATENCY_PACING_MARGIN_US").value_or(2'000)) * 1'000ul;
+    }();
+    return s_marginNanos;
+  }
+
   static bool getEnsureMinImageCount() {
     static bool s_ensureMinImageCount = []() -> bool {
       if (auto ensure = parseEnv<bool>("GAMESCOPE_WSI_ENSURE_MIN_IMAGE_COUNT")) {
@@ -322,29 +347,64 @@ namespace GamescopeWSILayer {
   // TODO: Maybe move to Wayland event or something.
   // This just utilizes the same code as the Mesa path used
   // for without the layer or GL though. Need to keep it around anyway.
-  static std::mutex gamescopeSwapchainLimiterFDMutex;
-  static uint32_t gamescopeFrameLimiterOverride() {
-    const char *path = getenv("GAMESCOPE_LIMITER_FILE");
-    if (!path)
-        return 0;
-
+  //
+  // Newer gamescope publishes a full control page in this file, which we map
+  // once and then read with plain loads. Older gamescope only writes the
+  // limiter value, in which case we fall back to pread.
+  struct GamescopeLimiterFile {
     int fd = -1;
-    {
-      std::unique_lock lock(gamescopeSwapchainLimiterFDMutex);
+    const GamescopeLayerClient::ControlPage *page = nullptr;
+  };
 
-      static int s_limiterFD = -1;
+  static const GamescopeLimiterFile& gamescopeLimiterFile() {
+    static const GamescopeLimiterFile s_limiterFile = []() {
+      GamescopeLimiterFile file;
+
+      const char *path = getenv("GAMESCOPE_LIMITER_FILE");
+      if (!path)
+        return file;
+
+      file.fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (file.fd < 0)
+        return file;
+
+      struct stat st;
+      if (fstat(file.fd, &st) == 0 && size_t(st.st_size) >= sizeof(GamescopeLayerClient::ControlPage)) {
+        void *mapping = mmap(nullptr, sizeof(GamescopeLayerClient::ControlPage), PROT_READ, MAP_SHARED, file.fd, 0);
+        if (mapping != MAP_FAILED) {
+          auto *page = reinterpret_cast<const GamescopeLayerClient::ControlPage *>(mapping);
+          if (page->IsValid())
+            file.page = page;
+          else
+            munmap(mapping, sizeof(GamescopeLayerClient::ControlPage));
+        }
+      }
 
-      if (s_limiterFD < 0)
-        s_limiterFD = open(path, O_RDONLY);
+      return file;
+    }();
 
-      fd = s_limiterFD;
-    }
+    return s_limiterFile;
+  }
 
-    if (fd < 0)
+  static std::optional<GamescopeLayerClient::ControlPageSnapshot> gamescopeControlPage() {
+    const GamescopeLimiterFile& file = gamescopeLimiterFile();
+    if (!file.page)
+      return std::nullopt;
+
+    return file.page->Read();
+  }
+
+  static uint32_t gamescopeFrameLimiterOverride() {
+    const GamescopeLimiterFile& file = gamescopeLimiterFile();
+
+    if (file.page)
+      return file.page->u32LimiterOverride.load(std::memory_order_relaxed);
+
+    if (file.fd < 0)
         return 0;
 
     uint32_t overrideValue = 0;
-    pread(fd, &overrideValue, sizeof(overrideValue), 0);
+    pread(file.fd, &overrideValue, sizeof(overrideValue), 0);
     return overrideValue;
   }
 
@@ -384,7 +444,7 @@ namespace GamescopeWSILayer {
           wl_registry_bind(registry, name, &wl_compositor_interface, version));
       } else if (interface == "gamescope_swapchain_factory_v2"sv) {
         objects->gamescopeSwapchainFactory = reinterpret_cast<gamescope_swapchain_factory_v2 *>(
-          wl_registry_bind(registry, name, &gamescope_swapchain_factory_v2_interface, version));
+          wl_registry_bind(registry, name, &gamescope_swapchain_factory_v2_interface, std::min<uint32_t>(version, gamescope_swapchain_factory_v2_interface.version)));
       }
     },
     .global_remove = [](void* data, wl_registry* registry, uint32_t name) {
@@ -414,6 +474,9 @@ namespace GamescopeWSILayer {
     // Cached for comparison.
     std::optional<VkRect2D> cachedWindowRect;
 
+    // Last optimal_extent hint from Gamescope, if any.
+    std::optional<VkExtent2D> optimalExtent;
+
     bool isWayland() const {
       // Is native Wayland?
       return connection == nullptr;
@@ -423,6 +486,18 @@ namespace GamescopeWSILayer {
       return !!(flags & GamescopeLayerClient::Flag::FrameLimiterAware);
     }
 
+    // The extent we advertise as currentExtent for a window of this size.
+    // Clamped to the optimal extent hint if Gamescope would just downscale us.
+    VkExtent2D getCurrentExtent(VkExtent2D windowExtent) const {
+      if (!optimalExtent)
+        return windowExtent;
+
+      if (optimalExtent->width >= windowExtent.width && optimalExtent->height >= windowExtent.height)
+        return windowExtent;
+
+      return *optimalExtent;
+    }
+
     bool shouldExposeHDR() const {
       const bool hdrAllowed = !(flags & GamescopeLayerClient::Flag::DisableHDR);
       return hdrOutput && hdrAllowed;
@@ -505,10 +580,166 @@ namespace GamescopeWSILayer {
     VkExtent2D extent;
     uint32_t serverId = 0;
     bool retired = false;
+    std::optional<VkExtent2D> optimalExtent;
+    // Until then, the surface keeps the hint an older swapchain got.
+    bool receivedOptimalExtent = false;
 
     std::unique_ptr<std::mutex> presentTimingMutex = std::make_unique<std::mutex>();
     std::vector<VkPastPresentationTimingGOOGLE> pastPresentTimings;
     uint64_t refreshCycle = 16'666'666;
+
+    // Low latency pacing state.
+    VkPresentModeKHR lastPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    uint64_t lastAcquireTime = 0;
+    // CPU time from AcquireNextImage to QueuePresent.
+    uint64_t frameTimeEstimate = 0;
+    uint64_t lastTargetVBlank = 0;
+    // Vblank the frame being recorded was paced for, 0 if it was not.
+    uint64_t pacingTargetVBlank = 0;
+    uint64_t pacingRefreshCycle = 0;
+    uint32_t nextPacingPresentId = 0;
+
+    // Frames we paced that gamescope has yet to report a present time for.
+    // Frames the app did not give a present ID get one of ours, which is
+    // not passed on to GetPastPresentationTimingGOOGLE.
+    // Guarded by presentTimingMutex, like everything below.
+    struct PacedPresent {
+      uint32_t presentId;
+      bool layerPresentId;
+      uint64_t targetVBlank;
+      uint64_t refreshCycle;
+      uint64_t gpuTimeEstimate;
+    };
+    std::vector<PacedPresent> pacedPresents;
+    // The GPU work submitted before present is not in the CPU frame time,
+    // so this is learned from when frames actually made it to the screen.
+    uint64_t gpuTimeEstimate = 0;
+    // Frames left to not pace for after a paced frame missed its vblank.
+    uint32_t pacingBackoffFrames = 0;
+
+    static constexpr uint32_t PacingBackoffFrames = 32;
+
+    void updateFrameTimeEstimate(uint64_t now) {
+      if (!lastAcquireTime || now < lastAcquireTime)
+        return;
+
+      uint64_t frameTime = now - lastAcquireTime;
+      lastAcquireTime = 0;
+
+      // Grow immediately so a slow frame does not make us miss the next
+      // vblank too, shrink slowly.
+      if (frameTime >= frameTimeEstimate)
+        frameTimeEstimate = frameTime;
+      else
+        frameTimeEstimate = (frameTimeEstimate * 15 + frameTime) / 16;
+    }
+
+    // Called with presentTimingMutex held, returns whether the present ID was
+    // one of ours.
+    bool onPacedPresentTiming(uint32_t presentId, uint64_t actualPresentTime) {
+      auto iter = std::find_if(pacedPresents.begin(), pacedPresents.end(),
+        [&](const PacedPresent& paced) { return paced.presentId == presentId; });
+      if (iter == pacedPresents.end())
+        return false;
+
+      const PacedPresent paced = *iter;
+      // Timings come back in order, anything before this was dropped.
+      pacedPresents.erase(pacedPresents.begin(), iter + 1);
+
+      if (actualPresentTime > paced.targetVBlank + paced.refreshCycle / 2) {
+        // Missed the vblank we slept the app for. Most likely it's GPU bound
+        // and we only know how long it takes on the CPU, so give the GPU
+        // more room. Base it on what this frame had, so that the frames
+        // already in flight with the same budget do not pile onto it.
+        const uint64_t slip = actualPresentTime - paced.targetVBlank;
+        gpuTimeEstimate = std::min(std::max(gpuTimeEstimate, paced.gpuTimeEstimate + slip / 2), 2 * paced.refreshCycle);
+        // And let the FIFO queue absorb it for a while rather than dropping
+        // more frames.
+        pacingBackoffFrames = PacingBackoffFrames;
+      } else {
+        // Made it, slowly give back the time in case the GPU load went down.
+        gpuTimeEstimate -= gpuTimeEstimate / 32;
+      }
+
+      return paced.layerPresentId;
+    }
+
+    // Called from QueuePresent for the frame that was acquired last,
+    // returns the present ID gamescope should report the timing under if
+    // the app did not give one.
+    std::optional<uint32_t> onPacedPresent(std::optional<uint32_t> appPresentId) {
+      if (!pacingTargetVBlank)
+        return std::nullopt;
+
+      std::unique_lock lock(*presentTimingMutex);
+      if (pacedPresents.size() >= MaxPastPresentationTimes)
+        pacedPresents.erase(pacedPresents.begin());
+
+      std::optional<uint32_t> layerPresentId;
+      if (!appPresentId)
+        layerPresentId = nextPacingPresentId++;
+
+      pacedPresents.emplace_back(PacedPresent {
+        .presentId       = appPresentId ? *appPresentId : *layerPresentId,
+        .layerPresentId  = !appPresentId,
+        .targetVBlank    = pacingTargetVBlank,
+        .refreshCycle    = pacingRefreshCycle,
+        .gpuTimeEstimate = gpuTimeEstimate,
+      });
+      pacingTargetVBlank = 0;
+
+      return layerPresentId;
+    }
+
+    std::optional<uint64_t> computePacingDeadline(uint64_t now) {
+      pacingTargetVBlank = 0;
+
+      if (lastPresentMode != VK_PRESENT_MODE_FIFO_KHR && lastPresentMode != VK_PRESENT_MODE_FIFO_RELAXED_KHR)
+        return std::nullopt;
+
+      auto controlPage = gamescopeControlPage();
+      if (!controlPage || !controlPage->ulRefreshCycle || !controlPage->ulNextVBlank)
+        return std::nullopt;
+
+      // No point in pacing anything under VRR, the latch just follows the app.
+      if (controlPage->u32PresentModeHints & GamescopeLayerClient::ControlPageHint::VRR)
+        return std::nullopt;
+
+      std::unique_lock lock(*presentTimingMutex);
+      if (pacingBackoffFrames) {
+        pacingBackoffFrames--;
+        lastTargetVBlank = 0;
+        return std::nullopt;
+      }
+
+      const uint64_t cycle = controlPage->ulRefreshCycle;
+      const uint64_t budget = frameTimeEstimate + gpuTimeEstimate + getLowLatencyPacingMarginNanos();
+
+      // Earliest vblank we can still make if we started right now.
+      uint64_t targetVBlank = controlPage->ulNextVBlank;
+      if (targetVBlank < now + budget)
+        targetVBlank += ((now + budget - targetVBlank + cycle - 1) / cycle) * cycle;
+
+      // FIFO shows at most one frame per vblank, so a frame targeting the
+      // same vblank as the last one would be shown a vblank later anyway,
+      // after sitting in the queue. Wait for that vblank before starting it
+      // instead, which is the latency this is here to remove.
+      // The cycle is the limited one if gamescope is limiting the app.
+      while (lastTargetVBlank && targetVBlank < lastTargetVBlank + cycle / 2)
+        targetVBlank += cycle;
+
+      lastTargetVBlank = targetVBlank;
+
+      uint64_t deadline = targetVBlank - budget;
+      // If the estimate is stale or we are way off (eg. a mode change),
+      // do not sleep the app for ages.
+      if (deadline <= now || deadline - now > 2 * cycle)
+        return std::nullopt;
+
+      pacingTargetVBlank = targetVBlank;
+      pacingRefreshCycle = cycle;
+      return deadline;
+    }
   };
   VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(GamescopeSwapchain, VkSwapchainKHR);
   static constexpr gamescope_swapchain_listener s_swapchainListener = {
@@ -526,10 +757,14 @@ namespace GamescopeWSILayer {
             uint32_t present_margin_lo) {
       GamescopeSwapchainData *swapchain = reinterpret_cast<GamescopeSwapchainData*>(data);
       std::unique_lock lock(*swapchain->presentTimingMutex);
+      const uint64_t actualPresentTime = (uint64_t(actual_present_time_hi) << 32) | actual_present_time_lo;
+      if (swapchain->onPacedPresentTiming(present_id, actualPresentTime))
+        return;
+
       swapchain->pastPresentTimings.emplace_back(VkPastPresentationTimingGOOGLE {
         .presentID           = present_id,
         .desiredPresentTime  = (uint64_t(desired_present_time_hi) << 32) | desired_present_time_lo,
-        .actualPresentTime   = (uint64_t(actual_present_time_hi) << 32) | actual_present_time_lo,
+        .actualPresentTime   = actualPresentTime,
         .earliestPresentTime = (uint64_t(earliest_present_time_hi) << 32) | earliest_present_time_lo,
         .presentMargin       = (uint64_t(present_margin_hi) << 32) | present_margin_lo
       });
@@ -560,6 +795,20 @@ namespace GamescopeWSILayer {
       }
       fprintf(stderr, "[Gamescope WSI] Swapchain retired\n");
     },
+
+    .optimal_extent = [](
+            void *data,
+            gamescope_swapchain *object,
+            uint32_t width,
+            uint32_t height) {
+      GamescopeSwapchainData *swapchain = reinterpret_cast<GamescopeSwapchainData*>(data);
+      if (width && height)
+        swapchain->optimalExtent = VkExtent2D{ width, height };
+      else
+        swapchain->optimalExtent = std::nullopt;
+      swapchain->receivedOptimalExtent = true;
+      fprintf(stderr, "[Gamescope WSI] Swapchain received new optimal extent: %ux%u\n", width, height);
+    },
   };
 
   class VkInstanceOverrides {
@@ -845,7 +1094,7 @@ namespace GamescopeWSILayer {
         if (!rect)
           return VK_ERROR_SURFACE_LOST_KHR;
 
-        pSurfaceCapabilities->currentExtent = rect->extent;
+        pSurfaceCapabilities->currentExtent = gamescopeSurface->getCurrentExtent(rect->extent);
       }
       pSurfaceCapabilities->minImageCount = getMinImageCount();
 
@@ -888,7 +1137,7 @@ namespace GamescopeWSILayer {
         if (!rect)
           return VK_ERROR_SURFACE_LOST_KHR;
 
-        pSurfaceCapabilities->surfaceCapabilities.currentExtent = rect->extent;
+        pSurfaceCapabilities->surfaceCapabilities.currentExtent = gamescopeSurface->getCurrentExtent(rect->extent);
       }
       pSurfaceCapabilities->surfaceCapabilities.minImageCount = getMinImageCount();
 
@@ -1131,7 +1380,7 @@ namespace GamescopeWSILayer {
           if (!rect)
             return VK_ERROR_SURFACE_LOST_KHR;
 
-          swapchainInfo.imageExtent = rect->extent;
+          swapchainInfo.imageExtent = gamescopeSurface->getCurrentExtent(rect->extent);
         }
       }
 
@@ -1238,6 +1487,7 @@ namespace GamescopeWSILayer {
           .serverId            = serverId,
         });
         gamescopeSwapchain->pastPresentTimings.reserve(MaxPastPresentationTimes);
+        gamescopeSwapchain->pacedPresents.reserve(MaxPastPresentationTimes);
 
         gamescope_swapchain_add_listener(gamescopeSwapchainObject, &s_swapchainListener, reinterpret_cast<void*>(gamescopeSwapchain.get()));
       }
@@ -1288,12 +1538,33 @@ namespace GamescopeWSILayer {
             VkDevice                   device,
       const VkAcquireNextImageInfoKHR* pAcquireInfo,
             uint32_t*                  pImageIndex) {
+      std::optional<uint64_t> pacingDeadline;
       if (auto gamescopeSwapchain = GamescopeSwapchain::get(pAcquireInfo->swapchain)) {
         if (gamescopeSwapchain->retired)
           return VK_ERROR_OUT_OF_DATE_KHR;
+
+        if (getLowLatencyPacing())
+          pacingDeadline = gamescopeSwapchain->computePacingDeadline(getTimeMonotonic());
       }
 
-      return pDispatch->AcquireNextImage2KHR(device, pAcquireInfo, pImageIndex);
+      // Sleep outside of the swapchain map lock.
+      if (pacingDeadline) {
+        timespec deadline = {
+          .tv_sec  = time_t(*pacingDeadline / 1'000'000'000ul),
+          .tv_nsec = long(*pacingDeadline % 1'000'000'000ul),
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR)
+          ;
+      }
+
+      VkResult result = pDispatch->AcquireNextImage2KHR(device, pAcquireInfo, pImageIndex);
+
+      if (getLowLatencyPacing() && result >= VK_SUCCESS) {
+        if (auto gamescopeSwapchain = GamescopeSwapchain::get(pAcquireInfo->swapchain))
+          gamescopeSwapchain->lastAcquireTime = getTimeMonotonic();
+      }
+
+      return result;
     }
 
     static VkResult QueuePresentKHR(
@@ -1313,6 +1584,7 @@ namespace GamescopeWSILayer {
             return VK_ERROR_OUT_OF_DATE_KHR;
           }
 
+          std::optional<uint32_t> appPresentId;
           if (pPresentTimes && pPresentTimes->pTimes) {
             assert(pPresentTimes->swapchainCount == presentInfo.swapchainCount);
 
@@ -1324,6 +1596,14 @@ namespace GamescopeWSILayer {
               pPresentTimes->pTimes[i].presentID,
               pPresentTimes->pTimes[i].desiredPresentTime >> 32,
               pPresentTimes->pTimes[i].desiredPresentTime & 0xffffffff);
+            appPresentId = pPresentTimes->pTimes[i].presentID;
+          }
+
+          // Have gamescope tell us when paced frames got shown, so we
+          // know if they made it.
+          if (getLowLatencyPacing()) {
+            if (auto layerPresentId = gamescopeSwapchain->onPacedPresent(appPresentId))
+              gamescope_swapchain_set_present_time(gamescopeSwapchain->object, *layerPresentId, 0, 0);
           }
 
           assert(display == nullptr || display == gamescopeSwapchain->display);
@@ -1393,6 +1673,11 @@ namespace GamescopeWSILayer {
             if (forceFifo && !frameLimiterAware)
               presentMode = VK_PRESENT_MODE_FIFO_KHR;
             gamescope_swapchain_set_present_mode(gamescopeSwapchain->object, uint32_t(presentMode));
+
+            if (getLowLatencyPacing()) {
+              gamescopeSwapchain->lastPresentMode = presentMode;
+              gamescopeSwapchain->updateFrameTimeEstimate(getTimeMonotonic());
+            }
           }
         }
       }
@@ -1436,14 +1721,27 @@ namespace GamescopeWSILayer {
             }
           }
 
+          // Let the app know if it could be rendering at a smaller size
+          // as we would only be downscaling its images afterwards.
+          bool optimalExtentChanged = false;
+          if (gamescopeSwapchain->receivedOptimalExtent) {
+            optimalExtentChanged = gamescopeSurface->optimalExtent != gamescopeSwapchain->optimalExtent;
+            gamescopeSurface->optimalExtent = gamescopeSwapchain->optimalExtent;
+          }
+
           // Emulate behaviour when currentExtent changes in X11 swapchain.
           if (!gamescopeSurface->isWayland() && !(gamescopeSurface->flags & GamescopeLayerClient::Flag::ForceSwapchainExtent)) {
             // gamescopeSurface->cachedWindowSize is set by canBypassXWayland.
             // TODO: Rename that to be some update cached vars thing, then read back canBypassXWayland.            
             if (gamescopeSurface->cachedWindowRect) {
+              const VkExtent2D currentExtent = gamescopeSurface->getCurrentExtent(gamescopeSurface->cachedWindowRect->extent);
               const bool windowSizeChanged = gamescopeSurface->cachedWindowRect->extent != gamescopeSwapchain->extent;
-              if (windowSizeChanged)
+              if (optimalExtentChanged && currentExtent != gamescopeSwapchain->extent) {
+                if (!(gamescopeSurface->flags & GamescopeLayerClient::Flag::NoSuboptimal))
+                  UpdateSwapchainResult(VK_SUBOPTIMAL_KHR);
+              } else if (windowSizeChanged && currentExtent != gamescopeSwapchain->extent) {
                 UpdateSwapchainResult(VK_ERROR_OUT_OF_DATE_KHR);
+              }
             } else {
               fprintf(stderr, "[Gamescope WSI] QueuePresentKHR: Failed to get cached window size for swapchain %u\n", i);
             }
@@ -63,6 +63,7 @@ namespace gamescope
         void Wayland_GamescopeControl_FeatureSupport( gamescope_control *pGamescopeControl, uint32_t uFeature, uint32_t uVersion, uint32_t uFlags );
         void Wayland_GamescopeControl_ActiveDisplayInfo( gamescope_control *pGamescopeControl, const char *pConnectorName, const char *pDisplayMake, const char *pDisplayModel, uint32_t uDisplayFlags, wl_array *pValidRefreshRatesArray );
         void Wayland_GamescopeControl_ScreenshotTaken( gamescope_control *pGamescopeControl, const char *pPath );
+        void Wayland_GamescopeControl_AppVRAMBudget( gamescope_control *pGamescopeControl, uint32_t uAppID, uint32_t uUsageMiB, uint32_t uBudgetMiB );
         static const gamescope_control_listener s_GamescopeControlListener;
 
         void Wayland_GamescopePrivate_Log( gamescope_private *pGamescopePrivate, const char *pText );
@@ -186,12 +187,18 @@ namespace gamescope
     {
         fprintf( stderr, "Screenshot taken to: %s\n", pPath );
     }
+    void GamescopeCtl::Wayland_GamescopeControl_AppVRAMBudget( gamescope_control *pGamescopeControl, uint32_t uAppID, uint32_t uUsageMiB, uint32_t uBudgetMiB )
+    {
+        fprintf( stderr, "App %u is using %u MiB of %u MiB VRAM\n", uAppID, uUsageMiB, uBudgetMiB );
+    }
 
     const gamescope_control_listener GamescopeCtl::s_GamescopeControlListener =
     {
         .feature_support     = WAYLAND_USERDATA_TO_THIS( GamescopeCtl, Wayland_GamescopeControl_FeatureSupport ),
         .active_display_info = WAYLAND_USERDATA_TO_THIS( GamescopeCtl, Wayland_GamescopeControl_ActiveDisplayInfo ),
         .screenshot_taken    = WAYLAND_USERDATA_TO_THIS( GamescopeCtl, Wayland_GamescopeControl_ScreenshotTaken ),
+        .app_performance_stats = WAYLAND_NULL(),
+        .app_vram_budget     = WAYLAND_USERDATA_TO_THIS( GamescopeCtl, Wayland_GamescopeControl_AppVRAMBudget ),
     };
 
     void GamescopeCtl::Wayland_GamescopePrivate_Log( gamescope_private *pGamescopePrivate, const char *pText )
@@ -226,6 +233,8 @@ namespace gamescope
                 return "Refresh Cycle Only Change Refresh Rate";
             case GAMESCOPE_CONTROL_FEATURE_MURA_CORRECTION:
                 return "Mura Correction";
+            case GAMESCOPE_CONTROL_FEATURE_VRAM_BUDGET:
+                return "VRAM Budget";
             default:
                 return "Unknown";
         }
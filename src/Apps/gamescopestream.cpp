@@ -369,7 +369,8 @@ on_stream_param_changed(void *_data, uint32_t id, const struct spa_pod *param)
     params[0] = (const struct spa_pod *) spa_pod_builder_add_object(&b,
         SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
         SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(8, 2, MAX_BUFFERS),
-        SPA_PARAM_BUFFERS_blocks,  SPA_POD_Int(1),
+        // Tiled/compressed modifiers can have more than one plane.
+        SPA_PARAM_BUFFERS_blocks,  SPA_POD_CHOICE_RANGE_Int(1, 1, 4),
         SPA_PARAM_BUFFERS_size,    SPA_POD_Int(data->stride * data->size.height),
         SPA_PARAM_BUFFERS_stride,  SPA_POD_Int(data->stride),
         SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int((1<<SPA_DATA_DmaBuf)));
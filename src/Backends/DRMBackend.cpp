@@ -14,6 +14,7 @@
 #include <cassert>
 #include <cinttypes>
 #include <climits>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
@@ -22,6 +23,7 @@
 #include <optional>
 #include <span>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -30,6 +32,7 @@
 #include "backend.h"
 #include "color_helpers.h"
 #include "Utils/Defer.h"
+#include "Utils/Trace.h"
 #include "drm_include.h"
 #include "edid.h"
 #include "gamescope_shared.h"
@@ -70,6 +73,10 @@ gamescope::ConVar<bool> cv_drm_debug_disable_ctm( "drm_debug_disable_ctm", false
 gamescope::ConVar<bool> cv_drm_debug_disable_color_encoding( "drm_debug_disable_color_encoding", false, "YUV Color Encoding chicken bit. (Forces COLOR_ENCODING to DEFAULT, does not affect other logic)" );
 gamescope::ConVar<bool> cv_drm_debug_disable_color_range( "drm_debug_disable_color_range", false, "YUV Color Range chicken bit. (Forces COLOR_RANGE to DEFAULT, does not affect other logic)" );
 gamescope::ConVar<bool> cv_drm_debug_disable_explicit_sync( "drm_debug_disable_explicit_sync", false, "Force disable explicit sync on the DRM backend." );
+gamescope::ConVar<bool> cv_drm_debug_disable_damage_clips( "drm_debug_disable_damage_clips", false, "FB_DAMAGE_CLIPS chicken bit. (Always report full damage, does not affect other logic)" );
+gamescope::ConVar<bool> cv_drm_partial_composite_mixed_colorspaces( "drm_partial_composite_mixed_colorspaces", true, "Allow partial composition of overlays with differing colorspaces by normalizing them to the output encoding." );
+gamescope::ConVar<bool> cv_drm_commit_thread( "drm_commit_thread", true, "Do the atomic commit and wait for its flip on a separate thread, so the compositor thread can get on with the next frame." );
+gamescope::ConVar<bool> cv_drm_reuse_partial_composite( "drm_reuse_partial_composite", true, "Skip the partial composite (and waiting on it) when the overlays have not changed since the last one." );
 gamescope::ConVar<bool> cv_drm_debug_disable_in_fence_fd( "drm_debug_disable_in_fence_fd", false, "Force disable IN_FENCE_FD being set to avoid over-synchronization on the DRM backend." );
 
 gamescope::ConVar<bool> cv_drm_allow_dynamic_modes_for_external_display( "drm_allow_dynamic_modes_for_external_display", false, "Allow dynamic mode/refresh rate switching for external displays." );
@@ -129,6 +136,10 @@ struct drm_t {
 
 	std::shared_ptr<gamescope::BackendBlob> sdr_static_metadata;
 
+	// FB_DAMAGE_CLIPS blobs for the request being built.
+	// Accessed only on req thread
+	std::array<std::shared_ptr<gamescope::BackendBlob>, k_nMaxLayers> damage_clips;
+
 	struct drm_state_t {
 		std::shared_ptr<gamescope::BackendBlob> mode_id;
 		uint32_t color_mgmt_serial;
@@ -317,6 +328,7 @@ namespace gamescope
 			std::optional<CDRMAtomicProperty> AMD_PLANE_LUT3D;
 			std::optional<CDRMAtomicProperty> AMD_PLANE_BLEND_TF;
 			std::optional<CDRMAtomicProperty> AMD_PLANE_BLEND_LUT;
+			std::optional<CDRMAtomicProperty> FB_DAMAGE_CLIPS;
 			std::optional<CDRMAtomicProperty> DUMMY_END;
 		};
 		      PlaneProperties &GetProperties()       { return m_Props; }
@@ -762,6 +774,7 @@ static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsi
 
 	drm_log.debugf("page_flip_handler %" PRIu64 " delta: %" PRIu64, pCtx->ulPendingFlipCount, vblanktime - ulLastVBlankTime );
 	gpuvis_trace_printf("page_flip_handler %" PRIu64, pCtx->ulPendingFlipCount);
+	gamescope::Trace::RecordInstant( "page_flip", pCtx->ulPendingFlipCount );
 
 	ulLastVBlankTime = vblanktime;
 
@@ -2065,6 +2078,7 @@ namespace gamescope
 			m_Props.AMD_PLANE_LUT3D          = CDRMAtomicProperty::Instantiate( "AMD_PLANE_LUT3D",          this, *rawProperties );
 			m_Props.AMD_PLANE_BLEND_TF       = CDRMAtomicProperty::Instantiate( "AMD_PLANE_BLEND_TF",       this, *rawProperties );
 			m_Props.AMD_PLANE_BLEND_LUT      = CDRMAtomicProperty::Instantiate( "AMD_PLANE_BLEND_LUT",      this, *rawProperties );
+			m_Props.FB_DAMAGE_CLIPS          = CDRMAtomicProperty::Instantiate( "FB_DAMAGE_CLIPS",          this, *rawProperties );
 		}
 	}
 
@@ -2563,6 +2577,54 @@ namespace gamescope
 	}
 }
 
+static bool
+drm_supports_damage_clips( struct drm_t *drm )
+{
+	// Only use it if every plane has it, so it can't affect which
+	// planes libliftoff is able to pick.
+	if ( drm->planes.empty() )
+		return false;
+
+	for ( std::unique_ptr< gamescope::CDRMPlane > &pPlane : drm->planes )
+	{
+		if ( !pPlane->GetProperties().FB_DAMAGE_CLIPS )
+			return false;
+	}
+
+	return true;
+}
+
+static uint32_t
+drm_damage_clips_blob( struct drm_t *drm, int nLayer, const gamescope::DamageRegion &damage )
+{
+	drm->damage_clips[ nLayer ] = nullptr;
+
+	if ( damage.IsFull() )
+		return 0;
+
+	std::array<drm_mode_rect, gamescope::DamageRegion::k_nMaxRects> rects;
+	uint32_t uRectCount = 0;
+	for ( const gamescope::DamageRegion::Rect_t &rect : damage.Rects() )
+	{
+		rects[ uRectCount++ ] = drm_mode_rect
+		{
+			.x1 = rect.nX1,
+			.y1 = rect.nY1,
+			.x2 = rect.nX2,
+			.y2 = rect.nY2,
+		};
+	}
+
+	// Nothing changed, but an empty blob isn't valid.
+	if ( uRectCount == 0 )
+		rects[ uRectCount++ ] = drm_mode_rect{ 0, 0, 1, 1 };
+
+	const uint8_t *pBegin = reinterpret_cast<const uint8_t *>( rects.data() );
+	drm->damage_clips[ nLayer ] = GetBackend()->CreateBackendBlob( typeid( drm_mode_rect ), std::span<const uint8_t>( pBegin, pBegin + uRectCount * sizeof( drm_mode_rect ) ) );
+
+	return drm->damage_clips[ nLayer ] ? drm->damage_clips[ nLayer ]->GetBlobValue() : 0;
+}
+
 static int
 drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo, bool needs_modeset )
 {
@@ -2581,6 +2643,7 @@ drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo, boo
 	}
 
 	bool bSinglePlane = frameInfo->layerCount < 2 && cv_drm_single_plane_optimizations;
+	bool bDamageClips = !cv_drm_debug_disable_damage_clips && drm_supports_damage_clips( drm );
 
 	for ( int i = 0; i < k_nMaxLayers; i++ )
 	{
@@ -2644,6 +2707,11 @@ drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo, boo
 			liftoff_layer_set_property( drm->lo_layers[ i ], "CRTC_W", entry.layerState[i].crtcW);
 			liftoff_layer_set_property( drm->lo_layers[ i ], "CRTC_H", entry.layerState[i].crtcH);
 
+			if ( bDamageClips )
+				liftoff_layer_set_property( drm->lo_layers[ i ], "FB_DAMAGE_CLIPS", drm_damage_clips_blob( drm, i, frameInfo->layers[ i ].scanoutDamage ) );
+			else
+				liftoff_layer_unset_property( drm->lo_layers[ i ], "FB_DAMAGE_CLIPS" );
+
 			if ( frameInfo->layers[i].applyColorMgmt )
 			{
 				bool bYCbCr = entry.layerState[i].ycbcr;
@@ -2740,6 +2808,7 @@ drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo, boo
 			liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_ENCODING" );
 			liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_RANGE" );
 			liftoff_layer_unset_property( drm->lo_layers[ i ], "pixel blend mode" );
+			liftoff_layer_unset_property( drm->lo_layers[ i ], "FB_DAMAGE_CLIPS" );
 
 			if ( drm_supports_color_mgmt( drm ) )
 			{
@@ -2847,6 +2916,8 @@ void drm_rollback( struct drm_t *drm )
  * negative errno on failure or if the scene-graph can't be presented directly. */
 int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo )
 {
+	GAMESCOPE_TRACE_SPAN( "drm_prepare" );
+
 	if ( !drm->pConnector )
 		return -EACCES;
 
@@ -3402,6 +3473,16 @@ namespace gamescope
 
 		virtual ~CDRMBackend()
 		{
+			if ( m_CommitThread.joinable() )
+			{
+				{
+					std::unique_lock lock( m_CommitMutex );
+					m_bCommitThreadRunning = false;
+				}
+				m_CommitCondition.notify_all();
+				m_CommitThread.join();
+			}
+
 			if ( g_DRM.fd != -1 )
 				finish_drm( &g_DRM );
 		}
@@ -3420,7 +3501,13 @@ namespace gamescope
 				return false;
 			}
 
-			return init_drm( &g_DRM, g_nPreferredOutputWidth, g_nPreferredOutputHeight, g_nNestedRefresh );
+			if ( !init_drm( &g_DRM, g_nPreferredOutputWidth, g_nPreferredOutputHeight, g_nNestedRefresh ) )
+				return false;
+
+			m_bCommitThreadRunning = true;
+			m_CommitThread = std::thread( [this]() { this->CommitThreadFunc(); } );
+
+			return true;
 		}
 
 		virtual bool PostInit() override
@@ -3511,6 +3598,8 @@ namespace gamescope
 			bool bDoComposite = true;
 			if ( !bNeedsFullComposite && !bWantsPartialComposite )
 			{
+				WaitForCommit();
+
 				int ret = drm_prepare( &g_DRM, bAsync, pFrameInfo );
 				if ( ret == 0 )
 					bDoComposite = false;
@@ -3525,11 +3614,22 @@ namespace gamescope
 			{
 				// Scanout + Planes Path
 				m_bWasPartialCompositing = false;
+				m_bWasNormalizingOverlays = false;
+				m_pLastPartialOverlayTex = nullptr;
 				m_bWasCompositing = false;
 				if ( pFrameInfo->layerCount == 2 )
 					m_nLastSingleOverlayZPos = pFrameInfo->layers[1].zpos;
 
-				return Commit( pFrameInfo );
+				// Textures uploaded from the CPU (cursor, mura) are not waited on
+				// when they are created, make sure the copy landed before scanning them out.
+				for ( int i = 0; i < pFrameInfo->layerCount; i++ )
+				{
+					const gamescope::Rc<CVulkanTexture> &pTex = pFrameInfo->layers[i].tex;
+					if ( pTex && pTex->uploadSeqNo() )
+						vulkan_wait( pTex->uploadSeqNo(), false );
+				}
+
+				return QueueCommit();
 			}
 
 			// Composition Path
@@ -3545,6 +3645,8 @@ namespace gamescope
 				bNeedsFullComposite = true;
 			}
 
+			bool bNormalizeOverlays = false;
+
 			if ( !bNeedsFullComposite )
 			{
 				// If we want to partial composite, fallback to full
@@ -3560,14 +3662,28 @@ namespace gamescope
 				// We can't just point it to random BDA or whatever, it has to be uploaded slowly
 				// thru registers which is SUPER SLOW.
 				// This avoids stutter.
+				bool bMixedOverlayColorspaces = false;
 				for ( int i = 2; i < compositeFrameInfo.layerCount; i++ )
 				{
 					if ( pFrameInfo->layers[i - 1].colorspace != pFrameInfo->layers[i].colorspace )
 					{
-						bNeedsFullComposite = true;
+						bMixedOverlayColorspaces = true;
 						break;
 					}
 				}
+
+				// Instead of changing any LUTs, mixed overlays get the shaper + 3D LUTs
+				// applied in the shader like a full composition would, ending up in
+				// the output encoding. That goes on the overlay plane with its color
+				// management bypassed, so the base plane stays on its own plane with
+				// the LUTs untouched and only needs BLEND_TF to blend with it.
+				if ( bMixedOverlayColorspaces )
+				{
+					if ( cv_drm_partial_composite_mixed_colorspaces && SupportsColorManagement() && compositeFrameInfo.applyOutputColorMgmt )
+						bNormalizeOverlays = true;
+					else
+						bNeedsFullComposite = true;
+				}
 			}
 
 			// If we ever promoted from partial -> full, for the first frame
@@ -3575,7 +3691,9 @@ namespace gamescope
 			// We were already stalling for the full composition before, so it's not an issue
 			// for latency, we just need to make sure we get 1 partial frame that isn't deferred
 			// in time so we don't lose layers.
-			bool bDefer = !bNeedsFullComposite && ( !m_bWasCompositing || m_bWasPartialCompositing );
+			// Same thing when switching how the overlays are encoded, the last composite
+			// would get scanned out with the wrong color management.
+			bool bDefer = !bNeedsFullComposite && ( !m_bWasCompositing || m_bWasPartialCompositing ) && bNormalizeOverlays == m_bWasNormalizingOverlays;
 
 			// If doing a partial composition then remove the baseplane
 			// from our frameinfo to composite.
@@ -3587,30 +3705,45 @@ namespace gamescope
 
 				// When doing partial composition, apply the shaper + 3D LUT stuff
 				// at scanout.
-				for ( uint32_t nEOTF = 0; nEOTF < EOTF_Count; nEOTF++ ) {
-					compositeFrameInfo.shaperLut[ nEOTF ] = nullptr;
-					compositeFrameInfo.lut3D[ nEOTF ] = nullptr;
+				if ( !bNormalizeOverlays )
+				{
+					for ( uint32_t nEOTF = 0; nEOTF < EOTF_Count; nEOTF++ ) {
+						compositeFrameInfo.shaperLut[ nEOTF ] = nullptr;
+						compositeFrameInfo.lut3D[ nEOTF ] = nullptr;
+					}
 				}
 			}
 
-			// If using composite debug markers, make sure we mark them as partial
-			// so we know!
-			if ( bDefer && !!( g_uCompositeDebug & CompositeDebugFlag::Markers ) )
-				g_uCompositeDebug |= CompositeDebugFlag::Markers_Partial;
+			// If only the base plane changed (eg. a game under the perf overlay),
+			// the last partial composite is still good, so just scan that out
+			// again without touching the GPU.
+			bool bReusePartialComposite =
+				cv_drm_reuse_partial_composite &&
+				!bNeedsFullComposite &&
+				m_bWasPartialCompositing &&
+				vulkan_last_output_image_is_current( &compositeFrameInfo, true );
 
-			std::optional oCompositeResult = vulkan_composite( &compositeFrameInfo, nullptr, !bNeedsFullComposite );
+			if ( !bReusePartialComposite )
+			{
+				// If using composite debug markers, make sure we mark them as partial
+				// so we know!
+				if ( bDefer && !!( g_uCompositeDebug & CompositeDebugFlag::Markers ) )
+					g_uCompositeDebug |= CompositeDebugFlag::Markers_Partial;
 
-			m_bWasCompositing = true;
+				std::optional oCompositeResult = vulkan_composite( &compositeFrameInfo, nullptr, !bNeedsFullComposite );
 
-			g_uCompositeDebug &= ~CompositeDebugFlag::Markers_Partial;
+				g_uCompositeDebug &= ~CompositeDebugFlag::Markers_Partial;
 
-			if ( !oCompositeResult )
-			{
-				xwm_log.errorf("vulkan_composite failed");
-				return -EINVAL;
+				if ( !oCompositeResult )
+				{
+					xwm_log.errorf("vulkan_composite failed");
+					return -EINVAL;
+				}
+
+				vulkan_wait( *oCompositeResult, true );
 			}
 
-			vulkan_wait( *oCompositeResult, true );
+			m_bWasCompositing = true;
 
 			FrameInfo_t presentCompFrameInfo = {};
 			presentCompFrameInfo.allowVRR = pFrameInfo->allowVRR;
@@ -3635,6 +3768,7 @@ namespace gamescope
 				baseLayer->colorspace = pFrameInfo->outputEncodingEOTF == EOTF_PQ ? GAMESCOPE_APP_TEXTURE_COLORSPACE_HDR10_PQ : GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB;
 
 				m_bWasPartialCompositing = false;
+				m_pLastPartialOverlayTex = nullptr;
 			}
 			else
 			{
@@ -3652,14 +3786,32 @@ namespace gamescope
 					overlayLayer->opacity = 1.0;
 					overlayLayer->zpos = g_zposOverlay;
 
-					overlayLayer->tex = vulkan_get_last_output_image( true, bDefer );
-					overlayLayer->applyColorMgmt = g_ColorMgmt.pending.enabled;
+					// When reusing, the newest composite is already up to date,
+					// there is nothing to defer.
+					bool bDeferOverlay = bDefer && !bReusePartialComposite;
+					overlayLayer->tex = vulkan_get_last_output_image( true, bDeferOverlay );
+					overlayLayer->applyColorMgmt = g_ColorMgmt.pending.enabled && !bNormalizeOverlays;
+					// Damage is relative to the previous composite, which is only
+					// what was on the plane if we were already scanning out one of ours.
+					if ( overlayLayer->tex == m_pLastPartialOverlayTex )
+						overlayLayer->scanoutDamage = gamescope::DamageRegion::Empty();
+					else if ( m_pLastPartialOverlayTex != nullptr )
+						overlayLayer->scanoutDamage = vulkan_get_last_output_image_damage( true, bDeferOverlay );
+					m_pLastPartialOverlayTex = overlayLayer->tex;
 
 					overlayLayer->filter = GamescopeUpscaleFilter::NEAREST;
-					// Partial composition stuff has the same colorspace.
-					// So read that from the composite frame info
 					overlayLayer->ctm = nullptr;
-					overlayLayer->colorspace = compositeFrameInfo.layers[0].colorspace;
+					if ( bNormalizeOverlays )
+					{
+						// Already in the output encoding.
+						overlayLayer->colorspace = pFrameInfo->outputEncodingEOTF == EOTF_PQ ? GAMESCOPE_APP_TEXTURE_COLORSPACE_HDR10_PQ : GAMESCOPE_APP_TEXTURE_COLORSPACE_SRGB;
+					}
+					else
+					{
+						// Partial composition stuff has the same colorspace.
+						// So read that from the composite frame info
+						overlayLayer->colorspace = compositeFrameInfo.layers[0].colorspace;
+					}
 				}
 				else
 				{
@@ -3671,6 +3823,8 @@ namespace gamescope
 					presentCompFrameInfo.layers[ 0 ] = pFrameInfo->layers[ 0 ];
 					presentCompFrameInfo.layers[ 0 ].zpos = g_zposBase;
 
+					m_pLastPartialOverlayTex = nullptr;
+
 					const FrameInfo_t::Layer_t *lastPresentedOverlayLayer = nullptr;
 					for (int i = 0; i < pFrameInfo->layerCount; i++)
 					{
@@ -3694,6 +3848,10 @@ namespace gamescope
 				m_bWasPartialCompositing = true;
 			}
 
+			m_bWasNormalizingOverlays = bNormalizeOverlays;
+
+			WaitForCommit();
+
 			int ret = drm_prepare( &g_DRM, bAsync, &presentCompFrameInfo );
 
 			// Happens when we're VT-switched away
@@ -3733,7 +3891,7 @@ namespace gamescope
 				}
 			}
 
-			return Commit( &compositeFrameInfo );
+			return QueueCommit();
 		}
 
 		virtual void DirtyState( bool bForce, bool bForceModeset ) override
@@ -3746,6 +3904,14 @@ namespace gamescope
 
 		virtual bool PollState() override
 		{
+			// Only wait if there is anything to poll, this gets called every
+			// time around the main loop. Otherwise just pick up the state of
+			// a commit that already finished.
+			if ( g_DRM.out_of_date )
+				WaitForCommit();
+			else
+				ReapCommit();
+
 			return drm_poll_state( &g_DRM );
 		}
 
@@ -3853,6 +4019,11 @@ namespace gamescope
 			return g_bSupportsSyncObjs && !cv_drm_debug_disable_explicit_sync;
 		}
 
+		virtual bool NeedsColorMgmtLutData() const override
+		{
+			return drm_supports_color_mgmt( &g_DRM );
+		}
+
 		virtual bool IsPaused() const override
 		{
 			return g_DRM.paused;
@@ -3873,6 +4044,8 @@ namespace gamescope
 
 		virtual bool HackTemporarySetDynamicRefresh( int nRefresh ) override
 		{
+			WaitForCommit();
+
 			return drm_set_refresh( &g_DRM, nRefresh );
 		}
 
@@ -3895,17 +4068,137 @@ namespace gamescope
 	private:
 		bool m_bWasCompositing = false;
 		bool m_bWasPartialCompositing = false;
+		bool m_bWasNormalizingOverlays = false;
+		// What we last put on the overlay plane when partial compositing.
+		gamescope::Rc<CVulkanTexture> m_pLastPartialOverlayTex;
 		int m_nLastSingleOverlayZPos = 0;
 
 		uint32_t m_uNextPresentCtx = 0;
 		DRMPresentCtx m_PresentCtxs[3];
 
+		// The commit thread takes over the prepared request in g_DRM,
+		// so nothing may touch the DRM state until WaitForCommit.
+		// The commit thread only does the ioctl and waits for the flip,
+		// the committed (or rolled back) state is applied back on the
+		// compositor thread when it reaps the result.
+		std::thread m_CommitThread;
+		std::mutex m_CommitMutex;
+		std::condition_variable m_CommitCondition;
+		bool m_bCommitThreadRunning = false;
+		bool m_bCommitQueued = false;
+		std::optional<int> m_oFinishedCommitResult;
+		uint32_t m_uCommitFlipCount = 0;
+
 		bool SupportsColorManagement() const
 		{
 			return drm_supports_color_mgmt( &g_DRM );
 		}
 
-		int Commit( const FrameInfo_t *pFrameInfo )
+		int QueueCommit()
+		{
+			if ( !cv_drm_commit_thread || !m_CommitThread.joinable() )
+			{
+				int ret = Commit();
+				FinishCommit( ret );
+				if ( ret == 0 )
+				{
+					UpdateLastDrawTime();
+					WaitForFlip();
+				}
+				return ret;
+			}
+
+			// The commit is issued as soon as the commit thread wakes up.
+			UpdateLastDrawTime();
+
+			{
+				std::unique_lock lock( m_CommitMutex );
+				assert( !m_bCommitQueued );
+				m_bCommitQueued = true;
+			}
+			m_CommitCondition.notify_all();
+
+			// We only find out how this commit went once it is reaped,
+			// failures are dealt with there.
+			return 0;
+		}
+
+		void WaitForCommit()
+		{
+			std::unique_lock lock( m_CommitMutex );
+			m_CommitCondition.wait( lock, [this]() { return !m_bCommitQueued; } );
+			ReapCommitLocked();
+		}
+
+		// Applies the result of a commit the commit thread is done with,
+		// without waiting for one that is still in flight.
+		void ReapCommit()
+		{
+			std::unique_lock lock( m_CommitMutex );
+			if ( !m_bCommitQueued )
+				ReapCommitLocked();
+		}
+
+		void ReapCommitLocked()
+		{
+			if ( !m_oFinishedCommitResult )
+				return;
+
+			const int ret = *m_oFinishedCommitResult;
+			m_oFinishedCommitResult = std::nullopt;
+
+			FinishCommit( ret );
+
+			// The frame this was for never made it to the screen, and the
+			// Present that queued it has long since returned. Get another
+			// one out with the rolled back state, unless we were VT-switched
+			// away, which repaints when we come back anyway.
+			if ( ret != 0 )
+			{
+				drm_log.errorf( "threaded commit failed (%s), rolled back", strerror( -ret ) );
+				if ( ret != -EACCES )
+					force_repaint();
+			}
+		}
+
+		void CommitThreadFunc()
+		{
+			pthread_setname_np( pthread_self(), "gamescope-cmt" );
+
+			std::unique_lock lock( m_CommitMutex );
+			for ( ;; )
+			{
+				m_CommitCondition.wait( lock, [this]() { return m_bCommitQueued || !m_bCommitThreadRunning; } );
+				// Finish anything queued before shutting down.
+				if ( !m_bCommitQueued )
+					break;
+
+				lock.unlock();
+				int ret = Commit();
+				if ( ret == 0 )
+					WaitForFlip();
+				lock.lock();
+
+				m_oFinishedCommitResult = ret;
+				m_bCommitQueued = false;
+				m_CommitCondition.notify_all();
+			}
+		}
+
+		void UpdateLastDrawTime()
+		{
+			// Update the draw time
+			// Ideally this would be updated by something right before the page flip
+			// is queued and would end up being the new page flip, rather than here.
+			// However, the page flip handler is called when the page flip occurs,
+			// not when it is successfully queued.
+			GetVBlankTimer().UpdateLastDrawTime( get_time_in_nanos() - g_SteamCompMgrVBlankTime.ulWakeupTime );
+		}
+
+		// Does the commit ioctl and the bookkeeping of the FBs it references.
+		// This can run on the commit thread, so it must not touch the
+		// property state the compositor thread reads, see FinishCommit.
+		int Commit()
 		{
 			drm_t *drm = &g_DRM;
 			int ret = 0;
@@ -3915,11 +4208,11 @@ namespace gamescope
 			defer( if ( drm->req != nullptr ) { drmModeAtomicFree( drm->req ); drm->req = nullptr; } );
 
 			bool isPageFlip = drm->flags & DRM_MODE_PAGE_FLIP_EVENT;
-			uint32_t uNewPendingFlipCount = 0;
+			m_uCommitFlipCount = 0;
 
 			if ( isPageFlip )
 			{
-				uNewPendingFlipCount = ++drm->uPendingFlipCount;
+				m_uCommitFlipCount = ++drm->uPendingFlipCount;
 
 				// Do it before the commit, as otherwise the pageflip handler could
 				// potentially beat us to the refcount checks.
@@ -3938,7 +4231,10 @@ namespace gamescope
 			drm_log.debugf("flip commit %" PRIu64, (uint64_t)GetCurrentConnector()->PresentationFeedback().m_uQueuedPresents);
 			gpuvis_trace_printf( "flip commit %" PRIu64, (uint64_t)GetCurrentConnector()->PresentationFeedback().m_uQueuedPresents );
 
-			ret = drmModeAtomicCommit(drm->fd, drm->req, drm->flags, &m_PresentCtxs[uCurrentPresentCtx] );
+			{
+				GAMESCOPE_TRACE_SPAN( "drm_commit", (uint64_t)GetCurrentConnector()->PresentationFeedback().m_uQueuedPresents );
+				ret = drmModeAtomicCommit(drm->fd, drm->req, drm->flags, &m_PresentCtxs[uCurrentPresentCtx] );
+			}
 			if ( ret != 0 )
 			{
 				drm_log.errorf_errno( "flip error" );
@@ -3951,8 +4247,6 @@ namespace gamescope
 					abort();
 				}
 
-				drm_rollback( drm );
-
 				// Swap back over to what was previously queued (probably nothing)
 				// if this commit failed.
 				{
@@ -3966,59 +4260,66 @@ namespace gamescope
 
 				if ( isPageFlip )
 					drm->uPendingFlipCount--;
-
-				return ret;
 			} else {
 				// Our request went through!
 				// Clear what we swapped with (what was previously queued)
 				drm->m_FbIdsInRequest.clear();
+			}
 
-				drm->current = drm->pending;
+			return ret;
+		}
 
-				for ( std::unique_ptr< gamescope::CDRMCRTC > &pCRTC : drm->crtcs )
-				{
-					for ( std::optional<gamescope::CDRMAtomicProperty> &oProperty : pCRTC->GetProperties() )
-					{
-						if ( oProperty )
-							oProperty->OnCommit();
-					}
-				}
+		void WaitForFlip()
+		{
+			if ( !m_uCommitFlipCount )
+				return;
+
+			// Wait for bPendingFlip to change from true -> false.
+			g_DRM.uPendingFlipCount.wait( m_uCommitFlipCount );
+			assert( g_DRM.uPendingFlipCount == 0 );
+		}
+
+		// Makes what we committed the current state, or rolls back to it
+		// if the commit failed. Always on the compositor thread.
+		void FinishCommit( int ret )
+		{
+			drm_t *drm = &g_DRM;
+
+			if ( ret != 0 )
+			{
+				drm_rollback( drm );
+				return;
+			}
 
-				for ( std::unique_ptr< gamescope::CDRMPlane > &pPlane : drm->planes )
+			drm->current = drm->pending;
+
+			for ( std::unique_ptr< gamescope::CDRMCRTC > &pCRTC : drm->crtcs )
+			{
+				for ( std::optional<gamescope::CDRMAtomicProperty> &oProperty : pCRTC->GetProperties() )
 				{
-					for ( std::optional<gamescope::CDRMAtomicProperty> &oProperty : pPlane->GetProperties() )
-					{
-						if ( oProperty )
-							oProperty->OnCommit();
-					}
+					if ( oProperty )
+						oProperty->OnCommit();
 				}
+			}
 
-				for ( auto &iter : drm->connectors )
+			for ( std::unique_ptr< gamescope::CDRMPlane > &pPlane : drm->planes )
+			{
+				for ( std::optional<gamescope::CDRMAtomicProperty> &oProperty : pPlane->GetProperties() )
 				{
-					gamescope::CDRMConnector *pConnector = &iter.second;
-					for ( std::optional<gamescope::CDRMAtomicProperty> &oProperty : pConnector->GetProperties() )
-					{
-						if ( oProperty )
-							oProperty->OnCommit();
-					}
+					if ( oProperty )
+						oProperty->OnCommit();
 				}
 			}
 
-			// Update the draw time
-			// Ideally this would be updated by something right before the page flip
-			// is queued and would end up being the new page flip, rather than here.
-			// However, the page flip handler is called when the page flip occurs,
-			// not when it is successfully queued.
-			GetVBlankTimer().UpdateLastDrawTime( get_time_in_nanos() - g_SteamCompMgrVBlankTime.ulWakeupTime );
-
-			if ( isPageFlip )
+			for ( auto &iter : drm->connectors )
 			{
-				// Wait for bPendingFlip to change from true -> false.
-				drm->uPendingFlipCount.wait( uNewPendingFlipCount );
-				assert( drm->uPendingFlipCount == 0 );
+				gamescope::CDRMConnector *pConnector = &iter.second;
+				for ( std::optional<gamescope::CDRMAtomicProperty> &oProperty : pConnector->GetProperties() )
+				{
+					if ( oProperty )
+						oProperty->OnCommit();
+				}
 			}
-
-			return ret;
 		}
 
 	};
@@ -418,6 +418,7 @@ namespace gamescope
         virtual const BackendConnectorHDRInfo &GetHDRInfo() const override;
         virtual bool IsVRRActive() const override;
         virtual std::span<const BackendMode> GetModes() const override;
+        virtual std::optional<VkExtent2D> GetOutputExtent() const override;
 
         virtual bool SupportsVRR() const override;
 
@@ -474,6 +475,9 @@ namespace gamescope
         std::atomic<bool> m_bDesiredFullscreenState = { false };
 
         bool m_bHostCompositorIsCurrentlyVRR = false;
+
+        // Set from the toplevel configure, alongside g_nOutputWidth/Height.
+        std::optional<VkExtent2D> m_oOutputExtent;
     };
 
     class CWaylandFb final : public CBaseBackendFb
@@ -1184,6 +1188,15 @@ namespace gamescope
     {
         return std::span<const BackendMode>{};
     }
+    std::optional<VkExtent2D> CWaylandConnector::GetOutputExtent() const
+    {
+        // Only meaningful when every toplevel is its own connector,
+        // otherwise the global output size is the truth.
+        if ( VirtualConnectorIsSingleOutput() )
+            return std::nullopt;
+
+        return m_oOutputExtent;
+    }
 
     bool CWaylandConnector::SupportsVRR() const
     {
@@ -1728,6 +1741,15 @@ namespace gamescope
         g_nOutputWidth  = WaylandScaleToPhysical( nWidth, uScale );
         g_nOutputHeight = WaylandScaleToPhysical( nHeight, uScale );
 
+        if ( m_pConnector )
+        {
+            m_pConnector->m_oOutputExtent = VkExtent2D
+            {
+                .width  = uint32_t( g_nOutputWidth ),
+                .height = uint32_t( g_nOutputHeight ),
+            };
+        }
+
         CommitLibDecor( pConfiguration );
 
         force_repaint();
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <span>
+
+namespace gamescope
+{
+    // A small, fixed-size set of damaged rectangles.
+    //
+    // This is intentionally coarse, it only needs to be good enough to skip
+    // work for things like a blinking caret or a perf overlay.
+    // Once more than k_nMaxRects rects are added, the pair that grows the least
+    // when unioned gets merged.
+    //
+    // A default constructed region is "full": the damage is unknown and
+    // everything must be treated as damaged.
+    class DamageRegion
+    {
+    public:
+        static constexpr uint32_t k_nMaxRects = 4;
+
+        struct Rect_t
+        {
+            int32_t nX1 = 0;
+            int32_t nY1 = 0;
+            int32_t nX2 = 0;
+            int32_t nY2 = 0;
+
+            bool IsEmpty() const { return nX2 <= nX1 || nY2 <= nY1; }
+            int64_t Area() const { return IsEmpty() ? 0 : int64_t( nX2 - nX1 ) * int64_t( nY2 - nY1 ); }
+
+            Rect_t Union( const Rect_t &other ) const
+            {
+                return Rect_t
+                {
+                    .nX1 = std::min( nX1, other.nX1 ),
+                    .nY1 = std::min( nY1, other.nY1 ),
+                    .nX2 = std::max( nX2, other.nX2 ),
+                    .nY2 = std::max( nY2, other.nY2 ),
+                };
+            }
+
+            Rect_t Intersect( const Rect_t &other ) const
+            {
+                return Rect_t
+                {
+                    .nX1 = std::max( nX1, other.nX1 ),
+                    .nY1 = std::max( nY1, other.nY1 ),
+                    .nX2 = std::min( nX2, other.nX2 ),
+                    .nY2 = std::min( nY2, other.nY2 ),
+                };
+            }
+
+            bool operator == ( const Rect_t &other ) const = default;
+        };
+
+        DamageRegion() = default;
+
+        static DamageRegion Full()
+        {
+            return DamageRegion{};
+        }
+
+        static DamageRegion Empty()
+        {
+            DamageRegion region;
+            region.m_bFull = false;
+            return region;
+        }
+
+        bool IsFull() const { return m_bFull; }
+        bool IsEmpty() const { return !m_bFull && m_uRectCount == 0; }
+
+        void SetFull()
+        {
+            m_bFull = true;
+            m_uRectCount = 0;
+        }
+
+        void Clear()
+        {
+            m_bFull = false;
+            m_uRectCount = 0;
+        }
+
+        std::span<const Rect_t> Rects() const
+        {
+            return std::span<const Rect_t>{ m_Rects.data(), m_uRectCount };
+        }
+
+        Rect_t Extents() const
+        {
+            if ( m_uRectCount == 0 )
+                return Rect_t{};
+
+            Rect_t extents = m_Rects[0];
+            for ( uint32_t i = 1; i < m_uRectCount; i++ )
+                extents = extents.Union( m_Rects[i] );
+            return extents;
+        }
+
+        int64_t Area() const
+        {
+            int64_t nArea = 0;
+            for ( const Rect_t &rect : Rects() )
+                nArea += rect.Area();
+            return nArea;
+        }
+
+        void Add( const Rect_t &rect )
+        {
+            if ( m_bFull || rect.IsEmpty() )
+                return;
+
+            // Already covered?
+            for ( uint32_t i = 0; i < m_uRectCount; i++ )
+            {
+                if ( m_Rects[i].Union( rect ) == m_Rects[i] )
+                    return;
+            }
+
+            if ( m_uRectCount < k_nMaxRects )
+            {
+                m_Rects[ m_uRectCount++ ] = rect;
+                return;
+            }
+
+            // Out of slots, merge the new rect into whichever one grows the least.
+            uint32_t uBest = 0;
+            int64_t nBestGrowth = std::numeric_limits<int64_t>::max();
+            for ( uint32_t i = 0; i < m_uRectCount; i++ )
+            {
+                int64_t nGrowth = m_Rects[i].Union( rect ).Area() - m_Rects[i].Area();
+                if ( nGrowth < nBestGrowth )
+                {
+                    nBestGrowth = nGrowth;
+                    uBest = i;
+                }
+            }
+            m_Rects[ uBest ] = m_Rects[ uBest ].Union( rect );
+        }
+
+        void Add( const DamageRegion &other )
+        {
+            if ( other.m_bFull )
+            {
+                SetFull();
+                return;
+            }
+
+            for ( const Rect_t &rect : other.Rects() )
+                Add( rect );
+        }
+
+        // Clips to [0, nWidth) x [0, nHeight), dropping anything outside.
+        void Clip( int32_t nWidth, int32_t nHeight )
+        {
+            const Rect_t bounds = { 0, 0, nWidth, nHeight };
+
+            uint32_t uCount = 0;
+            for ( uint32_t i = 0; i < m_uRectCount; i++ )
+            {
+                Rect_t clipped = m_Rects[i].Intersect( bounds );
+                if ( !clipped.IsEmpty() )
+                    m_Rects[ uCount++ ] = clipped;
+            }
+            m_uRectCount = uCount;
+        }
+
+    private:
+        bool m_bFull = true;
+        uint32_t m_uRectCount = 0;
+        std::array<Rect_t, k_nMaxRects> m_Rects{};
+    };
+
+    // What changed in a buffer relative to the last few commits on the same
+    // surface, so a consumer holding on to an older commit's contents can
+    // tell what it needs to redraw.
+    class DamageHistory
+    {
+    public:
+        static constexpr uint32_t k_nMaxEntries = 4;
+
+        // The damage accumulated since ulCommitID, full if that commit
+        // is too old or not part of this history.
+        DamageRegion DamageSince( uint64_t ulCommitID ) const
+        {
+            if ( ulCommitID == 0 )
+                return DamageRegion::Full();
+
+            for ( uint32_t i = 0; i < m_uEntryCount; i++ )
+            {
+                if ( m_Entries[i].ulBaseCommitID == ulCommitID )
+                    return m_Entries[i].damage;
+            }
+
+            return DamageRegion::Full();
+        }
+
+        // Returns the history of the commit following ulThisCommitID
+        // (the commit this history belongs to), which changed 'damage'.
+        DamageHistory Chain( uint64_t ulThisCommitID, const DamageRegion &damage ) const
+        {
+            DamageHistory next;
+            next.m_Entries[0] = Entry_t{ ulThisCommitID, damage };
+            next.m_uEntryCount = 1;
+
+            for ( uint32_t i = 0; i < m_uEntryCount && next.m_uEntryCount < k_nMaxEntries; i++ )
+            {
+                DamageRegion accumulated = m_Entries[i].damage;
+                accumulated.Add( damage );
+                next.m_Entries[ next.m_uEntryCount++ ] = Entry_t{ m_Entries[i].ulBaseCommitID, accumulated };
+            }
+
+            return next;
+        }
+
+    private:
+        struct Entry_t
+        {
+            uint64_t ulBaseCommitID = 0;
+            DamageRegion damage;
+        };
+
+        std::array<Entry_t, k_nMaxEntries> m_Entries{};
+        uint32_t m_uEntryCount = 0;
+    };
+}
@@ -0,0 +1,49 @@
+#include "FrameArena.h"
+
+#include "../log.hpp"
+
+namespace gamescope
+{
+    static LogScope arena_log{ "frame_arena" };
+
+    CFrameArena &CFrameArena::Get()
+    {
+        static thread_local CFrameArena s_Arena;
+        return s_Arena;
+    }
+
+    void CFrameArena::Reset()
+    {
+        if ( m_uLiveAllocations != 0 )
+        {
+            arena_log.errorf( "%u allocations outlived the frame, leaking %zu blocks so they stay valid.",
+                m_uLiveAllocations, m_Blocks.size() );
+
+            for ( Block_t &block : m_Blocks )
+                (void) block.pData.release();
+
+            m_Blocks.clear();
+            m_ulOffset = 0;
+            m_ulUsedInFullBlocks = 0;
+            m_uLiveAllocations = 0;
+            return;
+        }
+
+        Rewind();
+    }
+
+    void CFrameArena::Rewind()
+    {
+        if ( m_Blocks.size() > 1 )
+        {
+            size_t ulTotal = m_ulUsedInFullBlocks + m_ulOffset;
+            size_t ulBlockSize = std::max( k_ulDefaultBlockSize, ulTotal * 2 );
+
+            m_Blocks.clear();
+            m_Blocks.emplace_back( Block_t{ std::make_unique<std::byte[]>( ulBlockSize ), ulBlockSize } );
+        }
+
+        m_ulOffset = 0;
+        m_ulUsedInFullBlocks = 0;
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "NonCopyable.h"
+
+namespace gamescope
+{
+    // A bump allocator for temporaries that only live for one iteration of
+    // the compositor's main loop (lists of focusable windows and the like).
+    //
+    // Everything is thrown away at once by Reset(), or as soon as the last
+    // live allocation is freed, individual deallocations otherwise only give
+    // memory back if they were the most recent allocation (which covers a
+    // vector growing in place). The latter also makes it fine to use for
+    // function-local temporaries on threads that never call Reset().
+    // If a frame needed more than one block, they get merged into one big
+    // enough for it, so after the first few frames this stops touching the
+    // heap entirely.
+    class CFrameArena : public NonCopyable
+    {
+    public:
+        static constexpr size_t k_ulDefaultBlockSize = 64 * 1024;
+
+        // The arena for the calling thread.
+        static CFrameArena &Get();
+
+        void *Allocate( size_t ulSize, size_t ulAlign )
+        {
+            m_uLiveAllocations++;
+
+            if ( !m_Blocks.empty() )
+            {
+                Block_t &block = m_Blocks.back();
+                size_t ulOffset = ( m_ulOffset + ulAlign - 1 ) & ~( ulAlign - 1 );
+                if ( ulOffset + ulSize <= block.ulSize )
+                {
+                    m_ulOffset = ulOffset + ulSize;
+                    return block.pData.get() + ulOffset;
+                }
+            }
+
+            size_t ulBlockSize = std::max( k_ulDefaultBlockSize, ulSize + ulAlign );
+            m_Blocks.emplace_back( Block_t{ std::make_unique<std::byte[]>( ulBlockSize ), ulBlockSize } );
+            m_ulUsedInFullBlocks += m_ulOffset;
+
+            std::byte *pBase = m_Blocks.back().pData.get();
+            size_t ulOffset = ( ( uintptr_t( pBase ) + ulAlign - 1 ) & ~( uintptr_t( ulAlign ) - 1 ) ) - uintptr_t( pBase );
+            m_ulOffset = ulOffset + ulSize;
+            return pBase + ulOffset;
+        }
+
+        void Deallocate( void *pData, size_t ulSize )
+        {
+            std::byte *pBytes = static_cast<std::byte *>( pData );
+
+            // Something from a frame whose blocks Reset() had to leak.
+            if ( !OwnsAllocation( pBytes ) )
+                return;
+
+            assert( m_uLiveAllocations != 0 );
+            if ( --m_uLiveAllocations == 0 )
+            {
+                Rewind();
+                return;
+            }
+
+            std::byte *pBase = m_Blocks.back().pData.get();
+            if ( pBytes >= pBase && pBytes + ulSize == pBase + m_ulOffset )
+                m_ulOffset = size_t( pBytes - pBase );
+        }
+
+        // Nothing allocated from the arena should be alive when this is
+        // called. If something is, its blocks are leaked rather than
+        // handed out again.
+        void Reset();
+
+    private:
+        struct Block_t
+        {
+            std::unique_ptr<std::byte[]> pData;
+            size_t ulSize = 0;
+        };
+
+        // Starts handing out memory from the beginning again.
+        void Rewind();
+
+        bool OwnsAllocation( const std::byte *pBytes ) const
+        {
+            for ( const Block_t &block : m_Blocks )
+            {
+                if ( pBytes >= block.pData.get() && pBytes < block.pData.get() + block.ulSize )
+                    return true;
+            }
+            return false;
+        }
+
+        std::vector<Block_t> m_Blocks;
+        size_t m_ulOffset = 0;
+        size_t m_ulUsedInFullBlocks = 0;
+        uint32_t m_uLiveAllocations = 0;
+    };
+
+    // Allocates out of the calling thread's CFrameArena.
+    template <typename T>
+    class FrameAllocator
+    {
+    public:
+        using value_type = T;
+
+        FrameAllocator() = default;
+        template <typename U>
+        FrameAllocator( const FrameAllocator<U> & ) {}
+
+        T *allocate( size_t ulCount )
+        {
+            return static_cast<T *>( CFrameArena::Get().Allocate( ulCount * sizeof( T ), alignof( T ) ) );
+        }
+
+        void deallocate( T *pData, size_t ulCount )
+        {
+            CFrameArena::Get().Deallocate( pData, ulCount * sizeof( T ) );
+        }
+
+        template <typename U>
+        bool operator == ( const FrameAllocator<U> & ) const { return true; }
+    };
+
+    template <typename T>
+    using FrameVector = std::vector<T, FrameAllocator<T>>;
+}
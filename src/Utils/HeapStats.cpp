@@ -0,0 +1,109 @@
+#include "HeapStats.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+
+namespace gamescope
+{
+    static thread_local uint64_t s_ulThreadHeapAllocations = 0;
+
+    bool HeapAllocationCountingAvailable()
+    {
+        return HAVE_HEAP_STATS;
+    }
+
+    uint64_t GetThreadHeapAllocationCount()
+    {
+        return s_ulThreadHeapAllocations;
+    }
+}
+
+#if HAVE_HEAP_STATS
+
+// Replacements for the global allocation functions that only add counting.
+// The array forms are implemented in terms of these by libstdc++.
+//
+// Failures behave like the default ones: the new_handler gets a chance to
+// free something up, then the throwing forms report bad_alloc and the
+// nothrow forms return nullptr.
+
+static void *CountedAllocate( std::size_t ulSize, std::size_t ulAlign, bool bNoThrow )
+{
+    gamescope::s_ulThreadHeapAllocations++;
+
+    if ( !ulSize )
+        ulSize = 1;
+
+    for ( ;; )
+    {
+        void *pData = nullptr;
+        if ( ulAlign <= alignof( std::max_align_t ) )
+            pData = malloc( ulSize );
+        else if ( posix_memalign( &pData, std::max( ulAlign, sizeof( void * ) ), ulSize ) != 0 )
+            pData = nullptr;
+
+        if ( pData )
+            return pData;
+
+        std::new_handler pfnHandler = std::get_new_handler();
+        if ( !pfnHandler )
+        {
+            if ( bNoThrow )
+                return nullptr;
+
+#if defined( __GLIBCXX__ )
+            // We are built without exceptions, let the runtime throw it
+            // for anything that was built with them.
+            std::__throw_bad_alloc();
+#else
+            abort();
+#endif
+        }
+
+        pfnHandler();
+    }
+}
+
+void *operator new( std::size_t ulSize )
+{
+    return CountedAllocate( ulSize, alignof( std::max_align_t ), false );
+}
+
+void *operator new( std::size_t ulSize, const std::nothrow_t & ) noexcept
+{
+    return CountedAllocate( ulSize, alignof( std::max_align_t ), true );
+}
+
+void *operator new( std::size_t ulSize, std::align_val_t eAlign )
+{
+    return CountedAllocate( ulSize, size_t( eAlign ), false );
+}
+
+void *operator new( std::size_t ulSize, std::align_val_t eAlign, const std::nothrow_t & ) noexcept
+{
+    return CountedAllocate( ulSize, size_t( eAlign ), true );
+}
+
+void operator delete( void *pData ) noexcept
+{
+    free( pData );
+}
+
+void operator delete( void *pData, std::size_t ) noexcept
+{
+    free( pData );
+}
+
+void operator delete( void *pData, std::align_val_t ) noexcept
+{
+    free( pData );
+}
+
+void operator delete( void *pData, std::size_t, std::align_val_t ) noexcept
+{
+    free( pData );
+}
+
+#endif
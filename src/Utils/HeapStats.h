@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+namespace gamescope
+{
+    // Whether we were built with -Dheap_stats=true. Counting needs the
+    // global operator new replaced, so it is off by default.
+    bool HeapAllocationCountingAvailable();
+
+    // How many times the calling thread has called operator new, or
+    // always 0 without heap_stats.
+    // Only meant for spotting allocations in hot paths, compare it
+    // before and after.
+    uint64_t GetThreadHeapAllocationCount();
+}
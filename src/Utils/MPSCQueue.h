@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace gamescope
+{
+    // A bounded multi-producer, single-consumer queue with preallocated slots.
+    //
+    // Based on Dmitry Vyukov's bounded queue: every slot carries a sequence
+    // number which tells producers/consumers whether it is free or filled,
+    // so the common path is a single CAS on the head/tail and no locking.
+    //
+    // If the ring is ever full (eg. the consumer is stalled), entries spill into
+    // a mutex-protected overflow vector instead of blocking the producer.
+    // Once something has spilled, producers keep using the overflow until the
+    // consumer has drained it so ordering from a single producer is preserved.
+    //
+    // Producers are told when they need to wake the consumer: only the first
+    // push after a drain returns true, so a burst of pushes results in a single
+    // nudge rather than one per entry.
+    template <typename T, size_t Capacity = 256>
+    class BoundedMPSCQueue
+    {
+        static_assert( Capacity >= 2 && ( Capacity & ( Capacity - 1 ) ) == 0, "Capacity must be a power of two." );
+    public:
+        BoundedMPSCQueue()
+        {
+            for ( size_t i = 0; i < Capacity; i++ )
+                m_Slots[i].ulSequence.store( i, std::memory_order_relaxed );
+        }
+
+        ~BoundedMPSCQueue()
+        {
+            Clear();
+        }
+
+        BoundedMPSCQueue( const BoundedMPSCQueue & ) = delete;
+        BoundedMPSCQueue &operator = ( const BoundedMPSCQueue & ) = delete;
+
+        // Returns true if the consumer should be nudged.
+        bool Push( T&& value )
+        {
+            if ( !m_bOverflowed.load( std::memory_order_acquire ) )
+            {
+                if ( TryPushRing( value ) )
+                    return !m_bPendingNudge.exchange( true, std::memory_order_acq_rel );
+            }
+
+            {
+                std::unique_lock lock( m_OverflowMutex );
+                // Re-check under the lock, the consumer may have just drained
+                // the overflow and freed up ring slots.
+                if ( m_Overflow.empty() && TryPushRing( value ) )
+                {
+                    // Nothing to do, fall through to the nudge.
+                }
+                else
+                {
+                    m_Overflow.emplace_back( std::move( value ) );
+                    m_bOverflowed.store( true, std::memory_order_release );
+                }
+            }
+
+            return !m_bPendingNudge.exchange( true, std::memory_order_acq_rel );
+        }
+
+        // Moves everything currently in the queue to the end of outValues.
+        // Consumer only.
+        void Drain( std::vector<T> &outValues )
+        {
+            // Clear this first so any push that races with us nudges again.
+            // This needs to be an RMW so it synchronizes with the producer's
+            // exchange and we see the slot it wrote.
+            m_bPendingNudge.exchange( false, std::memory_order_acq_rel );
+
+            while ( std::optional<T> oValue = TryPopRing() )
+                outValues.emplace_back( std::move( *oValue ) );
+
+            if ( m_bOverflowed.load( std::memory_order_acquire ) )
+            {
+                std::unique_lock lock( m_OverflowMutex );
+                // Anything that landed in the ring before the overflow started
+                // must go first.
+                while ( std::optional<T> oValue = TryPopRing() )
+                    outValues.emplace_back( std::move( *oValue ) );
+
+                for ( T &value : m_Overflow )
+                    outValues.emplace_back( std::move( value ) );
+                m_Overflow.clear();
+                m_bOverflowed.store( false, std::memory_order_release );
+            }
+        }
+
+        void Clear()
+        {
+            std::vector<T> discarded;
+            Drain( discarded );
+        }
+
+    private:
+        bool TryPushRing( T &value )
+        {
+            uint64_t ulPos = m_ulTail.load( std::memory_order_relaxed );
+            for ( ;; )
+            {
+                Slot_t &slot = m_Slots[ ulPos & ( Capacity - 1 ) ];
+                uint64_t ulSequence = slot.ulSequence.load( std::memory_order_acquire );
+                int64_t nDiff = int64_t( ulSequence ) - int64_t( ulPos );
+
+                if ( nDiff == 0 )
+                {
+                    if ( m_ulTail.compare_exchange_weak( ulPos, ulPos + 1, std::memory_order_relaxed ) )
+                    {
+                        slot.oValue.emplace( std::move( value ) );
+                        slot.ulSequence.store( ulPos + 1, std::memory_order_release );
+                        return true;
+                    }
+                }
+                else if ( nDiff < 0 )
+                {
+                    // Full.
+                    return false;
+                }
+                else
+                {
+                    ulPos = m_ulTail.load( std::memory_order_relaxed );
+                }
+            }
+        }
+
+        std::optional<T> TryPopRing()
+        {
+            // Pops are CAS'd too, so a shutdown-time Clear() from another
+            // thread cannot corrupt the ring.
+            uint64_t ulPos = m_ulHead.load( std::memory_order_relaxed );
+            for ( ;; )
+            {
+                Slot_t &slot = m_Slots[ ulPos & ( Capacity - 1 ) ];
+                uint64_t ulSequence = slot.ulSequence.load( std::memory_order_acquire );
+                int64_t nDiff = int64_t( ulSequence ) - int64_t( ulPos + 1 );
+
+                if ( nDiff == 0 )
+                {
+                    if ( m_ulHead.compare_exchange_weak( ulPos, ulPos + 1, std::memory_order_relaxed ) )
+                    {
+                        std::optional<T> oValue = std::move( slot.oValue );
+                        slot.oValue.reset();
+                        slot.ulSequence.store( ulPos + Capacity, std::memory_order_release );
+                        return oValue;
+                    }
+                }
+                else if ( nDiff < 0 )
+                {
+                    // Empty (or the next producer has not finished writing yet).
+                    return std::nullopt;
+                }
+                else
+                {
+                    ulPos = m_ulHead.load( std::memory_order_relaxed );
+                }
+            }
+        }
+
+        struct Slot_t
+        {
+            std::atomic<uint64_t> ulSequence = { 0 };
+            std::optional<T> oValue;
+        };
+
+        static constexpr size_t k_unCacheLineSize = 64;
+
+        std::array<Slot_t, Capacity> m_Slots;
+
+        alignas( k_unCacheLineSize ) std::atomic<uint64_t> m_ulTail = { 0 };
+        alignas( k_unCacheLineSize ) std::atomic<uint64_t> m_ulHead = { 0 };
+        alignas( k_unCacheLineSize ) std::atomic<bool> m_bPendingNudge = { false };
+
+        std::atomic<bool> m_bOverflowed = { false };
+        std::mutex m_OverflowMutex;
+        std::vector<T> m_Overflow;
+    };
+}
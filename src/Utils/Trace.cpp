@@ -0,0 +1,290 @@
+#include "Trace.h"
+
+#include "../convar.h"
+#include "../log.hpp"
+#include "Defer.h"
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace gamescope::Trace
+{
+    static LogScope trace_log{ "trace" };
+
+    std::atomic<bool> g_bEnabled = { false };
+
+    static ConVar<bool> cv_trace_enabled( "trace_enabled", false, "Record spans of what the compositor is doing in memory, see trace_dump.",
+    []( ConVar<bool> &cvar )
+    {
+        g_bEnabled = cvar;
+    });
+
+    struct Event_t
+    {
+        // Seqlock style: 0 while the slot is being written, then the write
+        // count it was written for, so the dump can tell a slot was
+        // overwritten or torn while it read it.
+        std::atomic<uint64_t> ulSequence = { 0 };
+        std::atomic<const char *> pszName = { nullptr };
+        std::atomic<const char *> pszTrack = { nullptr };
+        std::atomic<uint64_t> ulBeginNs = { 0 };
+        std::atomic<uint64_t> ulEndNs = { 0 };
+        std::atomic<uint64_t> ulArg = { 0 };
+        std::atomic<bool> bInstant = { false };
+    };
+
+    struct ThreadRing_t
+    {
+        pid_t nTid = 0;
+        std::atomic<uint64_t> ulWriteCount = { 0 };
+        std::array<Event_t, k_uEventsPerThread> Events;
+    };
+
+    static std::mutex s_RingsMutex;
+    static std::vector<std::unique_ptr<ThreadRing_t>> s_Rings;
+
+    static thread_local ThreadRing_t *s_pThreadRing = nullptr;
+    static thread_local bool s_bThreadRingFailed = false;
+
+    static ThreadRing_t *GetThreadRing()
+    {
+        if ( s_pThreadRing || s_bThreadRingFailed )
+            return s_pThreadRing;
+
+        std::unique_lock lock( s_RingsMutex );
+        if ( s_Rings.size() >= k_uMaxThreads )
+        {
+            s_bThreadRingFailed = true;
+            return nullptr;
+        }
+
+        auto pRing = std::make_unique<ThreadRing_t>();
+        pRing->nTid = pid_t( syscall( SYS_gettid ) );
+        s_pThreadRing = pRing.get();
+        s_Rings.emplace_back( std::move( pRing ) );
+        return s_pThreadRing;
+    }
+
+    uint64_t Now()
+    {
+        timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return uint64_t( ts.tv_sec ) * 1'000'000'000ul + uint64_t( ts.tv_nsec );
+    }
+
+    static void Record( const char *pszName, uint64_t ulBeginNs, uint64_t ulEndNs, uint64_t ulArg, const char *pszTrack, bool bInstant )
+    {
+        ThreadRing_t *pRing = GetThreadRing();
+        if ( !pRing )
+            return;
+
+        const uint64_t ulIndex = pRing->ulWriteCount.load( std::memory_order_relaxed );
+        Event_t &event = pRing->Events[ ulIndex % k_uEventsPerThread ];
+
+        event.ulSequence.store( 0, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+
+        event.pszName.store( pszName, std::memory_order_relaxed );
+        event.pszTrack.store( pszTrack, std::memory_order_relaxed );
+        event.ulBeginNs.store( ulBeginNs, std::memory_order_relaxed );
+        event.ulEndNs.store( ulEndNs, std::memory_order_relaxed );
+        event.ulArg.store( ulArg, std::memory_order_relaxed );
+        event.bInstant.store( bInstant, std::memory_order_relaxed );
+
+        event.ulSequence.store( ulIndex + 1, std::memory_order_release );
+        pRing->ulWriteCount.store( ulIndex + 1, std::memory_order_release );
+    }
+
+    void RecordSpan( const char *pszName, uint64_t ulBeginNs, uint64_t ulEndNs, uint64_t ulArg, const char *pszTrack )
+    {
+        if ( !IsEnabled() )
+            return;
+
+        Record( pszName, ulBeginNs, ulEndNs, ulArg, pszTrack, false );
+    }
+
+    void RecordInstant( const char *pszName, uint64_t ulArg )
+    {
+        if ( !IsEnabled() )
+            return;
+
+        const uint64_t ulNow = Now();
+        Record( pszName, ulNow, ulNow, ulArg, nullptr, true );
+    }
+
+    static std::string GetThreadName( pid_t nTid )
+    {
+        char szPath[ PATH_MAX ];
+        snprintf( szPath, sizeof( szPath ), "/proc/self/task/%d/comm", int( nTid ) );
+
+        FILE *pFile = fopen( szPath, "r" );
+        if ( !pFile )
+            return "thread " + std::to_string( nTid );
+        defer( fclose( pFile ) );
+
+        char szName[ 64 ] = {};
+        if ( !fgets( szName, sizeof( szName ), pFile ) )
+            return "thread " + std::to_string( nTid );
+
+        szName[ strcspn( szName, "\n" ) ] = '\0';
+        return szName;
+    }
+
+    // Writes psz as the contents of a JSON string. Thread names come from
+    // whatever named the thread, so they can have anything in them.
+    static void WriteJsonString( FILE *pFile, const char *psz )
+    {
+        for ( ; *psz; psz++ )
+        {
+            const unsigned char c = (unsigned char)*psz;
+            if ( c == '"' || c == '\\' )
+                fprintf( pFile, "\\%c", c );
+            else if ( c < 0x20 )
+                fprintf( pFile, "\\u%04x", c );
+            else
+                fputc( c, pFile );
+        }
+    }
+
+    // Tracks not belonging to a thread get tids out of the way of real ones.
+    static constexpr int k_nFirstTrackTid = 0x40000000;
+
+    bool Dump( const char *pszPath )
+    {
+        std::vector<ThreadRing_t *> rings;
+        {
+            std::unique_lock lock( s_RingsMutex );
+            for ( auto &pRing : s_Rings )
+                rings.push_back( pRing.get() );
+        }
+
+        FILE *pFile = fopen( pszPath, "w" );
+        if ( !pFile )
+        {
+            trace_log.errorf_errno( "Failed to open '%s'", pszPath );
+            return false;
+        }
+        defer( fclose( pFile ) );
+
+        const int nPid = int( getpid() );
+        std::vector<const char *> tracks;
+        uint64_t ulEventCount = 0;
+
+        fprintf( pFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+        fprintf( pFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"gamescope\"}}", nPid );
+
+        for ( ThreadRing_t *pRing : rings )
+        {
+            fprintf( pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                nPid, int( pRing->nTid ) );
+            WriteJsonString( pFile, GetThreadName( pRing->nTid ).c_str() );
+            fprintf( pFile, "\"}}" );
+
+            const uint64_t ulEnd = pRing->ulWriteCount.load( std::memory_order_acquire );
+            const uint64_t ulBegin = ulEnd > k_uEventsPerThread ? ulEnd - k_uEventsPerThread : 0;
+            for ( uint64_t i = ulBegin; i < ulEnd; i++ )
+            {
+                const Event_t &event = pRing->Events[ i % k_uEventsPerThread ];
+
+                if ( event.ulSequence.load( std::memory_order_acquire ) != i + 1 )
+                    continue;
+
+                const char *pszName = event.pszName.load( std::memory_order_relaxed );
+                const char *pszTrack = event.pszTrack.load( std::memory_order_relaxed );
+                const uint64_t ulBeginNs = event.ulBeginNs.load( std::memory_order_relaxed );
+                const uint64_t ulEndNs = event.ulEndNs.load( std::memory_order_relaxed );
+                const uint64_t ulArg = event.ulArg.load( std::memory_order_relaxed );
+                const bool bInstant = event.bInstant.load( std::memory_order_relaxed );
+
+                // Overwritten by the thread while we were reading it?
+                std::atomic_thread_fence( std::memory_order_acquire );
+                if ( event.ulSequence.load( std::memory_order_relaxed ) != i + 1 )
+                    continue;
+
+                int nTid = int( pRing->nTid );
+                if ( pszTrack )
+                {
+                    auto iter = std::find( tracks.begin(), tracks.end(), pszTrack );
+                    if ( iter == tracks.end() )
+                        iter = tracks.insert( tracks.end(), pszTrack );
+                    nTid = k_nFirstTrackTid + int( iter - tracks.begin() );
+                }
+
+                fprintf( pFile, ",\n{\"name\":\"" );
+                WriteJsonString( pFile, pszName );
+
+                if ( bInstant )
+                {
+                    fprintf( pFile, "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                        nPid, nTid, ulBeginNs / 1'000.0 );
+                }
+                else
+                {
+                    fprintf( pFile, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                        nPid, nTid, ulBeginNs / 1'000.0, ( ulEndNs - ulBeginNs ) / 1'000.0 );
+                }
+
+                if ( ulArg )
+                    fprintf( pFile, ",\"args\":{\"arg\":%" PRIu64 "}", ulArg );
+
+                fprintf( pFile, "}" );
+                ulEventCount++;
+            }
+        }
+
+        for ( size_t i = 0; i < tracks.size(); i++ )
+        {
+            fprintf( pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                nPid, k_nFirstTrackTid + int( i ) );
+            WriteJsonString( pFile, tracks[i] );
+            fprintf( pFile, "\"}}" );
+        }
+
+        fprintf( pFile, "\n]}\n" );
+
+        if ( ferror( pFile ) )
+        {
+            trace_log.errorf( "Failed to write '%s'", pszPath );
+            return false;
+        }
+
+        trace_log.infof( "Wrote %" PRIu64 " events from %zu threads to '%s'", ulEventCount, rings.size(), pszPath );
+        return true;
+    }
+
+    static ConCommand cc_trace_dump( "trace_dump", "Write what trace_enabled recorded as a Chrome JSON trace, for ui.perfetto.dev or chrome://tracing. Usage: trace_dump [path], defaults to $XDG_RUNTIME_DIR/gamescope-trace-<pid>-<time>.json",
+    []( std::span<std::string_view> args )
+    {
+        std::string sPath;
+        if ( args.size() >= 2 )
+        {
+            sPath = std::string( args[1] );
+        }
+        else
+        {
+            const char *pszDir = getenv( "XDG_RUNTIME_DIR" );
+            if ( !pszDir || !*pszDir )
+                pszDir = "/tmp";
+
+            sPath = std::string( pszDir ) + "/gamescope-trace-" + std::to_string( getpid() ) + "-" + std::to_string( time( nullptr ) ) + ".json";
+        }
+
+        if ( !IsEnabled() )
+            trace_log.infof( "trace_enabled is off, only events from before it was turned off will be in the trace." );
+
+        Dump( sPath.c_str() );
+    });
+}
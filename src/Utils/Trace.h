@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace gamescope
+{
+    // An in-process flight recorder of what the compositor is doing, for
+    // when gpuvis is not an option (no root for tracefs, no trace-cmd on
+    // the device).
+    //
+    // While trace_enabled is on, spans and instant events go into a ring of
+    // the last k_uEventsPerThread events of the thread recording them. Only
+    // that thread ever writes to its ring, so recording is a handful of
+    // stores and never takes a lock. trace_dump (also available through
+    // gamescopectl) writes all of the rings out as a Chrome JSON trace,
+    // which ui.perfetto.dev and chrome://tracing can open.
+    //
+    // Names and tracks must be string literals, only the pointer is kept.
+    namespace Trace
+    {
+        static constexpr uint32_t k_uEventsPerThread = 16384;
+        // Threads past this many don't get a ring and are not recorded.
+        static constexpr uint32_t k_uMaxThreads = 64;
+
+        extern std::atomic<bool> g_bEnabled;
+
+        inline bool IsEnabled()
+        {
+            return g_bEnabled.load( std::memory_order_relaxed );
+        }
+
+        // CLOCK_MONOTONIC, like get_time_in_nanos.
+        uint64_t Now();
+
+        // pszTrack puts the span on a track of its own rather than the
+        // calling thread's, eg. for GPU work.
+        void RecordSpan( const char *pszName, uint64_t ulBeginNs, uint64_t ulEndNs, uint64_t ulArg = 0, const char *pszTrack = nullptr );
+        void RecordInstant( const char *pszName, uint64_t ulArg = 0 );
+
+        // Writes out everything still in the rings, recording carries on.
+        bool Dump( const char *pszPath );
+    }
+
+    // Records a span from construction to destruction if tracing was
+    // enabled when it started.
+    class TraceSpan
+    {
+    public:
+        TraceSpan( const char *pszName, uint64_t ulArg = 0 )
+            : m_pszName{ pszName }
+            , m_ulArg{ ulArg }
+            , m_ulBeginNs{ Trace::IsEnabled() ? Trace::Now() : 0 }
+        {
+        }
+
+        ~TraceSpan()
+        {
+            if ( m_ulBeginNs )
+                Trace::RecordSpan( m_pszName, m_ulBeginNs, Trace::Now(), m_ulArg );
+        }
+
+        TraceSpan( const TraceSpan & ) = delete;
+        TraceSpan &operator = ( const TraceSpan & ) = delete;
+
+        void SetArg( uint64_t ulArg ) { m_ulArg = ulArg; }
+
+    private:
+        const char *m_pszName;
+        uint64_t m_ulArg;
+        uint64_t m_ulBeginNs;
+    };
+}
+
+#define GAMESCOPE_TRACE_1(x, y) x##y
+#define GAMESCOPE_TRACE_2(x, y) GAMESCOPE_TRACE_1(x, y)
+#define GAMESCOPE_TRACE_SPAN(...) ::gamescope::TraceSpan GAMESCOPE_TRACE_2(_trace_span_, __COUNTER__)( __VA_ARGS__ )
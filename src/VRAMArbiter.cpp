@@ -0,0 +1,496 @@
+#include "VRAMArbiter.h"
+
+#include "convar.h"
+#include "log.hpp"
+#include "rendervulkan.hpp"
+#include "steamcompmgr.hpp"
+#include "wlserver.hpp"
+#include "Utils/Defer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <thread>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace gamescope
+{
+    static LogScope vram_log{ "vram" };
+
+    static void MarkVRAMProtectionDirty( ConVar<float> & )
+    {
+        CVRAMArbiter::Get().MarkProtectionDirty();
+    }
+
+    static ConVar<float> cv_vram_protect_focused( "vram_protect_focused", 1.0f, "Fraction of the VRAM capacity protected from eviction (dmem.low) for the focused app's cgroup.", MarkVRAMProtectionDirty );
+    static ConVar<float> cv_vram_protect_steam( "vram_protect_steam", 0.0f, "Fraction of the VRAM capacity protected from eviction (dmem.low) for Steam's cgroup.", MarkVRAMProtectionDirty );
+    static ConVar<float> cv_vram_protect_overlay( "vram_protect_overlay", 0.0f, "Fraction of the VRAM capacity protected from eviction (dmem.low) for the cgroups of overlays.", MarkVRAMProtectionDirty );
+    static ConVar<float> cv_vram_protect_background( "vram_protect_background", 0.0f, "Fraction of the VRAM capacity protected from eviction (dmem.low) for the cgroups of background apps.", MarkVRAMProtectionDirty );
+    static ConVar<uint32_t> cv_vram_accounting_interval_ms( "vram_accounting_interval_ms", 1000, "How often to account the VRAM usage of clients and check for memory pressure. 0 to disable." );
+    static ConVar<float> cv_vram_pressure_threshold( "vram_pressure_threshold", 0.9f, "Fraction of our own VRAM budget past which gamescope drops its caches." );
+    static ConVar<float> cv_vram_budget_warning_threshold( "vram_budget_warning_threshold", 0.9f, "Fraction of the VRAM left for the focused app past which gamescope_control clients are warned." );
+
+    static constexpr uint64_t k_ulShrinkIntervalNs = 5'000'000'000ul;
+
+    const char *VRAMTierName( VRAMTier eTier )
+    {
+        switch ( eTier )
+        {
+            case VRAMTier::Focused:    return "focused";
+            case VRAMTier::Steam:      return "steam";
+            case VRAMTier::Overlay:    return "overlay";
+            case VRAMTier::Background: return "background";
+            default:                   return "unknown";
+        }
+    }
+
+    static float VRAMTierProtection( VRAMTier eTier )
+    {
+        float flFraction = 0.0f;
+        switch ( eTier )
+        {
+            case VRAMTier::Focused:    flFraction = cv_vram_protect_focused; break;
+            case VRAMTier::Steam:      flFraction = cv_vram_protect_steam; break;
+            case VRAMTier::Overlay:    flFraction = cv_vram_protect_overlay; break;
+            case VRAMTier::Background: flFraction = cv_vram_protect_background; break;
+            default: break;
+        }
+        return std::clamp( flFraction, 0.0f, 1.0f );
+    }
+
+    static std::optional<std::string> CGroupPathFromPID( pid_t pid )
+    {
+        if ( pid <= 0 )
+            return std::nullopt;
+
+        char szPath[ 64 ];
+        snprintf( szPath, sizeof( szPath ), "/proc/%ld/cgroup", (long)pid );
+
+        FILE *pFile = fopen( szPath, "r" );
+        if ( !pFile )
+            return std::nullopt;
+        defer( fclose( pFile ) );
+
+        std::optional<std::string> osPath;
+
+        char *pszLine = nullptr;
+        size_t ulLineSize = 0;
+        while ( getline( &pszLine, &ulLineSize, pFile ) > 0 )
+        {
+            // cgroup v2 paths are always in the format "0::$PATH"
+            static constexpr std::string_view k_svHeader = "0::";
+            std::string_view svLine = pszLine;
+            if ( !svLine.starts_with( k_svHeader ) )
+                continue;
+            svLine.remove_prefix( k_svHeader.size() );
+
+            // (deleted) is added to the path if pid refers to a zombie process,
+            // and the process's cgroup has been deleted.
+            // It's nonsensical to set cgroup limits in such a case.
+            if ( svLine.find( "(deleted)" ) != std::string_view::npos )
+                break;
+
+            if ( svLine.ends_with( '\n' ) )
+                svLine.remove_suffix( 1 );
+
+            osPath = std::string( svLine );
+            break;
+        }
+        free( pszLine );
+
+        return osPath;
+    }
+
+    // Values in fdinfo are in bytes, unless they have a unit.
+    static uint64_t ParseFdinfoBytes( const char *pszValue )
+    {
+        char *pszEnd = nullptr;
+        uint64_t ulValue = strtoull( pszValue, &pszEnd, 10 );
+        while ( *pszEnd == ' ' || *pszEnd == '\t' )
+            pszEnd++;
+
+        if ( !strncmp( pszEnd, "KiB", 3 ) )
+            ulValue *= 1024ul;
+        else if ( !strncmp( pszEnd, "MiB", 3 ) )
+            ulValue *= 1024ul * 1024ul;
+        else if ( !strncmp( pszEnd, "GiB", 3 ) )
+            ulValue *= 1024ul * 1024ul * 1024ul;
+
+        return ulValue;
+    }
+
+    // Sums up the VRAM of the DRM clients a process has open, see
+    // https://docs.kernel.org/gpu/drm-usage-stats.html
+    static uint64_t AccountProcessVRAM( pid_t pid )
+    {
+        char szDir[ 64 ];
+        snprintf( szDir, sizeof( szDir ), "/proc/%ld/fd", (long)pid );
+
+        DIR *pDir = opendir( szDir );
+        if ( !pDir )
+            return 0;
+        defer( closedir( pDir ) );
+
+        // Several fds can refer to the same client.
+        std::unordered_map<uint64_t, uint64_t> clientUsage;
+
+        char *pszLine = nullptr;
+        size_t ulLineSize = 0;
+        defer( free( pszLine ) );
+
+        while ( dirent *pEntry = readdir( pDir ) )
+        {
+            if ( pEntry->d_name[0] == '.' )
+                continue;
+
+            // Games can have thousands of fds, only bother with the DRM ones.
+            char szPath[ 128 ];
+            snprintf( szPath, sizeof( szPath ), "/proc/%ld/fd/%s", (long)pid, pEntry->d_name );
+            char szTarget[ 64 ];
+            ssize_t nTargetLen = readlink( szPath, szTarget, sizeof( szTarget ) - 1 );
+            if ( nTargetLen <= 0 )
+                continue;
+            szTarget[ nTargetLen ] = '\0';
+            if ( strncmp( szTarget, "/dev/dri/", 9 ) )
+                continue;
+
+            snprintf( szPath, sizeof( szPath ), "/proc/%ld/fdinfo/%s", (long)pid, pEntry->d_name );
+            FILE *pFile = fopen( szPath, "r" );
+            if ( !pFile )
+                continue;
+
+            std::optional<uint64_t> oulClientID;
+            uint64_t ulResident = 0;
+            uint64_t ulLegacyVRAM = 0;
+            bool bHasResident = false;
+            while ( getline( &pszLine, &ulLineSize, pFile ) > 0 )
+            {
+                const char *pszValue = strchr( pszLine, ':' );
+                if ( !pszValue )
+                    continue;
+                pszValue++;
+
+                if ( !strncmp( pszLine, "drm-client-id:", 14 ) )
+                {
+                    oulClientID = strtoull( pszValue, nullptr, 10 );
+                }
+                else if ( !strncmp( pszLine, "drm-resident-vram", 17 ) || !strncmp( pszLine, "drm-resident-local", 18 ) )
+                {
+                    ulResident += ParseFdinfoBytes( pszValue );
+                    bHasResident = true;
+                }
+                else if ( !strncmp( pszLine, "drm-memory-vram:", 16 ) )
+                {
+                    // Older amdgpu.
+                    ulLegacyVRAM = ParseFdinfoBytes( pszValue );
+                }
+            }
+            fclose( pFile );
+
+            if ( oulClientID )
+                clientUsage[ *oulClientID ] = bHasResident ? ulResident : ulLegacyVRAM;
+        }
+
+        uint64_t ulTotal = 0;
+        for ( const auto &[ ulClientID, ulUsage ] : clientUsage )
+            ulTotal += ulUsage;
+        return ulTotal;
+    }
+
+    static double BytesToMiB( uint64_t ulBytes )
+    {
+        return double( ulBytes ) / ( 1024.0 * 1024.0 );
+    }
+
+    CVRAMArbiter &CVRAMArbiter::Get()
+    {
+        static CVRAMArbiter s_Arbiter;
+        return s_Arbiter;
+    }
+
+    void CVRAMArbiter::Init()
+    {
+        FILE *pCapacities = fopen( "/sys/fs/cgroup/dmem.capacity", "r" );
+        if ( pCapacities )
+        {
+            char *pszLine = nullptr;
+            size_t ulLineSize = 0;
+            while ( getline( &pszLine, &ulLineSize, pCapacities ) >= 0 )
+            {
+                char *pszCapacity = strchr( pszLine, ' ' );
+                if ( !pszCapacity )
+                    continue;
+
+                uint64_t ulCapacity = strtoull( pszCapacity + 1, nullptr, 10 );
+                m_Capacities.emplace_back( std::string( pszLine, pszCapacity - pszLine ), ulCapacity );
+                m_ulTotalCapacity += ulCapacity;
+            }
+            free( pszLine );
+            fclose( pCapacities );
+        }
+
+        std::thread accountingThread( [this]() { AccountingThreadMain(); } );
+        accountingThread.detach();
+    }
+
+    void CVRAMArbiter::SetClients( std::vector<VRAMClient_t> clients )
+    {
+        if ( clients == m_Clients )
+            return;
+
+        m_Clients = std::move( clients );
+        m_bProtectionDirty = true;
+
+        std::erase_if( m_CGroupCache, [&]( const auto &entry )
+        {
+            return std::none_of( m_Clients.begin(), m_Clients.end(), [&]( const VRAMClient_t &client ) { return client.pid == entry.first; } );
+        });
+
+        {
+            std::unique_lock lock( m_AccountingMutex );
+            m_AccountingClients = m_Clients;
+            // Don't wait a whole interval to know about a newly focused game.
+            m_bAccountNow = true;
+        }
+        m_AccountingCV.notify_one();
+    }
+
+    const std::string *CVRAMArbiter::CGroupForPID( pid_t pid )
+    {
+        auto iter = m_CGroupCache.find( pid );
+        if ( iter == m_CGroupCache.end() )
+            iter = m_CGroupCache.emplace( pid, CGroupPathFromPID( pid ) ).first;
+
+        return iter->second ? &*iter->second : nullptr;
+    }
+
+    bool CVRAMArbiter::WriteDMemLow( const std::string &sCGroup, float flFraction )
+    {
+        std::string sPath = "/sys/fs/cgroup" + sCGroup + "/dmem.low";
+        FILE *pFile = fopen( sPath.c_str(), "w" );
+        if ( !pFile )
+            return false;
+
+        for ( const auto &[ sRegion, ulCapacity ] : m_Capacities )
+            fprintf( pFile, "%s %" PRIu64 "\n", sRegion.c_str(), uint64_t( ulCapacity * double( flFraction ) ) );
+
+        fclose( pFile );
+        return true;
+    }
+
+    void CVRAMArbiter::ApplyProtection()
+    {
+        if ( m_Capacities.empty() )
+            return;
+
+        // A cgroup is as protected as the most important client in it,
+        // eg. a game launched in the same unit as Steam.
+        std::unordered_map<std::string, VRAMTier> cgroupTiers;
+        for ( const VRAMClient_t &client : m_Clients )
+        {
+            const std::string *psCGroup = CGroupForPID( client.pid );
+            if ( !psCGroup )
+                continue;
+
+            auto [ iter, bInserted ] = cgroupTiers.emplace( *psCGroup, client.eTier );
+            if ( !bInserted )
+                iter->second = std::min( iter->second, client.eTier );
+        }
+
+        for ( const auto &[ sCGroup, eTier ] : cgroupTiers )
+        {
+            float flFraction = VRAMTierProtection( eTier );
+
+            auto iter = m_AppliedProtection.find( sCGroup );
+            float flApplied = iter != m_AppliedProtection.end() ? iter->second : 0.0f;
+            if ( flFraction == flApplied )
+                continue;
+
+            if ( !WriteDMemLow( sCGroup, flFraction ) )
+                continue;
+
+            vram_log.debugf( "%s: %s, dmem.low %.0f%%", sCGroup.c_str(), VRAMTierName( eTier ), flFraction * 100.0f );
+            if ( flFraction != 0.0f )
+                m_AppliedProtection[ sCGroup ] = flFraction;
+            else if ( iter != m_AppliedProtection.end() )
+                m_AppliedProtection.erase( iter );
+        }
+
+        // Whoever went away entirely doesn't need protecting anymore.
+        for ( auto iter = m_AppliedProtection.begin(); iter != m_AppliedProtection.end(); )
+        {
+            if ( !cgroupTiers.contains( iter->first ) )
+            {
+                WriteDMemLow( iter->first, 0.0f );
+                iter = m_AppliedProtection.erase( iter );
+            }
+            else
+            {
+                iter++;
+            }
+        }
+    }
+
+    bool CVRAMArbiter::Update()
+    {
+        if ( m_bProtectionDirty.exchange( false ) )
+            ApplyProtection();
+
+        const uint32_t uIntervalMs = cv_vram_accounting_interval_ms;
+        if ( uIntervalMs == 0 )
+            return false;
+
+        const uint64_t ulNow = get_time_in_nanos();
+        if ( ulNow < m_ulNextPressureCheck )
+            return false;
+        m_ulNextPressureCheck = ulNow + uint64_t( uIntervalMs ) * 1'000'000ul;
+
+        uint64_t ulHeapSize = 0;
+        uint64_t ulOurUsage = 0;
+        uint64_t ulOurBudget = 0;
+        vulkan_get_device_local_memory( &ulHeapSize, &ulOurUsage, &ulOurBudget );
+
+        bool bPressure = ulOurBudget != 0 && ulOurUsage > ulOurBudget * double( cv_vram_pressure_threshold );
+
+        // What is left for the focused app is whatever nobody else is using.
+        uint64_t ulFocusedUsage = 0;
+        uint64_t ulOthersUsage = 0;
+        uint32_t uFocusedAppID = 0;
+        bool bHasFocused = false;
+        {
+            std::unique_lock lock( m_AccountingMutex );
+            for ( const VRAMClient_t &client : m_Clients )
+            {
+                auto iter = m_ProcessUsage.find( client.pid );
+                uint64_t ulUsage = iter != m_ProcessUsage.end() ? iter->second : 0;
+                if ( client.eTier == VRAMTier::Focused )
+                {
+                    ulFocusedUsage += ulUsage;
+                    uFocusedAppID = client.uAppID;
+                    bHasFocused = true;
+                }
+                else
+                {
+                    ulOthersUsage += ulUsage;
+                }
+            }
+        }
+
+        const uint64_t ulCapacity = m_ulTotalCapacity ? m_ulTotalCapacity : ulHeapSize;
+        const uint64_t ulUsedByOthers = ulOthersUsage + ulOurUsage;
+        const uint64_t ulFocusedBudget = ulCapacity > ulUsedByOthers ? ulCapacity - ulUsedByOthers : 0;
+
+        const double flWarningThreshold = cv_vram_budget_warning_threshold;
+        bool bWarn = bHasFocused && uFocusedAppID && ulFocusedBudget != 0;
+        if ( bWarn )
+        {
+            // Some hysteresis so we don't flap around the threshold.
+            const double flThreshold = m_uWarnedAppID == uFocusedAppID ? flWarningThreshold - 0.1 : flWarningThreshold;
+            bWarn = ulFocusedUsage > ulFocusedBudget * flThreshold;
+        }
+
+        const uint32_t uWarnAppID = bWarn ? uFocusedAppID : 0;
+        if ( uWarnAppID != m_uWarnedAppID )
+        {
+            const uint32_t uUsageMiB = uint32_t( BytesToMiB( ulFocusedUsage ) );
+            const uint32_t uBudgetMiB = uint32_t( BytesToMiB( ulFocusedBudget ) );
+
+            // Tell whoever we warned before that it's over, with 0s if it
+            // lost focus, then warn about the new one.
+            wlserver_lock();
+            if ( m_uWarnedAppID && m_uWarnedAppID != uFocusedAppID )
+                wlserver_send_app_vram_budget( m_uWarnedAppID, 0, 0 );
+            else if ( m_uWarnedAppID )
+                wlserver_send_app_vram_budget( m_uWarnedAppID, uUsageMiB, uBudgetMiB );
+            if ( uWarnAppID )
+                wlserver_send_app_vram_budget( uWarnAppID, uUsageMiB, uBudgetMiB );
+            wlserver_unlock();
+
+            if ( uWarnAppID )
+            {
+                vram_log.infof( "app %u is using %.1f MiB of the %.1f MiB of VRAM left for it",
+                    uWarnAppID, BytesToMiB( ulFocusedUsage ), BytesToMiB( ulFocusedBudget ) );
+            }
+
+            m_uWarnedAppID = uWarnAppID;
+        }
+
+        // Give back what we can while the game is squeezed too, not just us.
+        bPressure |= bWarn;
+
+        bool bShrink = bPressure && ( !m_bUnderPressure || ulNow - m_ulLastShrink >= k_ulShrinkIntervalNs );
+        if ( bPressure != m_bUnderPressure )
+            vram_log.debugf( "%s memory pressure", bPressure ? "under" : "no longer under" );
+        m_bUnderPressure = bPressure;
+
+        if ( bShrink )
+            m_ulLastShrink = ulNow;
+
+        return bShrink;
+    }
+
+    void CVRAMArbiter::AccountingThreadMain()
+    {
+        pthread_setname_np( pthread_self(), "gamescope-vram" );
+
+        for ( ;; )
+        {
+            std::vector<VRAMClient_t> clients;
+            {
+                std::unique_lock lock( m_AccountingMutex );
+                const uint32_t uIntervalMs = cv_vram_accounting_interval_ms;
+                if ( uIntervalMs != 0 )
+                    m_AccountingCV.wait_for( lock, std::chrono::milliseconds( uIntervalMs ), [this] { return m_bAccountNow; } );
+                else
+                    m_AccountingCV.wait( lock, [this] { return m_bAccountNow; } );
+                m_bAccountNow = false;
+
+                clients = m_AccountingClients;
+            }
+
+            // Without holding the lock, there can be a lot of fds to look at.
+            std::unordered_map<pid_t, uint64_t> processUsage;
+            for ( const VRAMClient_t &client : clients )
+            {
+                if ( client.pid > 0 && !processUsage.contains( client.pid ) )
+                    processUsage[ client.pid ] = AccountProcessVRAM( client.pid );
+            }
+
+            {
+                std::unique_lock lock( m_AccountingMutex );
+                m_ProcessUsage = std::move( processUsage );
+            }
+        }
+    }
+
+    void CVRAMArbiter::Dump()
+    {
+        if ( m_Capacities.empty() )
+            vram_log.infof( "no dmem cgroup controller, VRAM protection is not available." );
+        for ( const auto &[ sRegion, ulCapacity ] : m_Capacities )
+            vram_log.infof( "%s: %.1f MiB", sRegion.c_str(), BytesToMiB( ulCapacity ) );
+
+        // Can be called from any thread, only look at what we share with
+        // the accounting thread.
+        std::unique_lock lock( m_AccountingMutex );
+        for ( const VRAMClient_t &client : m_AccountingClients )
+        {
+            auto iter = m_ProcessUsage.find( client.pid );
+            std::optional<std::string> osCGroup = CGroupPathFromPID( client.pid );
+            vram_log.infof( "pid %ld (app %u): %s, %.1f MiB, cgroup %s",
+                (long)client.pid, client.uAppID, VRAMTierName( client.eTier ),
+                BytesToMiB( iter != m_ProcessUsage.end() ? iter->second : 0 ),
+                osCGroup ? osCGroup->c_str() : "(none)" );
+        }
+    }
+
+    static ConCommand cc_vram_clients( "vram_clients", "Dump the VRAM tier, usage and cgroup of every client.",
+    []( std::span<std::string_view> args )
+    {
+        CVRAMArbiter::Get().Dump();
+    });
+}
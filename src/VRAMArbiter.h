@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace gamescope
+{
+    // Who gets to keep their VRAM when there is not enough of it to go
+    // around, most protected first.
+    enum class VRAMTier : uint32_t
+    {
+        Focused,
+        Steam,
+        Overlay,
+        Background,
+
+        Count
+    };
+
+    const char *VRAMTierName( VRAMTier eTier );
+
+    struct VRAMClient_t
+    {
+        pid_t pid = 0;
+        uint32_t uAppID = 0;
+        VRAMTier eTier = VRAMTier::Background;
+
+        bool operator == ( const VRAMClient_t &other ) const = default;
+    };
+
+    // Arbitrates VRAM between the clients we know about and ourselves when
+    // the GPU's memory is oversubscribed, eg. alt-tabbing between two heavy
+    // games on a handheld with unified memory.
+    //
+    // - The cgroup of each client gets a dmem.low protection for its tier
+    //   (vram_protect_*, a fraction of the dmem capacity), so the kernel
+    //   evicts background apps before it touches the focused game.
+    // - A thread accounts the VRAM of every client from the DRM fdinfo of
+    //   its process, every vram_accounting_interval_ms.
+    // - When our own heaps get close to their budget, or the focused game
+    //   gets close to what is left for it, Update tells the caller to shrink
+    //   gamescope's caches, and gamescope_control clients get an
+    //   app_vram_budget event for the game.
+    class CVRAMArbiter
+    {
+    public:
+        static CVRAMArbiter &Get();
+
+        // Reads the dmem capacities and starts the accounting thread.
+        void Init();
+
+        // Main thread. Replaces the set of clients, changes are applied
+        // on the next Update.
+        void SetClients( std::vector<VRAMClient_t> clients );
+
+        // Main thread, called every iteration.
+        // Returns true when gamescope should shrink its own caches.
+        bool Update();
+
+        void MarkProtectionDirty() { m_bProtectionDirty = true; }
+
+        void Dump();
+
+    private:
+        void ApplyProtection();
+        bool WriteDMemLow( const std::string &sCGroup, float flFraction );
+        const std::string *CGroupForPID( pid_t pid );
+
+        void AccountingThreadMain();
+
+        // dmem.capacity, region -> bytes.
+        std::vector<std::pair<std::string, uint64_t>> m_Capacities;
+        uint64_t m_ulTotalCapacity = 0;
+
+        std::vector<VRAMClient_t> m_Clients;
+        std::atomic<bool> m_bProtectionDirty = { false };
+        std::unordered_map<pid_t, std::optional<std::string>> m_CGroupCache;
+        // Only cgroups we gave a non-zero protection.
+        std::unordered_map<std::string, float> m_AppliedProtection;
+
+        uint64_t m_ulNextPressureCheck = 0;
+        uint64_t m_ulLastShrink = 0;
+        bool m_bUnderPressure = false;
+        // The app we last sent a budget warning for, 0 if none.
+        uint32_t m_uWarnedAppID = 0;
+
+        // Shared with the accounting thread.
+        std::mutex m_AccountingMutex;
+        std::condition_variable m_AccountingCV;
+        bool m_bAccountNow = false;
+        std::vector<VRAMClient_t> m_AccountingClients;
+        std::unordered_map<pid_t, uint64_t> m_ProcessUsage;
+    };
+}
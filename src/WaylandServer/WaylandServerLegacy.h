@@ -57,6 +57,8 @@ struct wlserver_wl_surface_info
 	uint64_t desired_present_time = 0;
 
 	uint64_t last_refresh_cycle = 0;
+	uint32_t last_optimal_width = 0;
+	uint32_t last_optimal_height = 0;
 };
 
 wlserver_wl_surface_info *get_wl_surface_info(struct wlr_surface *wlr_surf);
@@ -185,6 +185,9 @@ namespace gamescope
         virtual const BackendConnectorHDRInfo &GetHDRInfo() const = 0;
         virtual bool IsVRRActive() const = 0;
         virtual std::span<const BackendMode> GetModes() const = 0;
+        // The extent this connector is presented at, if it is tracked per-connector
+        // (eg. virtual connectors) rather than by the global output size.
+        virtual std::optional<VkExtent2D> GetOutputExtent() const = 0;
 
         virtual bool SupportsVRR() const = 0;
 
@@ -234,6 +237,7 @@ namespace gamescope
         virtual BackendPresentFeedback& PresentationFeedback() override { return m_PresentFeedback; }
         virtual uint64_t GetVirtualConnectorKey() const override { return m_ulVirtualConnectorKey; }
         virtual INestedHints *GetNestedHints() override { return nullptr; }
+        virtual std::optional<VkExtent2D> GetOutputExtent() const override { return std::nullopt; }
 
         virtual void SetProperty( ConnectorProperty eProperty, std::any value ) override { }
     protected:
@@ -400,6 +404,10 @@ namespace gamescope
 
         virtual bool ShouldFitWindows() = 0;
 
+        // Whether the CPU copies of the color management LUTs get used
+        // (ie. for KMS blobs), rather than only the Vulkan images.
+        virtual bool NeedsColorMgmtLutData() const = 0;
+
         virtual void OnEndFrame() = 0;
 
         static IBackend *Get();
@@ -439,6 +447,8 @@ namespace gamescope
 
         virtual bool ShouldFitWindows() override { return true; }
 
+        virtual bool NeedsColorMgmtLutData() const override { return false; }
+
         virtual void OnEndFrame() override {}
     };
 
@@ -1,9 +1,22 @@
 #define COLOR_HELPERS_CPP
 #include "color_helpers_impl.h"
 
+#include "convar.h"
+#include "Utils/Defer.h"
+
 #include <algorithm>
+#include <charconv>
+#include <cinttypes>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
@@ -132,64 +145,396 @@ inline bool close_enough(float a, float b, float epsilon = 0.001f)
 	return fabsf(a - b) <= epsilon;
 }
 
-std::shared_ptr<lut3d_t> LoadCubeLut( FILE *pFile, bool &bRaisesBlackLevelFloor )
+gamescope::ConVar<std::string> cv_color_lut_cache_dir{ "color_lut_cache_dir", "", "Directory to persist computed color management LUTs and parsed looks in. Empty to only cache them in memory." };
+
+// .cube parsing
+//
+// R changes fastest
+// ...
+// LUT_3D_SIZE %d(lutEdgeSize)
+// %f %f %f
+// ...
+//
+// Looks can be up to 128^3 entries, so the data lines get split up into
+// chunks at line boundaries which are parsed in parallel.
+
+static constexpr size_t k_ulCubeParallelMinSize = 1024 * 1024;
+static constexpr uint32_t k_uCubeMaxParseThreads = 8;
+
+static bool IsCubeSpace( char c )
 {
-    // R changes fastest
-    // ...
-    // LUT_3D_SIZE %d(lutEdgeSize)
-    // %f %f %f
-    // ...
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static const char *SkipCubeSpace( const char *pch, const char *pchEnd )
+{
+    while ( pch < pchEnd && IsCubeSpace( *pch ) )
+        pch++;
+    // from_chars doesn't take an explicit +, sscanf did.
+    if ( pch < pchEnd && *pch == '+' )
+        pch++;
+    return pch;
+}
+
+// Matches what sscanf( "%f %f %f" ) accepted on a single line.
+static bool ParseCubeValue( const char *pch, const char *pchEnd, glm::vec3 *pValue )
+{
+    for ( int i = 0; i < 3; i++ )
+    {
+        pch = SkipCubeSpace( pch, pchEnd );
+        auto [ pchParsed, ec ] = std::from_chars( pch, pchEnd, (*pValue)[i] );
+        if ( ec != std::errc{} )
+            return false;
+        pch = pchParsed;
+    }
+    return true;
+}
+
+static void ParseCubeValues( const char *pchBegin, const char *pchEnd, std::vector<glm::vec3> *pValues )
+{
+    const char *pchLine = pchBegin;
+    while ( pchLine < pchEnd )
+    {
+        const char *pchLineEnd = static_cast<const char *>( memchr( pchLine, '\n', pchEnd - pchLine ) );
+        if ( !pchLineEnd )
+            pchLineEnd = pchEnd;
+
+        glm::vec3 val;
+        if ( ParseCubeValue( pchLine, pchLineEnd, &val ) )
+            pValues->push_back( val );
 
+        pchLine = pchLineEnd + 1;
+    }
+}
+
+std::shared_ptr<lut3d_t> ParseCubeLut( std::string_view svData, bool &bRaisesBlackLevelFloor )
+{
     bRaisesBlackLevelFloor = false;
     std::shared_ptr<lut3d_t> lut3d = std::make_shared<lut3d_t>();
 
-    glm::vec3 blackFloor = glm::vec3{ 0.0f, 0.0f, 0.0f };
+    // Anything before LUT_3D_SIZE is ignored.
+    const char *pchData = svData.data();
+    const char *pchEnd = svData.data() + svData.size();
+    while ( pchData < pchEnd && !lut3d->lutEdgeSize )
+    {
+        const char *pchLineEnd = static_cast<const char *>( memchr( pchData, '\n', pchEnd - pchData ) );
+        if ( !pchLineEnd )
+            pchLineEnd = pchEnd;
+
+        std::string_view svLine{ pchData, size_t( pchLineEnd - pchData ) };
+        pchData = std::min( pchLineEnd + 1, pchEnd );
+
+        static constexpr std::string_view k_svSizeKeyword = "LUT_3D_SIZE";
+        if ( !svLine.starts_with( k_svSizeKeyword ) )
+            continue;
+
+        const char *pchSize = SkipCubeSpace( svLine.data() + k_svSizeKeyword.size(), pchLineEnd );
+        int nEdgeSize = 0;
+        if ( std::from_chars( pchSize, pchLineEnd, nEdgeSize ).ec != std::errc{} )
+            continue;
+
+        if ( nEdgeSize < 2 || nEdgeSize > 128 ) // sanity check
+            return nullptr;
+        lut3d->lutEdgeSize = nEdgeSize;
+    }
+
+    if ( !lut3d->lutEdgeSize )
+        return nullptr;
+
+    const size_t ulExpectedElements = size_t( lut3d->lutEdgeSize ) * lut3d->lutEdgeSize * lut3d->lutEdgeSize;
+
+    uint32_t uChunkCount = 1;
+    if ( size_t( pchEnd - pchData ) >= k_ulCubeParallelMinSize )
+        uChunkCount = std::clamp( std::thread::hardware_concurrency(), 1u, k_uCubeMaxParseThreads );
 
-    char line[2048];
-    while ( fgets( line, sizeof( line ), pFile ) )
+    std::vector<std::vector<glm::vec3>> chunkValues( uChunkCount );
+    std::vector<std::thread> threads;
+    const size_t ulBodySize = pchEnd - pchData;
+    const char *pchChunk = pchData;
+    for ( uint32_t i = 0; i < uChunkCount; i++ )
     {
-        if ( lut3d->lutEdgeSize )
+        const char *pchChunkEnd = pchEnd;
+        if ( i + 1 < uChunkCount )
         {
-            glm::vec3 val;
-            if ( sscanf( line, "%f %f %f", &val.r, &val.g, &val.b ) == 3 )
+            const char *pchSplit = std::max( pchChunk, pchData + ulBodySize * ( i + 1 ) / uChunkCount );
+            const char *pchNewline = static_cast<const char *>( memchr( pchSplit, '\n', pchEnd - pchSplit ) );
+            pchChunkEnd = pchNewline ? pchNewline + 1 : pchEnd;
+        }
+
+        chunkValues[i].reserve( ulExpectedElements / uChunkCount + 1 );
+        if ( i + 1 < uChunkCount )
+            threads.emplace_back( ParseCubeValues, pchChunk, pchChunkEnd, &chunkValues[i] );
+        else
+            ParseCubeValues( pchChunk, pchChunkEnd, &chunkValues[i] );
+
+        pchChunk = pchChunkEnd;
+    }
+
+    for ( std::thread &thread : threads )
+        thread.join();
+
+    size_t ulElements = 0;
+    for ( const std::vector<glm::vec3> &values : chunkValues )
+        ulElements += values.size();
+
+    if ( ulElements != ulExpectedElements )
+        return nullptr;
+
+    lut3d->data.reserve( ulExpectedElements );
+    for ( const std::vector<glm::vec3> &values : chunkValues )
+        lut3d->data.insert( lut3d->data.end(), values.begin(), values.end() );
+
+    glm::vec3 blackFloor = lut3d->data[0];
+    bRaisesBlackLevelFloor = !close_enough(blackFloor.x, 0.0f) || !close_enough(blackFloor.y, 0.0f) || !close_enough(blackFloor.z, 0.0f);
+    return lut3d;
+}
+
+// Parsed looks, so switching between looks doesn't reparse them.
+//
+// In memory, entries are keyed by the file's identity and modification
+// time, which also covers looks handed to us as fds.
+// Looks loaded by path are also kept in color_lut_cache_dir if it is set,
+// keyed by path, mtime and size.
+class CCubeLutCache
+{
+public:
+    struct Entry_t
+    {
+        dev_t nDevice = 0;
+        ino_t nInode = 0;
+        int64_t nMTimeNs = 0;
+        int64_t nSize = 0;
+
+        std::shared_ptr<lut3d_t> pLut;
+        bool bRaisesBlackLevelFloor = false;
+
+        bool Matches( const struct stat &st ) const
+        {
+            return nDevice == st.st_dev && nInode == st.st_ino && nMTimeNs == MTimeNs( st ) && nSize == st.st_size;
+        }
+    };
+
+    static int64_t MTimeNs( const struct stat &st )
+    {
+        return int64_t( st.st_mtim.tv_sec ) * 1'000'000'000ll + st.st_mtim.tv_nsec;
+    }
+
+    std::shared_ptr<lut3d_t> Lookup( const struct stat &st, bool &bRaisesBlackLevelFloor )
+    {
+        std::scoped_lock lock( m_Mutex );
+
+        auto iter = std::find_if( m_Entries.begin(), m_Entries.end(), [&]( const Entry_t &entry ) { return entry.Matches( st ); } );
+        if ( iter == m_Entries.end() )
+            return nullptr;
+
+        // Most recently used goes to the back.
+        Entry_t entry = std::move( *iter );
+        m_Entries.erase( iter );
+        m_Entries.emplace_back( std::move( entry ) );
+
+        bRaisesBlackLevelFloor = m_Entries.back().bRaisesBlackLevelFloor;
+        return m_Entries.back().pLut;
+    }
+
+    void Store( const struct stat &st, std::shared_ptr<lut3d_t> pLut, bool bRaisesBlackLevelFloor )
+    {
+        std::scoped_lock lock( m_Mutex );
+
+        std::erase_if( m_Entries, [&]( const Entry_t &entry ) { return entry.Matches( st ); } );
+        if ( m_Entries.size() >= k_uMaxEntries )
+            m_Entries.erase( m_Entries.begin() );
+
+        m_Entries.emplace_back( Entry_t
+        {
+            .nDevice = st.st_dev,
+            .nInode = st.st_ino,
+            .nMTimeNs = MTimeNs( st ),
+            .nSize = st.st_size,
+            .pLut = std::move( pLut ),
+            .bRaisesBlackLevelFloor = bRaisesBlackLevelFloor,
+        } );
+    }
+
+    // File layout: magic, path length, path, mtime, size, edge size,
+    // black level flag, then the LUT as native endian floats.
+    static std::shared_ptr<lut3d_t> ReadFromDisk( std::string_view svPath, const struct stat &st, bool &bRaisesBlackLevelFloor )
+    {
+        std::string sCachePath = CachePath( svPath, st );
+        if ( sCachePath.empty() )
+            return nullptr;
+
+        FILE *pFile = fopen( sCachePath.c_str(), "rb" );
+        if ( !pFile )
+            return nullptr;
+        defer( fclose( pFile ) );
+
+        char szMagic[sizeof( k_szMagic )];
+        uint32_t uPathSize = 0;
+        if ( fread( szMagic, sizeof( szMagic ), 1, pFile ) != 1 ||
+             memcmp( szMagic, k_szMagic, sizeof( k_szMagic ) ) != 0 ||
+             fread( &uPathSize, sizeof( uPathSize ), 1, pFile ) != 1 ||
+             uPathSize != svPath.size() )
+            return nullptr;
+
+        std::string sPath( uPathSize, '\0' );
+        int64_t nMTimeNs = 0;
+        int64_t nSize = 0;
+        int32_t nEdgeSize = 0;
+        uint8_t uRaisesBlackLevelFloor = 0;
+        if ( fread( sPath.data(), 1, sPath.size(), pFile ) != sPath.size() || sPath != svPath ||
+             fread( &nMTimeNs, sizeof( nMTimeNs ), 1, pFile ) != 1 || nMTimeNs != MTimeNs( st ) ||
+             fread( &nSize, sizeof( nSize ), 1, pFile ) != 1 || nSize != st.st_size ||
+             fread( &nEdgeSize, sizeof( nEdgeSize ), 1, pFile ) != 1 || nEdgeSize < 2 || nEdgeSize > 128 ||
+             fread( &uRaisesBlackLevelFloor, sizeof( uRaisesBlackLevelFloor ), 1, pFile ) != 1 )
+            return nullptr;
+
+        std::shared_ptr<lut3d_t> lut3d = std::make_shared<lut3d_t>();
+        lut3d->resize( nEdgeSize );
+        if ( fread( lut3d->data.data(), sizeof( glm::vec3 ), lut3d->data.size(), pFile ) != lut3d->data.size() )
+            return nullptr;
+
+        bRaisesBlackLevelFloor = uRaisesBlackLevelFloor != 0;
+        return lut3d;
+    }
+
+    static void WriteToDisk( std::string_view svPath, const struct stat &st, const lut3d_t &lut3d, bool bRaisesBlackLevelFloor )
+    {
+        std::string sCachePath = CachePath( svPath, st );
+        if ( sCachePath.empty() )
+            return;
+
+        std::string sTempPath = sCachePath + ".tmp";
+        FILE *pFile = fopen( sTempPath.c_str(), "wb" );
+        if ( !pFile )
+            return;
+
+        uint32_t uPathSize = uint32_t( svPath.size() );
+        int64_t nMTimeNs = MTimeNs( st );
+        int64_t nSize = st.st_size;
+        int32_t nEdgeSize = lut3d.lutEdgeSize;
+        uint8_t uRaisesBlackLevelFloor = bRaisesBlackLevelFloor ? 1 : 0;
+        bool bWritten =
+            fwrite( k_szMagic, sizeof( k_szMagic ), 1, pFile ) == 1 &&
+            fwrite( &uPathSize, sizeof( uPathSize ), 1, pFile ) == 1 &&
+            fwrite( svPath.data(), 1, svPath.size(), pFile ) == svPath.size() &&
+            fwrite( &nMTimeNs, sizeof( nMTimeNs ), 1, pFile ) == 1 &&
+            fwrite( &nSize, sizeof( nSize ), 1, pFile ) == 1 &&
+            fwrite( &nEdgeSize, sizeof( nEdgeSize ), 1, pFile ) == 1 &&
+            fwrite( &uRaisesBlackLevelFloor, sizeof( uRaisesBlackLevelFloor ), 1, pFile ) == 1 &&
+            fwrite( lut3d.data.data(), sizeof( glm::vec3 ), lut3d.data.size(), pFile ) == lut3d.data.size();
+        bWritten = fclose( pFile ) == 0 && bWritten;
+
+        if ( !bWritten || rename( sTempPath.c_str(), sCachePath.c_str() ) != 0 )
+            unlink( sTempPath.c_str() );
+    }
+
+private:
+    // They are up to 128^3 * 12 bytes each, don't hold on to too many.
+    static constexpr uint32_t k_uMaxEntries = 4;
+    static constexpr char k_szMagic[8] = { 'G', 'S', 'C', 'U', 'B', 'E', '0', '1' };
+
+    static std::string CachePath( std::string_view svPath, const struct stat &st )
+    {
+        std::string_view svDir = cv_color_lut_cache_dir;
+        if ( svDir.empty() )
+            return std::string{};
+
+        // FNV-1a
+        uint64_t ulHash = 0xcbf29ce484222325ull;
+        auto HashBytes = [&]( const void *pData, size_t ulSize )
+        {
+            const uint8_t *pBytes = static_cast<const uint8_t *>( pData );
+            for ( size_t i = 0; i < ulSize; i++ )
             {
-                if ( lut3d->data.empty() )
-                {
-                    blackFloor = val;
-                }
-                lut3d->data.push_back( val );
+                ulHash ^= pBytes[i];
+                ulHash *= 0x100000001b3ull;
             }
-        }
-        else if ( sscanf( line, "LUT_3D_SIZE %d", &lut3d->lutEdgeSize ) == 1 )
+        };
+        int64_t nMTimeNs = MTimeNs( st );
+        int64_t nSize = st.st_size;
+        HashBytes( svPath.data(), svPath.size() );
+        HashBytes( &nMTimeNs, sizeof( nMTimeNs ) );
+        HashBytes( &nSize, sizeof( nSize ) );
+
+        char szName[32];
+        snprintf( szName, sizeof( szName ), "/%016" PRIx64 ".cube.bin", ulHash );
+        return std::string{ svDir } + szName;
+    }
+
+    std::mutex m_Mutex;
+    std::vector<Entry_t> m_Entries;
+};
+
+static CCubeLutCache s_CubeLutCache;
+
+static std::shared_ptr<lut3d_t> LoadCubeLutFromFd( int nFd, const char *pchFileName, bool &bRaisesBlackLevelFloor )
+{
+    bRaisesBlackLevelFloor = false;
+
+    struct stat st;
+    if ( fstat( nFd, &st ) != 0 )
+        return nullptr;
+
+    const bool bRegularFile = S_ISREG( st.st_mode ) && st.st_size > 0;
+    if ( bRegularFile )
+    {
+        if ( std::shared_ptr<lut3d_t> pLut = s_CubeLutCache.Lookup( st, bRaisesBlackLevelFloor ) )
+            return pLut;
+
+        if ( pchFileName )
         {
-            if ( lut3d->lutEdgeSize < 2 || lut3d->lutEdgeSize > 128 ) // sanity check
+            if ( std::shared_ptr<lut3d_t> pLut = CCubeLutCache::ReadFromDisk( pchFileName, st, bRaisesBlackLevelFloor ) )
             {
-                return nullptr;
+                s_CubeLutCache.Store( st, pLut, bRaisesBlackLevelFloor );
+                return pLut;
             }
-            lut3d->data.reserve( lut3d->lutEdgeSize * lut3d->lutEdgeSize * lut3d->lutEdgeSize );
         }
     }
 
-    int nExpectedElements = lut3d->lutEdgeSize * lut3d->lutEdgeSize * lut3d->lutEdgeSize;
-    bool bValid = ( nExpectedElements > 0 && ( nExpectedElements == (int) lut3d->data.size() ) );
-    if ( !bValid )
+    std::shared_ptr<lut3d_t> pLut;
+    void *pMapping = bRegularFile ? mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, nFd, 0 ) : MAP_FAILED;
+    if ( pMapping != MAP_FAILED )
     {
-        return nullptr;
+        madvise( pMapping, st.st_size, MADV_WILLNEED );
+        pLut = ParseCubeLut( std::string_view{ static_cast<const char *>( pMapping ), size_t( st.st_size ) }, bRaisesBlackLevelFloor );
+        munmap( pMapping, st.st_size );
+    }
+    else
+    {
+        // Pipes and the like.
+        std::string sData;
+        char buffer[64 * 1024];
+        ssize_t nRead;
+        while ( ( nRead = read( nFd, buffer, sizeof( buffer ) ) ) > 0 )
+            sData.append( buffer, nRead );
+        pLut = ParseCubeLut( sData, bRaisesBlackLevelFloor );
     }
 
-    bRaisesBlackLevelFloor = !close_enough(blackFloor.x, 0.0f) || !close_enough(blackFloor.y, 0.0f) || !close_enough(blackFloor.z, 0.0f);
-    return lut3d;
+    if ( pLut && bRegularFile )
+    {
+        s_CubeLutCache.Store( st, pLut, bRaisesBlackLevelFloor );
+        if ( pchFileName )
+            CCubeLutCache::WriteToDisk( pchFileName, st, *pLut, bRaisesBlackLevelFloor );
+    }
+
+    return pLut;
+}
+
+std::shared_ptr<lut3d_t> LoadCubeLut( FILE *pFile, bool &bRaisesBlackLevelFloor )
+{
+    return LoadCubeLutFromFd( fileno( pFile ), nullptr, bRaisesBlackLevelFloor );
 }
 
 std::shared_ptr<lut3d_t> LoadCubeLut( const char *pchFileName, bool &bRaisesBlackLevelFloor )
 {
     bRaisesBlackLevelFloor = false;
-    
-    FILE *pFile = fopen( pchFileName, "r" );
-    if ( !pFile )
+
+    int nFd = open( pchFileName, O_RDONLY | O_CLOEXEC );
+    if ( nFd < 0 )
         return nullptr;
+    defer( close( nFd ) );
 
-    return LoadCubeLut( pFile, bRaisesBlackLevelFloor );
+    return LoadCubeLutFromFd( nFd, pchFileName, bRaisesBlackLevelFloor );
 }
 
 int GetLut3DIndexRedFastRGB(int indexR, int indexG, int indexB, int dim)
@@ -686,6 +1031,96 @@ inline T applyShaper( const T & input, EOTF source, EOTF dest, const tonemapping
 
 bool g_bHuePreservationWhenClipping = false;
 
+colortransform3d_t calcColorTransform3D( const displaycolorimetry_t & source, const displaycolorimetry_t & dest,
+    const glm::vec2 & destVirtualWhite, EChromaticAdaptationMethod eMethod, const nightmode_t & nightmode, float flGain )
+{
+    colortransform3d_t transform;
+
+    glm::mat3 xyz_from_dest = normalised_primary_matrix( dest.primaries, dest.white, 1.f );
+    glm::mat3 dest_from_xyz = glm::inverse( xyz_from_dest );
+
+    glm::mat3 xyz_from_source = normalised_primary_matrix( source.primaries, source.white, 1.f );
+    transform.dest_from_source = dest_from_xyz * xyz_from_source; // XYZ scaling for white point adjustment
+
+    // Precalc night mode scalars & digital gain
+    // amount and saturation are overdetermined but we separate the two as they conceptually represent
+    // different quantities, and this preserves forwards algorithmic compatibility
+    glm::vec3 nightModeMultHSV( nightmode.hue, clamp01( nightmode.saturation * nightmode.amount ), 1.f );
+    glm::vec3 vMultLinear = glm::pow( hsv_to_rgb( nightModeMultHSV ), glm::vec3( 2.2f ) );
+    transform.vMultLinear = vMultLinear * flGain;
+
+    // Calculate the virtual white point adaptation
+    glm::mat3x3 whitePointDestAdaptation = glm::mat3x3( 1.f ); // identity
+    if ( destVirtualWhite.x > 0.01f && destVirtualWhite.y > 0.01f )
+    {
+        // if source white is within tiny tolerance of sourceWhitePointOverride
+        // don't do the override? (aka two quantizations of d65)
+        glm::mat3x3 virtualWhiteXYZFromPhysicalWhiteXYZ = chromatic_adaptation_matrix(
+             xy_to_xyz( dest.white ), xy_to_xyz( destVirtualWhite ), eMethod );
+        whitePointDestAdaptation = dest_from_xyz * virtualWhiteXYZFromPhysicalWhiteXYZ * xyz_from_dest;
+
+        // Consider lerp-ing the gain limiting between 0-1? That would allow partial clipping
+        // so that contrast ratios wouldnt be sacrified too bad with alternate white points
+        static const bool k_bLimitGain = true;
+        if ( k_bLimitGain )
+        {
+            glm::vec3 white = whitePointDestAdaptation * glm::vec3(1.f, 1.f, 1.f );
+            float whiteMax = std::max( white.r, std::max( white.g, white.b ) );
+            float normScale = 1.f / whiteMax;
+            whitePointDestAdaptation = whitePointDestAdaptation * glm::diagonal3x3( glm::vec3( normScale ) );
+        }
+    }
+    transform.whitePointDestAdaptation = whitePointDestAdaptation;
+
+    return transform;
+}
+
+void calcColorTransformEdges( const lut1d_t * pShaper, int nLutEdgeSize3d, glm::vec3 * pEdges )
+{
+    float flEdgeScale = 1.f / ( (float) nLutEdgeSize3d - 1.f );
+    for ( int nIndex = 0; nIndex < nLutEdgeSize3d; ++nIndex )
+    {
+        pEdges[nIndex] = glm::vec3( nIndex * flEdgeScale );
+        if ( pShaper )
+        {
+            pEdges[nIndex] = ApplyLut1D_Inverse_Linear( *pShaper, pEdges[nIndex] );
+        }
+    }
+}
+
+void calcColorTransformComputeParams( colorlut3d_compute_params_t * pParams, const lut1d_t * pShaper,
+    const displaycolorimetry_t & source, EOTF sourceEOTF,
+    const displaycolorimetry_t & dest, EOTF destEOTF,
+    const glm::vec2 & destVirtualWhite, EChromaticAdaptationMethod eMethod,
+    const colormapping_t & mapping, const nightmode_t & nightmode, const tonemapping_t & tonemapping,
+    const lut3d_t * pLook, float flGain )
+{
+    colortransform3d_t transform = calcColorTransform3D( source, dest, destVirtualWhite, eMethod, nightmode, flGain );
+
+    *pParams = colorlut3d_compute_params_t{};
+    pParams->destFromSource = transform.dest_from_source;
+    pParams->whitePointDestAdaptation = transform.whitePointDestAdaptation;
+    pParams->vMultLinear = transform.vMultLinear;
+    calcColorTransformEdges( pShaper, k_nColorLut3DComputeEdgeSize, pParams->vEdges );
+
+    pParams->vBlend = glm::vec4( mapping.blendEnableMinSat, mapping.blendEnableMaxSat, mapping.blendAmountMin, mapping.blendAmountMax );
+    pParams->uSourceEOTF = uint32_t( sourceEOTF );
+    pParams->uDestEOTF = uint32_t( destEOTF );
+    pParams->flG22Luminance = tonemapping.g22_luminance;
+    pParams->uTonemapOperator = uint32_t( tonemapping.eOperator );
+    pParams->flEetfSourceBlackPQ = tonemapping.eetf2390.source_black_pq();
+    pParams->flEetfSourcePQScale = tonemapping.eetf2390.source_pq_scale();
+    pParams->flEetfInvSourcePQScale = tonemapping.eetf2390.inv_source_pq_scale();
+    pParams->flEetfMinLumPQ = tonemapping.eetf2390.min_lum_pq();
+    pParams->flEetfMaxLumPQ = tonemapping.eetf2390.max_lum_pq();
+    pParams->flEetfKs = tonemapping.eetf2390.ks();
+
+    if ( pLook && !pLook->data.empty() )
+        pParams->uFlags |= k_uColorLut3DComputeFlag_Look;
+    if ( g_bHuePreservationWhenClipping )
+        pParams->uFlags |= k_uColorLut3DComputeFlag_HuePreservation;
+}
+
 template <uint32_t lutEdgeSize3d>
 void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
 	lut3d_t * pLut3d,
@@ -721,52 +1156,14 @@ void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
 
     if ( pLut3d )
     {
-        glm::mat3 xyz_from_dest = normalised_primary_matrix( dest.primaries, dest.white, 1.f );
-        glm::mat3 dest_from_xyz = glm::inverse( xyz_from_dest );
-
-        glm::mat3 xyz_from_source = normalised_primary_matrix( source.primaries, source.white, 1.f );
-        glm::mat3 dest_from_source = dest_from_xyz * xyz_from_source; // XYZ scaling for white point adjustment
-
-        // Precalc night mode scalars & digital gain
-        // amount and saturation are overdetermined but we separate the two as they conceptually represent
-        // different quantities, and this preserves forwards algorithmic compatibility
-        glm::vec3 nightModeMultHSV( nightmode.hue, clamp01( nightmode.saturation * nightmode.amount ), 1.f );
-        glm::vec3 vMultLinear = glm::pow( hsv_to_rgb( nightModeMultHSV ), glm::vec3( 2.2f ) );
-        vMultLinear = vMultLinear * flGain;
-
-        // Calculate the virtual white point adaptation
-        glm::mat3x3 whitePointDestAdaptation = glm::mat3x3( 1.f ); // identity
-        if ( destVirtualWhite.x > 0.01f && destVirtualWhite.y > 0.01f )
-        {
-            // if source white is within tiny tolerance of sourceWhitePointOverride
-            // don't do the override? (aka two quantizations of d65)
-            glm::mat3x3 virtualWhiteXYZFromPhysicalWhiteXYZ = chromatic_adaptation_matrix(
-                 xy_to_xyz( dest.white ), xy_to_xyz( destVirtualWhite ), eMethod );
-            whitePointDestAdaptation = dest_from_xyz * virtualWhiteXYZFromPhysicalWhiteXYZ * xyz_from_dest;
-
-            // Consider lerp-ing the gain limiting between 0-1? That would allow partial clipping
-            // so that contrast ratios wouldnt be sacrified too bad with alternate white points
-            static const bool k_bLimitGain = true;
-            if ( k_bLimitGain )
-            {
-                glm::vec3 white = whitePointDestAdaptation * glm::vec3(1.f, 1.f, 1.f );
-                float whiteMax = std::max( white.r, std::max( white.g, white.b ) );
-                float normScale = 1.f / whiteMax;
-                whitePointDestAdaptation = whitePointDestAdaptation * glm::diagonal3x3( glm::vec3( normScale ) );
-            }
-        }
+        colortransform3d_t transform = calcColorTransform3D( source, dest, destVirtualWhite, eMethod, nightmode, flGain );
+        const glm::mat3 &dest_from_source = transform.dest_from_source;
+        const glm::vec3 &vMultLinear = transform.vMultLinear;
+        const glm::mat3 &whitePointDestAdaptation = transform.whitePointDestAdaptation;
 
         // Precalculate source color EOTF encoded per-edge.
         glm::vec3 vSourceColorEOTFEncodedEdge[nLutEdgeSize3d];
-        float flEdgeScale = 1.f / ( (float) nLutEdgeSize3d - 1.f );
-        for ( int nIndex = 0; nIndex < nLutEdgeSize3d; ++nIndex )
-        {
-            vSourceColorEOTFEncodedEdge[nIndex] = glm::vec3( nIndex * flEdgeScale );
-            if ( pShaper )
-            {
-                vSourceColorEOTFEncodedEdge[nIndex] = ApplyLut1D_Inverse_Linear( *pShaper, vSourceColorEOTFEncodedEdge[nIndex] );
-            }
-        }
+        calcColorTransformEdges( pShaper, nLutEdgeSize3d, vSourceColorEOTFEncodedEdge );
 
         pLut3d->resize( nLutEdgeSize3d );
     
@@ -7,6 +7,7 @@
 #include <cmath>
 #include <vector>
 #include <memory>
+#include <string_view>
 
 #include <glm/vec2.hpp> // glm::vec2
 #include <glm/vec3.hpp> // glm::vec3
@@ -179,6 +180,14 @@ struct eetf_2390_t
 		return pq_to_nits( outputPQ );
 	}
 
+	// What apply_pq works with, for evaluating it elsewhere (ie. on the GPU).
+	float source_black_pq() const { return m_sourceBlackPQ; }
+	float source_pq_scale() const { return m_sourcePQScale; }
+	float inv_source_pq_scale() const { return m_invSourcePQScale; }
+	float min_lum_pq() const { return m_minLumPQ; }
+	float max_lum_pq() const { return m_maxLumPQ; }
+	float ks() const { return m_ks; }
+
 	private:
 	float m_sourceBlackPQ = 0.f;
 	float m_sourcePQScale = 0.f;
@@ -353,6 +362,8 @@ struct lut3d_t
 	}
 };
 
+std::shared_ptr<lut3d_t> ParseCubeLut( std::string_view svData, bool &bRaisesBlackLevelFloor );
+// These reuse earlier parses of the same file, see CCubeLutCache.
 std::shared_ptr<lut3d_t> LoadCubeLut( FILE *pFile, bool &bRaisesBlackLevelFloor );
 std::shared_ptr<lut3d_t> LoadCubeLut( const char *pchFileName, bool &bRaisesBlackLevelFloor );
 
@@ -365,6 +376,11 @@ std::shared_ptr<lut3d_t> LoadCubeLut( const char *pchFileName, bool &bRaisesBlac
 // If the white points differ, this performs an absolute colorimetric match
 // Look luts are optional, but if specified applied in the sourceEOTF space
 
+// Generated LUTs are cached on disk by their inputs, bump this whenever
+// calcColorTransform (or cs_color_lut3d.comp) changes what it outputs.
+// 2: Split into calcColorTransform3D/calcColorTransformEdges.
+static constexpr uint32_t k_uColorTransformVersion = 2;
+
 template <uint32_t lutEdgeSize3d>
 void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
 	lut3d_t * pLut3d,
@@ -374,6 +390,59 @@ void calcColorTransform( lut1d_t * pShaper, int nLutSize1d,
 	const colormapping_t & mapping, const nightmode_t & nightmode, const tonemapping_t & tonemapping,
 	const lut3d_t * pLook, float flGain );
 
+// What every entry of calcColorTransform's 3D LUT shares, so the LUT can be
+// evaluated elsewhere (ie. on the GPU) from exactly the same inputs.
+struct colortransform3d_t
+{
+	glm::mat3 dest_from_source;
+	glm::mat3 whitePointDestAdaptation;
+	glm::vec3 vMultLinear; // Night mode and gain
+};
+
+colortransform3d_t calcColorTransform3D( const displaycolorimetry_t & source, const displaycolorimetry_t & dest,
+	const glm::vec2 & destVirtualWhite, EChromaticAdaptationMethod eMethod, const nightmode_t & nightmode, float flGain );
+
+// The EOTF encoded source color at each index along the 3D LUT's edges,
+// which goes through the inverse of the shaper if there is one.
+void calcColorTransformEdges( const lut1d_t * pShaper, int nLutEdgeSize3d, glm::vec3 * pEdges );
+
+extern bool g_bHuePreservationWhenClipping;
+
+// Everything shaders/cs_color_lut3d.comp needs to evaluate calcColorTransform's
+// 3D LUT on the GPU, laid out to match its scalar uniform block.
+static constexpr int k_nColorLut3DComputeEdgeSize = 17; // VKR_LUT3D_EDGE_SIZE
+static constexpr uint32_t k_uColorLut3DComputeFlag_Look = 1u << 0;
+static constexpr uint32_t k_uColorLut3DComputeFlag_HuePreservation = 1u << 1;
+
+struct colorlut3d_compute_params_t
+{
+	glm::mat3 destFromSource;
+	glm::mat3 whitePointDestAdaptation;
+	glm::vec3 vMultLinear;
+	glm::vec3 vEdges[k_nColorLut3DComputeEdgeSize];
+	glm::vec4 vBlend; // blendEnableMinSat, blendEnableMaxSat, blendAmountMin, blendAmountMax
+	uint32_t uSourceEOTF;
+	uint32_t uDestEOTF;
+	float flG22Luminance;
+	uint32_t uTonemapOperator;
+	float flEetfSourceBlackPQ;
+	float flEetfSourcePQScale;
+	float flEetfInvSourcePQScale;
+	float flEetfMinLumPQ;
+	float flEetfMaxLumPQ;
+	float flEetfKs;
+	uint32_t uFlags;
+};
+
+// Same arguments as calcColorTransform, pShaper must already have been
+// generated by it. The look itself is bound separately.
+void calcColorTransformComputeParams( colorlut3d_compute_params_t * pParams, const lut1d_t * pShaper,
+	const displaycolorimetry_t & source, EOTF sourceEOTF,
+	const displaycolorimetry_t & dest, EOTF destEOTF,
+	const glm::vec2 & destVirtualWhite, EChromaticAdaptationMethod eMethod,
+	const colormapping_t & mapping, const nightmode_t & nightmode, const tonemapping_t & tonemapping,
+	const lut3d_t * pLook, float flGain );
+
 #define REGISTER_LUT_EDGE_SIZE(size) template void calcColorTransform<(size)>( lut1d_t * pShaper, int nLutSize1d, \
 	lut3d_t * pLut3d,                                                                                                   \
 	const displaycolorimetry_t & source, EOTF sourceEOTF,                                                               \
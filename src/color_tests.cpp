@@ -1,5 +1,23 @@
 #include "color_helpers.h"
+#include "convar.h"
+#include "Utils/Defer.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vulkan/vulkan.h>
+
+#include "cs_color_lut3d.h"
 
 //#include <glm/ext.hpp>
 #include <glm/gtx/string_cast.hpp>
@@ -230,10 +248,854 @@ void test_eetf2390_mono()
     }
 }
 
+// Runs shaders/cs_color_lut3d.comp on whatever Vulkan device is around and
+// compares it against calcColorTransform's 3D LUT.
+namespace color_lut3d_compute
+{
+    static constexpr int nLutEdgeSize3d = k_nColorLut3DComputeEdgeSize;
+    static constexpr int nLutSize1d = 4096;
+    // In 16-bit LUT codes, roughly 1e-3.
+    static constexpr int nTolerance = 64;
+
+    struct Context_t
+    {
+        VkInstance instance = VK_NULL_HANDLE;
+        VkPhysicalDevice physDev = VK_NULL_HANDLE;
+        VkDevice device = VK_NULL_HANDLE;
+        uint32_t uQueueFamily = 0;
+        VkQueue queue = VK_NULL_HANDLE;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+        VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+        VkShaderModule shaderModule = VK_NULL_HANDLE;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+        VkSampler sampler = VK_NULL_HANDLE;
+    };
+
+    struct Buffer_t
+    {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        void *pData = nullptr;
+    };
+
+    struct Image_t
+    {
+        VkImage image = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+    };
+
+    static bool FindMemoryType( const Context_t &ctx, uint32_t uTypeBits, VkMemoryPropertyFlags flags, uint32_t *puType )
+    {
+        VkPhysicalDeviceMemoryProperties memoryProperties;
+        vkGetPhysicalDeviceMemoryProperties( ctx.physDev, &memoryProperties );
+        for ( uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++ )
+        {
+            if ( ( uTypeBits & ( 1u << i ) ) && ( memoryProperties.memoryTypes[i].propertyFlags & flags ) == flags )
+            {
+                *puType = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool CreateBuffer( const Context_t &ctx, VkDeviceSize ulSize, VkBufferUsageFlags usage, Buffer_t *pBuffer )
+    {
+        VkBufferCreateInfo bufferInfo = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = ulSize,
+            .usage = usage,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        };
+        if ( vkCreateBuffer( ctx.device, &bufferInfo, nullptr, &pBuffer->buffer ) != VK_SUCCESS )
+            return false;
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetBufferMemoryRequirements( ctx.device, pBuffer->buffer, &memoryRequirements );
+
+        VkMemoryAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .allocationSize = memoryRequirements.size,
+        };
+        if ( !FindMemoryType( ctx, memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &allocInfo.memoryTypeIndex ) )
+            return false;
+        if ( vkAllocateMemory( ctx.device, &allocInfo, nullptr, &pBuffer->memory ) != VK_SUCCESS )
+            return false;
+        if ( vkBindBufferMemory( ctx.device, pBuffer->buffer, pBuffer->memory, 0 ) != VK_SUCCESS )
+            return false;
+        return vkMapMemory( ctx.device, pBuffer->memory, 0, VK_WHOLE_SIZE, 0, &pBuffer->pData ) == VK_SUCCESS;
+    }
+
+    static void DestroyBuffer( const Context_t &ctx, Buffer_t *pBuffer )
+    {
+        vkDestroyBuffer( ctx.device, pBuffer->buffer, nullptr );
+        vkFreeMemory( ctx.device, pBuffer->memory, nullptr );
+        *pBuffer = Buffer_t{};
+    }
+
+    static bool CreateLut3D( const Context_t &ctx, uint32_t uEdgeSize, VkImageUsageFlags usage, Image_t *pImage )
+    {
+        VkImageCreateInfo imageInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_3D,
+            .format = VK_FORMAT_R16G16B16A16_UNORM,
+            .extent = { uEdgeSize, uEdgeSize, uEdgeSize },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = usage,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        };
+        if ( vkCreateImage( ctx.device, &imageInfo, nullptr, &pImage->image ) != VK_SUCCESS )
+            return false;
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetImageMemoryRequirements( ctx.device, pImage->image, &memoryRequirements );
+
+        VkMemoryAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .allocationSize = memoryRequirements.size,
+        };
+        if ( !FindMemoryType( ctx, memoryRequirements.memoryTypeBits, 0, &allocInfo.memoryTypeIndex ) )
+            return false;
+        if ( vkAllocateMemory( ctx.device, &allocInfo, nullptr, &pImage->memory ) != VK_SUCCESS )
+            return false;
+        if ( vkBindImageMemory( ctx.device, pImage->image, pImage->memory, 0 ) != VK_SUCCESS )
+            return false;
+
+        VkImageViewCreateInfo viewInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = pImage->image,
+            .viewType = VK_IMAGE_VIEW_TYPE_3D,
+            .format = VK_FORMAT_R16G16B16A16_UNORM,
+            .subresourceRange = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .levelCount = 1,
+                .layerCount = 1,
+            },
+        };
+        return vkCreateImageView( ctx.device, &viewInfo, nullptr, &pImage->view ) == VK_SUCCESS;
+    }
+
+    static void DestroyImage( const Context_t &ctx, Image_t *pImage )
+    {
+        vkDestroyImageView( ctx.device, pImage->view, nullptr );
+        vkDestroyImage( ctx.device, pImage->image, nullptr );
+        vkFreeMemory( ctx.device, pImage->memory, nullptr );
+        *pImage = Image_t{};
+    }
+
+    static void ImageBarrier( VkCommandBuffer cmdBuffer, VkImage image,
+        VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, VkImageLayout oldLayout,
+        VkPipelineStageFlags dstStage, VkAccessFlags dstAccess, VkImageLayout newLayout )
+    {
+        VkImageMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = srcAccess,
+            .dstAccessMask = dstAccess,
+            .oldLayout = oldLayout,
+            .newLayout = newLayout,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = image,
+            .subresourceRange = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .levelCount = 1,
+                .layerCount = 1,
+            },
+        };
+        vkCmdPipelineBarrier( cmdBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier );
+    }
+
+    static void Shutdown( Context_t &ctx )
+    {
+        if ( ctx.device )
+        {
+            vkDestroySampler( ctx.device, ctx.sampler, nullptr );
+            vkDestroyDescriptorPool( ctx.device, ctx.descriptorPool, nullptr );
+            vkDestroyPipeline( ctx.device, ctx.pipeline, nullptr );
+            vkDestroyShaderModule( ctx.device, ctx.shaderModule, nullptr );
+            vkDestroyPipelineLayout( ctx.device, ctx.pipelineLayout, nullptr );
+            vkDestroyDescriptorSetLayout( ctx.device, ctx.descriptorSetLayout, nullptr );
+            vkDestroyCommandPool( ctx.device, ctx.commandPool, nullptr );
+            vkDestroyDevice( ctx.device, nullptr );
+        }
+        if ( ctx.instance )
+            vkDestroyInstance( ctx.instance, nullptr );
+        ctx = Context_t{};
+    }
+
+    static bool Init( Context_t &ctx )
+    {
+        VkApplicationInfo appInfo = {
+            .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+            .pApplicationName = "gamescope_color_tests",
+            .apiVersion = VK_API_VERSION_1_2,
+        };
+        VkInstanceCreateInfo instanceInfo = {
+            .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+            .pApplicationInfo = &appInfo,
+        };
+        if ( vkCreateInstance( &instanceInfo, nullptr, &ctx.instance ) != VK_SUCCESS )
+            return false;
+
+        uint32_t uDeviceCount = 0;
+        vkEnumeratePhysicalDevices( ctx.instance, &uDeviceCount, nullptr );
+        std::vector<VkPhysicalDevice> physDevs( uDeviceCount );
+        vkEnumeratePhysicalDevices( ctx.instance, &uDeviceCount, physDevs.data() );
+
+        for ( VkPhysicalDevice physDev : physDevs )
+        {
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties( physDev, &properties );
+            if ( properties.apiVersion < VK_API_VERSION_1_2 )
+                continue;
+
+            VkFormatProperties formatProperties;
+            vkGetPhysicalDeviceFormatProperties( physDev, VK_FORMAT_R16G16B16A16_UNORM, &formatProperties );
+            if ( !( formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT ) )
+                continue;
+
+            uint32_t uQueueFamilyCount = 0;
+            vkGetPhysicalDeviceQueueFamilyProperties( physDev, &uQueueFamilyCount, nullptr );
+            std::vector<VkQueueFamilyProperties> queueFamilies( uQueueFamilyCount );
+            vkGetPhysicalDeviceQueueFamilyProperties( physDev, &uQueueFamilyCount, queueFamilies.data() );
+
+            for ( uint32_t i = 0; i < uQueueFamilyCount; i++ )
+            {
+                if ( queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT )
+                {
+                    ctx.physDev = physDev;
+                    ctx.uQueueFamily = i;
+                    break;
+                }
+            }
+
+            if ( ctx.physDev )
+            {
+                printf( "Using %s\n", properties.deviceName );
+                break;
+            }
+        }
+
+        if ( !ctx.physDev )
+            return false;
+
+        float flQueuePriority = 1.f;
+        VkDeviceQueueCreateInfo queueInfo = {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = ctx.uQueueFamily,
+            .queueCount = 1,
+            .pQueuePriorities = &flQueuePriority,
+        };
+        VkPhysicalDeviceVulkan12Features vulkan12Features = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+            .scalarBlockLayout = VK_TRUE,
+        };
+        VkDeviceCreateInfo deviceInfo = {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+            .pNext = &vulkan12Features,
+            .queueCreateInfoCount = 1,
+            .pQueueCreateInfos = &queueInfo,
+        };
+        if ( vkCreateDevice( ctx.physDev, &deviceInfo, nullptr, &ctx.device ) != VK_SUCCESS )
+            return false;
+        vkGetDeviceQueue( ctx.device, ctx.uQueueFamily, 0, &ctx.queue );
+
+        VkCommandPoolCreateInfo commandPoolInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = ctx.uQueueFamily,
+        };
+        if ( vkCreateCommandPool( ctx.device, &commandPoolInfo, nullptr, &ctx.commandPool ) != VK_SUCCESS )
+            return false;
+
+        // Only what the shader uses out of descriptor_set.h.
+        std::array<VkDescriptorSetLayoutBinding, 3> bindings = {{
+            { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+            { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+            { .binding = 6, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = EOTF_Count, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        }};
+        VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .bindingCount = uint32_t( bindings.size() ),
+            .pBindings = bindings.data(),
+        };
+        if ( vkCreateDescriptorSetLayout( ctx.device, &descriptorSetLayoutInfo, nullptr, &ctx.descriptorSetLayout ) != VK_SUCCESS )
+            return false;
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount = 1,
+            .pSetLayouts = &ctx.descriptorSetLayout,
+        };
+        if ( vkCreatePipelineLayout( ctx.device, &pipelineLayoutInfo, nullptr, &ctx.pipelineLayout ) != VK_SUCCESS )
+            return false;
+
+        VkShaderModuleCreateInfo shaderInfo = {
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .codeSize = sizeof( cs_color_lut3d ),
+            .pCode = cs_color_lut3d,
+        };
+        if ( vkCreateShaderModule( ctx.device, &shaderInfo, nullptr, &ctx.shaderModule ) != VK_SUCCESS )
+            return false;
+
+        VkComputePipelineCreateInfo pipelineInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage = {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = ctx.shaderModule,
+                .pName = "main",
+            },
+            .layout = ctx.pipelineLayout,
+        };
+        if ( vkCreateComputePipelines( ctx.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &ctx.pipeline ) != VK_SUCCESS )
+            return false;
+
+        std::array<VkDescriptorPoolSize, 3> poolSizes = {{
+            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
+            { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
+            { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, EOTF_Count },
+        }};
+        VkDescriptorPoolCreateInfo descriptorPoolInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .maxSets = 1,
+            .poolSizeCount = uint32_t( poolSizes.size() ),
+            .pPoolSizes = poolSizes.data(),
+        };
+        if ( vkCreateDescriptorPool( ctx.device, &descriptorPoolInfo, nullptr, &ctx.descriptorPool ) != VK_SUCCESS )
+            return false;
+
+        // Matches the one gamescope uses for s_lut3D.
+        VkSamplerCreateInfo samplerInfo = {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .magFilter = VK_FILTER_NEAREST,
+            .minFilter = VK_FILTER_NEAREST,
+            .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+        };
+        return vkCreateSampler( ctx.device, &samplerInfo, nullptr, &ctx.sampler ) == VK_SUCCESS;
+    }
+
+    static bool Evaluate( Context_t &ctx, const colorlut3d_compute_params_t &params, const lut3d_t *pLook, std::vector<uint16_t> &outLut3d )
+    {
+        const uint32_t uLookEdgeSize = pLook ? pLook->lutEdgeSize : 1;
+        const size_t ulLookTexels = size_t( uLookEdgeSize ) * uLookEdgeSize * uLookEdgeSize;
+        const size_t ulLutTexels = size_t( nLutEdgeSize3d ) * nLutEdgeSize3d * nLutEdgeSize3d;
+
+        Buffer_t paramsBuffer, lookBuffer, readbackBuffer;
+        Image_t lookImage, lutImage;
+        defer( DestroyBuffer( ctx, &paramsBuffer ) );
+        defer( DestroyBuffer( ctx, &lookBuffer ) );
+        defer( DestroyBuffer( ctx, &readbackBuffer ) );
+        defer( DestroyImage( ctx, &lookImage ) );
+        defer( DestroyImage( ctx, &lutImage ) );
+
+        if ( !CreateBuffer( ctx, sizeof( params ), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &paramsBuffer ) ||
+             !CreateBuffer( ctx, ulLookTexels * 4 * sizeof( uint16_t ), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &lookBuffer ) ||
+             !CreateBuffer( ctx, ulLutTexels * 4 * sizeof( uint16_t ), VK_BUFFER_USAGE_TRANSFER_DST_BIT, &readbackBuffer ) ||
+             !CreateLut3D( ctx, uLookEdgeSize, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, &lookImage ) ||
+             !CreateLut3D( ctx, nLutEdgeSize3d, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, &lutImage ) )
+        {
+            return false;
+        }
+
+        memcpy( paramsBuffer.pData, &params, sizeof( params ) );
+
+        // Quantized the same way gamescope uploads looks.
+        uint16_t *pLookData = static_cast<uint16_t *>( lookBuffer.pData );
+        for ( size_t i = 0; i < ulLookTexels; i++ )
+        {
+            pLookData[4*i+0] = pLook ? quantize_lut_value_16bit( pLook->data[i].r ) : 0;
+            pLookData[4*i+1] = pLook ? quantize_lut_value_16bit( pLook->data[i].g ) : 0;
+            pLookData[4*i+2] = pLook ? quantize_lut_value_16bit( pLook->data[i].b ) : 0;
+            pLookData[4*i+3] = 0;
+        }
+
+        vkResetDescriptorPool( ctx.device, ctx.descriptorPool, 0 );
+        VkDescriptorSetAllocateInfo descriptorSetInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = ctx.descriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &ctx.descriptorSetLayout,
+        };
+        VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+        if ( vkAllocateDescriptorSets( ctx.device, &descriptorSetInfo, &descriptorSet ) != VK_SUCCESS )
+            return false;
+
+        VkDescriptorBufferInfo paramsDescriptor = { paramsBuffer.buffer, 0, sizeof( params ) };
+        VkDescriptorImageInfo lutDescriptor = { VK_NULL_HANDLE, lutImage.view, VK_IMAGE_LAYOUT_GENERAL };
+        std::array<VkDescriptorImageInfo, EOTF_Count> lookDescriptors;
+        lookDescriptors.fill( { ctx.sampler, lookImage.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL } );
+
+        std::array<VkWriteDescriptorSet, 3> writes = {{
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = descriptorSet, .dstBinding = 0, .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .pBufferInfo = &paramsDescriptor },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = descriptorSet, .dstBinding = 1, .descriptorCount = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .pImageInfo = &lutDescriptor },
+            { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, .dstSet = descriptorSet, .dstBinding = 6, .descriptorCount = EOTF_Count, .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .pImageInfo = lookDescriptors.data() },
+        }};
+        vkUpdateDescriptorSets( ctx.device, uint32_t( writes.size() ), writes.data(), 0, nullptr );
+
+        VkCommandBufferAllocateInfo commandBufferInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = ctx.commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+        VkCommandBuffer cmdBuffer = VK_NULL_HANDLE;
+        if ( vkAllocateCommandBuffers( ctx.device, &commandBufferInfo, &cmdBuffer ) != VK_SUCCESS )
+            return false;
+        defer( vkFreeCommandBuffers( ctx.device, ctx.commandPool, 1, &cmdBuffer ) );
+
+        VkCommandBufferBeginInfo beginInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        vkBeginCommandBuffer( cmdBuffer, &beginInfo );
+
+        ImageBarrier( cmdBuffer, lookImage.image,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, VK_IMAGE_LAYOUT_UNDEFINED,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL );
+        VkBufferImageCopy lookRegion = {
+            .imageSubresource = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .layerCount = 1 },
+            .imageExtent = { uLookEdgeSize, uLookEdgeSize, uLookEdgeSize },
+        };
+        vkCmdCopyBufferToImage( cmdBuffer, lookBuffer.buffer, lookImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &lookRegion );
+        ImageBarrier( cmdBuffer, lookImage.image,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL );
+        ImageBarrier( cmdBuffer, lutImage.image,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, VK_IMAGE_LAYOUT_UNDEFINED,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL );
+
+        vkCmdBindPipeline( cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ctx.pipeline );
+        vkCmdBindDescriptorSets( cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ctx.pipelineLayout, 0, 1, &descriptorSet, 0, nullptr );
+        const uint32_t uDispatchSize = ( nLutEdgeSize3d + 3 ) / 4;
+        vkCmdDispatch( cmdBuffer, uDispatchSize, uDispatchSize, uDispatchSize );
+
+        ImageBarrier( cmdBuffer, lutImage.image,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL );
+        VkBufferImageCopy lutRegion = {
+            .imageSubresource = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, .layerCount = 1 },
+            .imageExtent = { uint32_t( nLutEdgeSize3d ), uint32_t( nLutEdgeSize3d ), uint32_t( nLutEdgeSize3d ) },
+        };
+        vkCmdCopyImageToBuffer( cmdBuffer, lutImage.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer.buffer, 1, &lutRegion );
+
+        VkMemoryBarrier hostBarrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        };
+        vkCmdPipelineBarrier( cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr );
+
+        if ( vkEndCommandBuffer( cmdBuffer ) != VK_SUCCESS )
+            return false;
+
+        VkSubmitInfo submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &cmdBuffer,
+        };
+        if ( vkQueueSubmit( ctx.queue, 1, &submitInfo, VK_NULL_HANDLE ) != VK_SUCCESS )
+            return false;
+        if ( vkQueueWaitIdle( ctx.queue ) != VK_SUCCESS )
+            return false;
+
+        const uint16_t *pLutData = static_cast<const uint16_t *>( readbackBuffer.pData );
+        outLut3d.assign( pLutData, pLutData + ulLutTexels * 4 );
+        return true;
+    }
+
+    struct TestCase_t
+    {
+        const char *pszName;
+        displaycolorimetry_t inputColorimetry;
+        EOTF inputEOTF;
+        displaycolorimetry_t outputColorimetry;
+        EOTF outputEOTF;
+        glm::vec2 outputVirtualWhite;
+        colormapping_t mapping;
+        nightmode_t nightmode;
+        tonemapping_t tonemapping;
+        const lut3d_t *pLook;
+        float flGain;
+        bool bHuePreservation;
+    };
+
+    // Returns whether the GPU result is within the tolerance.
+    static bool RunTestCase( Context_t &ctx, const TestCase_t &test )
+    {
+        g_bHuePreservationWhenClipping = test.bHuePreservation;
+
+        lut1d_t shaper;
+        lut3d_t lut3d;
+        calcColorTransform<nLutEdgeSize3d>( &shaper, nLutSize1d, &lut3d,
+            test.inputColorimetry, test.inputEOTF,
+            test.outputColorimetry, test.outputEOTF,
+            test.outputVirtualWhite, k_EChromaticAdapatationMethod_Bradford,
+            test.mapping, test.nightmode, test.tonemapping, test.pLook, test.flGain );
+
+        colorlut3d_compute_params_t params;
+        calcColorTransformComputeParams( &params, &shaper,
+            test.inputColorimetry, test.inputEOTF,
+            test.outputColorimetry, test.outputEOTF,
+            test.outputVirtualWhite, k_EChromaticAdapatationMethod_Bradford,
+            test.mapping, test.nightmode, test.tonemapping, test.pLook, test.flGain );
+
+        g_bHuePreservationWhenClipping = false;
+
+        std::vector<uint16_t> gpuLut3d;
+        if ( !Evaluate( ctx, params, test.pLook, gpuLut3d ) )
+        {
+            printf( "FAIL %s: could not evaluate on the GPU\n", test.pszName );
+            return false;
+        }
+
+        int nMaxError = 0;
+        size_t ulMaxErrorIndex = 0;
+        for ( size_t i = 0; i < lut3d.data.size(); i++ )
+        {
+            for ( int nChannel = 0; nChannel < 3; nChannel++ )
+            {
+                int nExpected = quantize_lut_value_16bit( lut3d.data[i][nChannel] );
+                int nError = std::abs( nExpected - int( gpuLut3d[4*i+nChannel] ) );
+                if ( nError > nMaxError )
+                {
+                    nMaxError = nError;
+                    ulMaxErrorIndex = i;
+                }
+            }
+        }
+
+        bool bPass = nMaxError <= nTolerance;
+        printf( "%s %s: max error %d/65535 at entry %zu\n", bPass ? "PASS" : "FAIL", test.pszName, nMaxError, ulMaxErrorIndex );
+        return bPass;
+    }
+}
+
+int test_color_lut3d_compute()
+{
+    using namespace color_lut3d_compute;
+
+    printf("%s\n", __func__ );
+
+    Context_t ctx;
+    defer( Shutdown( ctx ) );
+    if ( !Init( ctx ) )
+    {
+        printf( "SKIP: no usable Vulkan device\n" );
+        return 0;
+    }
+
+    const displaycolorimetry_t nativeDisplay = { .primaries = { { 0.602f, 0.355f }, { 0.340f, 0.574f }, { 0.164f, 0.121f } }, .white = { 0.3070f, 0.3220f } };
+    const displaycolorimetry_t wideDisplay = { .primaries = { { 0.687f, 0.308f }, { 0.231f, 0.717f }, { 0.136f, 0.051f } }, .white = { 0.3127f, 0.3290f } };
+
+    displaycolorimetry_t sdrColorimetry;
+    colormapping_t sdrMapping;
+    buildSDRColorimetry( &sdrColorimetry, &sdrMapping, 0.5f, nativeDisplay );
+
+    displaycolorimetry_t wideSdrColorimetry;
+    colormapping_t wideSdrMapping;
+    buildSDRColorimetry( &wideSdrColorimetry, &wideSdrMapping, 0.5f, wideDisplay );
+
+    displaycolorimetry_t pqColorimetry;
+    colormapping_t pqMapping;
+    buildPQColorimetry( &pqColorimetry, &pqMapping, wideDisplay );
+
+    const nightmode_t noNightmode = { .amount = 0.f, .hue = 0.f, .saturation = 0.f };
+    const nightmode_t nightmode = { .amount = 0.8f, .hue = 0.08f, .saturation = 0.9f };
+
+    tonemapping_t g22Tonemapping;
+    g22Tonemapping.g22_luminance = 1.f;
+
+    tonemapping_t sdrOnHdrTonemapping;
+    sdrOnHdrTonemapping.g22_luminance = 203.f;
+
+    const tonemap_info_t hdrSource = { .flBlackPointNits = 0.005f, .flWhitePointNits = 4000.f };
+    const tonemap_info_t hdrDisplay = { .flBlackPointNits = 0.1f, .flWhitePointNits = 600.f };
+    tonemapping_t hdrOnSdrTonemapping[3];
+    const ETonemapOperator eOperators[3] = { ETonemapOperator_EETF2390_Luma, ETonemapOperator_EETF2390_Independent, ETonemapOperator_EETF2390_MaxChan };
+    for ( int i = 0; i < 3; i++ )
+    {
+        hdrOnSdrTonemapping[i].g22_luminance = 600.f;
+        hdrOnSdrTonemapping[i].eOperator = eOperators[i];
+        hdrOnSdrTonemapping[i].eetf2390.init( hdrSource, hdrDisplay );
+    }
+
+    // A look that does something to every channel, but stays in range.
+    lut3d_t look;
+    look.resize( 9 );
+    for ( int nBlue = 0; nBlue < 9; nBlue++ )
+    {
+        for ( int nGreen = 0; nGreen < 9; nGreen++ )
+        {
+            for ( int nRed = 0; nRed < 9; nRed++ )
+            {
+                glm::vec3 rgb = glm::vec3( nRed, nGreen, nBlue ) / 8.f;
+                look.data[ nRed + 9 * nGreen + 81 * nBlue ] = glm::vec3( rgb.r * rgb.r, 0.8f * rgb.g + 0.2f * rgb.b, std::sqrt( rgb.b ) );
+            }
+        }
+    }
+
+    const glm::vec2 noVirtualWhite = { 0.f, 0.f };
+    const glm::vec2 d50 = { 0.3457f, 0.3585f };
+
+    const TestCase_t testCases[] =
+    {
+        { "sdr",                   sdrColorimetry,     EOTF_Gamma22, nativeDisplay,               EOTF_Gamma22, noVirtualWhite, sdrMapping,     noNightmode, g22Tonemapping,         nullptr, 1.f,  false },
+        { "sdr nightmode gain",    sdrColorimetry,     EOTF_Gamma22, nativeDisplay,               EOTF_Gamma22, noVirtualWhite, sdrMapping,     nightmode,   g22Tonemapping,         nullptr, 1.2f, false },
+        { "sdr virtual white",     wideSdrColorimetry, EOTF_Gamma22, wideDisplay,                 EOTF_Gamma22, d50,            wideSdrMapping, noNightmode, g22Tonemapping,         nullptr, 1.f,  false },
+        { "sdr look",              sdrColorimetry,     EOTF_Gamma22, nativeDisplay,               EOTF_Gamma22, noVirtualWhite, sdrMapping,     noNightmode, g22Tonemapping,         &look,   1.f,  false },
+        { "sdr on hdr",            wideSdrColorimetry, EOTF_Gamma22, displaycolorimetry_2020,     EOTF_PQ,      noVirtualWhite, wideSdrMapping, noNightmode, sdrOnHdrTonemapping,    nullptr, 1.f,  false },
+        { "hdr on sdr luma",       pqColorimetry,      EOTF_PQ,      wideDisplay,                 EOTF_Gamma22, noVirtualWhite, pqMapping,      noNightmode, hdrOnSdrTonemapping[0], nullptr, 1.f,  false },
+        { "hdr on sdr independent",pqColorimetry,      EOTF_PQ,      wideDisplay,                 EOTF_Gamma22, noVirtualWhite, pqMapping,      noNightmode, hdrOnSdrTonemapping[1], nullptr, 1.f,  false },
+        { "hdr on sdr maxchan",    pqColorimetry,      EOTF_PQ,      wideDisplay,                 EOTF_Gamma22, noVirtualWhite, pqMapping,      noNightmode, hdrOnSdrTonemapping[2], nullptr, 1.f,  true },
+        { "hdr",                   pqColorimetry,      EOTF_PQ,      displaycolorimetry_2020,     EOTF_PQ,      noVirtualWhite, pqMapping,      nightmode,   g22Tonemapping,         &look,   1.f,  false },
+    };
+
+    int nFailures = 0;
+    for ( const TestCase_t &test : testCases )
+    {
+        if ( !RunTestCase( ctx, test ) )
+            nFailures++;
+    }
+
+    return nFailures;
+}
+
+extern gamescope::ConVar<std::string> cv_color_lut_cache_dir;
+
+// .cube parsing and the on-disk cache of parsed looks.
+namespace cube_lut
+{
+    // Entry i of an identity LUT, R changes fastest.
+    static glm::vec3 IdentityValue( int nEdgeSize, size_t i )
+    {
+        const float flScale = 1.f / float( nEdgeSize - 1 );
+        return glm::vec3( i % nEdgeSize, ( i / nEdgeSize ) % nEdgeSize, i / ( nEdgeSize * nEdgeSize ) ) * flScale;
+    }
+
+    static bool ValueEqual( const glm::vec3 &a, const glm::vec3 &b )
+    {
+        return fabsf( a.r - b.r ) <= 1e-5f && fabsf( a.g - b.g ) <= 1e-5f && fabsf( a.b - b.b ) <= 1e-5f;
+    }
+
+    static std::string IdentityCube( int nEdgeSize, const char *pszNewline = "\n", size_t ulEntries = ~size_t( 0 ) )
+    {
+        std::string sCube = "LUT_3D_SIZE " + std::to_string( nEdgeSize ) + pszNewline;
+        ulEntries = std::min( ulEntries, size_t( nEdgeSize ) * nEdgeSize * nEdgeSize );
+        for ( size_t i = 0; i < ulEntries; i++ )
+        {
+            glm::vec3 value = IdentityValue( nEdgeSize, i );
+            char szLine[64];
+            snprintf( szLine, sizeof( szLine ), "%.6f %.6f %.6f%s", value.r, value.g, value.b, pszNewline );
+            sCube += szLine;
+        }
+        return sCube;
+    }
+
+    static bool CheckIdentity( const char *pszName, const std::shared_ptr<lut3d_t> &pLut, int nEdgeSize )
+    {
+        bool bPass = pLut && pLut->lutEdgeSize == nEdgeSize && pLut->data.size() == size_t( nEdgeSize ) * nEdgeSize * nEdgeSize;
+        for ( size_t i = 0; bPass && i < pLut->data.size(); i++ )
+        {
+            if ( !ValueEqual( pLut->data[i], IdentityValue( nEdgeSize, i ) ) )
+            {
+                printf( "FAIL %s: entry %zu is %s\n", pszName, i, glm::to_string( pLut->data[i] ).c_str() );
+                return false;
+            }
+        }
+        printf( "%s %s\n", bPass ? "PASS" : "FAIL", pszName );
+        return bPass;
+    }
+
+    static bool CheckRejected( const char *pszName, const std::shared_ptr<lut3d_t> &pLut )
+    {
+        printf( "%s %s\n", pLut ? "FAIL" : "PASS", pszName );
+        return !pLut;
+    }
+
+    static bool WriteFile( const std::string &sPath, const std::string &sData )
+    {
+        FILE *pFile = fopen( sPath.c_str(), "wb" );
+        if ( !pFile )
+            return false;
+        bool bWritten = fwrite( sData.data(), 1, sData.size(), pFile ) == sData.size();
+        return fclose( pFile ) == 0 && bWritten;
+    }
+
+    // Swaps the look for a new file (so a new inode, missing the in-memory
+    // cache) that does not parse, with the given mtime.
+    static bool ReplaceWithJunk( const std::string &sPath, size_t ulSize, const timespec &mtime )
+    {
+        std::string sTempPath = sPath + ".new";
+        if ( !WriteFile( sTempPath, std::string( ulSize, '#' ) ) )
+            return false;
+
+        const timespec times[2] = { mtime, mtime };
+        return utimensat( AT_FDCWD, sTempPath.c_str(), times, 0 ) == 0 && rename( sTempPath.c_str(), sPath.c_str() ) == 0;
+    }
+
+    static std::vector<std::string> ListDir( const std::string &sDir )
+    {
+        std::vector<std::string> names;
+        DIR *pDir = opendir( sDir.c_str() );
+        if ( !pDir )
+            return names;
+        defer( closedir( pDir ) );
+
+        while ( dirent *pEntry = readdir( pDir ) )
+        {
+            if ( pEntry->d_name[0] != '.' )
+                names.emplace_back( pEntry->d_name );
+        }
+        return names;
+    }
+
+    static void RemoveDir( const std::string &sDir )
+    {
+        for ( const std::string &sName : ListDir( sDir ) )
+            unlink( ( sDir + "/" + sName ).c_str() );
+        rmdir( sDir.c_str() );
+    }
+
+    static int TestDiskCache()
+    {
+        char szDir[] = "/tmp/gamescope_color_tests_XXXXXX";
+        if ( !mkdtemp( szDir ) )
+        {
+            printf( "SKIP: disk cache, no temporary directory\n" );
+            return 0;
+        }
+        const std::string sDir = szDir;
+        const std::string sPath = sDir + "/look.cube";
+
+        cv_color_lut_cache_dir = sDir;
+        defer( cv_color_lut_cache_dir = std::string{}; RemoveDir( sDir ) );
+
+        int nFailures = 0;
+        bool bRaisesBlackLevelFloor = false;
+
+        const std::string sCube = IdentityCube( 5 );
+        struct stat st;
+        if ( !WriteFile( sPath, sCube ) || stat( sPath.c_str(), &st ) != 0 )
+        {
+            printf( "FAIL disk cache: could not write %s\n", sPath.c_str() );
+            return 1;
+        }
+
+        if ( !CheckIdentity( "disk cache first load", LoadCubeLut( sPath.c_str(), bRaisesBlackLevelFloor ), 5 ) )
+            nFailures++;
+
+        std::vector<std::string> names = ListDir( sDir );
+        const bool bWritten = std::count_if( names.begin(), names.end(),
+            []( const std::string &sName ) { return sName.ends_with( ".cube.bin" ); } ) == 1;
+        printf( "%s disk cache written\n", bWritten ? "PASS" : "FAIL" );
+        if ( !bWritten )
+            nFailures++;
+
+        // Same path, mtime and size: only the disk cache has the LUT now.
+        if ( !ReplaceWithJunk( sPath, sCube.size(), st.st_mtim ) ||
+             !CheckIdentity( "disk cache round trip", LoadCubeLut( sPath.c_str(), bRaisesBlackLevelFloor ), 5 ) )
+            nFailures++;
+
+        timespec newerMTime = st.st_mtim;
+        newerMTime.tv_sec++;
+        if ( !ReplaceWithJunk( sPath, sCube.size(), newerMTime ) ||
+             !CheckRejected( "disk cache mtime mismatch", LoadCubeLut( sPath.c_str(), bRaisesBlackLevelFloor ) ) )
+            nFailures++;
+
+        if ( !ReplaceWithJunk( sPath, sCube.size() + 1, st.st_mtim ) ||
+             !CheckRejected( "disk cache size mismatch", LoadCubeLut( sPath.c_str(), bRaisesBlackLevelFloor ) ) )
+            nFailures++;
+
+        return nFailures;
+    }
+}
+
+int test_cube_lut()
+{
+    using namespace cube_lut;
+
+    printf("%s\n", __func__ );
+
+    int nFailures = 0;
+    bool bRaisesBlackLevelFloor = false;
+
+    if ( !CheckIdentity( "cube lf", ParseCubeLut( IdentityCube( 3 ), bRaisesBlackLevelFloor ), 3 ) || bRaisesBlackLevelFloor )
+        nFailures++;
+
+    if ( !CheckIdentity( "cube crlf", ParseCubeLut( IdentityCube( 3, "\r\n" ), bRaisesBlackLevelFloor ), 3 ) )
+        nFailures++;
+
+    // Anything that isn't a value is skipped, before and after the size.
+    const std::string sKeywords =
+        "# Created by hand\n"
+        "TITLE \"keywords\"\n"
+        "DOMAIN_MIN 0.0 0.0 0.0\n"
+        "\n" +
+        IdentityCube( 2 ).insert( strlen( "LUT_3D_SIZE 2\n" ), "DOMAIN_MAX 1.0 1.0 1.0\n# 0.5 0.5 0.5\n\n" );
+    if ( !CheckIdentity( "cube comments and keywords", ParseCubeLut( sKeywords, bRaisesBlackLevelFloor ), 2 ) )
+        nFailures++;
+
+    {
+        const std::string sFloats =
+            "LUT_3D_SIZE 2\n"
+            "+1.0e-1 +5E-1 1e0\n"
+            "\t0.25   +0.0\t2.5e-01\n"
+            "0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n"
+            "1.0E+0 -0 .5\n";
+        std::shared_ptr<lut3d_t> pLut = ParseCubeLut( sFloats, bRaisesBlackLevelFloor );
+        bool bPass = pLut && pLut->data.size() == 8 &&
+            ValueEqual( pLut->data[0], glm::vec3( 0.1f, 0.5f, 1.0f ) ) &&
+            ValueEqual( pLut->data[1], glm::vec3( 0.25f, 0.0f, 0.25f ) ) &&
+            ValueEqual( pLut->data[7], glm::vec3( 1.0f, 0.0f, 0.5f ) ) &&
+            bRaisesBlackLevelFloor;
+        printf( "%s cube signed and exponent floats\n", bPass ? "PASS" : "FAIL" );
+        if ( !bPass )
+            nFailures++;
+    }
+
+    if ( !CheckRejected( "cube too few entries", ParseCubeLut( IdentityCube( 3, "\n", 26 ), bRaisesBlackLevelFloor ) ) )
+        nFailures++;
+
+    if ( !CheckRejected( "cube too many entries", ParseCubeLut( IdentityCube( 3 ) + "1 1 1\n", bRaisesBlackLevelFloor ) ) )
+        nFailures++;
+
+    if ( !CheckRejected( "cube no size", ParseCubeLut( "0 0 0\n1 1 1\n", bRaisesBlackLevelFloor ) ) )
+        nFailures++;
+
+    // Well over the size where parsing gets split into chunks, so values
+    // on both sides of every chunk boundary are checked.
+    {
+        const std::string sLarge = IdentityCube( 65, "\r\n" );
+        printf( "large cube is %zu bytes\n", sLarge.size() );
+        if ( !CheckIdentity( "cube parallel", ParseCubeLut( sLarge, bRaisesBlackLevelFloor ), 65 ) )
+            nFailures++;
+        if ( !CheckRejected( "cube parallel too few entries", ParseCubeLut( IdentityCube( 65, "\n", 65 * 65 * 65 - 1 ), bRaisesBlackLevelFloor ) ) )
+            nFailures++;
+    }
+
+    nFailures += TestDiskCache();
+
+    return nFailures;
+}
+
 int main(int argc, char* argv[])
 {
     printf("color_tests\n");
     // test_eetf2390_mono();
     color_tests();
-    return 0;
+    int nFailures = test_cube_lut();
+    nFailures += test_color_lut3d_compute();
+    return nFailures == 0 ? 0 : 1;
 }
\ No newline at end of file
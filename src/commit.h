@@ -59,6 +59,8 @@ struct commit_t final : public gamescope::RcObject, public gamescope::IWaitable,
 	}
 
 	uint64_t commitID = 0;
+	// What changed relative to the last few commits on this surface.
+	gamescope::DamageHistory damageHistory;
 	bool done = false;
 	bool async = false;
 	bool fifo = false;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <string_view>
 
@@ -15,4 +17,83 @@ namespace GamescopeLayerClient
         static constexpr uint32_t ForceSwapchainExtent = 1u << 4;
     }
     using Flags = uint32_t;
-}
\ No newline at end of file
+}
+namespace GamescopeLayerClient
+{
+    // Control page published by gamescope in the file at GAMESCOPE_LIMITER_FILE.
+    //
+    // The first 4 bytes are the legacy limiter value that Mesa's WSI reads with
+    // pread, the rest is only valid once u32Magic matches.
+    // Multi-field reads are protected by a seqlock (u32Sequence), so readers
+    // only ever do plain loads and never take a lock or make a syscall.
+    namespace ControlPageHint {
+        static constexpr uint32_t ForceFifo = 1u << 0;
+        static constexpr uint32_t AllowTearing = 1u << 1;
+        static constexpr uint32_t VRR = 1u << 2;
+    }
+
+    struct ControlPageSnapshot
+    {
+        uint32_t u32LimiterOverride = 0;
+        uint32_t u32PresentModeHints = 0;
+        uint64_t ulRefreshCycle = 0;
+        uint64_t ulNextVBlank = 0;
+    };
+
+    struct ControlPage
+    {
+        static constexpr uint32_t k_u32Magic = 0x50435347; // 'GSCP'
+        static constexpr uint32_t k_u32Version = 1;
+
+        std::atomic<uint32_t> u32LimiterOverride;
+        std::atomic<uint32_t> u32Magic;
+        uint32_t u32Version;
+        std::atomic<uint32_t> u32Sequence;
+        std::atomic<uint32_t> u32PresentModeHints;
+        uint32_t u32Pad;
+        std::atomic<uint64_t> ulRefreshCycle;
+        std::atomic<uint64_t> ulNextVBlank;
+
+        bool IsValid() const
+        {
+            return u32Magic.load( std::memory_order_acquire ) == k_u32Magic && u32Version == k_u32Version;
+        }
+
+        // Single writer only (gamescope).
+        void Publish( const ControlPageSnapshot &snapshot )
+        {
+            uint32_t u32Sequence = this->u32Sequence.load( std::memory_order_relaxed );
+            this->u32Sequence.store( u32Sequence + 1, std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_release );
+
+            u32LimiterOverride.store( snapshot.u32LimiterOverride, std::memory_order_relaxed );
+            u32PresentModeHints.store( snapshot.u32PresentModeHints, std::memory_order_relaxed );
+            ulRefreshCycle.store( snapshot.ulRefreshCycle, std::memory_order_relaxed );
+            ulNextVBlank.store( snapshot.ulNextVBlank, std::memory_order_relaxed );
+
+            this->u32Sequence.store( u32Sequence + 2, std::memory_order_release );
+        }
+
+        ControlPageSnapshot Read() const
+        {
+            ControlPageSnapshot snapshot;
+            for ( ;; )
+            {
+                uint32_t u32Begin = u32Sequence.load( std::memory_order_acquire );
+                if ( u32Begin & 1 )
+                    continue;
+
+                snapshot.u32LimiterOverride = u32LimiterOverride.load( std::memory_order_relaxed );
+                snapshot.u32PresentModeHints = u32PresentModeHints.load( std::memory_order_relaxed );
+                snapshot.ulRefreshCycle = ulRefreshCycle.load( std::memory_order_relaxed );
+                snapshot.ulNextVBlank = ulNextVBlank.load( std::memory_order_relaxed );
+
+                std::atomic_thread_fence( std::memory_order_acquire );
+                if ( u32Sequence.load( std::memory_order_relaxed ) == u32Begin )
+                    return snapshot;
+            }
+        }
+    };
+    static_assert( std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free );
+    static_assert( offsetof( ControlPage, u32LimiterOverride ) == 0, "Limiter value must stay at offset 0 for Mesa." );
+}
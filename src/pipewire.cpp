@@ -1,11 +1,13 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <thread>
 #include <vector>
@@ -13,6 +15,7 @@
 #include "main.hpp"
 #include "pipewire.hpp"
 #include "log.hpp"
+#include "Utils/Trace.h"
 
 #include <spa/debug/format.h>
 
@@ -89,12 +92,51 @@ static void calculate_capture_size()
 	}
 }
 
-static void build_format_params(struct spa_pod_builder *builder, spa_video_format format, std::vector<const struct spa_pod *> &params) {
+uint32_t spa_format_to_drm(uint32_t spa_format)
+{
+	switch (spa_format)
+	{
+		case SPA_VIDEO_FORMAT_NV12: return DRM_FORMAT_NV12;
+		default:
+		case SPA_VIDEO_FORMAT_BGR: return DRM_FORMAT_XRGB8888;
+	}
+}
+
+// Capture textures exported with an explicit modifier are only ever written
+// by the GPU, so unlike the MemFd ones they don't need to be mappable.
+static CVulkanTexture::createFlags pipewire_dmabuf_texture_flags()
+{
+	CVulkanTexture::createFlags flags;
+	flags.bTransferDst = true;
+	flags.bStorage = true;
+	flags.bExportable = true;
+	return flags;
+}
+
+static void build_format_params(struct pipewire_state *state, struct spa_pod_builder *builder, spa_video_format format, std::vector<const struct spa_pod *> &params) {
 	struct spa_rectangle size = SPA_RECTANGLE(s_nCaptureWidth, s_nCaptureHeight);
 	struct spa_rectangle min_requested_size = { 0, 0 };
 	struct spa_rectangle max_requested_size = { UINT32_MAX, UINT32_MAX };
 	struct spa_fraction framerate = SPA_FRACTION(0, 1);
-	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+
+	std::vector<uint64_t> modifiers;
+	if (state->modifier_fixated && state->fixated_format == format) {
+		modifiers.push_back(state->fixated_modifier);
+	} else {
+		modifiers = vulkan_get_export_modifiers(spa_format_to_drm(format), pipewire_dmabuf_texture_flags());
+		// Prefer anything tiled/compressed, linear is the last resort.
+		std::stable_partition(modifiers.begin(), modifiers.end(), [](uint64_t modifier) { return modifier != DRM_FORMAT_MOD_LINEAR; });
+	}
+
+	uint32_t modifier_flags = SPA_POD_PROP_FLAG_MANDATORY;
+	if (modifiers.empty()) {
+		// No explicit modifier support, single-plane linear only.
+		modifiers.push_back(DRM_FORMAT_MOD_LINEAR);
+	} else if (modifiers.size() > 1) {
+		// Let the consumer narrow the list down, the final pick happens
+		// in fixate_modifier.
+		modifier_flags |= SPA_POD_PROP_FLAG_DONT_FIXATE;
+	}
 
 	struct spa_pod_frame obj_frame, choice_frame;
 	spa_pod_builder_push_object(builder, &obj_frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
@@ -119,10 +161,11 @@ static void build_format_params(struct spa_pod_builder *builder, spa_video_forma
 							SPA_VIDEO_COLOR_RANGE_0_255),
 			0);
 	}
-	spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
+	spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, modifier_flags);
 	spa_pod_builder_push_choice(builder, &choice_frame, SPA_CHOICE_Enum, 0);
-	spa_pod_builder_long(builder, modifier); // default
-	spa_pod_builder_long(builder, modifier);
+	spa_pod_builder_long(builder, modifiers[0]); // default
+	for (uint64_t modifier : modifiers)
+		spa_pod_builder_long(builder, modifier);
 	spa_pod_builder_pop(builder, &choice_frame);
 	params.push_back((const struct spa_pod *) spa_pod_builder_pop(builder, &obj_frame));
 
@@ -155,16 +198,27 @@ static void build_format_params(struct spa_pod_builder *builder, spa_video_forma
 }
 
 
-static std::vector<const struct spa_pod *> build_format_params(struct spa_pod_builder *builder)
+static std::vector<const struct spa_pod *> build_format_params(struct pipewire_state *state, struct spa_pod_builder *builder)
 {
 	std::vector<const struct spa_pod *> params;
 
-	build_format_params(builder, SPA_VIDEO_FORMAT_BGRx, params);
-	build_format_params(builder, SPA_VIDEO_FORMAT_NV12, params);
+	build_format_params(state, builder, SPA_VIDEO_FORMAT_BGRx, params);
+	build_format_params(state, builder, SPA_VIDEO_FORMAT_NV12, params);
 
 	return params;
 }
 
+static void update_format_params(struct pipewire_state *state)
+{
+	uint8_t buf[4096];
+	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
+	std::vector<const struct spa_pod *> format_params = build_format_params(state, &builder);
+	int ret = pw_stream_update_params(state->stream, format_params.data(), format_params.size());
+	if (ret < 0) {
+		pwr_log.errorf("pw_stream_update_params failed");
+	}
+}
+
 static void request_buffer(struct pipewire_state *state)
 {
 	struct pw_buffer *pw_buffer = pw_stream_dequeue_buffer(state->stream);
@@ -182,8 +236,32 @@ static void request_buffer(struct pipewire_state *state)
 	assert(old == nullptr);
 }
 
+static uint32_t dmabuf_plane_size(const struct wlr_dmabuf_attributes &dmabuf, uint32_t spa_format, int plane, uint32_t maxsize)
+{
+	if (dmabuf.n_planes == 1) {
+		// Without an explicit modifier, NV12 chroma follows luma in the
+		// same plane.
+		uint32_t size = dmabuf.height * dmabuf.stride[0];
+		if (spa_format == SPA_VIDEO_FORMAT_NV12) {
+			size += (dmabuf.height + 1) / 2 * dmabuf.stride[0];
+		}
+		return size;
+	}
+
+	if (plane == 0)
+		return dmabuf.height * dmabuf.stride[0];
+	if (plane == 1 && spa_format == SPA_VIDEO_FORMAT_NV12)
+		return (dmabuf.height + 1) / 2 * dmabuf.stride[1];
+
+	// Auxiliary planes (eg. compression metadata) have no meaningful
+	// row layout, they get everything up to the end of the buffer.
+	return maxsize - dmabuf.offset[plane];
+}
+
 static void copy_buffer(struct pipewire_state *state, struct pipewire_buffer *buffer)
 {
+	GAMESCOPE_TRACE_SPAN( "pipewire_copy" );
+
 	gamescope::OwningRc<CVulkanTexture> &tex = buffer->texture;
 	assert(tex != nullptr);
 
@@ -251,12 +329,13 @@ static void copy_buffer(struct pipewire_state *state, struct pipewire_buffer *bu
 		break;
 	case SPA_DATA_DmaBuf:
 		dmabuf = tex->dmabuf();
-		assert(dmabuf.n_planes == 1);
-		chunk->offset = dmabuf.offset[0];
-		chunk->stride = dmabuf.stride[0];
-		chunk->size = dmabuf.height * chunk->stride;
-		if (state->video_info.format == SPA_VIDEO_FORMAT_NV12) {
-			chunk->size += ((dmabuf.height + 1)/2 * chunk->stride);
+		assert(spa_buffer->n_datas >= uint32_t(dmabuf.n_planes));
+		for (int i = 0; i < dmabuf.n_planes; i++) {
+			struct spa_chunk *plane_chunk = spa_buffer->datas[i].chunk;
+			plane_chunk->flags = chunk->flags;
+			plane_chunk->offset = dmabuf.offset[i];
+			plane_chunk->stride = dmabuf.stride[i];
+			plane_chunk->size = dmabuf_plane_size(dmabuf, state->video_info.format, i, spa_buffer->datas[i].maxsize);
 		}
 		break;
 	default:
@@ -282,14 +361,7 @@ static void dispatch_nudge(struct pipewire_state *state, int fd)
 	}
 	if (s_nCaptureWidth != state->video_info.size.width || s_nCaptureHeight != state->video_info.size.height) {
 		pwr_log.debugf("renegotiating stream params (size: %dx%d)", s_nCaptureWidth, s_nCaptureHeight);
-
-		uint8_t buf[4096];
-		struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
-		std::vector<const struct spa_pod *> format_params = build_format_params(&builder);
-		int ret = pw_stream_update_params(state->stream, format_params.data(), format_params.size());
-		if (ret < 0) {
-			pwr_log.errorf("pw_stream_update_params failed");
-		}
+		update_format_params(state);
 	}
 
 	struct pipewire_buffer *buffer = in_buffer.exchange(nullptr);
@@ -338,12 +410,58 @@ static void stream_handle_state_changed(void *data, enum pw_stream_state old_str
 	}
 }
 
+// The consumer left the modifier open (SPA_POD_PROP_FLAG_DONT_FIXATE): let
+// the driver pick its favourite out of what both sides can do by allocating
+// with the whole list, then advertise only that one.
+static void fixate_modifier(struct pipewire_state *state, const struct spa_pod_prop *modifier_prop)
+{
+	uint32_t n_modifiers = 0, choice = SPA_CHOICE_None;
+	const struct spa_pod *values = spa_pod_get_values(&modifier_prop->value, &n_modifiers, &choice);
+	if (SPA_POD_TYPE(values) != SPA_TYPE_Long || n_modifiers == 0) {
+		pwr_log.errorf("invalid modifier property");
+		return;
+	}
+
+	const uint64_t *modifiers = (const uint64_t *) SPA_POD_BODY_CONST(values);
+	if (choice == SPA_CHOICE_Enum && n_modifiers > 1) {
+		// Skip the default
+		modifiers++;
+		n_modifiers--;
+	}
+
+	gamescope::OwningRc<CVulkanTexture> probe = new CVulkanTexture();
+	CVulkanTexture::createFlags flags = pipewire_dmabuf_texture_flags();
+	flags.exportModifiers = std::span<const uint64_t>(modifiers, n_modifiers);
+	if (!probe->BInit(s_nCaptureWidth, s_nCaptureHeight, 1u, spa_format_to_drm(state->video_info.format), flags)) {
+		pwr_log.errorf("failed to allocate a dmabuf with any of the %u modifiers offered", n_modifiers);
+		pw_stream_set_error(state->stream, -EINVAL, "no usable DRM modifier");
+		return;
+	}
+
+	state->modifier_fixated = true;
+	state->fixated_format = state->video_info.format;
+	state->fixated_modifier = probe->dmabuf().modifier;
+
+	pwr_log.debugf("fixated modifier 0x%" PRIx64 " out of %u", state->fixated_modifier, n_modifiers);
+
+	update_format_params(state);
+}
+
 static void stream_handle_param_changed(void *data, uint32_t id, const struct spa_pod *param)
 {
 	struct pipewire_state *state = (struct pipewire_state *) data;
 
-	if (param == nullptr || id != SPA_PARAM_Format)
+	if (id != SPA_PARAM_Format)
+		return;
+
+	if (param == nullptr) {
+		if (state->modifier_fixated) {
+			// Whoever connects next gets to pick from the full list again.
+			state->modifier_fixated = false;
+			update_format_params(state);
+		}
 		return;
+	}
 
 	struct spa_gamescope gamescope_info{};
 
@@ -368,6 +486,24 @@ static void stream_handle_param_changed(void *data, uint32_t id, const struct sp
 	const struct spa_pod_prop *modifier_prop = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
 	state->dmabuf = modifier_prop != nullptr;
 
+	if (modifier_prop != nullptr && (modifier_prop->flags & SPA_POD_PROP_FLAG_DONT_FIXATE)) {
+		fixate_modifier(state, modifier_prop);
+		return;
+	}
+
+	state->dmabuf_explicit_modifier = false;
+	state->dmabuf_modifier = DRM_FORMAT_MOD_INVALID;
+	state->dmabuf_planes = 1;
+	if (state->dmabuf) {
+		uint32_t drm_format = spa_format_to_drm(state->video_info.format);
+		std::vector<uint64_t> modifiers = vulkan_get_export_modifiers(drm_format, pipewire_dmabuf_texture_flags());
+		if (std::find(modifiers.begin(), modifiers.end(), state->video_info.modifier) != modifiers.end()) {
+			state->dmabuf_explicit_modifier = true;
+			state->dmabuf_modifier = state->video_info.modifier;
+			state->dmabuf_planes = vulkan_get_modifier_plane_count(drm_format, state->dmabuf_modifier);
+		}
+	}
+
 	uint8_t buf[1024];
 	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
 
@@ -382,7 +518,7 @@ static void stream_handle_param_changed(void *data, uint32_t id, const struct sp
 		(const struct spa_pod *) spa_pod_builder_add_object(&builder,
 		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
 		SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(buffers, 1, 8),
-		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(state->dmabuf_planes),
 		SPA_PARAM_BUFFERS_size, SPA_POD_Int(shm_size),
 		SPA_PARAM_BUFFERS_stride, SPA_POD_Int(state->shm_stride),
 		SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(data_type));
@@ -403,10 +539,11 @@ static void stream_handle_param_changed(void *data, uint32_t id, const struct sp
 		pwr_log.errorf("pw_stream_update_params failed");
 	}
 
-	pwr_log.debugf("format changed (size: %dx%d, requested %dx%d, format %d, stride %d, size: %d, dmabuf: %d)",
+	pwr_log.debugf("format changed (size: %dx%d, requested %dx%d, format %d, stride %d, size: %d, dmabuf: %d, modifier: 0x%" PRIx64 ", planes: %u)",
 		state->video_info.size.width, state->video_info.size.height,
 		s_nRequestedWidth, s_nRequestedHeight,
-		state->video_info.format, state->shm_stride, shm_size, state->dmabuf);
+		state->video_info.format, state->shm_stride, shm_size, state->dmabuf,
+		state->dmabuf_modifier, state->dmabuf_planes);
 }
 
 static void randname(char *buf)
@@ -440,16 +577,6 @@ static int anonymous_shm_open(void)
 	return -1;
 }
 
-uint32_t spa_format_to_drm(uint32_t spa_format)
-{
-	switch (spa_format)
-	{
-		case SPA_VIDEO_FORMAT_NV12: return DRM_FORMAT_NV12;
-		default:
-		case SPA_VIDEO_FORMAT_BGR: return DRM_FORMAT_XRGB8888;
-	}
-}
-
 static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffer)
 {
 	struct pipewire_state *state = (struct pipewire_state *) user_data;
@@ -499,13 +626,21 @@ static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffe
 
 	buffer->texture = new CVulkanTexture();
 	CVulkanTexture::createFlags screenshotImageFlags;
-	screenshotImageFlags.bMappable = true;
-	screenshotImageFlags.bTransferDst = true;
-	screenshotImageFlags.bStorage = true;
-	if (is_dmabuf || drmFormat == DRM_FORMAT_NV12)
+	if (is_dmabuf && state->dmabuf_explicit_modifier)
 	{
-		screenshotImageFlags.bExportable = true;
-		screenshotImageFlags.bLinear = true; // TODO: support multi-planar DMA-BUF export via PipeWire
+		screenshotImageFlags = pipewire_dmabuf_texture_flags();
+		screenshotImageFlags.exportModifiers = std::span<const uint64_t>(&state->dmabuf_modifier, 1);
+	}
+	else
+	{
+		screenshotImageFlags.bMappable = true;
+		screenshotImageFlags.bTransferDst = true;
+		screenshotImageFlags.bStorage = true;
+		if (is_dmabuf || drmFormat == DRM_FORMAT_NV12)
+		{
+			screenshotImageFlags.bExportable = true;
+			screenshotImageFlags.bLinear = true;
+		}
 	}
 	bool bImageInitSuccess = buffer->texture->BInit( s_nCaptureWidth, s_nCaptureHeight, 1u, drmFormat, screenshotImageFlags );
 	if ( !bImageInitSuccess )
@@ -517,9 +652,9 @@ static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffe
 
 	if (is_dmabuf) {
 		const struct wlr_dmabuf_attributes dmabuf = buffer->texture->dmabuf();
-		if (dmabuf.n_planes != 1)
+		if (uint32_t(dmabuf.n_planes) > spa_buffer->n_datas)
 		{
-			pwr_log.errorf("dmabuf.n_planes != 1");
+			pwr_log.errorf("dmabuf has %d planes, but the buffer only has %u datas", dmabuf.n_planes, spa_buffer->n_datas);
 			goto error;
 		}
 
@@ -531,12 +666,17 @@ static void stream_handle_add_buffer(void *user_data, struct pw_buffer *pw_buffe
 
 		buffer->type = SPA_DATA_DmaBuf;
 
-		spa_data->type = SPA_DATA_DmaBuf;
-		spa_data->flags = SPA_DATA_FLAG_READABLE;
-		spa_data->fd = dmabuf.fd[0];
-		spa_data->mapoffset = dmabuf.offset[0];
-		spa_data->maxsize = size;
-		spa_data->data = nullptr;
+		// All planes share the same memory, the per-plane offsets
+		// go into the chunks (see copy_buffer).
+		for (int i = 0; i < dmabuf.n_planes; i++) {
+			struct spa_data *plane_data = &spa_buffer->datas[i];
+			plane_data->type = SPA_DATA_DmaBuf;
+			plane_data->flags = SPA_DATA_FLAG_READABLE;
+			plane_data->fd = dmabuf.fd[i];
+			plane_data->mapoffset = 0;
+			plane_data->maxsize = size;
+			plane_data->data = nullptr;
+		}
 	} else if (is_memfd) {
 		int fd = anonymous_shm_open();
 		if (fd < 0) {
@@ -712,7 +852,7 @@ bool init_pipewire(void)
 
 	uint8_t buf[4096];
 	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buf, sizeof(buf));
-	std::vector<const struct spa_pod *> format_params = build_format_params(&builder);
+	std::vector<const struct spa_pod *> format_params = build_format_params(state, &builder);
 
 	enum pw_stream_flags flags = (enum pw_stream_flags)(PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_ALLOC_BUFFERS);
 	int ret = pw_stream_connect(state->stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, flags, format_params.data(), format_params.size());
@@ -22,6 +22,20 @@ struct pipewire_state {
 	bool dmabuf;
 	int shm_stride;
 	uint64_t seq;
+
+	// How dmabufs are allocated for the current format. Without an explicit
+	// modifier, they are linear single-plane images (the fallback for
+	// drivers without VK_EXT_image_drm_format_modifier).
+	bool dmabuf_explicit_modifier;
+	uint64_t dmabuf_modifier;
+	uint32_t dmabuf_planes;
+
+	// Set once we picked one modifier out of what the consumer left open
+	// (SPA_POD_PROP_FLAG_DONT_FIXATE), it is advertised on its own for
+	// fixated_format from then on.
+	bool modifier_fixated;
+	enum spa_video_format fixated_format;
+	uint64_t fixated_modifier;
 };
 
 /**
@@ -13,6 +13,8 @@
 #include <dlfcn.h>
 #include "vulkan_include.h"
 #include "Utils/Algorithm.h"
+#include "Utils/Defer.h"
+#include "Utils/FrameArena.h"
 
 #if defined(__linux__)
 #include <sys/sysmacros.h>
@@ -37,7 +39,10 @@
 #include "steamcompmgr.hpp"
 #include "log.hpp"
 #include "Utils/Process.h"
+#include "Utils/Trace.h"
+#include "gpuvis_trace_utils.h"
 
+#include "cs_color_lut3d.h"
 #include "cs_composite_blit.h"
 #include "cs_composite_blur.h"
 #include "cs_composite_blur_cond.h"
@@ -123,6 +128,7 @@ VulkanOutput_t g_output;
 
 uint32_t g_uCompositeDebug = 0u;
 gamescope::ConVar<uint32_t> cv_composite_debug{ "composite_debug", 0, "Debug composition flags" };
+gamescope::ConVar<bool> cv_vulkan_suballocate_images{ "vulkan_suballocate_images", true, "Place internal images in shared device memory blocks instead of a dedicated allocation each." };
 
 static std::map< VkFormat, std::map< uint64_t, VkDrmFormatModifierPropertiesEXT > > DRMModifierProps = {};
 static std::unordered_map<uint32_t, std::vector<uint64_t>> s_SampledModifierFormats = {};
@@ -306,6 +312,8 @@ bool CVulkanDevice::BInit(VkInstance instance, VkSurfaceKHR surface)
 		return false;
 	if (!createDevice())
 		return false;
+	m_memoryAllocator.init(this);
+	m_gpuProfiler.init(this, m_bSupportsCalibratedTimestamps);
 	if (!createLayouts())
 		return false;
 	if (!createPools())
@@ -456,6 +464,12 @@ bool CVulkanDevice::createDevice()
 
 		if ( strcmp(ext.extensionName, VK_EXT_HDR_METADATA_EXTENSION_NAME) == 0 )
 			supportsHDRMetadata = true;
+
+		if ( strcmp(ext.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0 )
+			m_bSupportsMemoryBudget = true;
+
+		if ( strcmp(ext.extensionName, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0 )
+			m_bSupportsCalibratedTimestamps = true;
 	}
 
 	vk_log.infof( "physical device %s DRM format modifiers", m_bSupportsModifiers ? "supports" : "does not support" );
@@ -528,7 +542,25 @@ bool CVulkanDevice::createDevice()
 		m_bSupportsFp16 = vulkan12Features.shaderFloat16 && features2.features.shaderInt16;
 	}
 
-	float queuePriorities = 1.0f;
+	// If our queue family has room for another queue, get a second one for
+	// background work (eg. pre-emptive upscaling), so it does not sit in
+	// front of the composite that has to make the next vblank in one queue.
+	// This is not a real deprioritization: global priority can only be set
+	// per family and applies to both queues, and the lower relative priority
+	// we ask for is only a hint that RADV and most other drivers ignore.
+	// Putting it on another family would need queue family ownership
+	// transfers for everything it touches.
+	{
+		uint32_t queueFamilyCount = 0;
+		vk.GetPhysicalDeviceQueueFamilyProperties(physDev(), &queueFamilyCount, nullptr);
+		std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyCount);
+		vk.GetPhysicalDeviceQueueFamilyProperties(physDev(), &queueFamilyCount, queueFamilyProperties.data());
+
+		m_bHasBackgroundQueue = queueFamilyProperties[m_queueFamily].queueCount >= 2 &&
+			!env_to_bool( getenv( "GAMESCOPE_DISABLE_BACKGROUND_QUEUE" ) );
+	}
+
+	const float queuePriorities[2] = { 1.0f, 0.0f };
 
 	VkDeviceQueueGlobalPriorityCreateInfoEXT queueCreateInfoEXT = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_GLOBAL_PRIORITY_CREATE_INFO_EXT,
@@ -542,15 +574,15 @@ bool CVulkanDevice::createDevice()
 			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
 			.pNext = gamescope::Process::HasCapSysNice() ? &queueCreateInfoEXT : nullptr,
 			.queueFamilyIndex = m_queueFamily,
-			.queueCount = 1,
-			.pQueuePriorities = &queuePriorities
+			.queueCount = m_bHasBackgroundQueue ? 2u : 1u,
+			.pQueuePriorities = queuePriorities
 		},
 		{
 			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
 			.pNext = gamescope::Process::HasCapSysNice() ? &queueCreateInfoEXT : nullptr,
 			.queueFamilyIndex = m_generalQueueFamily,
 			.queueCount = 1,
-			.pQueuePriorities = &queuePriorities
+			.pQueuePriorities = queuePriorities
 		},
 	};
 
@@ -584,6 +616,12 @@ bool CVulkanDevice::createDevice()
 	if ( supportsHDRMetadata )
 		enabledExtensions.push_back( VK_EXT_HDR_METADATA_EXTENSION_NAME );
 
+	if ( m_bSupportsMemoryBudget )
+		enabledExtensions.push_back( VK_EXT_MEMORY_BUDGET_EXTENSION_NAME );
+
+	if ( m_bSupportsCalibratedTimestamps )
+		enabledExtensions.push_back( VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME );
+
 	for ( auto& extension : GetBackend()->GetDeviceExtensions( physDev() ) )
 		enabledExtensions.push_back( extension );
 
@@ -683,6 +721,19 @@ bool CVulkanDevice::createDevice()
 	else
 		vk.GetDeviceQueue(device(), m_generalQueueFamily, 0, &m_generalQueue);
 
+	if ( m_bHasBackgroundQueue )
+		vk.GetDeviceQueue(device(), m_queueFamily, 1, &m_backgroundQueue);
+
+	if ( m_bHasBackgroundQueue )
+	{
+		vk_log.infof( "using a background queue on queue family %x. It shares the family, and its global priority, with the composite queue, so background work is not deprioritized, only queued separately.",
+			m_queueFamily );
+	}
+	else
+	{
+		vk_log.infof( "no background queue" );
+	}
+
 	return true;
 }
 
@@ -768,7 +819,7 @@ bool CVulkanDevice::createLayouts()
 	std::array<VkDescriptorSetLayoutBinding, 7 > layoutBindings = {
 		VkDescriptorSetLayoutBinding {
 			.binding = 0,
-			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
 			.descriptorCount = 1,
 			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
 		},
@@ -890,7 +941,7 @@ bool CVulkanDevice::createPools()
 
 	VkDescriptorPoolSize poolSizes[3] {
 		{
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
 			uint32_t(m_descriptorSets.size()),
 		},
 		{
@@ -946,6 +997,7 @@ bool CVulkanDevice::createShaders()
 		SHADER(NIS, cs_nis);
 	}
 	SHADER(RGB_TO_NV12, cs_rgb_to_nv12);
+	SHADER(COLOR_LUT3D, cs_color_lut3d);
 #undef SHADER
 
 	for (uint32_t i = 0; i < shaderInfos.size(); i++)
@@ -989,7 +1041,7 @@ bool CVulkanDevice::createScratchResources()
 	
 	VkBufferCreateInfo bufferCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		.size = upload_buffer_size,
+		.size = upload_buffer_size + upload_buffer_uniform_range,
 		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
 	};
 
@@ -1044,9 +1096,124 @@ bool CVulkanDevice::createScratchResources()
 		return false;
 	}
 
+	if ( m_bHasBackgroundQueue )
+	{
+		res = vk.CreateSemaphore( device(), &semCreateInfo, NULL, &m_backgroundTimelineSemaphore );
+		if ( res != VK_SUCCESS )
+		{
+			vk_errorf( res, "vkCreateSemaphore failed" );
+			return false;
+		}
+	}
+
 	return true;
 }
 
+VkDescriptorSet CVulkanDevice::descriptorSet( const DescriptorSetKey_t &key, bool bBackground, uint32_t *puIndex, bool *pbNeedsWrite, std::optional<DescriptorSetKey_t> *pPreviousKey )
+{
+	std::unique_lock lock( m_descriptorSetMutex );
+
+	uint64_t ulUse = ++m_ulDescriptorSetUseCount;
+
+	auto iter = m_descriptorSetLookup.find( key );
+	if ( iter != m_descriptorSetLookup.end() )
+	{
+		m_descriptorSetLastUse[ iter->second ] = ulUse;
+		if ( bBackground )
+			m_descriptorSetBackgroundHolds[ iter->second ]++;
+		*puIndex = iter->second;
+		*pbNeedsWrite = false;
+		return m_descriptorSets[ iter->second ];
+	}
+
+	// Skip over anything background work might still be using.
+	uint64_t ulBackgroundCompleted = ~0ull;
+	if ( m_bHasBackgroundQueue )
+		ulBackgroundCompleted = completedBackgroundSeqNo();
+
+	std::optional<uint32_t> oOldest;
+	for ( uint32_t i = 0; i < m_descriptorSets.size(); i++ )
+	{
+		if ( m_descriptorSetBackgroundHolds[i] || m_descriptorSetBackgroundSeqNo[i] > ulBackgroundCompleted )
+			continue;
+
+		if ( !oOldest || m_descriptorSetLastUse[i] < m_descriptorSetLastUse[ *oOldest ] )
+			oOldest = i;
+	}
+
+	if ( !oOldest )
+	{
+		// Everything is in use by background work, writing to any of these
+		// now would race with the GPU reading it. Wait for the submission
+		// that frees one up the soonest.
+		for ( uint32_t i = 0; i < m_descriptorSets.size(); i++ )
+		{
+			if ( m_descriptorSetBackgroundHolds[i] )
+				continue;
+
+			if ( !oOldest || m_descriptorSetBackgroundSeqNo[i] < m_descriptorSetBackgroundSeqNo[ *oOldest ] )
+				oOldest = i;
+		}
+
+		if ( !oOldest )
+		{
+			// Only possible if background buffers that are still being
+			// recorded hold every set, nothing is going to free one up.
+			vk_log.errorf( "all %zu descriptor sets are held by background command buffers", m_descriptorSets.size() );
+			abort();
+		}
+
+		VkSemaphoreWaitInfo waitInfo = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+			.semaphoreCount = 1,
+			.pSemaphores = &m_backgroundTimelineSemaphore,
+			.pValues = &m_descriptorSetBackgroundSeqNo[ *oOldest ],
+		};
+
+		vk_check( vk.WaitSemaphores( device(), &waitInfo, ~0ull ) );
+	}
+
+	const uint32_t uOldest = *oOldest;
+	m_descriptorSetBackgroundSeqNo[ uOldest ] = 0;
+	m_descriptorSetBackgroundHolds[ uOldest ] = bBackground ? 1 : 0;
+	*puIndex = uOldest;
+
+	if ( m_descriptorSetKeys[ uOldest ] )
+		m_descriptorSetLookup.erase( *m_descriptorSetKeys[ uOldest ] );
+
+	*pPreviousKey = std::move( m_descriptorSetKeys[ uOldest ] );
+	*pbNeedsWrite = true;
+
+	m_descriptorSetKeys[ uOldest ] = key;
+	m_descriptorSetLastUse[ uOldest ] = ulUse;
+	m_descriptorSetLookup[ key ] = uOldest;
+
+	return m_descriptorSets[ uOldest ];
+}
+
+void CVulkanDevice::pinBackgroundDescriptorSets( std::vector<uint32_t> &indices, uint64_t ulSeqNo )
+{
+	std::unique_lock lock( m_descriptorSetMutex );
+
+	for ( uint32_t uIndex : indices )
+	{
+		m_descriptorSetBackgroundHolds[ uIndex ]--;
+		m_descriptorSetBackgroundSeqNo[ uIndex ] = std::max( m_descriptorSetBackgroundSeqNo[ uIndex ], ulSeqNo );
+	}
+
+	indices.clear();
+}
+
+void CVulkanDevice::releaseBackgroundDescriptorSets( std::vector<uint32_t> &indices )
+{
+	std::unique_lock lock( m_descriptorSetMutex );
+
+	for ( uint32_t uIndex : indices )
+		m_descriptorSetBackgroundHolds[ uIndex ]--;
+
+	indices.clear();
+}
+
 VkSampler CVulkanDevice::sampler( SamplerState key )
 {
 	if ( m_samplerCache.count(key) != 0 )
@@ -1141,6 +1308,8 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 
 	VkComputePipelineCreateInfo computePipelineCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+		// For only recompositing damaged regions.
+		.flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT,
 		.stage = {
 			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
 			.stage = VK_SHADER_STAGE_COMPUTE_BIT,
@@ -1176,6 +1345,7 @@ void CVulkanDevice::compileAllPipelines()
 	SHADER(EASU, 1, 1, 1);
 	SHADER(NIS, 1, 1, 1);
 	SHADER(RGB_TO_NV12, 1, 1, 1);
+	SHADER(COLOR_LUT3D, 1, 1, 1);
 #undef SHADER
 
 	for (auto& info : pipelineInfos) {
@@ -1241,7 +1411,7 @@ int32_t CVulkanDevice::findMemoryType( VkMemoryPropertyFlags properties, uint32_
 	return -1;
 }
 
-std::unique_ptr<CVulkanCmdBuffer> CVulkanDevice::commandBuffer()
+std::unique_ptr<CVulkanCmdBuffer> CVulkanDevice::commandBuffer( bool bBackground )
 {
 	std::unique_ptr<CVulkanCmdBuffer> cmdBuffer;
 	if (m_unusedCmdBufs.empty())
@@ -1269,6 +1439,9 @@ std::unique_ptr<CVulkanCmdBuffer> CVulkanDevice::commandBuffer()
 		m_unusedCmdBufs.pop_back();
 	}
 
+	if ( bBackground && m_bHasBackgroundQueue )
+		cmdBuffer->setQueue( m_backgroundQueue, true );
+
 	cmdBuffer->begin();
 	return cmdBuffer;
 }
@@ -1277,22 +1450,39 @@ uint64_t CVulkanDevice::submitInternal( CVulkanCmdBuffer* cmdBuffer )
 {
 	cmdBuffer->end();
 
+	// Background work signals its own timeline, it can complete out of order
+	// with the main queue.
+	const bool bBackground = cmdBuffer->background();
+	std::atomic<uint64_t> &submissionSeqNo = bBackground ? m_backgroundSubmissionSeqNo : m_submissionSeqNo;
+
 	// The seq no of the last submission.
-	const uint64_t lastSubmissionSeqNo = m_submissionSeqNo++;
+	const uint64_t lastSubmissionSeqNo = submissionSeqNo++;
 
 	// This is the seq no of the command buffer we are going to submit.
 	const uint64_t nextSeqNo = lastSubmissionSeqNo + 1;
 
-	std::vector<VkSemaphore> pSignalSemaphores;
-	std::vector<uint64_t> ulSignalPoints;
+	// Every frame submits at least once, keep these off the heap.
+	const size_t ulMaxSignals = cmdBuffer->GetExternalSignals().size() + 1;
+	const size_t ulMaxWaits = cmdBuffer->GetExternalDependencies().size() + 1;
+
+	gamescope::FrameVector<VkSemaphore> pSignalSemaphores;
+	gamescope::FrameVector<uint64_t> ulSignalPoints;
+	pSignalSemaphores.reserve( ulMaxSignals );
+	ulSignalPoints.reserve( ulMaxSignals );
 
-	std::vector<VkPipelineStageFlags> uWaitStageFlags;
-	std::vector<VkSemaphore> pWaitSemaphores;
-	std::vector<uint64_t> ulWaitPoints;
+	gamescope::FrameVector<VkPipelineStageFlags> uWaitStageFlags;
+	gamescope::FrameVector<VkSemaphore> pWaitSemaphores;
+	gamescope::FrameVector<uint64_t> ulWaitPoints;
+	uWaitStageFlags.reserve( ulMaxWaits );
+	pWaitSemaphores.reserve( ulMaxWaits );
+	ulWaitPoints.reserve( ulMaxWaits );
 
-	pSignalSemaphores.push_back( m_scratchTimelineSemaphore );
+	pSignalSemaphores.push_back( bBackground ? m_backgroundTimelineSemaphore : m_scratchTimelineSemaphore );
 	ulSignalPoints.push_back( nextSeqNo );
 
+	if ( bBackground )
+		pinBackgroundDescriptorSets( cmdBuffer->backgroundDescriptorSets(), nextSeqNo );
+
 	for ( auto &dep : cmdBuffer->GetExternalSignals() )
 	{
 		pSignalSemaphores.push_back( dep.pTimelineSemaphore->pVkSemaphore );
@@ -1306,9 +1496,16 @@ uint64_t CVulkanDevice::submitInternal( CVulkanCmdBuffer* cmdBuffer )
 		uWaitStageFlags.push_back( VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT );
 	}
 
+	if ( bBackground && cmdBuffer->GetMainQueueDependency() > completedSeqNo() )
+	{
+		pWaitSemaphores.push_back( m_scratchTimelineSemaphore );
+		ulWaitPoints.push_back( cmdBuffer->GetMainQueueDependency() );
+		uWaitStageFlags.push_back( VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT );
+	}
+
 	VkTimelineSemaphoreSubmitInfo timelineInfo = {
 		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
-		// no need to ensure order of cmd buffer submission, we only have one queue
+		// no need to ensure order of cmd buffer submission, each queue has its own timeline
 		.waitSemaphoreValueCount = static_cast<uint32_t>( ulWaitPoints.size() ),
 		.pWaitSemaphoreValues = ulWaitPoints.data(),
 		.signalSemaphoreValueCount = static_cast<uint32_t>( ulSignalPoints.size() ),
@@ -1331,13 +1528,13 @@ uint64_t CVulkanDevice::submitInternal( CVulkanCmdBuffer* cmdBuffer )
 
 	vk_check( vk.QueueSubmit( cmdBuffer->queue(), 1, &submitInfo, VK_NULL_HANDLE ) );
 
-	return nextSeqNo;
+	return bBackground ? ( nextSeqNo | k_ulBackgroundSeqNoBit ) : nextSeqNo;
 }
 
 uint64_t CVulkanDevice::submit( std::unique_ptr<CVulkanCmdBuffer> cmdBuffer)
 {
 	uint64_t nextSeqNo = submitInternal(cmdBuffer.get());
-	m_pendingCmdBufs.emplace(nextSeqNo, std::move(cmdBuffer));
+	pendingCmdBufs(nextSeqNo).emplace(nextSeqNo, std::move(cmdBuffer));
 	return nextSeqNo;
 }
 
@@ -1347,6 +1544,23 @@ void CVulkanDevice::garbageCollect( void )
 	vk_check( vk.GetSemaphoreCounterValue(device(), m_scratchTimelineSemaphore, &currentSeqNo) );
 
 	resetCmdBuffers(currentSeqNo);
+
+	if ( m_bHasBackgroundQueue )
+	{
+		vk_check( vk.GetSemaphoreCounterValue(device(), m_backgroundTimelineSemaphore, &currentSeqNo) );
+
+		resetCmdBuffers(currentSeqNo | k_ulBackgroundSeqNoBit);
+	}
+
+	m_memoryAllocator.trim();
+}
+
+uint64_t CVulkanDevice::completedBackgroundSeqNo()
+{
+	uint64_t ulCompleted = 0;
+	if ( m_bHasBackgroundQueue )
+		vk_check( vk.GetSemaphoreCounterValue(device(), m_backgroundTimelineSemaphore, &ulCompleted) );
+	return ulCompleted;
 }
 
 VulkanTimelineSemaphore_t::~VulkanTimelineSemaphore_t()
@@ -1460,49 +1674,751 @@ std::shared_ptr<VulkanTimelineSemaphore_t> CVulkanDevice::ImportTimelineSemaphor
 		return nullptr;
 	}
 
-	return pSemaphore;
+	return pSemaphore;
+}
+
+void CVulkanCmdBuffer::AddDependency( std::shared_ptr<VulkanTimelineSemaphore_t> pTimelineSemaphore, uint64_t ulPoint )
+{
+	m_ExternalDependencies.emplace_back( std::move( pTimelineSemaphore ), ulPoint );
+}
+
+void CVulkanCmdBuffer::AddSignal( std::shared_ptr<VulkanTimelineSemaphore_t> pTimelineSemaphore, uint64_t ulPoint )
+{
+	m_ExternalSignals.emplace_back( std::move( pTimelineSemaphore ), ulPoint );
+}
+
+void CVulkanCmdBuffer::AddMainQueueDependency( uint64_t ulSeqNo )
+{
+	assert( !( ulSeqNo & CVulkanDevice::k_ulBackgroundSeqNoBit ) );
+	m_ulMainQueueDependency = std::max( m_ulMainQueueDependency, ulSeqNo );
+}
+
+void CVulkanDevice::wait(uint64_t sequence, bool reset)
+{
+	const bool bBackground = !!( sequence & k_ulBackgroundSeqNoBit );
+	uint64_t ulPoint = sequence & ~k_ulBackgroundSeqNoBit;
+
+	// The upload buffer is shared between the queues, only start over
+	// once both of them are done with it.
+	if ( bBackground )
+	{
+		if ( m_backgroundSubmissionSeqNo == ulPoint && completedSeqNo() == m_submissionSeqNo )
+			m_uploadBufferOffset = 0;
+	}
+	else
+	{
+		if ( m_submissionSeqNo == ulPoint && completedBackgroundSeqNo() == m_backgroundSubmissionSeqNo )
+			m_uploadBufferOffset = 0;
+	}
+
+	VkSemaphoreWaitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = bBackground ? &m_backgroundTimelineSemaphore : &m_scratchTimelineSemaphore,
+		.pValues = &ulPoint,
+	} ;
+
+	vk_check( vk.WaitSemaphores( device(), &waitInfo, ~0ull ) );
+
+	if (reset)
+		resetCmdBuffers(sequence);
+}
+
+void CVulkanDevice::waitIdle(bool reset)
+{
+	if ( m_bHasBackgroundQueue && m_backgroundSubmissionSeqNo != 0 )
+	{
+		wait( m_backgroundSubmissionSeqNo | k_ulBackgroundSeqNoBit, reset );
+	}
+
+	wait(m_submissionSeqNo, reset);
+}
+
+uint64_t CVulkanDevice::completedSeqNo()
+{
+	uint64_t ulCompleted = 0;
+	vk_check( vk.GetSemaphoreCounterValue(device(), m_scratchTimelineSemaphore, &ulCompleted) );
+	return ulCompleted;
+}
+
+bool CVulkanDevice::seqNoCompleted( uint64_t ulSeqNo )
+{
+	if ( ulSeqNo & k_ulBackgroundSeqNoBit )
+		return completedBackgroundSeqNo() >= ( ulSeqNo & ~k_ulBackgroundSeqNoBit );
+
+	return completedSeqNo() >= ulSeqNo;
+}
+
+bool CVulkanDevice::createStagingBuffer( VkDeviceSize ulSize )
+{
+	VkBufferCreateInfo bufferCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = ulSize,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	};
+
+	VkResult res = vk.CreateBuffer( device(), &bufferCreateInfo, nullptr, &m_stagingBuffer );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreateBuffer failed" );
+		return false;
+	}
+
+	VkMemoryRequirements memRequirements;
+	vk.GetBufferMemoryRequirements( device(), m_stagingBuffer, &memRequirements );
+
+	uint32_t memTypeIndex = findMemoryType( VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
+	if ( memTypeIndex == ~0u )
+	{
+		vk_log.errorf( "findMemoryType failed" );
+		destroyStagingBuffer();
+		return false;
+	}
+
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = memRequirements.size,
+		.memoryTypeIndex = memTypeIndex,
+	};
+
+	res = vk.AllocateMemory( device(), &allocInfo, nullptr, &m_stagingBufferMemory );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkAllocateMemory failed" );
+		destroyStagingBuffer();
+		return false;
+	}
+
+	res = vk.BindBufferMemory( device(), m_stagingBuffer, m_stagingBufferMemory, 0 );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkBindBufferMemory failed" );
+		destroyStagingBuffer();
+		return false;
+	}
+
+	res = vk.MapMemory( device(), m_stagingBufferMemory, 0, VK_WHOLE_SIZE, 0, (void **)&m_pStagingBufferData );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkMapMemory failed" );
+		destroyStagingBuffer();
+		return false;
+	}
+
+	m_ulStagingBufferSize = ulSize;
+	m_ulStagingBufferHead = 0;
+	return true;
+}
+
+void CVulkanDevice::destroyStagingBuffer()
+{
+	if ( m_pStagingBufferData != nullptr )
+	{
+		vk.UnmapMemory( device(), m_stagingBufferMemory );
+		m_pStagingBufferData = nullptr;
+	}
+
+	if ( m_stagingBuffer != VK_NULL_HANDLE )
+	{
+		vk.DestroyBuffer( device(), m_stagingBuffer, nullptr );
+		m_stagingBuffer = VK_NULL_HANDLE;
+	}
+
+	if ( m_stagingBufferMemory != VK_NULL_HANDLE )
+	{
+		vk.FreeMemory( device(), m_stagingBufferMemory, nullptr );
+		m_stagingBufferMemory = VK_NULL_HANDLE;
+	}
+
+	m_ulStagingBufferSize = 0;
+	m_ulStagingBufferHead = 0;
+}
+
+std::optional<CVulkanDevice::StagingAllocation_t> CVulkanDevice::stagingBufferData( VkDeviceSize ulSize )
+{
+	// 16 covers the alignment of every texel size we copy from.
+	ulSize = align( std::max<VkDeviceSize>( ulSize, 1 ), 16 );
+
+	if ( ulSize > m_ulStagingBufferSize )
+	{
+		// Whatever is in flight lives in the old buffer.
+		for ( const StagingRange_t &range : m_stagingRanges )
+		{
+			assert( range.ulSeqNo != 0 );
+			wait( range.ulSeqNo, false );
+		}
+		m_stagingRanges.clear();
+
+		destroyStagingBuffer();
+		if ( !createStagingBuffer( std::max( k_ulMinStagingBufferSize, ulSize * 2 ) ) )
+			return std::nullopt;
+	}
+
+	for ( ;; )
+	{
+		while ( !m_stagingRanges.empty() && m_stagingRanges.front().ulSeqNo != 0 && seqNoCompleted( m_stagingRanges.front().ulSeqNo ) )
+			m_stagingRanges.pop_front();
+
+		std::optional<VkDeviceSize> oulOffset;
+		if ( m_stagingRanges.empty() )
+		{
+			oulOffset = 0;
+		}
+		else
+		{
+			const VkDeviceSize ulTail = m_stagingRanges.front().ulBegin;
+			if ( m_ulStagingBufferHead > ulTail )
+			{
+				// In use: [ulTail, head), try the end first, then wrap around.
+				if ( m_ulStagingBufferHead + ulSize <= m_ulStagingBufferSize )
+					oulOffset = m_ulStagingBufferHead;
+				else if ( ulSize <= ulTail )
+					oulOffset = 0;
+			}
+			else if ( m_ulStagingBufferHead + ulSize <= ulTail )
+			{
+				// Already wrapped, in use: [ulTail, end) and [0, head).
+				oulOffset = m_ulStagingBufferHead;
+			}
+		}
+
+		if ( oulOffset )
+		{
+			m_stagingRanges.push_back( StagingRange_t{ *oulOffset, *oulOffset + ulSize, 0 } );
+			m_ulStagingBufferHead = *oulOffset + ulSize;
+
+			return StagingAllocation_t
+			{
+				.buffer = m_stagingBuffer,
+				.ulOffset = *oulOffset,
+				.pData = m_pStagingBufferData + *oulOffset,
+			};
+		}
+
+		if ( m_stagingRanges.front().ulSeqNo == 0 )
+		{
+			vk_log.errorf( "staging buffer is full of uploads that were never submitted" );
+			return std::nullopt;
+		}
+
+		wait( m_stagingRanges.front().ulSeqNo, false );
+	}
+}
+
+void CVulkanDevice::retireStagingData( uint64_t ulSeqNo )
+{
+	for ( auto iter = m_stagingRanges.rbegin(); iter != m_stagingRanges.rend() && iter->ulSeqNo == 0; iter++ )
+		iter->ulSeqNo = ulSeqNo;
+}
+
+bool CVulkanDevice::queryMemoryBudget( MemoryBudget_t *pBudget )
+{
+	if ( !m_bSupportsMemoryBudget )
+		return false;
+
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProps = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+	};
+	VkPhysicalDeviceMemoryProperties2 memoryProps2 = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+		.pNext = &budgetProps,
+	};
+	vk.GetPhysicalDeviceMemoryProperties2( physDev(), &memoryProps2 );
+
+	for ( uint32_t i = 0; i < VK_MAX_MEMORY_HEAPS; i++ )
+	{
+		pBudget->ulHeapBudget[i] = budgetProps.heapBudget[i];
+		pBudget->ulHeapUsage[i] = budgetProps.heapUsage[i];
+	}
+
+	return true;
+}
+
+void CVulkanMemoryAllocator::init( CVulkanDevice *pDevice )
+{
+	m_pDevice = pDevice;
+}
+
+bool CVulkanMemoryAllocator::createBlock( uint32_t uMemoryType, uint32_t *puBlockIndex )
+{
+	// Don't push the heap over budget for a block we may only use a bit of,
+	// a dedicated allocation of the exact size has a better chance.
+	CVulkanDevice::MemoryBudget_t budget;
+	if ( m_pDevice->queryMemoryBudget( &budget ) )
+	{
+		uint32_t uHeap = m_pDevice->memoryProperties().memoryTypes[ uMemoryType ].heapIndex;
+		if ( budget.ulHeapUsage[ uHeap ] + k_ulBlockSize > budget.ulHeapBudget[ uHeap ] )
+		{
+			vk_log.debugf( "not allocating a new memory block, heap %u is at %" PRIu64 " of %" PRIu64 " bytes", uHeap, budget.ulHeapUsage[ uHeap ], budget.ulHeapBudget[ uHeap ] );
+			return false;
+		}
+	}
+
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = k_ulBlockSize,
+		.memoryTypeIndex = uMemoryType,
+	};
+
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkResult res = m_pDevice->vk.AllocateMemory( m_pDevice->device(), &allocInfo, nullptr, &memory );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkAllocateMemory failed for a memory block" );
+		return false;
+	}
+
+	Block_t block;
+	block.memory = memory;
+	block.uMemoryType = uMemoryType;
+	block.ulEmptySince = get_time_in_nanos();
+	block.freeRanges[ k_uSizeClassCount - 1 ].push_back( 0 );
+
+	auto iter = std::find_if( m_blocks.begin(), m_blocks.end(), []( const Block_t &block ) { return block.memory == VK_NULL_HANDLE; } );
+	if ( iter != m_blocks.end() )
+	{
+		*iter = std::move( block );
+		*puBlockIndex = uint32_t( iter - m_blocks.begin() );
+	}
+	else
+	{
+		m_blocks.emplace_back( std::move( block ) );
+		*puBlockIndex = uint32_t( m_blocks.size() - 1 );
+	}
+
+	return true;
+}
+
+std::optional<VulkanSubAllocation_t> CVulkanMemoryAllocator::allocate( const VkMemoryRequirements &memRequirements, uint32_t uMemoryType )
+{
+	// Ranges are aligned to their size, so this covers the alignment too.
+	VkDeviceSize ulSize = std::max( { memRequirements.size, memRequirements.alignment, k_ulMinAllocationSize } );
+	if ( ulSize > k_ulMaxSubAllocationSize )
+		return std::nullopt;
+
+	uint32_t uSizeClass = 0;
+	while ( sizeClassBytes( uSizeClass ) < ulSize )
+		uSizeClass++;
+
+	std::unique_lock lock( m_mutex );
+
+	// Take from the fullest block that has room.
+	std::optional<uint32_t> ouBlockIndex;
+	uint32_t uSplitClass = 0;
+	for ( uint32_t i = 0; i < m_blocks.size(); i++ )
+	{
+		const Block_t &block = m_blocks[i];
+		if ( block.memory == VK_NULL_HANDLE || block.uMemoryType != uMemoryType )
+			continue;
+
+		if ( ouBlockIndex && m_blocks[ *ouBlockIndex ].ulUsed >= block.ulUsed )
+			continue;
+
+		for ( uint32_t uClass = uSizeClass; uClass < k_uSizeClassCount; uClass++ )
+		{
+			if ( !block.freeRanges[ uClass ].empty() )
+			{
+				ouBlockIndex = i;
+				uSplitClass = uClass;
+				break;
+			}
+		}
+	}
+
+	if ( !ouBlockIndex )
+	{
+		uint32_t uBlockIndex = 0;
+		if ( !createBlock( uMemoryType, &uBlockIndex ) )
+			return std::nullopt;
+
+		ouBlockIndex = uBlockIndex;
+		uSplitClass = k_uSizeClassCount - 1;
+	}
+
+	Block_t &block = m_blocks[ *ouBlockIndex ];
+
+	VkDeviceSize ulOffset = block.freeRanges[ uSplitClass ].back();
+	block.freeRanges[ uSplitClass ].pop_back();
+
+	// Hand the upper halves back until we are down to the size we want.
+	while ( uSplitClass > uSizeClass )
+	{
+		uSplitClass--;
+		block.freeRanges[ uSplitClass ].push_back( ulOffset + sizeClassBytes( uSplitClass ) );
+	}
+
+	block.ulUsed += sizeClassBytes( uSizeClass );
+	block.uAllocationCount++;
+
+	return VulkanSubAllocation_t
+	{
+		.memory = block.memory,
+		.ulOffset = ulOffset,
+		.ulSize = sizeClassBytes( uSizeClass ),
+		.uBlockIndex = *ouBlockIndex,
+		.uSizeClass = uSizeClass,
+	};
+}
+
+void CVulkanMemoryAllocator::free( const VulkanSubAllocation_t &allocation )
+{
+	std::unique_lock lock( m_mutex );
+
+	Block_t &block = m_blocks[ allocation.uBlockIndex ];
+	assert( block.memory == allocation.memory );
+
+	// Merge with the buddy for as long as it is free.
+	VkDeviceSize ulOffset = allocation.ulOffset;
+	uint32_t uSizeClass = allocation.uSizeClass;
+	while ( uSizeClass < k_uSizeClassCount - 1 )
+	{
+		std::vector<VkDeviceSize> &freeRanges = block.freeRanges[ uSizeClass ];
+		VkDeviceSize ulBuddyOffset = ulOffset ^ sizeClassBytes( uSizeClass );
+
+		auto iter = std::find( freeRanges.begin(), freeRanges.end(), ulBuddyOffset );
+		if ( iter == freeRanges.end() )
+			break;
+
+		*iter = freeRanges.back();
+		freeRanges.pop_back();
+
+		ulOffset = std::min( ulOffset, ulBuddyOffset );
+		uSizeClass++;
+	}
+	block.freeRanges[ uSizeClass ].push_back( ulOffset );
+
+	block.ulUsed -= allocation.ulSize;
+	block.uAllocationCount--;
+	if ( block.uAllocationCount == 0 )
+		block.ulEmptySince = get_time_in_nanos();
+}
+
+void CVulkanMemoryAllocator::trim( bool bAll )
+{
+	std::unique_lock lock( m_mutex );
+
+	uint64_t ulNow = get_time_in_nanos();
+	for ( Block_t &block : m_blocks )
+	{
+		if ( block.memory == VK_NULL_HANDLE || block.uAllocationCount != 0 )
+			continue;
+
+		if ( !bAll && ulNow - block.ulEmptySince < k_ulEmptyBlockLifetimeNs )
+			continue;
+
+		m_pDevice->vk.FreeMemory( m_pDevice->device(), block.memory, nullptr );
+		block = Block_t{};
+	}
+}
+
+CVulkanMemoryAllocator::Stats_t CVulkanMemoryAllocator::stats()
+{
+	std::unique_lock lock( m_mutex );
+
+	Stats_t stats;
+	for ( const Block_t &block : m_blocks )
+	{
+		if ( block.memory == VK_NULL_HANDLE )
+			continue;
+
+		stats.uBlockCount++;
+		stats.ulBlockBytes += k_ulBlockSize;
+		stats.uSubAllocationCount += block.uAllocationCount;
+		stats.ulSubAllocatedBytes += block.ulUsed;
+
+		VkDeviceSize ulLargestFree = 0;
+		for ( uint32_t uClass = 0; uClass < k_uSizeClassCount; uClass++ )
+		{
+			if ( !block.freeRanges[ uClass ].empty() )
+				ulLargestFree = sizeClassBytes( uClass );
+		}
+		stats.ulFragmentedBytes += ( k_ulBlockSize - block.ulUsed ) - ulLargestFree;
+	}
+
+	return stats;
+}
+
+void CVulkanMemoryAllocator::noteDedicatedAllocation( VkDeviceSize ulSize, bool bFreed )
+{
+	if ( bFreed )
+	{
+		m_uDedicatedAllocationCount--;
+		m_ulDedicatedAllocationBytes -= ulSize;
+	}
+	else
+	{
+		m_uDedicatedAllocationCount++;
+		m_ulDedicatedAllocationBytes += ulSize;
+	}
+}
+
+static double BytesToMiB( VkDeviceSize ulBytes )
+{
+	return double( ulBytes ) / ( 1024.0 * 1024.0 );
+}
+
+static gamescope::ConCommand cc_vram_stats( "vram_stats", "Dump device memory heaps, their budget and what our images use. 'vram_stats trim' also releases all empty memory blocks.",
+[]( std::span<std::string_view> args )
+{
+	const VkPhysicalDeviceMemoryProperties &memoryProps = g_device.memoryProperties();
+
+	CVulkanDevice::MemoryBudget_t budget;
+	const bool bHasBudget = g_device.queryMemoryBudget( &budget );
+	for ( uint32_t i = 0; i < memoryProps.memoryHeapCount; i++ )
+	{
+		const char *pszType = ( memoryProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ) ? "device local" : "host";
+		if ( bHasBudget )
+		{
+			vk_log.infof( "heap %u (%s): %.1f MiB, usage %.1f MiB, budget %.1f MiB",
+				i, pszType, BytesToMiB( memoryProps.memoryHeaps[i].size ),
+				BytesToMiB( budget.ulHeapUsage[i] ), BytesToMiB( budget.ulHeapBudget[i] ) );
+		}
+		else
+		{
+			vk_log.infof( "heap %u (%s): %.1f MiB", i, pszType, BytesToMiB( memoryProps.memoryHeaps[i].size ) );
+		}
+	}
+	if ( !bHasBudget )
+		vk_log.infof( "VK_EXT_memory_budget is not supported, no usage or budget info." );
+
+	if ( args.size() >= 2 && args[1] == "trim" )
+		g_device.memoryAllocator().trim( true );
+
+	CVulkanMemoryAllocator &allocator = g_device.memoryAllocator();
+	CVulkanMemoryAllocator::Stats_t stats = allocator.stats();
+	vk_log.infof( "suballocated: %u images, %.1f MiB in %u blocks of %.1f MiB, %.1f MiB fragmented",
+		stats.uSubAllocationCount, BytesToMiB( stats.ulSubAllocatedBytes ),
+		stats.uBlockCount, BytesToMiB( stats.ulBlockBytes ), BytesToMiB( stats.ulFragmentedBytes ) );
+	vk_log.infof( "dedicated: %u images, %.1f MiB",
+		allocator.dedicatedAllocationCount(), BytesToMiB( allocator.dedicatedAllocationBytes() ) );
+});
+
+gamescope::ConVar<bool> cv_gpu_profiling( "gpu_profiling", false, "Time each compositor pass on the GPU, see gpu_pass_stats. Passes also show up as gpuvis markers." );
+
+void CVulkanGPUProfiler::init( CVulkanDevice *pDevice, bool bSupportsCalibratedTimestamps )
+{
+	m_pDevice = pDevice;
+
+	VkPhysicalDeviceProperties props;
+	pDevice->vk.GetPhysicalDeviceProperties( pDevice->physDev(), &props );
+	m_flTimestampPeriodNs = props.limits.timestampPeriod;
+
+	uint32_t uQueueFamilyCount = 0;
+	pDevice->vk.GetPhysicalDeviceQueueFamilyProperties( pDevice->physDev(), &uQueueFamilyCount, nullptr );
+	std::vector<VkQueueFamilyProperties> queueFamilyProperties( uQueueFamilyCount );
+	pDevice->vk.GetPhysicalDeviceQueueFamilyProperties( pDevice->physDev(), &uQueueFamilyCount, queueFamilyProperties.data() );
+	for ( const VkQueueFamilyProperties &familyProps : queueFamilyProperties )
+		m_queueFamilyTimestampBits.push_back( familyProps.timestampValidBits );
+
+	if ( bSupportsCalibratedTimestamps && pDevice->vk.GetPhysicalDeviceCalibrateableTimeDomainsEXT )
+	{
+		uint32_t uDomainCount = 0;
+		pDevice->vk.GetPhysicalDeviceCalibrateableTimeDomainsEXT( pDevice->physDev(), &uDomainCount, nullptr );
+		std::vector<VkTimeDomainEXT> domains( uDomainCount );
+		pDevice->vk.GetPhysicalDeviceCalibrateableTimeDomainsEXT( pDevice->physDev(), &uDomainCount, domains.data() );
+
+		m_bCanCalibrate =
+			std::find( domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_EXT ) != domains.end() &&
+			std::find( domains.begin(), domains.end(), VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT ) != domains.end();
+	}
+}
+
+bool CVulkanGPUProfiler::enabled() const
+{
+	return cv_gpu_profiling;
+}
+
+bool CVulkanGPUProfiler::supportsQueueFamily( uint32_t uQueueFamily ) const
+{
+	return m_flTimestampPeriodNs > 0.0f &&
+		uQueueFamily < m_queueFamilyTimestampBits.size() &&
+		m_queueFamilyTimestampBits[ uQueueFamily ] != 0;
+}
+
+VkQueryPool CVulkanGPUProfiler::createQueryPool()
+{
+	VkQueryPoolCreateInfo createInfo = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = k_uMaxPassesPerCmdBuffer * 2,
+	};
+
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	VkResult res = m_pDevice->vk.CreateQueryPool( m_pDevice->device(), &createInfo, nullptr, &queryPool );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreateQueryPool failed" );
+		return VK_NULL_HANDLE;
+	}
+
+	return queryPool;
+}
+
+bool CVulkanGPUProfiler::calibrate( uint64_t ulNow )
+{
+	if ( !m_bCanCalibrate )
+		return false;
+
+	if ( m_ulLastCalibration != 0 && ulNow - m_ulLastCalibration < k_ulCalibrationIntervalNs )
+		return true;
+
+	const VkCalibratedTimestampInfoEXT timestampInfos[2] =
+	{
+		{ .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = VK_TIME_DOMAIN_DEVICE_EXT },
+		{ .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT },
+	};
+	uint64_t ulTimestamps[2] = {};
+	uint64_t ulMaxDeviation = 0;
+	if ( m_pDevice->vk.GetCalibratedTimestampsEXT( m_pDevice->device(), 2, timestampInfos, ulTimestamps, &ulMaxDeviation ) != VK_SUCCESS )
+		return m_ulLastCalibration != 0;
+
+	m_ulCalibrationTicks = ulTimestamps[0];
+	m_ulCalibrationNs = ulTimestamps[1];
+	m_ulLastCalibration = ulNow;
+	return true;
+}
+
+void CVulkanGPUProfiler::resolve( VkQueryPool queryPool, uint32_t uQueueFamily, std::span<const char * const> passNames, bool bBackground )
+{
+	assert( passNames.size() <= k_uMaxPassesPerCmdBuffer );
+
+	std::array<uint64_t, k_uMaxPassesPerCmdBuffer * 2> ulTimestamps;
+	const uint32_t uQueryCount = uint32_t( passNames.size() ) * 2;
+	VkResult res = m_pDevice->vk.GetQueryPoolResults( m_pDevice->device(), queryPool, 0, uQueryCount,
+		uQueryCount * sizeof( uint64_t ), ulTimestamps.data(), sizeof( uint64_t ), VK_QUERY_RESULT_64_BIT );
+	// Not waited on, the submission is done by the time its command buffer gets reset.
+	if ( res != VK_SUCCESS )
+		return;
+
+	const uint32_t uValidBits = m_queueFamilyTimestampBits[ uQueueFamily ];
+	const uint64_t ulMask = uValidBits >= 64 ? ~0ull : ( 1ull << uValidBits ) - 1;
+	const uint64_t ulNow = get_time_in_nanos();
+
+	std::scoped_lock lock( m_mutex );
+
+	const bool bCalibrated = calibrate( ulNow );
+	for ( size_t i = 0; i < passNames.size(); i++ )
+	{
+		const uint64_t ulBeginTicks = ulTimestamps[ i * 2 ] & ulMask;
+		const uint64_t ulEndTicks = ulTimestamps[ i * 2 + 1 ] & ulMask;
+
+		PassTiming_t pass =
+		{
+			.pszName = passNames[i],
+			.bBackground = bBackground,
+			.ulDurationNs = uint64_t( double( ( ulEndTicks - ulBeginTicks ) & ulMask ) * m_flTimestampPeriodNs ),
+		};
+
+		if ( bCalibrated )
+		{
+			// The pass can be either side of the calibration, sign extend the difference.
+			const uint32_t uShift = 64 - uValidBits;
+			const int64_t nTicks = int64_t( ( ( ulBeginTicks - m_ulCalibrationTicks ) & ulMask ) << uShift ) >> uShift;
+			pass.ulBeginNs = uint64_t( int64_t( m_ulCalibrationNs ) + int64_t( double( nTicks ) * m_flTimestampPeriodNs ) );
+		}
+
+		recordPass( pass, ulNow );
+	}
 }
 
-void CVulkanCmdBuffer::AddDependency( std::shared_ptr<VulkanTimelineSemaphore_t> pTimelineSemaphore, uint64_t ulPoint )
+void CVulkanGPUProfiler::recordPass( const PassTiming_t &pass, uint64_t ulNow )
 {
-	m_ExternalDependencies.emplace_back( std::move( pTimelineSemaphore ), ulPoint );
-}
+	const float flDurationMs = pass.ulDurationNs / 1'000'000.0f;
 
-void CVulkanCmdBuffer::AddSignal( std::shared_ptr<VulkanTimelineSemaphore_t> pTimelineSemaphore, uint64_t ulPoint )
-{
-	m_ExternalSignals.emplace_back( std::move( pTimelineSemaphore ), ulPoint );
+	PassHistory_t &history = m_passes[ { pass.pszName, pass.bBackground } ];
+	history.pszName = pass.pszName;
+	history.flDurationsMs[ history.uNext ] = flDurationMs;
+	history.uNext = ( history.uNext + 1 ) % k_uHistoryLength;
+	history.uCount = std::min( history.uCount + 1, k_uHistoryLength );
+	history.ulTotalSamples++;
+
+	const char *pszQueue = pass.bBackground ? " (background)" : "";
+	if ( pass.ulBeginNs != 0 && pass.ulBeginNs <= ulNow )
+	{
+		gamescope::Trace::RecordSpan( pass.pszName, pass.ulBeginNs, pass.ulBeginNs + pass.ulDurationNs, 0, pass.bBackground ? "GPU (background)" : "GPU" );
+		gpuvis_trace_printf( "gpu %s%s (lduration=%lu offset=-%lu)", pass.pszName, pszQueue,
+			(unsigned long)pass.ulDurationNs, (unsigned long)( ulNow - pass.ulBeginNs ) );
+	}
+	else
+	{
+		// No idea when it ran, only for how long.
+		gpuvis_trace_printf( "gpu %s%s (lduration=-%lu)", pass.pszName, pszQueue, (unsigned long)pass.ulDurationNs );
+	}
 }
 
-void CVulkanDevice::wait(uint64_t sequence, bool reset)
+std::vector<CVulkanGPUProfiler::PassStats_t> CVulkanGPUProfiler::stats()
 {
-	if (m_submissionSeqNo == sequence)
-		m_uploadBufferOffset = 0;
+	std::scoped_lock lock( m_mutex );
 
-	VkSemaphoreWaitInfo waitInfo = {
-		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
-		.semaphoreCount = 1,
-		.pSemaphores = &m_scratchTimelineSemaphore,
-		.pValues = &sequence,
-	} ;
+	std::vector<PassStats_t> passStats;
+	for ( const auto &[key, history] : m_passes )
+	{
+		if ( history.uCount == 0 )
+			continue;
 
-	vk_check( vk.WaitSemaphores( device(), &waitInfo, ~0ull ) );
+		PassStats_t stats =
+		{
+			.pszName = history.pszName,
+			.bBackground = key.second,
+			.ulTotalSamples = history.ulTotalSamples,
+			.flLastMs = history.flDurationsMs[ ( history.uNext + k_uHistoryLength - 1 ) % k_uHistoryLength ],
+		};
 
-	if (reset)
-		resetCmdBuffers(sequence);
+		float flTotalMs = 0.0f;
+		for ( uint32_t i = 0; i < history.uCount; i++ )
+		{
+			flTotalMs += history.flDurationsMs[i];
+			stats.flMaxMs = std::max( stats.flMaxMs, history.flDurationsMs[i] );
+		}
+		stats.flAverageMs = flTotalMs / history.uCount;
+
+		passStats.push_back( stats );
+	}
+
+	return passStats;
 }
 
-void CVulkanDevice::waitIdle(bool reset)
+void CVulkanGPUProfiler::resetStats()
 {
-	wait(m_submissionSeqNo, reset);
+	std::scoped_lock lock( m_mutex );
+	m_passes.clear();
 }
 
+static gamescope::ConCommand cc_gpu_pass_stats( "gpu_pass_stats", "Dump how long each compositor pass took on the GPU over the last frames, needs gpu_profiling. 'gpu_pass_stats reset' starts over.",
+[]( std::span<std::string_view> args )
+{
+	CVulkanGPUProfiler &profiler = g_device.gpuProfiler();
+
+	if ( args.size() >= 2 && args[1] == "reset" )
+	{
+		profiler.resetStats();
+		return;
+	}
+
+	if ( !profiler.supportsQueueFamily( g_device.queueFamily() ) )
+		vk_log.infof( "Timestamps are not supported on our queue, nothing will be timed." );
+	else if ( !cv_gpu_profiling )
+		vk_log.infof( "gpu_profiling is off, run 'gpu_profiling 1' to start timing passes." );
+
+	std::vector<CVulkanGPUProfiler::PassStats_t> passStats = profiler.stats();
+	for ( const CVulkanGPUProfiler::PassStats_t &stats : passStats )
+	{
+		vk_log.infof( "%s%s: avg %.3f ms, max %.3f ms, last %.3f ms (last %u of %lu samples)",
+			stats.pszName, stats.bBackground ? " (background)" : "",
+			stats.flAverageMs, stats.flMaxMs, stats.flLastMs,
+			(uint32_t)std::min<uint64_t>( stats.ulTotalSamples, CVulkanGPUProfiler::k_uHistoryLength ), (unsigned long)stats.ulTotalSamples );
+	}
+});
+
 void CVulkanDevice::resetCmdBuffers(uint64_t sequence)
 {
-	auto last = m_pendingCmdBufs.find(sequence);
-	if (last == m_pendingCmdBufs.end())
+	auto &pendingCmdBufs = this->pendingCmdBufs(sequence);
+
+	auto last = pendingCmdBufs.find(sequence);
+	if (last == pendingCmdBufs.end())
 		return;
 
-	for (auto it = m_pendingCmdBufs.begin(); ; it++)
+	for (auto it = pendingCmdBufs.begin(); ; it++)
 	{
 		it->second->reset();
 		m_unusedCmdBufs.push_back(std::move(it->second));
@@ -1510,27 +2426,46 @@ void CVulkanDevice::resetCmdBuffers(uint64_t sequence)
 			break;
 	}
 
-	m_pendingCmdBufs.erase(m_pendingCmdBufs.begin(), ++last);
+	pendingCmdBufs.erase(pendingCmdBufs.begin(), ++last);
 }
 
 CVulkanCmdBuffer::CVulkanCmdBuffer(CVulkanDevice *parent, VkCommandBuffer cmdBuffer, VkQueue queue, uint32_t queueFamily)
-	: m_cmdBuffer(cmdBuffer), m_device(parent), m_queue(queue), m_queueFamily(queueFamily)
+	: m_cmdBuffer(cmdBuffer), m_device(parent), m_queue(queue), m_queueFamily(queueFamily), m_defaultQueue(queue)
 {
 }
 
 CVulkanCmdBuffer::~CVulkanCmdBuffer()
 {
+	if (m_queryPool != VK_NULL_HANDLE)
+		m_device->vk.DestroyQueryPool(m_device->device(), m_queryPool, nullptr);
 	m_device->vk.FreeCommandBuffers(m_device->device(), m_device->commandPool(), 1, &m_cmdBuffer);
 }
 
 void CVulkanCmdBuffer::reset()
 {
+	// Only reset once the submission has completed, so the timestamps are there.
+	if (m_uPassCount != 0)
+		m_device->gpuProfiler().resolve(m_queryPool, m_queueFamily, std::span<const char * const>(m_passNames.data(), m_uPassCount), m_bBackground);
+	m_uPassCount = 0;
+	m_bInPass = false;
+
 	vk_check( m_device->vk.ResetCommandBuffer(m_cmdBuffer, 0) );
 	m_textureRefs.clear();
 	m_textureState.clear();
 
 	m_ExternalDependencies.clear();
 	m_ExternalSignals.clear();
+	m_ulMainQueueDependency = 0;
+
+	// Never submitted, don't keep these from being recycled.
+	m_device->releaseBackgroundDescriptorSets(m_backgroundDescriptorSets);
+	setQueue(m_defaultQueue, false);
+}
+
+void CVulkanCmdBuffer::setQueue(VkQueue queue, bool background)
+{
+	m_queue = queue;
+	m_bBackground = background;
 }
 
 void CVulkanCmdBuffer::begin()
@@ -1555,7 +2490,13 @@ void CVulkanCmdBuffer::bindTexture(uint32_t slot, gamescope::Rc<CVulkanTexture>
 {
 	m_boundTextures[slot] = texture.get();
 	if (texture)
+	{
+		// Uploads from the CPU are not waited on, see vulkan_create_texture_from_bits.
+		// The main queue is ordered by submission already.
+		if (m_bBackground)
+			AddMainQueueDependency(texture->uploadSeqNo());
 		m_textureRefs.emplace_back(std::move(texture));
+	}
 }
 
 void CVulkanCmdBuffer::bindColorMgmtLuts(uint32_t slot, gamescope::Rc<CVulkanTexture> lut1d, gamescope::Rc<CVulkanTexture> lut3d)
@@ -1563,6 +2504,15 @@ void CVulkanCmdBuffer::bindColorMgmtLuts(uint32_t slot, gamescope::Rc<CVulkanTex
 	m_shaperLut[slot] = lut1d.get();
 	m_lut3D[slot] = lut3d.get();
 
+	// LUT uploads are not waited on, see vulkan_update_luts.
+	if (m_bBackground)
+	{
+		if (lut1d != nullptr)
+			AddMainQueueDependency(lut1d->uploadSeqNo());
+		if (lut3d != nullptr)
+			AddMainQueueDependency(lut3d->uploadSeqNo());
+	}
+
 	if (lut1d != nullptr)
 		m_textureRefs.emplace_back(std::move(lut1d));
 	if (lut3d != nullptr)
@@ -1608,6 +2558,8 @@ void CVulkanCmdBuffer::uploadConstants(Args&&... args)
 {
 	PushData data(std::forward<Args>(args)...);
 
+	static_assert(sizeof(data) <= CVulkanDevice::upload_buffer_uniform_range);
+
 	auto [ptr, offset] = m_device->uploadBufferData(sizeof(data));
 	m_renderBufferOffset = offset;
 	memcpy(ptr, &data, sizeof(data));
@@ -1619,6 +2571,62 @@ void CVulkanCmdBuffer::bindPipeline(VkPipeline pipeline)
 }
 
 void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
+{
+	prepareDispatch();
+
+	m_device->vk.CmdDispatch(m_cmdBuffer, x, y, z);
+
+	markDirty(m_target);
+}
+
+void CVulkanCmdBuffer::dispatchBase(uint32_t baseX, uint32_t baseY, uint32_t x, uint32_t y)
+{
+	prepareDispatch();
+
+	m_device->vk.CmdDispatchBase(m_cmdBuffer, baseX, baseY, 0, x, y, 1);
+
+	markDirty(m_target);
+}
+
+void CVulkanCmdBuffer::beginPass(const char *pszName)
+{
+	assert(!m_bInPass);
+
+	CVulkanGPUProfiler &profiler = m_device->gpuProfiler();
+	if (!profiler.enabled() || !profiler.supportsQueueFamily(m_queueFamily))
+		return;
+
+	if (m_uPassCount == CVulkanGPUProfiler::k_uMaxPassesPerCmdBuffer)
+		return;
+
+	if (m_queryPool == VK_NULL_HANDLE)
+	{
+		m_queryPool = profiler.createQueryPool();
+		if (m_queryPool == VK_NULL_HANDLE)
+			return;
+	}
+
+	if (m_uPassCount == 0)
+		m_device->vk.CmdResetQueryPool(m_cmdBuffer, m_queryPool, 0, CVulkanGPUProfiler::k_uMaxPassesPerCmdBuffer * 2);
+
+	// Bottom of pipe, so the pass starts once the work before it is done,
+	// rather than overlapping with it.
+	m_device->vk.CmdWriteTimestamp(m_cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, m_uPassCount * 2);
+	m_passNames[m_uPassCount] = pszName;
+	m_bInPass = true;
+}
+
+void CVulkanCmdBuffer::endPass()
+{
+	if (!m_bInPass)
+		return;
+
+	m_device->vk.CmdWriteTimestamp(m_cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, m_uPassCount * 2 + 1);
+	m_uPassCount++;
+	m_bInPass = false;
+}
+
+void CVulkanCmdBuffer::prepareDispatch()
 {
 	for (auto src : m_boundTextures)
 	{
@@ -1629,9 +2637,42 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 	prepareDestImage(m_target);
 	insertBarrier();
 
-	VkDescriptorSet descriptorSet = m_device->descriptorSet();
+	DescriptorSetKey_t key;
+	for (uint32_t i = 0; i < VKR_SAMPLER_SLOTS; i++)
+	{
+		key.samplers[i] = m_samplerState[i];
+		if (m_boundTextures[i] == nullptr)
+			continue;
+
+		key.textureIDs[i] = m_boundTextures[i]->textureID();
+		key.srgb[i] = m_useSrgb[i];
+	}
+	key.targetID = m_target->textureID();
+	for (uint32_t i = 0; i < VKR_LUT3D_COUNT; i++)
+	{
+		key.shaperLutIDs[i] = m_shaperLut[i] ? m_shaperLut[i]->textureID() : 0;
+		key.lut3DIDs[i] = m_lut3D[i] ? m_lut3D[i]->textureID() : 0;
+	}
+
+	bool bNeedsWrite = false;
+	uint32_t uIndex = 0;
+	std::optional<DescriptorSetKey_t> previousKey;
+	VkDescriptorSet descriptorSet = m_device->descriptorSet(key, m_bBackground, &uIndex, &bNeedsWrite, &previousKey);
+	if (m_bBackground)
+		m_backgroundDescriptorSets.push_back(uIndex);
+	if (bNeedsWrite)
+		writeDescriptorSet(descriptorSet, key, previousKey);
+
+	m_device->vk.CmdBindDescriptorSets(m_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_device->pipelineLayout(), 0, 1, &descriptorSet, 1, &m_renderBufferOffset);
+}
+
+// Only writes the bindings that differ from what the set held before.
+void CVulkanCmdBuffer::writeDescriptorSet(VkDescriptorSet descriptorSet, const DescriptorSetKey_t &key, const std::optional<DescriptorSetKey_t> &previousKey)
+{
+	static constexpr uint32_t k_uMaxWrites = 5 + 2 * VKR_SAMPLER_SLOTS;
+	std::array<VkWriteDescriptorSet, k_uMaxWrites> writeDescriptorSets;
+	uint32_t uWriteCount = 0;
 
-	std::array<VkWriteDescriptorSet, 7> writeDescriptorSets;
 	std::array<VkDescriptorImageInfo, VKR_SAMPLER_SLOTS> imageDescriptors = {};
 	std::array<VkDescriptorImageInfo, VKR_SAMPLER_SLOTS> ycbcrImageDescriptors = {};
 	std::array<VkDescriptorImageInfo, VKR_TARGET_SLOTS> targetDescriptors = {};
@@ -1639,137 +2680,137 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 	std::array<VkDescriptorImageInfo, VKR_LUT3D_COUNT> lut3DDescriptor = {};
 	VkDescriptorBufferInfo scratchDescriptor = {};
 
-	writeDescriptorSets[0] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 0,
-		.dstArrayElement = 0,
-		.descriptorCount = 1,
-		.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-		.pBufferInfo = &scratchDescriptor,
-	};
-
-	writeDescriptorSets[1] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 1,
-		.dstArrayElement = 0,
-		.descriptorCount = 1,
-		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-		.pImageInfo = &targetDescriptors[0],
-	};
-
-	writeDescriptorSets[2] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 2,
-		.dstArrayElement = 0,
-		.descriptorCount = 1,
-		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-		.pImageInfo = &targetDescriptors[1],
-	};
-
-	writeDescriptorSets[3] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 3,
-		.dstArrayElement = 0,
-		.descriptorCount = imageDescriptors.size(),
-		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-		.pImageInfo = imageDescriptors.data(),
-	};
+	if (!previousKey)
+	{
+		// The offset into this is dynamic, so this never changes.
+		scratchDescriptor.buffer = m_device->m_uploadBuffer;
+		scratchDescriptor.offset = 0;
+		scratchDescriptor.range = CVulkanDevice::upload_buffer_uniform_range;
 
-	writeDescriptorSets[4] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 4,
-		.dstArrayElement = 0,
-		.descriptorCount = ycbcrImageDescriptors.size(),
-		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-		.pImageInfo = ycbcrImageDescriptors.data(),
-	};
+		writeDescriptorSets[uWriteCount++] = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptorSet,
+			.dstBinding = 0,
+			.dstArrayElement = 0,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+			.pBufferInfo = &scratchDescriptor,
+		};
+	}
 
-	writeDescriptorSets[5] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 5,
-		.dstArrayElement = 0,
-		.descriptorCount = shaperLutDescriptor.size(),
-		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-		.pImageInfo = shaperLutDescriptor.data(),
-	};
+	if (!previousKey || previousKey->targetID != key.targetID)
+	{
+		if (!m_target->isYcbcr())
+		{
+			targetDescriptors[0].imageView = m_target->srgbView();
+			targetDescriptors[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		}
+		else
+		{
+			targetDescriptors[0].imageView = m_target->lumaView();
+			targetDescriptors[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-	writeDescriptorSets[6] = {
-		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-		.dstSet = descriptorSet,
-		.dstBinding = 6,
-		.dstArrayElement = 0,
-		.descriptorCount = lut3DDescriptor.size(),
-		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-		.pImageInfo = lut3DDescriptor.data(),
-	};
+			targetDescriptors[1].imageView = m_target->chromaView();
+			targetDescriptors[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		}
 
-	scratchDescriptor.buffer = m_device->m_uploadBuffer;
-	scratchDescriptor.offset = m_renderBufferOffset;
-	scratchDescriptor.range = VK_WHOLE_SIZE;
+		for (uint32_t i = 0; i < VKR_TARGET_SLOTS; i++)
+		{
+			writeDescriptorSets[uWriteCount++] = {
+				.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+				.dstSet = descriptorSet,
+				.dstBinding = 1 + i,
+				.dstArrayElement = 0,
+				.descriptorCount = 1,
+				.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+				.pImageInfo = &targetDescriptors[i],
+			};
+		}
+	}
 
 	for (uint32_t i = 0; i < VKR_SAMPLER_SLOTS; i++)
 	{
+		if (previousKey && previousKey->SameSlot(key, i))
+			continue;
+
 		imageDescriptors[i].sampler = m_device->sampler(m_samplerState[i]);
 		imageDescriptors[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 		ycbcrImageDescriptors[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-		if (m_boundTextures[i] == nullptr)
-			continue;
-
-		VkImageView view = m_useSrgb[i] ? m_boundTextures[i]->srgbView() : m_boundTextures[i]->linearView();
-
-		if (m_boundTextures[i]->format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM)
-			ycbcrImageDescriptors[i].imageView = view;
-		else
-			imageDescriptors[i].imageView = view;
-	}
+		if (m_boundTextures[i] != nullptr)
+		{
+			VkImageView view = m_useSrgb[i] ? m_boundTextures[i]->srgbView() : m_boundTextures[i]->linearView();
 
-	for (uint32_t i = 0; i < VKR_LUT3D_COUNT; i++)
-	{
-		SamplerState linearState;
-		linearState.bNearest = false;
-		linearState.bUnnormalized = false;
-		SamplerState nearestState; // TODO(Josh): Probably want to do this when I bring in tetrahedral interpolation.
-		nearestState.bNearest = true;
-		nearestState.bUnnormalized = false;
+			if (m_boundTextures[i]->format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM)
+				ycbcrImageDescriptors[i].imageView = view;
+			else
+				imageDescriptors[i].imageView = view;
+		}
 
-		shaperLutDescriptor[i].sampler = m_device->sampler(linearState);
-		shaperLutDescriptor[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		// TODO(Josh): I hate the fact that srgbView = view *as* raw srgb and treat as linear.
-		// I need to change this, it's so utterly stupid and confusing.
-		shaperLutDescriptor[i].imageView = m_shaperLut[i] ? m_shaperLut[i]->srgbView() : VK_NULL_HANDLE;
+		writeDescriptorSets[uWriteCount++] = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptorSet,
+			.dstBinding = 3,
+			.dstArrayElement = i,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.pImageInfo = &imageDescriptors[i],
+		};
 
-		lut3DDescriptor[i].sampler = m_device->sampler(nearestState);
-		lut3DDescriptor[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		lut3DDescriptor[i].imageView = m_lut3D[i] ? m_lut3D[i]->srgbView() : VK_NULL_HANDLE;
+		writeDescriptorSets[uWriteCount++] = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptorSet,
+			.dstBinding = 4,
+			.dstArrayElement = i,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.pImageInfo = &ycbcrImageDescriptors[i],
+		};
 	}
 
-	if (!m_target->isYcbcr())
+	if (!previousKey || previousKey->shaperLutIDs != key.shaperLutIDs || previousKey->lut3DIDs != key.lut3DIDs)
 	{
-		targetDescriptors[0].imageView = m_target->srgbView();
-		targetDescriptors[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-	}
-	else
-	{
-		targetDescriptors[0].imageView = m_target->lumaView();
-		targetDescriptors[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-
-		targetDescriptors[1].imageView = m_target->chromaView();
-		targetDescriptors[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-	}
-
-	m_device->vk.UpdateDescriptorSets(m_device->device(), writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
+		for (uint32_t i = 0; i < VKR_LUT3D_COUNT; i++)
+		{
+			SamplerState linearState;
+			linearState.bNearest = false;
+			linearState.bUnnormalized = false;
+			SamplerState nearestState; // TODO(Josh): Probably want to do this when I bring in tetrahedral interpolation.
+			nearestState.bNearest = true;
+			nearestState.bUnnormalized = false;
+
+			shaperLutDescriptor[i].sampler = m_device->sampler(linearState);
+			shaperLutDescriptor[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			// TODO(Josh): I hate the fact that srgbView = view *as* raw srgb and treat as linear.
+			// I need to change this, it's so utterly stupid and confusing.
+			shaperLutDescriptor[i].imageView = m_shaperLut[i] ? m_shaperLut[i]->srgbView() : VK_NULL_HANDLE;
+
+			lut3DDescriptor[i].sampler = m_device->sampler(nearestState);
+			lut3DDescriptor[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			lut3DDescriptor[i].imageView = m_lut3D[i] ? m_lut3D[i]->srgbView() : VK_NULL_HANDLE;
+		}
 
-	m_device->vk.CmdBindDescriptorSets(m_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_device->pipelineLayout(), 0, 1, &descriptorSet, 0, nullptr);
+		writeDescriptorSets[uWriteCount++] = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptorSet,
+			.dstBinding = 5,
+			.dstArrayElement = 0,
+			.descriptorCount = shaperLutDescriptor.size(),
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.pImageInfo = shaperLutDescriptor.data(),
+		};
 
-	m_device->vk.CmdDispatch(m_cmdBuffer, x, y, z);
+		writeDescriptorSets[uWriteCount++] = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptorSet,
+			.dstBinding = 6,
+			.dstArrayElement = 0,
+			.descriptorCount = lut3DDescriptor.size(),
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.pImageInfo = lut3DDescriptor.data(),
+		};
+	}
 
-	markDirty(m_target);
+	m_device->vk.UpdateDescriptorSets(m_device->device(), uWriteCount, writeDescriptorSets.data(), 0, nullptr);
 }
 
 void CVulkanCmdBuffer::copyImage(gamescope::Rc<CVulkanTexture> src, gamescope::Rc<CVulkanTexture> dst)
@@ -1828,6 +2869,18 @@ void CVulkanCmdBuffer::copyBufferToImage(VkBuffer buffer, VkDeviceSize offset, u
 	m_textureRefs.emplace_back(std::move(dst));
 }
 
+void CVulkanCmdBuffer::copyBufferRegionsToImage(VkBuffer buffer, std::span<const VkBufferImageCopy> regions, gamescope::Rc<CVulkanTexture> dst)
+{
+	preserveImage(dst.get());
+	insertBarrier();
+
+	m_device->vk.CmdCopyBufferToImage(m_cmdBuffer, buffer, dst->vkImage(), VK_IMAGE_LAYOUT_GENERAL, uint32_t(regions.size()), regions.data());
+
+	markDirty(dst.get());
+
+	m_textureRefs.emplace_back(std::move(dst));
+}
+
 void CVulkanCmdBuffer::prepareSrcImage(CVulkanTexture *image)
 {
 	auto result = m_textureState.emplace(image, TextureState());
@@ -1859,6 +2912,16 @@ void CVulkanCmdBuffer::discardImage(CVulkanTexture *image)
 	result.first->second.discarded = true;
 }
 
+void CVulkanCmdBuffer::preserveImage(CVulkanTexture *image)
+{
+	auto result = m_textureState.emplace(image, TextureState());
+	if (!result.second)
+		return;
+	result.first->second.needsImport = image->externalImage();
+	result.first->second.needsExport = image->externalImage();
+	result.first->second.needsPresentLayout = image->outputImage();
+}
+
 void CVulkanCmdBuffer::markDirty(CVulkanTexture *image)
 {
 	auto result = m_textureState.find(image);
@@ -1869,7 +2932,9 @@ void CVulkanCmdBuffer::markDirty(CVulkanTexture *image)
 
 void CVulkanCmdBuffer::insertBarrier(bool flush)
 {
-	std::vector<VkImageMemoryBarrier> barriers;
+	// Once per dispatch, keep it off the heap.
+	gamescope::FrameVector<VkImageMemoryBarrier> barriers;
+	barriers.reserve(m_textureState.size());
 
 	uint32_t externalQueue = m_device->supportsModifiers() ? VK_QUEUE_FAMILY_FOREIGN_EXT : VK_QUEUE_FAMILY_EXTERNAL_KHR;
 
@@ -1992,6 +3057,28 @@ static VkResult getModifierProps( const VkImageCreateInfo *imageInfo, uint64_t m
 	return g_device.vk.GetPhysicalDeviceImageFormatProperties2(g_device.physDev(), &imageFormatInfo, &imageProps);
 }
 
+static VkImageUsageFlags ImageUsageForCreateFlags( const CVulkanTexture::createFlags &flags )
+{
+	VkImageUsageFlags usage = 0;
+
+	if ( flags.bSampled == true )
+		usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+
+	if ( flags.bStorage == true )
+		usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+
+	if ( flags.bColorAttachment == true )
+		usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+
+	if ( flags.bTransferSrc == true )
+		usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+	if ( flags.bTransferDst == true )
+		usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+	return usage;
+}
+
 static VkImageViewType VulkanImageTypeToViewType(VkImageType type)
 {
 	switch (type)
@@ -2010,39 +3097,14 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 	VkResult res = VK_ERROR_INITIALIZATION_FAILED;
 
 	VkImageTiling tiling = (flags.bMappable || flags.bLinear) ? VK_IMAGE_TILING_LINEAR : VK_IMAGE_TILING_OPTIMAL;
-	VkImageUsageFlags usage = 0;
+	VkImageUsageFlags usage = ImageUsageForCreateFlags( flags );
 	VkMemoryPropertyFlags properties;
 
-	if ( flags.bSampled == true )
-	{
-		usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
-	}
-
-	if ( flags.bStorage == true )
-	{
-		usage |= VK_IMAGE_USAGE_STORAGE_BIT;
-	}
-
-	if ( flags.bColorAttachment == true )
-	{
-		usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-	}
-
 	if ( flags.bFlippable == true )
 	{
 		flags.bExportable = true;
 	}
 
-	if ( flags.bTransferSrc == true )
-	{
-		usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-	}
-
-	if ( flags.bTransferDst == true )
-	{
-		usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-	}
-
 	if ( flags.bMappable == true )
 	{
 		properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
@@ -2141,8 +3203,9 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 	}
 
 	std::vector<uint64_t> modifiers = {};
+	const bool bExplicitExportModifiers = flags.bExportable && !flags.bFlippable && !flags.exportModifiers.empty() && g_device.supportsModifiers() && !pDMA;
 	// TODO(JoshA): Move this code to backend for making flippable image.
-	if ( GetBackend()->UsesModifiers() && flags.bFlippable && g_device.supportsModifiers() && !pDMA )
+	if ( ( GetBackend()->UsesModifiers() && flags.bFlippable && g_device.supportsModifiers() && !pDMA ) || bExplicitExportModifiers )
 	{
 		assert( drmFormat != DRM_FORMAT_INVALID );
 
@@ -2150,7 +3213,12 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 
 		const uint64_t *possibleModifiers;
 		size_t numPossibleModifiers;
-		if ( flags.bLinear )
+		if ( bExplicitExportModifiers )
+		{
+			possibleModifiers = flags.exportModifiers.data();
+			numPossibleModifiers = flags.exportModifiers.size();
+		}
+		else if ( flags.bLinear )
 		{
 			possibleModifiers = &linear;
 			numPossibleModifiers = 1;
@@ -2184,6 +3252,12 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 			modifiers.push_back( modifier );
 		}
 
+		if ( bExplicitExportModifiers && modifiers.empty() )
+		{
+			vk_log.errorf( "none of the %zu requested modifiers can export DRM format 0x%" PRIX32, numPossibleModifiers, drmFormat );
+			return false;
+		}
+
 		assert( modifiers.size() > 0 );
 
 		modifierListInfo = {
@@ -2244,8 +3318,19 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 		return false;
 	}
 	
-	VkMemoryRequirements memRequirements;
-	g_device.vk.GetImageMemoryRequirements(g_device.device(), m_vkImage, &memRequirements);
+	VkMemoryDedicatedRequirements dedicatedRequirements = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS,
+	};
+	VkMemoryRequirements2 memRequirements2 = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedicatedRequirements,
+	};
+	const VkImageMemoryRequirementsInfo2 memRequirementsInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+		.image = m_vkImage,
+	};
+	g_device.vk.GetImageMemoryRequirements2(g_device.device(), &memRequirementsInfo, &memRequirements2);
+	const VkMemoryRequirements &memRequirements = memRequirements2.memoryRequirements;
 
 	VkMemoryAllocateInfo allocInfo = {
 		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
@@ -2256,8 +3341,22 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 	m_size = allocInfo.allocationSize;
 
 	VkDeviceMemory memoryHandle = VK_NULL_HANDLE;
+	VkDeviceSize ulMemoryOffset = 0;
+
+	// Images nobody outside of us ever sees can share memory blocks.
+	const bool bSubAllocate = cv_vulkan_suballocate_images &&
+		pExistingImageToReuseMemory == nullptr && pDMA == nullptr &&
+		!flags.bExportable && !flags.bFlippable && !flags.bMappable &&
+		!dedicatedRequirements.requiresDedicatedAllocation;
+	if ( bSubAllocate )
+		m_oSubAllocation = g_device.memoryAllocator().allocate( memRequirements, allocInfo.memoryTypeIndex );
 
-	if ( pExistingImageToReuseMemory == nullptr )
+	if ( m_oSubAllocation )
+	{
+		memoryHandle = m_oSubAllocation->memory;
+		ulMemoryOffset = m_oSubAllocation->ulOffset;
+	}
+	else if ( pExistingImageToReuseMemory == nullptr )
 	{
 		// Possible pNexts
 		VkImportMemoryFdInfoKHR importMemoryInfo = {};
@@ -2323,17 +3422,26 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t depth, uin
 		}
 
 		m_vkImageMemory = memoryHandle;
+		g_device.memoryAllocator().noteDedicatedAllocation( m_size, false );
 	}
 	else
 	{
 		vk_log.infof("%d vs %d!", (int)pExistingImageToReuseMemory->m_size, (int)m_size);
 		assert(pExistingImageToReuseMemory->m_size >= m_size);
 
-		memoryHandle = pExistingImageToReuseMemory->m_vkImageMemory;
+		if ( pExistingImageToReuseMemory->m_oSubAllocation )
+		{
+			memoryHandle = pExistingImageToReuseMemory->m_oSubAllocation->memory;
+			ulMemoryOffset = pExistingImageToReuseMemory->m_oSubAllocation->ulOffset;
+		}
+		else
+		{
+			memoryHandle = pExistingImageToReuseMemory->m_vkImageMemory;
+		}
 		m_vkImageMemory = VK_NULL_HANDLE;
 	}
 	
-	res = g_device.vk.BindImageMemory( g_device.device(), m_vkImage, memoryHandle, 0 );
+	res = g_device.vk.BindImageMemory( g_device.device(), m_vkImage, memoryHandle, ulMemoryOffset );
 	if ( res != VK_SUCCESS )
 	{
 		vk_errorf( res, "vkBindImageMemory failed" );
@@ -2655,7 +3763,10 @@ bool CVulkanTexture::IsInUse()
 	return GetRefCount() != 0;
 }
 
+static std::atomic<uint64_t> s_ulNextTextureID = { 1 };
+
 CVulkanTexture::CVulkanTexture( void )
+	: m_ulTextureID( s_ulNextTextureID++ )
 {
 }
 
@@ -2684,6 +3795,18 @@ CVulkanTexture::~CVulkanTexture( void )
 	if ( m_pBackendFb != nullptr )
 		m_pBackendFb = nullptr;
 
+	if ( m_oSubAllocation )
+	{
+		if ( m_vkImage != VK_NULL_HANDLE )
+		{
+			g_device.vk.DestroyImage( g_device.device(), m_vkImage, nullptr );
+			m_vkImage = VK_NULL_HANDLE;
+		}
+
+		g_device.memoryAllocator().free( *m_oSubAllocation );
+		m_oSubAllocation = std::nullopt;
+	}
+
 	if ( m_vkImageMemory != VK_NULL_HANDLE )
 	{
 		if ( m_vkImage != VK_NULL_HANDLE )
@@ -2693,6 +3816,7 @@ CVulkanTexture::~CVulkanTexture( void )
 		}
 
 		g_device.vk.FreeMemory( g_device.device(), m_vkImageMemory, nullptr );
+		g_device.memoryAllocator().noteDedicatedAllocation( m_size, true );
 		m_vkImageMemory = VK_NULL_HANDLE;
 	}
 
@@ -3036,11 +4160,23 @@ gamescope::Rc<CVulkanTexture> vulkan_create_1d_lut(uint32_t size)
 	return texture;
 }
 
+bool vulkan_supports_color_lut3d_compute()
+{
+	static const bool s_bSupported = []()
+	{
+		VkFormatProperties props = {};
+		g_device.vk.GetPhysicalDeviceFormatProperties(g_device.physDev(), VK_FORMAT_R16G16B16A16_UNORM, &props);
+		return (props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) != 0;
+	}();
+	return s_bSupported;
+}
+
 gamescope::Rc<CVulkanTexture> vulkan_create_3d_lut(uint32_t width, uint32_t height, uint32_t depth)
 {
 	CVulkanTexture::createFlags flags;
 	flags.bSampled = true;
 	flags.bTransferDst = true;
+	flags.bStorage = vulkan_supports_color_lut3d_compute();
 	flags.imageType = VK_IMAGE_TYPE_3D;
 
 	auto texture = new CVulkanTexture();
@@ -3056,18 +4192,94 @@ void vulkan_update_luts(const gamescope::Rc<CVulkanTexture>& lut1d, const gamesc
 	size_t lut1d_size = lut1d->width() * sizeof(uint16_t) * 4;
 	size_t lut3d_size = lut3d->width() * lut3d->height() * lut3d->depth() * sizeof(uint16_t) * 4;
 
-	auto [base_dst, base_offset] = g_device.uploadBufferData(lut1d_size + lut3d_size);
+	// The staging ring rather than the upload buffer, which gets recycled
+	// by the next wait() regardless of whether this copy ran yet.
+	std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData(lut1d_size + lut3d_size);
+	if (!oStaging)
+		return;
 
-	void* lut1d_dst = base_dst;
-	void *lut3d_dst = ((uint8_t*)base_dst) + lut1d_size;
+	void* lut1d_dst = oStaging->pData;
+	void *lut3d_dst = oStaging->pData + lut1d_size;
 	memcpy(lut1d_dst, lut1d_data, lut1d_size);
 	memcpy(lut3d_dst, lut3d_data, lut3d_size);
 
 	auto cmdBuffer = g_device.commandBuffer();
-	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), base_offset, 0, lut1d);
-	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), base_offset + lut1d_size, 0, lut3d);
-	g_device.submit(std::move(cmdBuffer));
-	g_device.waitIdle(); // TODO: Sync this better
+	cmdBuffer->copyBufferToImage(oStaging->buffer, oStaging->ulOffset, 0, lut1d);
+	cmdBuffer->copyBufferToImage(oStaging->buffer, oStaging->ulOffset + lut1d_size, 0, lut3d);
+	uint64_t ulSeqNo = g_device.submit(std::move(cmdBuffer));
+	g_device.retireStagingData(ulSeqNo);
+
+	// Composites on the main queue are ordered after this by submission,
+	// background ones wait on it when binding the LUTs.
+	lut1d->setUploadSeqNo(ulSeqNo);
+	lut3d->setUploadSeqNo(ulSeqNo);
+}
+
+gamescope::Rc<CVulkanTexture> vulkan_create_look_lut(const lut3d_t &look)
+{
+	assert(look.lutEdgeSize > 0);
+
+	size_t look_size = look.data.size() * sizeof(uint16_t) * 4;
+	std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData(look_size);
+	if (!oStaging)
+		return nullptr;
+
+	uint16_t *look_dst = reinterpret_cast<uint16_t *>(oStaging->pData);
+	for (size_t i = 0; i < look.data.size(); i++)
+	{
+		look_dst[4*i+0] = quantize_lut_value_16bit(look.data[i].r);
+		look_dst[4*i+1] = quantize_lut_value_16bit(look.data[i].g);
+		look_dst[4*i+2] = quantize_lut_value_16bit(look.data[i].b);
+		look_dst[4*i+3] = 0;
+	}
+
+	gamescope::Rc<CVulkanTexture> texture = vulkan_create_3d_lut(look.lutEdgeSize, look.lutEdgeSize, look.lutEdgeSize);
+
+	auto cmdBuffer = g_device.commandBuffer();
+	cmdBuffer->copyBufferToImage(oStaging->buffer, oStaging->ulOffset, 0, texture);
+	uint64_t ulSeqNo = g_device.submit(std::move(cmdBuffer));
+	g_device.retireStagingData(ulSeqNo);
+	texture->setUploadSeqNo(ulSeqNo);
+
+	return texture;
+}
+
+static_assert(k_nColorLut3DComputeEdgeSize == VKR_LUT3D_EDGE_SIZE);
+static_assert(rendervulkan::s_nLutEdgeSize3d == VKR_LUT3D_EDGE_SIZE);
+static_assert(sizeof(colorlut3d_compute_params_t) == 87 * sizeof(float), "Must match the scalar layout in cs_color_lut3d.comp");
+
+void vulkan_update_luts_compute(const gamescope::Rc<CVulkanTexture>& lut1d, const gamescope::Rc<CVulkanTexture>& lut3d, void* lut1d_data, const colorlut3d_compute_params_t &params, const gamescope::Rc<CVulkanTexture>& look)
+{
+	assert(lut3d->width() == VKR_LUT3D_EDGE_SIZE);
+
+	size_t lut1d_size = lut1d->width() * sizeof(uint16_t) * 4;
+	std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData(lut1d_size);
+	if (!oStaging)
+		return;
+	memcpy(oStaging->pData, lut1d_data, lut1d_size);
+
+	auto cmdBuffer = g_device.commandBuffer();
+	cmdBuffer->copyBufferToImage(oStaging->buffer, oStaging->ulOffset, 0, lut1d);
+
+	// The look goes where the shader expects it, the other slots
+	// are unused by it.
+	for (uint32_t i = 0; i < EOTF_Count; i++)
+		cmdBuffer->bindColorMgmtLuts(i, nullptr, i == 0 ? look : gamescope::Rc<CVulkanTexture>{});
+	cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_COLOR_LUT3D));
+	cmdBuffer->bindTarget(lut3d);
+	cmdBuffer->uploadConstants<colorlut3d_compute_params_t>(params);
+
+	const uint32_t uWorkgroupSize = 4;
+	const uint32_t uDispatchSize = div_roundup(VKR_LUT3D_EDGE_SIZE, uWorkgroupSize);
+	cmdBuffer->beginPass("color_lut3d");
+	cmdBuffer->dispatch(uDispatchSize, uDispatchSize, uDispatchSize);
+	cmdBuffer->endPass();
+
+	uint64_t ulSeqNo = g_device.submit(std::move(cmdBuffer));
+	g_device.retireStagingData(ulSeqNo);
+
+	lut1d->setUploadSeqNo(ulSeqNo);
+	lut3d->setUploadSeqNo(ulSeqNo);
 }
 
 gamescope::Rc<CVulkanTexture> vulkan_get_hacky_blank_texture()
@@ -3256,6 +4468,8 @@ bool vulkan_remake_swapchain( void )
 	return bRet;
 }
 
+static void invalidate_output_image_contents();
+
 static bool vulkan_make_output_images( VulkanOutput_t *pOutput )
 {
 	CVulkanTexture::createFlags outputImageflags;
@@ -3265,6 +4479,8 @@ static bool vulkan_make_output_images( VulkanOutput_t *pOutput )
 	outputImageflags.bSampled = true; // for pipewire blits
 	outputImageflags.bOutputImage = true;
 
+	invalidate_output_image_contents();
+
 	pOutput->outputImages.resize(3); // extra image for partial composition.
 	pOutput->outputImagesPartialOverlay.resize(3);
 
@@ -3432,27 +4648,30 @@ bool vulkan_make_output()
 	return true;
 }
 
-static void update_tmp_images( uint32_t width, uint32_t height )
+static gamescope::OwningRc<CVulkanTexture> &update_tmp_images( uint32_t width, uint32_t height, bool bBackground )
 {
-	if ( g_output.tmpOutput != nullptr
-			&& width == g_output.tmpOutput->width()
-			&& height == g_output.tmpOutput->height() )
+	gamescope::OwningRc<CVulkanTexture> &tmpOutput = bBackground ? g_output.tmpBackgroundOutput : g_output.tmpOutput;
+
+	if ( tmpOutput != nullptr
+			&& width == tmpOutput->width()
+			&& height == tmpOutput->height() )
 	{
-		return;
+		return tmpOutput;
 	}
 
 	CVulkanTexture::createFlags createFlags;
 	createFlags.bSampled = true;
 	createFlags.bStorage = true;
 
-	g_output.tmpOutput = new CVulkanTexture();
-	bool bSuccess = g_output.tmpOutput->BInit( width, height, 1u, DRM_FORMAT_ARGB8888, createFlags, nullptr );
+	tmpOutput = new CVulkanTexture();
+	bool bSuccess = tmpOutput->BInit( width, height, 1u, DRM_FORMAT_ARGB8888, createFlags, nullptr );
 
 	if ( !bSuccess )
 	{
 		vk_log.errorf( "failed to create fsr output" );
-		return;
 	}
+
+	return tmpOutput;
 }
 
 
@@ -3572,16 +4791,21 @@ gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_bits( uint32_t wi
 		return nullptr;
 
 	size_t size = width * height * DRMFormatGetBPP(drmFormat);
-	auto [ dst, offset ] = g_device.uploadBufferData(size);
-	memcpy( dst, bits, size );
+	std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData(size);
+	if ( !oStaging )
+		return nullptr;
+
+	memcpy( oStaging->pData, bits, size );
 
 	auto cmdBuffer = g_device.commandBuffer();
 
-	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), offset, 0, pTex.get());
-	// TODO: Sync this copyBufferToImage.
+	cmdBuffer->copyBufferToImage(oStaging->buffer, oStaging->ulOffset, 0, pTex.get());
 
-	g_device.submit(std::move(cmdBuffer));
-	g_device.waitIdle();
+	// Don't idle the GPU for this (eg. cursor changes mid-game), command buffers
+	// binding the texture pick up the upload point, see CVulkanCmdBuffer::bindTexture.
+	uint64_t ulSeqNo = g_device.submit(std::move(cmdBuffer));
+	g_device.retireStagingData(ulSeqNo);
+	pTex->setUploadSeqNo(ulSeqNo);
 
 	return pTex;
 }
@@ -3593,6 +4817,41 @@ void vulkan_garbage_collect( void )
 	g_device.garbageCollect();
 }
 
+void vulkan_shrink_caches( void )
+{
+	for (auto& pScreenshotImage : g_output.pScreenshotImages)
+	{
+		if (pScreenshotImage != nullptr && pScreenshotImage->GetRefCount() == 0)
+			pScreenshotImage = nullptr;
+	}
+
+	g_device.memoryAllocator().trim( true );
+}
+
+void vulkan_get_device_local_memory( uint64_t *pulSize, uint64_t *pulUsage, uint64_t *pulBudget )
+{
+	*pulSize = 0;
+	*pulUsage = 0;
+	*pulBudget = 0;
+
+	CVulkanDevice::MemoryBudget_t budget;
+	const bool bHasBudget = g_device.queryMemoryBudget( &budget );
+
+	const VkPhysicalDeviceMemoryProperties &memoryProps = g_device.memoryProperties();
+	for ( uint32_t i = 0; i < memoryProps.memoryHeapCount; i++ )
+	{
+		if ( !( memoryProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ) )
+			continue;
+
+		*pulSize += memoryProps.memoryHeaps[i].size;
+		if ( bHasBudget )
+		{
+			*pulUsage += budget.ulHeapUsage[i];
+			*pulBudget += budget.ulHeapBudget[i];
+		}
+	}
+}
+
 gamescope::Rc<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width, uint32_t height, bool exportable, uint32_t drmFormat, EStreamColorspace colorspace)
 {
 	for (auto& pScreenshotImage : g_output.pScreenshotImages)
@@ -3898,7 +5157,9 @@ std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo,
 
 	const int pixelsPerGroup = 8;
 
+	cmdBuffer->beginPass("screenshot");
 	cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+	cmdBuffer->endPass();
 
 	if ( pYUVOutTexture != nullptr )
 	{
@@ -3928,7 +5189,9 @@ std::optional<uint64_t> vulkan_screenshot( const struct FrameInfo_t *frameInfo,
 		// For ycbcr, we operate on 2 pixels at a time, so use the half-extent.
 		const int dispatchSize = pixelsPerGroup * 2;
 
+		cmdBuffer->beginPass("screenshot_rgb_to_nv12");
 		cmdBuffer->dispatch(div_roundup(pYUVOutTexture->width(), dispatchSize), div_roundup(pYUVOutTexture->height(), dispatchSize));
+		cmdBuffer->endPass();
 	}
 
 	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
@@ -3940,6 +5203,194 @@ extern uint32_t g_reshade_technique_idx;
 
 ReshadeEffectPipeline *g_pLastReshadeEffect = nullptr;
 
+gamescope::ConVar<bool> cv_composite_incremental( "composite_incremental", true, "Only recomposite the parts of our output images that changed since they were last composited to." );
+gamescope::ConVar<float> cv_composite_incremental_max_area( "composite_incremental_max_area", 0.75f, "Fraction of the output past which an incremental composite is done as a full one instead." );
+
+// What one of our output images was last composited with, so we can tell
+// which parts of it are still up to date when it comes around again.
+struct OutputImageContents_t
+{
+	struct Layer_t
+	{
+		gamescope::Rc<CVulkanTexture> tex;
+		uint64_t ulCommitID = 0;
+		uint32_t uTexWidth = 0;
+		uint32_t uTexHeight = 0;
+		vec2_t offset{};
+		vec2_t scale{};
+		float opacity = 0.0f;
+		GamescopeUpscaleFilter filter = GamescopeUpscaleFilter::LINEAR;
+		AlphaBlendingMode_t eAlphaBlendingMode = ALPHA_BLENDING_MODE_PREMULTIPLIED;
+		bool blackBorder = false;
+		gamescope::BackendBlob *pCtm = nullptr;
+		GamescopeAppTextureColorspace colorspace = GAMESCOPE_APP_TEXTURE_COLORSPACE_LINEAR;
+
+		bool SameGeometry( const Layer_t &other ) const
+		{
+			return uTexWidth == other.uTexWidth &&
+			       uTexHeight == other.uTexHeight &&
+			       offset.x == other.offset.x &&
+			       offset.y == other.offset.y &&
+			       scale.x == other.scale.x &&
+			       scale.y == other.scale.y &&
+			       opacity == other.opacity &&
+			       filter == other.filter &&
+			       eAlphaBlendingMode == other.eAlphaBlendingMode &&
+			       blackBorder == other.blackBorder &&
+			       pCtm == other.pCtm &&
+			       colorspace == other.colorspace;
+		}
+
+		// Texture space -> output space, see sampleLayerEx.
+		gamescope::DamageRegion::Rect_t ToOutput( const gamescope::DamageRegion::Rect_t &rect ) const
+		{
+			// Pad a bit for filtering.
+			const int32_t nPad = 2;
+			return gamescope::DamageRegion::Rect_t
+			{
+				.nX1 = int32_t( floorf( rect.nX1 / scale.x - offset.x ) ) - nPad,
+				.nY1 = int32_t( floorf( rect.nY1 / scale.y - offset.y ) ) - nPad,
+				.nX2 = int32_t( ceilf( rect.nX2 / scale.x - offset.x ) ) + nPad,
+				.nY2 = int32_t( ceilf( rect.nY2 / scale.y - offset.y ) ) + nPad,
+			};
+		}
+
+		gamescope::DamageRegion::Rect_t OutputRect() const
+		{
+			return ToOutput( gamescope::DamageRegion::Rect_t{ 0, 0, int32_t( uTexWidth ), int32_t( uTexHeight ) } );
+		}
+	};
+
+	bool bValid = false;
+	bool bPartial = false;
+	int layerCount = 0;
+	EOTF outputTF = EOTF_Count;
+	uint32_t uColorMgmtSerial = 0;
+	uint32_t uBorderMask = 0;
+	float flLinearToNits = 0.0f;
+	float flItmSdrNits = 0.0f;
+	float flItmTargetNits = 0.0f;
+	std::array<gamescope::Rc<CVulkanTexture>, EOTF_Count> shaperLuts;
+	std::array<gamescope::Rc<CVulkanTexture>, EOTF_Count> lut3Ds;
+	std::array<Layer_t, k_nMaxLayers> layers;
+
+	// What changed relative to the image composited right before this one.
+	gamescope::DamageRegion damageSincePrevious;
+
+	bool SameGlobalState( const OutputImageContents_t &other ) const
+	{
+		return bPartial == other.bPartial &&
+		       layerCount == other.layerCount &&
+		       outputTF == other.outputTF &&
+		       uColorMgmtSerial == other.uColorMgmtSerial &&
+		       uBorderMask == other.uBorderMask &&
+		       flLinearToNits == other.flLinearToNits &&
+		       flItmSdrNits == other.flItmSdrNits &&
+		       flItmTargetNits == other.flItmTargetNits &&
+		       shaperLuts == other.shaperLuts &&
+		       lut3Ds == other.lut3Ds;
+	}
+};
+
+// Indexed like g_output.outputImages. The partial overlay images alias
+// the same memory, so they share an entry.
+static std::array<OutputImageContents_t, 3> s_OutputImageContents;
+static std::optional<uint32_t> s_oLastCompositedImage;
+
+static void invalidate_output_image_contents()
+{
+	for ( OutputImageContents_t &contents : s_OutputImageContents )
+		contents = OutputImageContents_t{};
+	s_oLastCompositedImage = std::nullopt;
+}
+
+static OutputImageContents_t capture_output_image_contents( const struct FrameInfo_t *frameInfo, EOTF outputTF, bool partial )
+{
+	OutputImageContents_t contents;
+	contents.bValid = true;
+	contents.bPartial = partial;
+	contents.layerCount = frameInfo->layerCount;
+	contents.outputTF = outputTF;
+	contents.uColorMgmtSerial = g_ColorMgmt.serial;
+	contents.uBorderMask = frameInfo->borderMask();
+	contents.flLinearToNits = g_flInternalDisplayBrightnessNits;
+	contents.flItmSdrNits = g_flHDRItmSdrNits;
+	contents.flItmTargetNits = g_flHDRItmTargetNits;
+	for ( uint32_t i = 0; i < EOTF_Count; i++ )
+	{
+		contents.shaperLuts[i] = frameInfo->shaperLut[i];
+		contents.lut3Ds[i] = frameInfo->lut3D[i];
+	}
+
+	for ( int i = 0; i < frameInfo->layerCount; i++ )
+	{
+		const FrameInfo_t::Layer_t *layer = &frameInfo->layers[i];
+		OutputImageContents_t::Layer_t *pContentsLayer = &contents.layers[i];
+
+		pContentsLayer->tex = layer->tex;
+		pContentsLayer->ulCommitID = layer->ulCommitID;
+		pContentsLayer->uTexWidth = layer->tex ? layer->tex->width() : 0;
+		pContentsLayer->uTexHeight = layer->tex ? layer->tex->height() : 0;
+		pContentsLayer->offset = layer->offsetPixelCenter();
+		pContentsLayer->scale = layer->scale;
+		pContentsLayer->opacity = layer->opacity;
+		pContentsLayer->filter = layer->filter;
+		pContentsLayer->eAlphaBlendingMode = layer->eAlphaBlendingMode;
+		pContentsLayer->blackBorder = layer->blackBorder;
+		pContentsLayer->pCtm = layer->ctm.get();
+		pContentsLayer->colorspace = layer->colorspace;
+	}
+
+	return contents;
+}
+
+// What needs recompositing to turn an image holding 'oldContents' into
+// one holding 'newContents'.
+static gamescope::DamageRegion compute_output_image_damage( const OutputImageContents_t &oldContents, const OutputImageContents_t &newContents, const struct FrameInfo_t *frameInfo )
+{
+	if ( !oldContents.bValid || !newContents.bValid || !oldContents.SameGlobalState( newContents ) )
+		return gamescope::DamageRegion::Full();
+
+	gamescope::DamageRegion damage = gamescope::DamageRegion::Empty();
+	for ( int i = 0; i < newContents.layerCount; i++ )
+	{
+		const OutputImageContents_t::Layer_t &oldLayer = oldContents.layers[i];
+		const OutputImageContents_t::Layer_t &newLayer = newContents.layers[i];
+
+		if ( !oldLayer.tex || !newLayer.tex )
+			return gamescope::DamageRegion::Full();
+
+		if ( !oldLayer.SameGeometry( newLayer ) )
+		{
+			// Black borders cover everything outside of the layer.
+			if ( oldLayer.blackBorder || newLayer.blackBorder )
+				return gamescope::DamageRegion::Full();
+
+			damage.Add( oldLayer.OutputRect() );
+			damage.Add( newLayer.OutputRect() );
+			continue;
+		}
+
+		if ( oldLayer.tex == newLayer.tex && oldLayer.ulCommitID == newLayer.ulCommitID )
+			continue;
+
+		gamescope::DamageRegion layerDamage = newLayer.ulCommitID
+			? frameInfo->layers[i].damageHistory.DamageSince( oldLayer.ulCommitID )
+			: gamescope::DamageRegion::Full();
+
+		if ( layerDamage.IsFull() )
+		{
+			damage.Add( newLayer.OutputRect() );
+			continue;
+		}
+
+		for ( const gamescope::DamageRegion::Rect_t &rect : layerDamage.Rects() )
+			damage.Add( newLayer.ToOutput( rect ) );
+	}
+
+	return damage;
+}
+
 std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pPipewireTexture, bool partial, gamescope::Rc<CVulkanTexture> pOutputOverride, bool increment, std::unique_ptr<CVulkanCmdBuffer> pInCommandBuffer )
 {
 	EOTF outputTF = frameInfo->outputEncodingEOTF;
@@ -3982,6 +5433,43 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 	else
 		compositeImage = partial ? g_output.outputImagesPartialOverlay[ g_output.nOutImage ] : g_output.outputImages[ g_output.nOutImage ];
 
+	// Our own output images keep their contents between uses, so for plain
+	// blits we only need to recomposite what changed since this image was
+	// last composited to.
+	gamescope::DamageRegion compositeDamage = gamescope::DamageRegion::Full();
+	if ( !pOutputOverride && !GetBackend()->UsesVulkanSwapchain() )
+	{
+		const uint32_t uImage = g_output.nOutImage;
+
+		const bool bCanTrack =
+			!frameInfo->useFSRLayer0 &&
+			!frameInfo->useNISLayer0 &&
+			!frameInfo->blurLayer0 &&
+			g_reshade_effect.empty() &&
+			g_uCompositeDebug == 0 &&
+			GetBackend()->GetPresentLayout() == VK_IMAGE_LAYOUT_GENERAL;
+
+		OutputImageContents_t newContents = bCanTrack
+			? capture_output_image_contents( frameInfo, outputTF, partial )
+			: OutputImageContents_t{};
+
+		if ( cv_composite_incremental )
+			compositeDamage = compute_output_image_damage( s_OutputImageContents[ uImage ], newContents, frameInfo );
+
+		newContents.damageSincePrevious = s_oLastCompositedImage
+			? compute_output_image_damage( s_OutputImageContents[ *s_oLastCompositedImage ], newContents, frameInfo )
+			: gamescope::DamageRegion::Full();
+		newContents.damageSincePrevious.Clip( compositeImage->width(), compositeImage->height() );
+
+		s_OutputImageContents[ uImage ] = std::move( newContents );
+		s_oLastCompositedImage = uImage;
+
+		compositeDamage.Clip( compositeImage->width(), compositeImage->height() );
+		const int64_t nOutputArea = int64_t( compositeImage->width() ) * int64_t( compositeImage->height() );
+		if ( compositeDamage.Area() > int64_t( nOutputArea * cv_composite_incremental_max_area ) )
+			compositeDamage.SetFull();
+	}
+
 	auto cmdBuffer = pInCommandBuffer ? std::move( pInCommandBuffer ) : g_device.commandBuffer();
 
 	for (uint32_t i = 0; i < EOTF_Count; i++)
@@ -3995,10 +5483,10 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 		uint32_t tempX = frameInfo->layers[0].integerWidth();
 		uint32_t tempY = frameInfo->layers[0].integerHeight();
 
-		update_tmp_images(tempX, tempY);
+		auto &tmpOutput = update_tmp_images(tempX, tempY, cmdBuffer->background());
 
 		cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_EASU));
-		cmdBuffer->bindTarget(g_output.tmpOutput);
+		cmdBuffer->bindTarget(tmpOutput);
 		cmdBuffer->bindTexture(0, frameInfo->layers[0].tex);
 		cmdBuffer->setTextureSrgb(0, true);
 		cmdBuffer->setSamplerUnnormalized(0, false);
@@ -4007,18 +5495,22 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 
 		int pixelsPerGroup = 16;
 
+		cmdBuffer->beginPass("easu");
 		cmdBuffer->dispatch(div_roundup(tempX, pixelsPerGroup), div_roundup(tempY, pixelsPerGroup));
+		cmdBuffer->endPass();
 
 		cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_RCAS, frameInfo->layerCount, frameInfo->ycbcrMask() & ~1, 0u, frameInfo->colorspaceMask(), outputTF ));
 		bind_all_layers(cmdBuffer.get(), frameInfo);
-		cmdBuffer->bindTexture(0, g_output.tmpOutput);
+		cmdBuffer->bindTexture(0, tmpOutput);
 		cmdBuffer->setTextureSrgb(0, true);
 		cmdBuffer->setSamplerUnnormalized(0, false);
 		cmdBuffer->setSamplerNearest(0, false);
 		cmdBuffer->bindTarget(compositeImage);
 		cmdBuffer->uploadConstants<RcasPushData_t>(frameInfo, g_upscaleFilterSharpness / 10.0f);
 
+		cmdBuffer->beginPass("rcas");
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		cmdBuffer->endPass();
 	}
 	else if ( frameInfo->useNISLayer0 )
 	{
@@ -4028,12 +5520,12 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 		uint32_t tempX = frameInfo->layers[0].integerWidth();
 		uint32_t tempY = frameInfo->layers[0].integerHeight();
 
-		update_tmp_images(tempX, tempY);
+		auto &tmpOutput = update_tmp_images(tempX, tempY, cmdBuffer->background());
 
 		float nisSharpness = (20 - g_upscaleFilterSharpness) / 20.0f;
 
 		cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_NIS));
-		cmdBuffer->bindTarget(g_output.tmpOutput);
+		cmdBuffer->bindTarget(tmpOutput);
 		cmdBuffer->bindTexture(0, frameInfo->layers[0].tex);
 		cmdBuffer->setTextureSrgb(0, true);
 		cmdBuffer->setSamplerUnnormalized(0, false);
@@ -4049,10 +5541,12 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 		int pixelsPerGroupX = 32;
 		int pixelsPerGroupY = 24;
 
+		cmdBuffer->beginPass("nis");
 		cmdBuffer->dispatch(div_roundup(tempX, pixelsPerGroupX), div_roundup(tempY, pixelsPerGroupY));
+		cmdBuffer->endPass();
 
 		struct FrameInfo_t nisFrameInfo = *frameInfo;
-		nisFrameInfo.layers[0].tex = g_output.tmpOutput;
+		nisFrameInfo.layers[0].tex = tmpOutput;
 		nisFrameInfo.layers[0].scale.x = 1.0f;
 		nisFrameInfo.layers[0].scale.y = 1.0f;
 
@@ -4063,11 +5557,13 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 
 		int pixelsPerGroup = 8;
 
+		cmdBuffer->beginPass("composite");
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		cmdBuffer->endPass();
 	}
 	else if ( frameInfo->blurLayer0 )
 	{
-		update_tmp_images(currentOutputWidth, currentOutputHeight);
+		auto &tmpOutput = update_tmp_images(currentOutputWidth, currentOutputHeight, cmdBuffer->background());
 
 		ShaderType type = SHADER_TYPE_BLUR_FIRST_PASS;
 
@@ -4077,7 +5573,7 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 			blur_layer_count++;
 
 		cmdBuffer->bindPipeline(g_device.pipeline(type, blur_layer_count, frameInfo->ycbcrMask() & 0x3u, 0, frameInfo->colorspaceMask(), outputTF ));
-		cmdBuffer->bindTarget(g_output.tmpOutput);
+		cmdBuffer->bindTarget(tmpOutput);
 		for (uint32_t i = 0; i < blur_layer_count; i++)
 		{
 			cmdBuffer->bindTexture(i, frameInfo->layers[i].tex);
@@ -4089,7 +5585,9 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 
 		int pixelsPerGroup = 8;
 
+		cmdBuffer->beginPass("blur_first_pass");
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		cmdBuffer->endPass();
 
 		bool useSrgbView = frameInfo->layers[0].colorspace == GAMESCOPE_APP_TEXTURE_COLORSPACE_LINEAR;
 
@@ -4097,12 +5595,14 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 		cmdBuffer->bindPipeline(g_device.pipeline(type, frameInfo->layerCount, frameInfo->ycbcrMask(), blur_layer_count, frameInfo->colorspaceMask(), outputTF ));
 		bind_all_layers(cmdBuffer.get(), frameInfo);
 		cmdBuffer->bindTarget(compositeImage);
-		cmdBuffer->bindTexture(VKR_BLUR_EXTRA_SLOT, g_output.tmpOutput);
+		cmdBuffer->bindTexture(VKR_BLUR_EXTRA_SLOT, tmpOutput);
 		cmdBuffer->setTextureSrgb(VKR_BLUR_EXTRA_SLOT, !useSrgbView); // Inverted because it chooses whether to view as linear (sRGB view) or sRGB (raw view). It's horrible. I need to change it.
 		cmdBuffer->setSamplerUnnormalized(VKR_BLUR_EXTRA_SLOT, true);
 		cmdBuffer->setSamplerNearest(VKR_BLUR_EXTRA_SLOT, false);
 
+		cmdBuffer->beginPass("blur");
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		cmdBuffer->endPass();
 	}
 	else
 	{
@@ -4113,7 +5613,33 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 
 		const int pixelsPerGroup = 8;
 
-		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		cmdBuffer->beginPass("composite");
+
+		if ( compositeDamage.IsFull() )
+		{
+			cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		}
+		else
+		{
+			cmdBuffer->preserveImage(compositeImage.get());
+
+			// Always dispatch something so the image goes through the usual
+			// acquire/release, even if nothing changed.
+			if ( compositeDamage.IsEmpty() )
+				cmdBuffer->dispatch(1, 1);
+
+			for ( const gamescope::DamageRegion::Rect_t &rect : compositeDamage.Rects() )
+			{
+				uint32_t uGroupX1 = uint32_t( rect.nX1 ) / pixelsPerGroup;
+				uint32_t uGroupY1 = uint32_t( rect.nY1 ) / pixelsPerGroup;
+				uint32_t uGroupX2 = div_roundup( uint32_t( rect.nX2 ), pixelsPerGroup );
+				uint32_t uGroupY2 = div_roundup( uint32_t( rect.nY2 ), pixelsPerGroup );
+
+				cmdBuffer->dispatchBase(uGroupX1, uGroupY1, uGroupX2 - uGroupX1, uGroupY2 - uGroupY1);
+			}
+		}
+
+		cmdBuffer->endPass();
 	}
 
 	if ( pPipewireTexture != nullptr )
@@ -4122,7 +5648,9 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 		if (compositeImage->format() == pPipewireTexture->format() &&
 			compositeImage->width() == pPipewireTexture->width() &&
 		    compositeImage->height() == pPipewireTexture->height()) {
+			cmdBuffer->beginPass("pipewire_copy");
 			cmdBuffer->copyImage(compositeImage, pPipewireTexture);
+			cmdBuffer->endPass();
 		} else {
 			const bool ycbcr = pPipewireTexture->isYcbcr();
 
@@ -4159,7 +5687,9 @@ std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamesco
 			// For ycbcr, we operate on 2 pixels at a time, so use the half-extent.
 			const int dispatchSize = ycbcr ? pixelsPerGroup * 2 : pixelsPerGroup;
 
+			cmdBuffer->beginPass(ycbcr ? "pipewire_rgb_to_nv12" : "pipewire_blit");
 			cmdBuffer->dispatch(div_roundup(pPipewireTexture->width(), dispatchSize), div_roundup(pPipewireTexture->height(), dispatchSize));
+			cmdBuffer->endPass();
 		}
 	}
 
@@ -4215,6 +5745,40 @@ gamescope::Rc<CVulkanTexture> vulkan_get_last_output_image( bool partial, bool d
 	return g_output.outputImages[ nOutImage ];
 }
 
+gamescope::DamageRegion vulkan_get_last_output_image_damage( bool partial, bool defer )
+{
+	// Same indexing as vulkan_get_last_output_image.
+	uint32_t nOutImage = defer ? ( g_output.nOutImage + 1 ) % 3 : ( g_output.nOutImage + 2 ) % 3;
+
+	const OutputImageContents_t &contents = s_OutputImageContents[ nOutImage ];
+	if ( !contents.bValid || contents.bPartial != partial )
+		return gamescope::DamageRegion::Full();
+
+	return contents.damageSincePrevious;
+}
+
+bool vulkan_last_output_image_is_current( const struct FrameInfo_t *frameInfo, bool partial )
+{
+	// Debug markers etc. change every composite.
+	if ( g_uCompositeDebug != 0 )
+		return false;
+
+	if ( !s_oLastCompositedImage || *s_oLastCompositedImage != ( g_output.nOutImage + 2 ) % 3 )
+		return false;
+
+	const OutputImageContents_t &lastContents = s_OutputImageContents[ *s_oLastCompositedImage ];
+	if ( !lastContents.bValid || lastContents.bPartial != partial )
+		return false;
+
+	EOTF outputTF = frameInfo->outputEncodingEOTF;
+	if ( !frameInfo->applyOutputColorMgmt )
+		outputTF = EOTF_Count;
+
+	// Anything we could not track, or any damage at all, means it needs compositing again.
+	OutputImageContents_t newContents = capture_output_image_contents( frameInfo, outputTF, partial );
+	return compute_output_image_damage( lastContents, newContents, frameInfo ).IsEmpty();
+}
+
 bool vulkan_primary_dev_id(dev_t *id)
 {
 	*id = g_device.primaryDevId();
@@ -4226,6 +5790,76 @@ bool vulkan_supports_modifiers(void)
 	return g_device.supportsModifiers();
 }
 
+std::vector<uint64_t> vulkan_get_export_modifiers( uint32_t drmFormat, const CVulkanTexture::createFlags &flags )
+{
+	std::vector<uint64_t> modifiers;
+
+	if ( !g_device.supportsModifiers() )
+		return modifiers;
+
+	VkFormat format = DRMFormatToVulkan( drmFormat, false );
+	auto iter = DRMModifierProps.find( format );
+	if ( iter == DRMModifierProps.end() )
+		return modifiers;
+
+	// Same as what BInit will ask for, so anything returned here
+	// is guaranteed to work for it.
+	VkImageCreateInfo imageInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = flags.imageType,
+		.format = format,
+		.usage = ImageUsageForCreateFlags( flags ),
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+
+	std::array<VkFormat, 2> formats = {
+		DRMFormatToVulkan( drmFormat, false ),
+		DRMFormatToVulkan( drmFormat, true ),
+	};
+
+	VkImageFormatListCreateInfo formatList = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO,
+		.viewFormatCount = (uint32_t)formats.size(),
+		.pViewFormats = formats.data(),
+	};
+
+	if ( formats[0] != formats[1] )
+	{
+		formatList.pNext = std::exchange( imageInfo.pNext, &formatList );
+		imageInfo.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+	}
+
+	for ( const auto &[ modifier, props ] : iter->second )
+	{
+		VkExternalImageFormatProperties externalFormatProps = {
+			.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
+		};
+		if ( getModifierProps( &imageInfo, modifier, &externalFormatProps ) != VK_SUCCESS )
+			continue;
+
+		if ( !( externalFormatProps.externalMemoryProperties.externalMemoryFeatures & VK_EXTERNAL_MEMORY_FEATURE_EXPORTABLE_BIT ) )
+			continue;
+
+		modifiers.push_back( modifier );
+	}
+
+	return modifiers;
+}
+
+uint32_t vulkan_get_modifier_plane_count( uint32_t drmFormat, uint64_t modifier )
+{
+	VkFormat format = DRMFormatToVulkan( drmFormat, false );
+	auto formatIter = DRMModifierProps.find( format );
+	if ( formatIter == DRMModifierProps.end() )
+		return 1;
+
+	auto modifierIter = formatIter->second.find( modifier );
+	if ( modifierIter == formatIter->second.end() )
+		return 1;
+
+	return modifierIter->second.drmFormatModifierPlaneCount;
+}
+
 static void texture_destroy( struct wlr_texture *wlr_texture )
 {
 	VulkanWlrTexture_t *tex = (VulkanWlrTexture_t *)wlr_texture;
@@ -4296,8 +5930,6 @@ gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struc
 		return vulkan_create_texture_from_dmabuf( &dmabuf, pBackendFb );
 	}
 
-	VkResult result;
-
 	void *src;
 	uint32_t drmFormat;
 	size_t stride;
@@ -4305,87 +5937,159 @@ gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struc
 	{
 		return nullptr;
 	}
+	defer( wlr_buffer_end_data_ptr_access( buf ) );
 
 	uint32_t width = buf->width;
 	uint32_t height = buf->height;
 
-	VkBufferCreateInfo bufferCreateInfo = {
-		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		.size = stride * height,
-		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-	};
-	VkBuffer buffer;
-	result = g_device.vk.CreateBuffer( g_device.device(), &bufferCreateInfo, nullptr, &buffer );
-	if ( result != VK_SUCCESS )
-	{
-		wlr_buffer_end_data_ptr_access( buf );
+	gamescope::OwningRc<CVulkanTexture> pTex = new CVulkanTexture();
+	CVulkanTexture::createFlags texCreateFlags;
+	texCreateFlags.bSampled = true;
+	texCreateFlags.bTransferDst = true;
+	texCreateFlags.bFlippable = true;
+	if ( pTex->BInit( width, height, 1u, drmFormat, texCreateFlags, nullptr, 0, 0, nullptr, pBackendFb ) == false )
 		return nullptr;
-	}
 
-	VkMemoryRequirements memRequirements;
-	g_device.vk.GetBufferMemoryRequirements(g_device.device(), buffer, &memRequirements);
+	std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData( stride * height );
+	if ( !oStaging )
+		return nullptr;
 
-	uint32_t memTypeIndex =  g_device.findMemoryType(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
-	if ( memTypeIndex == ~0u )
+	memcpy( oStaging->pData, src, stride * height );
+
+	auto cmdBuffer = g_device.commandBuffer();
+
+	cmdBuffer->copyBufferToImage( oStaging->buffer, oStaging->ulOffset, stride / DRMFormatGetBPP(drmFormat), pTex);
+
+	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+	g_device.retireStagingData( sequence );
+
+	// Nothing to signal the caller with, see CVulkanShmTexturePool for that.
+	g_device.wait(sequence);
+
+	return pTex;
+}
+
+gamescope::OwningRc<CVulkanTexture> CVulkanShmTexturePool::Upload( struct wlr_buffer *buf, uint64_t ulCommitID, const gamescope::DamageHistory &damageHistory, uint64_t *pulUploadPoint )
+{
+	if ( !m_pUploadTimeline )
 	{
-		wlr_buffer_end_data_ptr_access( buf );
-		return nullptr;
+		m_pUploadTimeline = gamescope::CTimeline::Create();
+		if ( !m_pUploadTimeline )
+			return nullptr;
 	}
 
-	VkMemoryAllocateInfo allocInfo = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = memRequirements.size,
-		.memoryTypeIndex = memTypeIndex,
-	};
+	void *pSrc;
+	uint32_t uDrmFormat;
+	size_t ulStride;
+	if ( !wlr_buffer_begin_data_ptr_access( buf, WLR_BUFFER_DATA_PTR_ACCESS_READ, &pSrc, &uDrmFormat, &ulStride ) )
+		return nullptr;
+	defer( wlr_buffer_end_data_ptr_access( buf ) );
 
-	VkDeviceMemory bufferMemory;
-	result = g_device.vk.AllocateMemory( g_device.device(), &allocInfo, nullptr, &bufferMemory);
-	if ( result != VK_SUCCESS )
+	const uint32_t uWidth = buf->width;
+	const uint32_t uHeight = buf->height;
+
+	std::erase_if( m_Textures, [&]( const Texture_t &texture )
 	{
-		wlr_buffer_end_data_ptr_access( buf );
-		return nullptr;
+		return texture.pTexture->width() != uWidth ||
+		       texture.pTexture->height() != uHeight ||
+		       texture.pTexture->drmFormat() != uDrmFormat;
+	});
+
+	Texture_t *pTarget = nullptr;
+	for ( Texture_t &texture : m_Textures )
+	{
+		if ( !texture.pTexture->IsInUse() )
+		{
+			pTarget = &texture;
+			break;
+		}
 	}
 
-	result = g_device.vk.BindBufferMemory( g_device.device(), buffer, bufferMemory, 0 );
-	if ( result != VK_SUCCESS )
+	// Used if every pooled texture is busy and the pool is full.
+	Texture_t oneOffTexture;
+	if ( !pTarget )
 	{
-		wlr_buffer_end_data_ptr_access( buf );
-		return nullptr;
+		gamescope::OwningRc<CVulkanTexture> pTexture = new CVulkanTexture();
+		CVulkanTexture::createFlags texCreateFlags;
+		texCreateFlags.bSampled = true;
+		texCreateFlags.bTransferDst = true;
+		texCreateFlags.bFlippable = true;
+		if ( !pTexture->BInit( uWidth, uHeight, 1u, uDrmFormat, texCreateFlags ) )
+			return nullptr;
+
+		if ( m_Textures.size() < k_uMaxTextures )
+			pTarget = &m_Textures.emplace_back( Texture_t{ std::move( pTexture ) } );
+		else
+			pTarget = &( oneOffTexture = Texture_t{ std::move( pTexture ) } );
 	}
 
-	void *dst;
-	result = g_device.vk.MapMemory( g_device.device(), bufferMemory, 0, VK_WHOLE_SIZE, 0, &dst );
-	if ( result != VK_SUCCESS )
+	gamescope::DamageRegion damage = damageHistory.DamageSince( pTarget->ulCommitID );
+	damage.Clip( int32_t( uWidth ), int32_t( uHeight ) );
+
+	const uint32_t uBpp = DRMFormatGetBPP( uDrmFormat );
+	auto cmdBuffer = g_device.commandBuffer();
+
+	if ( damage.IsFull() )
 	{
-		wlr_buffer_end_data_ptr_access( buf );
-		return nullptr;
+		std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData( ulStride * uHeight );
+		if ( !oStaging )
+			return nullptr;
+
+		memcpy( oStaging->pData, pSrc, ulStride * uHeight );
+		cmdBuffer->copyBufferToImage( oStaging->buffer, oStaging->ulOffset, ulStride / uBpp, pTarget->pTexture );
 	}
+	else if ( !damage.IsEmpty() )
+	{
+		std::span<const gamescope::DamageRegion::Rect_t> rects = damage.Rects();
 
-	memcpy( dst, src, stride * height );
+		VkDeviceSize ulTotalSize = 0;
+		for ( const gamescope::DamageRegion::Rect_t &rect : rects )
+			ulTotalSize += align( VkDeviceSize( rect.nX2 - rect.nX1 ) * uBpp * ( rect.nY2 - rect.nY1 ), 16 );
 
-	g_device.vk.UnmapMemory( g_device.device(), bufferMemory );
+		std::optional<CVulkanDevice::StagingAllocation_t> oStaging = g_device.stagingBufferData( ulTotalSize );
+		if ( !oStaging )
+			return nullptr;
 
-	wlr_buffer_end_data_ptr_access( buf );
+		// Each rect is packed tightly, so the staging memory only costs as
+		// much as the damage.
+		std::array<VkBufferImageCopy, gamescope::DamageRegion::k_nMaxRects> regions;
+		VkDeviceSize ulOffset = 0;
+		for ( size_t i = 0; i < rects.size(); i++ )
+		{
+			const gamescope::DamageRegion::Rect_t &rect = rects[i];
+			const uint32_t uRectWidth = uint32_t( rect.nX2 - rect.nX1 );
+			const uint32_t uRectHeight = uint32_t( rect.nY2 - rect.nY1 );
+			const size_t ulRowSize = size_t( uRectWidth ) * uBpp;
 
-	gamescope::OwningRc<CVulkanTexture> pTex = new CVulkanTexture();
-	CVulkanTexture::createFlags texCreateFlags;
-	texCreateFlags.bSampled = true;
-	texCreateFlags.bTransferDst = true;
-	texCreateFlags.bFlippable = true;
-	if ( pTex->BInit( width, height, 1u, drmFormat, texCreateFlags, nullptr, 0, 0, nullptr, pBackendFb ) == false )
-		return nullptr;
+			const uint8_t *pSrcRow = (const uint8_t *)pSrc + size_t( rect.nY1 ) * ulStride + size_t( rect.nX1 ) * uBpp;
+			uint8_t *pDstRow = oStaging->pData + ulOffset;
+			for ( uint32_t y = 0; y < uRectHeight; y++ )
+				memcpy( pDstRow + y * ulRowSize, pSrcRow + y * ulStride, ulRowSize );
 
-	auto cmdBuffer = g_device.commandBuffer();
+			regions[i] = VkBufferImageCopy
+			{
+				.bufferOffset = oStaging->ulOffset + ulOffset,
+				.imageSubresource =
+				{
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1,
+				},
+				.imageOffset = { rect.nX1, rect.nY1, 0 },
+				.imageExtent = { uRectWidth, uRectHeight, 1 },
+			};
 
-	cmdBuffer->copyBufferToImage( buffer, 0, stride / DRMFormatGetBPP(drmFormat), pTex);
-	// TODO: Sync this copyBufferToImage
+			ulOffset += align( VkDeviceSize( ulRowSize ) * uRectHeight, 16 );
+		}
 
-	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+		cmdBuffer->copyBufferRegionsToImage( oStaging->buffer, std::span<const VkBufferImageCopy>( regions.data(), rects.size() ), pTarget->pTexture );
+	}
 
-	g_device.wait(sequence);
+	*pulUploadPoint = ++m_ulLastUploadPoint;
+	cmdBuffer->AddSignal( m_pUploadTimeline->ToVkSemaphore(), *pulUploadPoint );
 
-	g_device.vk.DestroyBuffer(g_device.device(), buffer, nullptr);
-	g_device.vk.FreeMemory(g_device.device(), bufferMemory, nullptr);
+	uint64_t ulSeqNo = g_device.submit( std::move( cmdBuffer ) );
+	g_device.retireStagingData( ulSeqNo );
 
-	return pTex;
+	pTarget->ulCommitID = ulCommitID;
+	return pTarget->pTexture;
 }
@@ -9,8 +9,11 @@
 #include <unordered_map>
 #include <array>
 #include <bitset>
+#include <deque>
 #include <mutex>
 #include <optional>
+#include <span>
+#include <string_view>
 
 #include "main.hpp"
 
@@ -18,6 +21,7 @@
 #include "backend.h"
 
 #include "shaders/descriptor_set_constants.h"
+#include "Utils/DamageRegion.h"
 
 class CVulkanCmdBuffer;
 
@@ -124,6 +128,16 @@ inline GamescopeAppTextureColorspace VkColorSpaceToGamescopeAppTextureColorSpace
 	}
 }
 
+// A range of a device memory block handed out by CVulkanMemoryAllocator.
+struct VulkanSubAllocation_t
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize ulOffset = 0;
+	VkDeviceSize ulSize = 0;
+	uint32_t uBlockIndex = 0;
+	uint32_t uSizeClass = 0;
+};
+
 class CVulkanTexture : public gamescope::RcObject
 {
 public:
@@ -155,6 +169,11 @@ public:
 		bool bOutputImage : 1;
 		bool bColorAttachment : 1;
 		VkImageType imageType;
+
+		// For exportable, non-flippable images: allocate with one of these
+		// DRM modifiers (the driver picks) and export every memory plane.
+		// BInit fails if none of them can be used with the other flags.
+		std::span<const uint64_t> exportModifiers;
 	};
 
 	bool BInit( uint32_t width, uint32_t height, uint32_t depth, uint32_t drmFormat, createFlags flags, wlr_dmabuf_attributes *pDMA = nullptr, uint32_t contentWidth = 0, uint32_t contentHeight = 0, CVulkanTexture *pExistingImageToReuseMemory = nullptr, gamescope::OwningRc<gamescope::IBackendFb> pBackendFb = nullptr );
@@ -185,6 +204,8 @@ public:
 	inline bool externalImage() { return m_bExternal; }
 	inline VkDeviceSize totalSize() const { return m_size; }
 	inline uint32_t drmFormat() const { return m_drmFormat; }
+	// Unique for the lifetime of the process, unlike our pointer or Vulkan handles.
+	inline uint64_t textureID() const { return m_ulTextureID; }
 
 	inline uint32_t lumaOffset() const { return m_lumaOffset; }
 	inline uint32_t lumaRowPitch() const { return m_lumaPitch; }
@@ -194,6 +215,11 @@ public:
 	inline EStreamColorspace streamColorspace() const { return m_streamColorspace; }
 	inline void setStreamColorspace(EStreamColorspace colorspace) { m_streamColorspace = colorspace; }
 
+	// The main queue submission that last uploaded into this texture without
+	// anyone waiting for it on the CPU, 0 if none.
+	inline uint64_t uploadSeqNo() const { return m_ulUploadSeqNo; }
+	inline void setUploadSeqNo(uint64_t ulSeqNo) { m_ulUploadSeqNo = ulSeqNo; }
+
 	inline bool isYcbcr() const
 	{
 		return format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
@@ -211,10 +237,16 @@ private:
 	bool m_bExternal = false;
 	bool m_bOutputImage = false;
 
+	uint64_t m_ulTextureID = 0;
+	uint64_t m_ulUploadSeqNo = 0;
+
 	uint32_t m_drmFormat = DRM_FORMAT_INVALID;
 
 	VkImage m_vkImage = VK_NULL_HANDLE;
 	VkDeviceMemory m_vkImageMemory = VK_NULL_HANDLE;
+	// Internal images share blocks of device memory instead of owning
+	// m_vkImageMemory, see CVulkanMemoryAllocator.
+	std::optional<VulkanSubAllocation_t> m_oSubAllocation;
 	
 	VkImageView m_srgbView = VK_NULL_HANDLE;
 	VkImageView m_linearView = VK_NULL_HANDLE;
@@ -315,6 +347,15 @@ struct FrameInfo_t
 
 		GamescopeAppTextureColorspace colorspace;
 
+		// The commit tex came from and what changed in it since the commits
+		// before it, in texture space. 0 if tex is not a client commit.
+		uint64_t ulCommitID = 0;
+		gamescope::DamageHistory damageHistory;
+
+		// Damage relative to whatever was last scanned out on this plane.
+		// Only used for our own composited images.
+		gamescope::DamageRegion scanoutDamage;
+
 		bool isYcbcr() const
 		{
 			if ( !tex )
@@ -408,24 +449,67 @@ gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_dmabuf( struct wl
 gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_bits( uint32_t width, uint32_t height, uint32_t contentWidth, uint32_t contentHeight, uint32_t drmFormat, CVulkanTexture::createFlags texCreateFlags, void *bits );
 gamescope::OwningRc<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struct wlr_buffer *buf, gamescope::OwningRc<gamescope::IBackendFb> pBackendFb );
 
+// Destination textures for the wl_shm buffers committed to one surface.
+//
+// A texture is recycled once nothing references it anymore, and only what
+// was damaged since the commit it last received gets uploaded again.
+// Uploads go through the device's staging ring and are never waited on,
+// the point on GetUploadTimeline() returned by Upload is signalled once the
+// texture holds the buffer's contents.
+class CVulkanShmTexturePool
+{
+public:
+	static constexpr uint32_t k_uMaxTextures = 4;
+
+	gamescope::OwningRc<CVulkanTexture> Upload( struct wlr_buffer *buf, uint64_t ulCommitID, const gamescope::DamageHistory &damageHistory, uint64_t *pulUploadPoint );
+
+	const std::shared_ptr<gamescope::CTimeline> &GetUploadTimeline() const { return m_pUploadTimeline; }
+
+private:
+	struct Texture_t
+	{
+		gamescope::OwningRc<CVulkanTexture> pTexture;
+		// The commit whose contents the texture holds.
+		uint64_t ulCommitID = 0;
+	};
+
+	std::vector<Texture_t> m_Textures;
+	std::shared_ptr<gamescope::CTimeline> m_pUploadTimeline;
+	uint64_t m_ulLastUploadPoint = 0;
+};
+
 std::optional<uint64_t> vulkan_composite( struct FrameInfo_t *frameInfo, gamescope::Rc<CVulkanTexture> pScreenshotTexture, bool partial, gamescope::Rc<CVulkanTexture> pOutputOverride = nullptr, bool increment = true, std::unique_ptr<CVulkanCmdBuffer> pInCommandBuffer = nullptr );
 void vulkan_wait( uint64_t ulSeqNo, bool bReset );
 gamescope::Rc<CVulkanTexture> vulkan_get_last_output_image( bool partial, bool defer );
+gamescope::DamageRegion vulkan_get_last_output_image_damage( bool partial, bool defer );
+bool vulkan_last_output_image_is_current( const struct FrameInfo_t *frameInfo, bool partial );
 gamescope::Rc<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width, uint32_t height, bool exportable, uint32_t drmFormat, EStreamColorspace colorspace = k_EStreamColorspace_Unknown);
 
 void vulkan_present_to_window( void );
 
 void vulkan_garbage_collect( void );
+// Drops internal images that are recreated on demand and gives empty
+// memory blocks back to the driver, for when VRAM is tight.
+void vulkan_shrink_caches( void );
+// Total size of the device local heaps, and our usage and budget of them
+// (0 without VK_EXT_memory_budget).
+void vulkan_get_device_local_memory( uint64_t *pulSize, uint64_t *pulUsage, uint64_t *pulBudget );
 bool vulkan_remake_swapchain( void );
 bool vulkan_remake_output_images( void );
 bool acquire_next_image( void );
 
 bool vulkan_primary_dev_id(dev_t *id);
 bool vulkan_supports_modifiers(void);
+std::vector<uint64_t> vulkan_get_export_modifiers( uint32_t drmFormat, const CVulkanTexture::createFlags &flags );
+uint32_t vulkan_get_modifier_plane_count( uint32_t drmFormat, uint64_t modifier );
 
 gamescope::Rc<CVulkanTexture> vulkan_create_1d_lut(uint32_t size);
 gamescope::Rc<CVulkanTexture> vulkan_create_3d_lut(uint32_t width, uint32_t height, uint32_t depth);
 void vulkan_update_luts(const gamescope::Rc<CVulkanTexture>& lut1d, const gamescope::Rc<CVulkanTexture>& lut3d, void* lut1d_data, void* lut3d_data);
+// Evaluates the 3D LUT on the GPU rather than uploading it, see cs_color_lut3d.comp.
+bool vulkan_supports_color_lut3d_compute();
+gamescope::Rc<CVulkanTexture> vulkan_create_look_lut(const struct lut3d_t &look);
+void vulkan_update_luts_compute(const gamescope::Rc<CVulkanTexture>& lut1d, const gamescope::Rc<CVulkanTexture>& lut3d, void* lut1d_data, const struct colorlut3d_compute_params_t &params, const gamescope::Rc<CVulkanTexture>& look);
 
 gamescope::Rc<CVulkanTexture> vulkan_get_hacky_blank_texture();
 
@@ -487,6 +571,17 @@ struct gamescope_color_mgmt_luts
 	gamescope::Rc<CVulkanTexture> vk_lut3d;
 	gamescope::Rc<CVulkanTexture> vk_lut1d;
 
+	// The previous pair, uploaded into next time unless a frame still
+	// references it. Uploads are not waited on, so they must never go into
+	// the textures a composite in flight is sampling.
+	gamescope::Rc<CVulkanTexture> vk_lut3dSpare;
+	gamescope::Rc<CVulkanTexture> vk_lut1dSpare;
+
+	// The look uploaded for evaluating the 3D LUT on the GPU,
+	// see vulkan_update_luts_compute.
+	std::shared_ptr<lut3d_t> pVkLookSource;
+	gamescope::Rc<CVulkanTexture> vk_look;
+
 	bool HasLuts() const
 	{
 		return bHasLut3D && bHasLut1D;
@@ -498,6 +593,10 @@ struct gamescope_color_mgmt_luts
 		bHasLut3D = false;
 		vk_lut1d = nullptr;
 		vk_lut3d = nullptr;
+		vk_lut1dSpare = nullptr;
+		vk_lut3dSpare = nullptr;
+		pVkLookSource = nullptr;
+		vk_look = nullptr;
 	}
 
 	void reset()
@@ -541,6 +640,8 @@ struct VulkanOutput_t
 
 	// NIS and FSR
 	gamescope::OwningRc<CVulkanTexture> tmpOutput;
+	// Same, for work on the background queue so it cannot race the main one.
+	gamescope::OwningRc<CVulkanTexture> tmpBackgroundOutput;
 
 	// NIS
 	gamescope::OwningRc<CVulkanTexture> nisScalerImage;
@@ -557,6 +658,7 @@ enum ShaderType {
 	SHADER_TYPE_RCAS,
 	SHADER_TYPE_NIS,
 	SHADER_TYPE_RGB_TO_NV12,
+	SHADER_TYPE_COLOR_LUT3D,
 
 	SHADER_TYPE_COUNT
 };
@@ -645,6 +747,62 @@ namespace std
 	};
 }
 
+// Everything that goes into the descriptor set of a dispatch,
+// other than the uniform buffer offset which is dynamic.
+struct DescriptorSetKey_t
+{
+	std::array<uint64_t, VKR_SAMPLER_SLOTS> textureIDs{};
+	std::bitset<VKR_SAMPLER_SLOTS> srgb;
+	std::array<SamplerState, VKR_SAMPLER_SLOTS> samplers;
+
+	uint64_t targetID = 0;
+
+	std::array<uint64_t, VKR_LUT3D_COUNT> shaperLutIDs{};
+	std::array<uint64_t, VKR_LUT3D_COUNT> lut3DIDs{};
+
+	bool SameSlot( const DescriptorSetKey_t &o, uint32_t slot ) const
+	{
+		return
+		textureIDs[slot] == o.textureIDs[slot] &&
+		srgb[slot] == o.srgb[slot] &&
+		samplers[slot] == o.samplers[slot];
+	}
+
+	bool operator==(const DescriptorSetKey_t& o) const {
+		return
+		textureIDs == o.textureIDs &&
+		srgb == o.srgb &&
+		samplers == o.samplers &&
+		targetID == o.targetID &&
+		shaperLutIDs == o.shaperLutIDs &&
+		lut3DIDs == o.lut3DIDs;
+	}
+};
+
+namespace std
+{
+	template <>
+	struct hash<DescriptorSetKey_t>
+	{
+		size_t operator()( const DescriptorSetKey_t& k ) const
+		{
+			uint32_t hash = uint32_t(k.targetID);
+			for (uint32_t i = 0; i < VKR_SAMPLER_SLOTS; i++)
+			{
+				hash = hash_combine(hash, uint32_t(k.textureIDs[i]));
+				hash = hash_combine(hash, k.srgb[i]);
+				hash = hash_combine(hash, std::hash<SamplerState>()(k.samplers[i]));
+			}
+			for (uint32_t i = 0; i < VKR_LUT3D_COUNT; i++)
+			{
+				hash = hash_combine(hash, uint32_t(k.shaperLutIDs[i]));
+				hash = hash_combine(hash, uint32_t(k.lut3DIDs[i]));
+			}
+			return hash;
+		}
+	};
+}
+
 static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 {
 	return (x + (y - 1)) / y;
@@ -655,11 +813,13 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(EnumerateDeviceExtensionProperties) \
 	VK_FUNC(EnumeratePhysicalDevices) \
 	VK_FUNC(GetDeviceProcAddr) \
+	VK_FUNC(GetPhysicalDeviceCalibrateableTimeDomainsEXT) \
 	VK_FUNC(GetPhysicalDeviceFeatures2) \
 	VK_FUNC(GetPhysicalDeviceFormatProperties) \
 	VK_FUNC(GetPhysicalDeviceFormatProperties2) \
 	VK_FUNC(GetPhysicalDeviceImageFormatProperties2) \
 	VK_FUNC(GetPhysicalDeviceMemoryProperties) \
+	VK_FUNC(GetPhysicalDeviceMemoryProperties2) \
 	VK_FUNC(GetPhysicalDeviceQueueFamilyProperties) \
 	VK_FUNC(GetPhysicalDeviceProperties) \
 	VK_FUNC(GetPhysicalDeviceProperties2) \
@@ -683,10 +843,13 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(CmdCopyBufferToImage) \
 	VK_FUNC(CmdCopyImage) \
 	VK_FUNC(CmdDispatch) \
+	VK_FUNC(CmdDispatchBase) \
 	VK_FUNC(CmdDraw) \
 	VK_FUNC(CmdEndRendering) \
 	VK_FUNC(CmdPipelineBarrier) \
 	VK_FUNC(CmdPushConstants) \
+	VK_FUNC(CmdResetQueryPool) \
+	VK_FUNC(CmdWriteTimestamp) \
 	VK_FUNC(CreateBuffer) \
 	VK_FUNC(CreateCommandPool) \
 	VK_FUNC(CreateComputePipelines) \
@@ -697,6 +860,7 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(CreateImage) \
 	VK_FUNC(CreateImageView) \
 	VK_FUNC(CreatePipelineLayout) \
+	VK_FUNC(CreateQueryPool) \
 	VK_FUNC(CreateSampler) \
 	VK_FUNC(CreateSamplerYcbcrConversion) \
 	VK_FUNC(CreateSemaphore) \
@@ -712,6 +876,7 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(DestroyPipeline) \
 	VK_FUNC(DestroySemaphore) \
 	VK_FUNC(DestroyPipelineLayout) \
+	VK_FUNC(DestroyQueryPool) \
 	VK_FUNC(DestroySampler) \
 	VK_FUNC(DestroySwapchainKHR) \
 	VK_FUNC(EndCommandBuffer) \
@@ -719,11 +884,14 @@ static inline uint32_t div_roundup(uint32_t x, uint32_t y)
 	VK_FUNC(FreeDescriptorSets) \
 	VK_FUNC(FreeMemory) \
 	VK_FUNC(GetBufferMemoryRequirements) \
+	VK_FUNC(GetCalibratedTimestampsEXT) \
 	VK_FUNC(GetDeviceQueue) \
 	VK_FUNC(GetImageDrmFormatModifierPropertiesEXT) \
 	VK_FUNC(GetImageMemoryRequirements) \
+	VK_FUNC(GetImageMemoryRequirements2) \
 	VK_FUNC(GetImageSubresourceLayout) \
 	VK_FUNC(GetMemoryFdKHR) \
+	VK_FUNC(GetQueryPoolResults) \
 	VK_FUNC(GetSemaphoreCounterValue) \
 	VK_FUNC(GetSwapchainImagesKHR) \
 	VK_FUNC(MapMemory) \
@@ -762,6 +930,158 @@ struct VulkanTimelinePoint_t
 	uint64_t ulPoint;
 };
 
+// Suballocates device memory for internal images (output images, upscale
+// and blur temporaries, LUTs, ReShade render targets...) so that creating
+// and destroying them on mode changes or effect toggles does not go through
+// vkAllocateMemory every time, which is slow and fragments VRAM on APUs
+// with a small carveout.
+//
+// Each memory type gets its own k_ulBlockSize blocks, which are split up
+// buddy-style into power of two size classes. New allocations go into the
+// fullest block that can take them, so live images pack together and the
+// other blocks can empty out; blocks that stay empty for a while are given
+// back to the driver from garbageCollect.
+// Anything bigger than k_ulMaxSubAllocationSize, or that must be dedicated
+// (imported, exported, flippable or mapped images) does not come through here.
+class CVulkanMemoryAllocator
+{
+public:
+	static constexpr VkDeviceSize k_ulBlockSize = 32 * 1024 * 1024;
+	static constexpr VkDeviceSize k_ulMinAllocationSize = 64 * 1024;
+	static constexpr VkDeviceSize k_ulMaxSubAllocationSize = k_ulBlockSize / 4;
+	// 64KiB ... 32MiB
+	static constexpr uint32_t k_uSizeClassCount = 10;
+	static_assert( ( k_ulMinAllocationSize << ( k_uSizeClassCount - 1 ) ) == k_ulBlockSize );
+
+	static constexpr uint64_t k_ulEmptyBlockLifetimeNs = 2'000'000'000ul;
+
+	void init( CVulkanDevice *pDevice );
+
+	std::optional<VulkanSubAllocation_t> allocate( const VkMemoryRequirements &memRequirements, uint32_t uMemoryType );
+	void free( const VulkanSubAllocation_t &allocation );
+
+	// Releases blocks that have been empty for k_ulEmptyBlockLifetimeNs,
+	// or all empty blocks if bAll.
+	void trim( bool bAll = false );
+
+	// Blocks and dedicated image allocations, for vram_stats.
+	struct Stats_t
+	{
+		uint32_t uBlockCount = 0;
+		VkDeviceSize ulBlockBytes = 0;
+		uint32_t uSubAllocationCount = 0;
+		VkDeviceSize ulSubAllocatedBytes = 0;
+		// Bytes that are free in the blocks, but not in the biggest size
+		// class still available.
+		VkDeviceSize ulFragmentedBytes = 0;
+	};
+	Stats_t stats();
+
+	void noteDedicatedAllocation( VkDeviceSize ulSize, bool bFreed );
+	uint32_t dedicatedAllocationCount() const { return m_uDedicatedAllocationCount.load(); }
+	VkDeviceSize dedicatedAllocationBytes() const { return m_ulDedicatedAllocationBytes.load(); }
+
+private:
+	struct Block_t
+	{
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		uint32_t uMemoryType = 0;
+		VkDeviceSize ulUsed = 0;
+		uint32_t uAllocationCount = 0;
+		uint64_t ulEmptySince = 0;
+		// Offsets of the free ranges of each size class.
+		std::array<std::vector<VkDeviceSize>, k_uSizeClassCount> freeRanges;
+	};
+
+	static VkDeviceSize sizeClassBytes( uint32_t uSizeClass ) { return k_ulMinAllocationSize << uSizeClass; }
+	bool createBlock( uint32_t uMemoryType, uint32_t *puBlockIndex );
+
+	CVulkanDevice *m_pDevice = nullptr;
+	std::mutex m_mutex;
+	// Freed blocks leave a hole (memory == VK_NULL_HANDLE) so indices stay valid.
+	std::vector<Block_t> m_blocks;
+
+	std::atomic<uint32_t> m_uDedicatedAllocationCount = { 0 };
+	std::atomic<VkDeviceSize> m_ulDedicatedAllocationBytes = { 0 };
+};
+
+// GPU timestamps around the passes our command buffers record (upscaling,
+// blur, composite, ReShade, captures...), when gpu_profiling is on.
+//
+// A command buffer gets its own query pool the first time it records a pass.
+// The timestamps are read back without waiting when the command buffer is
+// reset, which only happens once its submission has completed, so this never
+// stalls and results come in a frame or so late.
+// Each pass keeps rolling stats for gpu_pass_stats and is sent to gpuvis as a
+// "gpu" marker, placed on the CPU timeline with VK_EXT_calibrated_timestamps
+// when the driver has it. Placed passes also go on the GPU track of
+// trace_dump's traces.
+class CVulkanGPUProfiler
+{
+public:
+	static constexpr uint32_t k_uMaxPassesPerCmdBuffer = 16;
+	// How many of the most recent samples of a pass its stats are over.
+	static constexpr uint32_t k_uHistoryLength = 128;
+	// The GPU and CPU clocks drift apart, recalibrate this often.
+	static constexpr uint64_t k_ulCalibrationIntervalNs = 1'000'000'000ul;
+
+	void init( CVulkanDevice *pDevice, bool bSupportsCalibratedTimestamps );
+
+	bool enabled() const;
+	bool supportsQueueFamily( uint32_t uQueueFamily ) const;
+
+	VkQueryPool createQueryPool();
+
+	// Reads back the timestamps of a command buffer whose submission has completed.
+	void resolve( VkQueryPool queryPool, uint32_t uQueueFamily, std::span<const char * const> passNames, bool bBackground );
+
+	struct PassTiming_t
+	{
+		const char *pszName = nullptr;
+		bool bBackground = false;
+		// CLOCK_MONOTONIC, 0 if we have no calibration.
+		uint64_t ulBeginNs = 0;
+		uint64_t ulDurationNs = 0;
+	};
+
+	struct PassStats_t
+	{
+		const char *pszName = nullptr;
+		bool bBackground = false;
+		uint64_t ulTotalSamples = 0;
+		float flLastMs = 0.0f;
+		float flAverageMs = 0.0f;
+		float flMaxMs = 0.0f;
+	};
+	std::vector<PassStats_t> stats();
+	void resetStats();
+
+private:
+	struct PassHistory_t
+	{
+		const char *pszName = nullptr;
+		std::array<float, k_uHistoryLength> flDurationsMs{};
+		uint32_t uNext = 0;
+		uint32_t uCount = 0;
+		uint64_t ulTotalSamples = 0;
+	};
+
+	bool calibrate( uint64_t ulNow );
+	void recordPass( const PassTiming_t &pass, uint64_t ulNow );
+
+	CVulkanDevice *m_pDevice = nullptr;
+	float m_flTimestampPeriodNs = 0.0f;
+	std::vector<uint32_t> m_queueFamilyTimestampBits;
+	bool m_bCanCalibrate = false;
+
+	std::mutex m_mutex;
+	uint64_t m_ulLastCalibration = 0;
+	uint64_t m_ulCalibrationTicks = 0;
+	uint64_t m_ulCalibrationNs = 0;
+	// By name and whether it ran on the background queue.
+	std::map<std::pair<std::string_view, bool>, PassHistory_t> m_passes;
+};
+
 class CVulkanDevice
 {
 public:
@@ -770,23 +1090,25 @@ public:
 	VkSampler sampler(SamplerState key);
 	VkPipeline pipeline(ShaderType type, uint32_t layerCount = 1, uint32_t ycbcrMask = 0, uint32_t blur_layers = 0, uint32_t colorspace_mask = 0, uint32_t output_eotf = EOTF_Gamma22, bool itm_enable = false);
 	int32_t findMemoryType( VkMemoryPropertyFlags properties, uint32_t requiredTypeBits );
-	std::unique_ptr<CVulkanCmdBuffer> commandBuffer();
+	// Background command buffers go to the background queue when there is one.
+	std::unique_ptr<CVulkanCmdBuffer> commandBuffer( bool bBackground = false );
 	uint64_t submit( std::unique_ptr<CVulkanCmdBuffer> cmdBuf);
 	uint64_t submitInternal( CVulkanCmdBuffer* cmdBuf );
 	void wait(uint64_t sequence, bool reset = true);
 	void waitIdle(bool reset = true);
 	void garbageCollect();
-	inline VkDescriptorSet descriptorSet()
-	{
-		VkDescriptorSet ret = m_descriptorSets[m_currentDescriptorSet];
-		m_currentDescriptorSet = (m_currentDescriptorSet + 1) % m_descriptorSets.size();
-		return ret;
-	}
+	uint64_t completedSeqNo();
+	uint64_t completedBackgroundSeqNo();
+	inline bool hasBackgroundQueue() {return m_bHasBackgroundQueue;}
+	VkDescriptorSet descriptorSet( const DescriptorSetKey_t &key, bool bBackground, uint32_t *puIndex, bool *pbNeedsWrite, std::optional<DescriptorSetKey_t> *pPreviousKey );
 
 	std::shared_ptr<VulkanTimelineSemaphore_t> CreateTimelineSemaphore( uint64_t ulStartingPoint, bool bShared = false );
 	std::shared_ptr<VulkanTimelineSemaphore_t> ImportTimelineSemaphore( gamescope::CTimeline *pTimeline );
 
 	static const uint32_t upload_buffer_size = 1920 * 1080 * 4;
+	// The uniform buffer is bound with a dynamic offset into the upload buffer,
+	// and this range past it.
+	static const uint32_t upload_buffer_uniform_range = 4096;
 
 	inline VkDevice device() { return m_device; }
 	inline VkPhysicalDevice physDev() {return m_physDev; }
@@ -805,6 +1127,18 @@ public:
 	inline dev_t primaryDevId() {return m_drmPrimaryDevId;}
 	inline bool supportsFp16() {return m_bSupportsFp16;}
 	inline std::vector<VkExtensionProperties>& supportedExtensions() {return m_supportedExts;}
+	inline CVulkanMemoryAllocator &memoryAllocator() {return m_memoryAllocator;}
+	inline const VkPhysicalDeviceMemoryProperties &memoryProperties() {return m_memoryProperties;}
+	inline bool supportsMemoryBudget() {return m_bSupportsMemoryBudget;}
+	inline CVulkanGPUProfiler &gpuProfiler() {return m_gpuProfiler;}
+
+	// VK_EXT_memory_budget, per memory heap. False if unsupported.
+	struct MemoryBudget_t
+	{
+		std::array<VkDeviceSize, VK_MAX_MEMORY_HEAPS> ulHeapBudget{};
+		std::array<VkDeviceSize, VK_MAX_MEMORY_HEAPS> ulHeapUsage{};
+	};
+	bool queryMemoryBudget( MemoryBudget_t *pBudget );
 
 	inline std::pair<void *, uint32_t> uploadBufferData(uint32_t size)
 	{
@@ -824,6 +1158,20 @@ public:
 		return std::make_pair( ptr, uOffset );
 	}
 
+	// A persistent ring of host visible memory for uploads that are too big
+	// for the upload buffer or must not stall waiting for the device to go
+	// idle (eg. wl_shm buffers).
+	// Space is handed back per submission: everything allocated since the
+	// last retireStagingData is reused once ulSeqNo has completed.
+	struct StagingAllocation_t
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VkDeviceSize ulOffset = 0;
+		uint8_t *pData = nullptr;
+	};
+	std::optional<StagingAllocation_t> stagingBufferData( VkDeviceSize ulSize );
+	void retireStagingData( uint64_t ulSeqNo );
+
 	#define VK_FUNC(x) PFN_vk##x x = nullptr;
 	struct
 	{
@@ -868,10 +1216,14 @@ protected:
 	bool m_bSupportsFp16 = false;
 	bool m_bHasDrmPrimaryDevId = false;
 	bool m_bSupportsModifiers = false;
+	bool m_bSupportsMemoryBudget = false;
+	bool m_bSupportsCalibratedTimestamps = false;
 	bool m_bInitialized = false;
 
 
 	VkPhysicalDeviceMemoryProperties m_memoryProperties;
+	CVulkanMemoryAllocator m_memoryAllocator;
+	CVulkanGPUProfiler m_gpuProfiler;
 
 	std::unordered_map< SamplerState, VkSampler > m_samplerCache;
 	std::array<VkShaderModule, SHADER_TYPE_COUNT> m_shaderModules;
@@ -880,22 +1232,77 @@ protected:
 
 	static constexpr uint32_t k_uMaxConcurrentSubmits = 8;
 
-	// currently just one set, no need to double buffer because we
-	// vkQueueWaitIdle after each submit.
+	// Descriptor sets are cached by what is bound to them, so repeated
+	// dispatches with the same textures (every tile of an incremental
+	// composite, or the same client buffers coming around again) do not need
+	// any updates.
+	// Only the least recently used set gets rewritten, which was used at least
+	// m_descriptorSets.size() dispatches ago, like when these were a ring.
 	// should be moved to the output if we are going to support multiple outputs
 	std::array<VkDescriptorSet, k_uMaxConcurrentSubmits * 3> m_descriptorSets;
-	uint32_t m_currentDescriptorSet = 0;
+	std::array<std::optional<DescriptorSetKey_t>, k_uMaxConcurrentSubmits * 3> m_descriptorSetKeys;
+	std::array<uint64_t, k_uMaxConcurrentSubmits * 3> m_descriptorSetLastUse{};
+	std::unordered_map<DescriptorSetKey_t, uint32_t> m_descriptorSetLookup;
+	uint64_t m_ulDescriptorSetUseCount = 0;
+	std::mutex m_descriptorSetMutex;
 
 	VkBuffer m_uploadBuffer;
 	VkDeviceMemory m_uploadBufferMemory;
 	void *m_uploadBufferData;
 	uint32_t m_uploadBufferOffset = 0;
 
+	static constexpr VkDeviceSize k_ulMinStagingBufferSize = 32 * 1024 * 1024;
+	bool seqNoCompleted( uint64_t ulSeqNo );
+	bool createStagingBuffer( VkDeviceSize ulSize );
+	void destroyStagingBuffer();
+	VkBuffer m_stagingBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory m_stagingBufferMemory = VK_NULL_HANDLE;
+	uint8_t *m_pStagingBufferData = nullptr;
+	VkDeviceSize m_ulStagingBufferSize = 0;
+	VkDeviceSize m_ulStagingBufferHead = 0;
+	struct StagingRange_t
+	{
+		VkDeviceSize ulBegin;
+		VkDeviceSize ulEnd;
+		// 0 until retired.
+		uint64_t ulSeqNo;
+	};
+	// Oldest first.
+	std::deque<StagingRange_t> m_stagingRanges;
+
 	VkSemaphore m_scratchTimelineSemaphore;
 	std::atomic<uint64_t> m_submissionSeqNo = { 0 };
 	std::vector<std::unique_ptr<CVulkanCmdBuffer>> m_unusedCmdBufs;
 	std::map<uint64_t, std::unique_ptr<CVulkanCmdBuffer>> m_pendingCmdBufs;
 
+	// A second queue on the same family for work that is not needed for the
+	// next scanout, so it does not queue up in front of work that is.
+	// Its lower relative priority is only a hint, which most drivers ignore.
+	// It has its own timeline, and its seq nos are handed out with
+	// k_ulBackgroundSeqNoBit set so wait() knows which one to look at.
+	static constexpr uint64_t k_ulBackgroundSeqNoBit = 1ull << 63;
+	bool m_bHasBackgroundQueue = false;
+	VkQueue m_backgroundQueue = nullptr;
+	VkSemaphore m_backgroundTimelineSemaphore = VK_NULL_HANDLE;
+	std::atomic<uint64_t> m_backgroundSubmissionSeqNo = { 0 };
+	std::map<uint64_t, std::unique_ptr<CVulkanCmdBuffer>> m_pendingBackgroundCmdBufs;
+
+	std::map<uint64_t, std::unique_ptr<CVulkanCmdBuffer>> &pendingCmdBufs( uint64_t sequence )
+	{
+		return ( sequence & k_ulBackgroundSeqNoBit ) ? m_pendingBackgroundCmdBufs : m_pendingCmdBufs;
+	}
+
+	// Descriptor sets used by background work cannot be recycled based on
+	// how many dispatches ago they were last used, as the main queue can
+	// run ahead of it.
+	// While a background buffer is being recorded its sets are held by
+	// count, once it is submitted they are pinned until its seq no completes.
+	// Both of these take the indices over from the command buffer.
+	void pinBackgroundDescriptorSets( std::vector<uint32_t> &indices, uint64_t ulSeqNo );
+	void releaseBackgroundDescriptorSets( std::vector<uint32_t> &indices );
+	std::array<uint32_t, k_uMaxConcurrentSubmits * 3> m_descriptorSetBackgroundHolds{};
+	std::array<uint64_t, k_uMaxConcurrentSubmits * 3> m_descriptorSetBackgroundSeqNo{};
+
 private:
 	std::vector<VkExtensionProperties> m_supportedExts;
 };
@@ -944,21 +1351,42 @@ public:
 	void uploadConstants(Args&&... args);
 	void bindPipeline(VkPipeline pipeline);
 	void dispatch(uint32_t x, uint32_t y = 1, uint32_t z = 1);
+	// Like dispatch, but gl_WorkGroupID starts at baseX/baseY.
+	void dispatchBase(uint32_t baseX, uint32_t baseY, uint32_t x, uint32_t y);
 	void copyImage(gamescope::Rc<CVulkanTexture> src, gamescope::Rc<CVulkanTexture> dst);
 	void copyBufferToImage(VkBuffer buffer, VkDeviceSize offset, uint32_t stride, gamescope::Rc<CVulkanTexture> dst);
+	// Only touches the given regions, the rest of dst is preserved.
+	void copyBufferRegionsToImage(VkBuffer buffer, std::span<const VkBufferImageCopy> regions, gamescope::Rc<CVulkanTexture> dst);
+
+	// Times what is recorded in between on the GPU, for gpu_pass_stats.
+	// Does nothing unless gpu_profiling is on. pszName must outlive the
+	// command buffer's submission (ie. a string literal).
+	void beginPass(const char *pszName);
+	void endPass();
 
 
 	void prepareSrcImage(CVulkanTexture *image);
 	void prepareDestImage(CVulkanTexture *image);
 	void discardImage(CVulkanTexture *image);
+	// Keeps the existing contents of a target we only partially write to.
+	void preserveImage(CVulkanTexture *image);
 	void markDirty(CVulkanTexture *image);
 	void insertBarrier(bool flush = false);
+	void prepareDispatch();
+	void writeDescriptorSet(VkDescriptorSet descriptorSet, const DescriptorSetKey_t &key, const std::optional<DescriptorSetKey_t> &previousKey);
 
 	VkQueue queue() { return m_queue; }
 	uint32_t queueFamily() { return m_queueFamily; }
+	void setQueue(VkQueue queue, bool background);
+	bool background() { return m_bBackground; }
+	std::vector<uint32_t> &backgroundDescriptorSets() { return m_backgroundDescriptorSets; }
 
 	void AddDependency( std::shared_ptr<VulkanTimelineSemaphore_t> pTimelineSemaphore, uint64_t ulPoint );
 	void AddSignal( std::shared_ptr<VulkanTimelineSemaphore_t> pTimelineSemaphore, uint64_t ulPoint );
+	// Waits for a main queue submission before running. Only needed on the
+	// background queue, the main queue executes in submission order.
+	void AddMainQueueDependency( uint64_t ulSeqNo );
+	uint64_t GetMainQueueDependency() const { return m_ulMainQueueDependency; }
 
 	const std::vector<VulkanTimelinePoint_t> &GetExternalDependencies() const { return m_ExternalDependencies; }
 	const std::vector<VulkanTimelinePoint_t> &GetExternalSignals() const { return m_ExternalSignals; }
@@ -969,6 +1397,8 @@ private:
 
 	VkQueue m_queue;
 	uint32_t m_queueFamily;
+	VkQueue m_defaultQueue;
+	bool m_bBackground = false;
 
 	// Per Use State
 	std::vector<gamescope::Rc<CVulkanTexture>> m_textureRefs;
@@ -985,8 +1415,18 @@ private:
 
 	std::vector<VulkanTimelinePoint_t> m_ExternalDependencies;
 	std::vector<VulkanTimelinePoint_t> m_ExternalSignals;
+	uint64_t m_ulMainQueueDependency = 0;
+
+	// Indices of the descriptor sets this (background) buffer uses.
+	std::vector<uint32_t> m_backgroundDescriptorSets;
 
 	uint32_t m_renderBufferOffset = 0;
+
+	// gpu_profiling, see CVulkanGPUProfiler.
+	VkQueryPool m_queryPool = VK_NULL_HANDLE;
+	std::array<const char *, CVulkanGPUProfiler::k_uMaxPassesPerCmdBuffer> m_passNames{};
+	uint32_t m_uPassCount = 0;
+	bool m_bInPass = false;
 };
 
 uint32_t VulkanFormatToDRM( VkFormat vkFormat, std::optional<bool> obHasAlphaOverride = std::nullopt );
@@ -1787,6 +1787,7 @@ uint64_t ReshadeEffectPipeline::execute(gamescope::Rc<CVulkanTexture> inImage, g
     // Draw and compute time!
     m_cmdBuffer->reset();
     m_cmdBuffer->begin();
+    m_cmdBuffer->beginPass("reshade");
 
     VkCommandBuffer cmd = m_cmdBuffer->rawBuffer();
     device->vk.CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, std::size(m_descriptorSets), m_descriptorSets, 0, nullptr);
@@ -1914,6 +1915,7 @@ uint64_t ReshadeEffectPipeline::execute(gamescope::Rc<CVulkanTexture> inImage, g
     if (lastRT)
         *outImage = lastRT;
 
+    m_cmdBuffer->endPass();
     return device->submitInternal(&*m_cmdBuffer);
 }
 
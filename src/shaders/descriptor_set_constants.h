@@ -10,5 +10,6 @@
 #define VKR_NIS_COEF_USM_SLOT    (VKR_NIS_COEF_SCALER_SLOT + 1u)
 
 #define VKR_LUT3D_COUNT 2 // Must match EOTF_Count
+#define VKR_LUT3D_EDGE_SIZE 17 // Must match s_nLutEdgeSize3d
 
 #endif
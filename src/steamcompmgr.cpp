@@ -70,6 +70,7 @@
 #endif
 #include <sys/socket.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -96,8 +97,13 @@
 #include "commit.h"
 #include "reshade_effect_manager.hpp"
 #include "BufferMemo.h"
+#include "VRAMArbiter.h"
+#include "layer_defines.h"
 #include "Utils/Process.h"
 #include "Utils/Algorithm.h"
+#include "Utils/FrameArena.h"
+#include "Utils/HeapStats.h"
+#include "Utils/Trace.h"
 
 #include "wlr_begin.hpp"
 #include "wlr/types/wlr_pointer_constraints_v1.h"
@@ -128,7 +134,8 @@ LogScope g_WaitableLog("waitable");
 
 gamescope::ConVar<bool> cv_overlay_unmultiplied_alpha{ "overlay_unmultiplied_alpha", false };
 
-gamescope::ConVar<bool> cv_vr_show_forwarded_overlays{ "vr_show_forwarded_overlays", false };
+void MakeFocusDirty();
+gamescope::ConVar<bool> cv_vr_show_forwarded_overlays{ "vr_show_forwarded_overlays", false, "", []( gamescope::ConVar<bool> & ) { MakeFocusDirty(); } };
 
 std::string *g_pVROverlayKey = nullptr;
 bool g_bWasPartialComposite = false;
@@ -183,86 +190,14 @@ namespace gamescope
 	extern std::shared_ptr<INestedHints::CursorInfo> GetX11HostCursor();
 }
 
-static std::unordered_map<std::string, uint64_t> g_vramCapacities;
-
-static const char *cgroupPathFromPID(pid_t pid) {
-	if (!pid)
-		return NULL;
-
-	char procfsPath[512];
-	if (snprintf(procfsPath, 512, "/proc/%ld/cgroup", (long)pid) < 0)
-		return NULL;
-
-	FILE *procfsFile = fopen(procfsPath, "r");
-	if (!procfsFile)
-		return NULL;
-
-	char *retPath = NULL;
-
-	char *line = NULL;
-	size_t lineSize;
-	while (getline(&line, &lineSize, procfsFile) > 0) {
-		/* cgroup v2 pathsi are always in the format "0::$PATH" */
-		const char *pathHeader = "0::";
-		/* Does the line start with "0::"? */
-		if (strncmp(line, pathHeader, strlen(pathHeader)))
-			continue;
-		char *path = line;
-		/* Skip over the header */
-		path = path + strlen(pathHeader);
-
-		/* According to https://docs.kernel.org/admin-guide/cgroup-v2.html,
-		 * (deleted) is added to the path if pid refers to a zombie process,
-		 * and the process's cgroup has been deleted.
-		 * It's nonsensical for us to try setting cgroup limits in such a case,
-		 * so bail out.
-		 */
-		if (strstr(path, "(deleted)"))
-			break;
-
-		/* Remove trailing newlines. */
-		char *delim = strstr(path, "\n");
-		if (delim)
-			*delim = '\0';
-
-		retPath = strdup(path);
-		break;
-	}
-
-	free(line);
-	fclose(procfsFile);
-	return retPath;
-}
-
-static int setDMemMemoryLow(const char *cgroupPath, bool focused) {
-	char *limitPath;
-
-	int r = asprintf(&limitPath, "/sys/fs/cgroup%s/dmem.low", cgroupPath);
-	if (r < 0)
-		return r;
-
-	FILE *limitFile = fopen(limitPath, "w");
-
-	free(limitPath);
-	if (!limitFile)
-		return -1;
-
-	for (const auto& cap : g_vramCapacities) {
-		fprintf(limitFile, "%s %" PRIu64 "\n", cap.first.c_str(), focused ? cap.second : 0);
-	}
-
-	fclose(limitFile);
-	return 0;
-}
-
-static std::vector< steamcompmgr_win_t* > GetGlobalPossibleFocusWindows();
+static gamescope::FrameVector< steamcompmgr_win_t* > GetGlobalPossibleFocusWindows();
 static bool
 pick_primary_focus_and_override(
 	focus_t *out,
 	Window focusControlWindow,
-	const std::vector<steamcompmgr_win_t*>& vecPossibleFocusWindows,
+	const gamescope::FrameVector< steamcompmgr_win_t* >& vecPossibleFocusWindows,
 	bool globalFocus,
-	const std::vector<uint32_t>& ctxFocusControlAppIDs,
+	std::span<const uint32_t> ctxFocusControlAppIDs,
 	uint64_t ulVirtualFocusKey = 0,
 	gamescope::VirtualConnectorStrategy eStrategy = gamescope::VirtualConnectorStrategies::PerWindow);
 
@@ -298,6 +233,7 @@ gamescope::ConVar<int> cv_adaptive_sync_overlay_cycles( "adaptive_sync_overlay_c
 
 gamescope::ConVar<bool> cv_upscale_preemptive( "upscale_preemptive", true, "Allow pre-emptive upscaling" );
 gamescope::ConVar<bool> cv_upscale_preemptive_debug_force_sync( "upscale_preemptive_debug_force_sync", false, "Force synchronize pre-emptive upscaling" );
+gamescope::ConVar<bool> cv_upscale_preemptive_background_queue( "upscale_preemptive_background_queue", true, "Run pre-emptive upscaling on the background queue, if there is one, so it does not queue up in front of the composite. It is not given a lower priority on the GPU." );
 
 uint64_t g_SteamCompMgrLimitedAppRefreshCycle = 16'666'666;
 uint64_t g_SteamCompMgrAppRefreshCycle = 16'666'666;
@@ -323,6 +259,210 @@ static const gamescope_color_mgmt_t k_ScreenshotColorMgmtHDR =
 //#define COLOR_MGMT_MICROBENCH
 // sudo cpupower frequency-set --governor performance
 
+// Quantized LUTs of color management states we computed before, so going
+// back to one (toggling HDR, replugging a display, a slider returning to
+// where it was) doesn't redo the whole calcColorTransform.
+//
+// Entries are keyed by the bytes of everything create_color_mgmt_luts reads
+// for one input EOTF, with the look LUT folded in as a hash of its content.
+// If color_lut_cache_dir is set, entries are also kept there across runs.
+
+static gamescope::ConVar<bool> cv_color_mgmt_gpu_lut3d{ "color_mgmt_gpu_lut3d", false, "Evaluate the color management 3D LUTs in a compute shader rather than on the CPU, when the backend has no use for the CPU copy." };
+extern gamescope::ConVar<std::string> cv_color_lut_cache_dir;
+
+class CColorMgmtLutCache
+{
+public:
+	static constexpr uint32_t k_uMaxEntries = 16;
+
+	class Key
+	{
+	public:
+		template <typename T>
+		void Add( const T &value )
+		{
+			static_assert( std::is_trivially_copyable_v<T> );
+			const uint8_t *pBytes = reinterpret_cast<const uint8_t *>( &value );
+			m_Bytes.insert( m_Bytes.end(), pBytes, pBytes + sizeof( T ) );
+		}
+
+		uint64_t Hash() const { return HashBytes( m_Bytes.data(), m_Bytes.size() ); }
+
+		const std::vector<uint8_t> &Bytes() const { return m_Bytes; }
+
+		bool operator == ( const Key & ) const = default;
+	private:
+		std::vector<uint8_t> m_Bytes;
+	};
+
+	static uint64_t HashBytes( const void *pData, size_t ulSize, uint64_t ulHash = 0xcbf29ce484222325ull )
+	{
+		// FNV-1a
+		const uint8_t *pBytes = static_cast<const uint8_t *>( pData );
+		for ( size_t i = 0; i < ulSize; i++ )
+		{
+			ulHash ^= pBytes[i];
+			ulHash *= 0x100000001b3ull;
+		}
+		return ulHash;
+	}
+
+	bool Lookup( const Key &key, gamescope_color_mgmt_luts &outLuts )
+	{
+		for ( auto iter = m_Entries.begin(); iter != m_Entries.end(); iter++ )
+		{
+			if ( iter->key == key )
+			{
+				memcpy( outLuts.lut1d, iter->lut1d.data(), sizeof( outLuts.lut1d ) );
+				memcpy( outLuts.lut3d, iter->lut3d.data(), sizeof( outLuts.lut3d ) );
+
+				// Most recently used goes last.
+				std::rotate( iter, iter + 1, m_Entries.end() );
+				return true;
+			}
+		}
+
+		Entry_t entry;
+		if ( !ReadFromDisk( key, entry ) )
+			return false;
+
+		memcpy( outLuts.lut1d, entry.lut1d.data(), sizeof( outLuts.lut1d ) );
+		memcpy( outLuts.lut3d, entry.lut3d.data(), sizeof( outLuts.lut3d ) );
+		Insert( std::move( entry ) );
+		return true;
+	}
+
+	void Store( Key key, const gamescope_color_mgmt_luts &luts )
+	{
+		Entry_t entry;
+		entry.key = std::move( key );
+		entry.lut1d.assign( std::begin( luts.lut1d ), std::end( luts.lut1d ) );
+		entry.lut3d.assign( std::begin( luts.lut3d ), std::end( luts.lut3d ) );
+
+		WriteToDisk( entry );
+		Insert( std::move( entry ) );
+	}
+
+private:
+	struct Entry_t
+	{
+		Key key;
+		std::vector<uint16_t> lut1d;
+		std::vector<uint16_t> lut3d;
+	};
+
+	static constexpr char k_szMagic[8] = { 'G', 'S', 'L', 'U', 'T', 'v', '0', '1' };
+
+	void Insert( Entry_t entry )
+	{
+		if ( m_Entries.size() >= k_uMaxEntries )
+			m_Entries.erase( m_Entries.begin() );
+		m_Entries.emplace_back( std::move( entry ) );
+	}
+
+	static std::string PathForKey( const Key &key )
+	{
+		std::string_view svDir = cv_color_lut_cache_dir;
+		if ( svDir.empty() )
+			return std::string{};
+
+		char szName[32];
+		snprintf( szName, sizeof( szName ), "/%016" PRIx64 ".lut", key.Hash() );
+		return std::string{ svDir } + szName;
+	}
+
+	// File layout: magic, key size, key, LUT data as native endian u16s.
+	// The key is stored in full so a hash collision is just a miss.
+	static bool ReadFromDisk( const Key &key, Entry_t &outEntry )
+	{
+		std::string sPath = PathForKey( key );
+		if ( sPath.empty() )
+			return false;
+
+		FILE *pFile = fopen( sPath.c_str(), "rb" );
+		if ( !pFile )
+			return false;
+		defer( fclose( pFile ) );
+
+		char szMagic[sizeof( k_szMagic )];
+		uint32_t uKeySize = 0;
+		if ( fread( szMagic, sizeof( szMagic ), 1, pFile ) != 1 ||
+		     memcmp( szMagic, k_szMagic, sizeof( k_szMagic ) ) != 0 ||
+		     fread( &uKeySize, sizeof( uKeySize ), 1, pFile ) != 1 ||
+		     uKeySize != key.Bytes().size() )
+			return false;
+
+		std::vector<uint8_t> keyBytes( uKeySize );
+		if ( fread( keyBytes.data(), 1, keyBytes.size(), pFile ) != keyBytes.size() ||
+		     keyBytes != key.Bytes() )
+			return false;
+
+		outEntry.key = key;
+		outEntry.lut1d.resize( sizeof( gamescope_color_mgmt_luts::lut1d ) / sizeof( uint16_t ) );
+		outEntry.lut3d.resize( sizeof( gamescope_color_mgmt_luts::lut3d ) / sizeof( uint16_t ) );
+		if ( fread( outEntry.lut1d.data(), sizeof( uint16_t ), outEntry.lut1d.size(), pFile ) != outEntry.lut1d.size() ||
+		     fread( outEntry.lut3d.data(), sizeof( uint16_t ), outEntry.lut3d.size(), pFile ) != outEntry.lut3d.size() )
+			return false;
+
+		return true;
+	}
+
+	static void WriteToDisk( const Entry_t &entry )
+	{
+		std::string sPath = PathForKey( entry.key );
+		if ( sPath.empty() )
+			return;
+
+		// Write it out under a temporary name first so nobody ever sees
+		// half of a file.
+		std::string sTempPath = sPath + ".tmp";
+		FILE *pFile = fopen( sTempPath.c_str(), "wb" );
+		if ( !pFile )
+		{
+			xwm_log.errorf_errno( "Failed to open color LUT cache file %s", sTempPath.c_str() );
+			return;
+		}
+
+		const uint32_t uKeySize = entry.key.Bytes().size();
+		bool bSuccess =
+			fwrite( k_szMagic, sizeof( k_szMagic ), 1, pFile ) == 1 &&
+			fwrite( &uKeySize, sizeof( uKeySize ), 1, pFile ) == 1 &&
+			fwrite( entry.key.Bytes().data(), 1, uKeySize, pFile ) == uKeySize &&
+			fwrite( entry.lut1d.data(), sizeof( uint16_t ), entry.lut1d.size(), pFile ) == entry.lut1d.size() &&
+			fwrite( entry.lut3d.data(), sizeof( uint16_t ), entry.lut3d.size(), pFile ) == entry.lut3d.size();
+		bSuccess = fclose( pFile ) == 0 && bSuccess;
+
+		if ( !bSuccess || rename( sTempPath.c_str(), sPath.c_str() ) != 0 )
+		{
+			xwm_log.errorf_errno( "Failed to write color LUT cache file %s", sPath.c_str() );
+			unlink( sTempPath.c_str() );
+		}
+	}
+
+	std::vector<Entry_t> m_Entries;
+};
+
+static CColorMgmtLutCache s_ColorMgmtLutCache;
+
+static uint64_t
+get_color_mgmt_look_hash( uint32_t nInputEOTF, const std::shared_ptr<lut3d_t> &pLook )
+{
+	if ( !pLook )
+		return 0;
+
+	// Looks never change once loaded, only hash each one once.
+	// Hold on to the look, so a new one can't get the address of
+	// a freed one and pick up its hash.
+	static std::array<std::pair<std::shared_ptr<lut3d_t>, uint64_t>, EOTF_Count> s_LookHashes;
+	if ( s_LookHashes[nInputEOTF].first != pLook )
+	{
+		uint64_t ulHash = CColorMgmtLutCache::HashBytes( &pLook->lutEdgeSize, sizeof( pLook->lutEdgeSize ) );
+		ulHash = CColorMgmtLutCache::HashBytes( pLook->data.data(), pLook->data.size() * sizeof( glm::vec3 ), ulHash );
+		s_LookHashes[nInputEOTF] = { pLook, ulHash };
+	}
+	return s_LookHashes[nInputEOTF].second;
+}
+
 static void
 create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_color_mgmt_luts outColorMgmtLuts[ EOTF_Count ])
 {
@@ -331,10 +471,16 @@ create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_col
 
 	for ( uint32_t nInputEOTF = 0; nInputEOTF < EOTF_Count; nInputEOTF++ )
 	{
-		if (!outColorMgmtLuts[nInputEOTF].vk_lut1d)
+		// Upload into the spare pair, frames already queued keep sampling
+		// the current one. If something still holds on to the spare besides
+		// us, it gets replaced rather than waited on.
+		std::swap( outColorMgmtLuts[nInputEOTF].vk_lut1d, outColorMgmtLuts[nInputEOTF].vk_lut1dSpare );
+		std::swap( outColorMgmtLuts[nInputEOTF].vk_lut3d, outColorMgmtLuts[nInputEOTF].vk_lut3dSpare );
+
+		if (!outColorMgmtLuts[nInputEOTF].vk_lut1d || outColorMgmtLuts[nInputEOTF].vk_lut1d->GetRefCount() > 1)
 			outColorMgmtLuts[nInputEOTF].vk_lut1d = vulkan_create_1d_lut(s_nLutSize1d);
 
-		if (!outColorMgmtLuts[nInputEOTF].vk_lut3d)
+		if (!outColorMgmtLuts[nInputEOTF].vk_lut3d || outColorMgmtLuts[nInputEOTF].vk_lut3d->GetRefCount() > 1)
 			outColorMgmtLuts[nInputEOTF].vk_lut3d = vulkan_create_3d_lut(s_nLutEdgeSize3d, s_nLutEdgeSize3d, s_nLutEdgeSize3d);
 
 		if ( g_ColorMgmtLutsOverride[nInputEOTF].HasLuts() )
@@ -422,7 +568,39 @@ create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_col
 				buildPQColorimetry( &inputColorimetry, &colorMapping, displayColorimetry );
 			}
 
-			calcColorTransform<s_nLutEdgeSize3d>( &g_tmpLut1d, s_nLutSize1d, &g_tmpLut3d, inputColorimetry, inputEOTF,
+			CColorMgmtLutCache::Key key;
+			key.Add( k_uColorTransformVersion );
+			key.Add( nInputEOTF );
+			key.Add( inputColorimetry );
+			key.Add( colorMapping );
+			// Field by field, tonemapping_t has padding after bUseShaper.
+			key.Add( tonemapping.bUseShaper );
+			key.Add( tonemapping.g22_luminance );
+			key.Add( tonemapping.eOperator );
+			key.Add( tonemapping.eetf2390 );
+			key.Add( outputEncodingColorimetry );
+			key.Add( newColorMgmt.outputEncodingEOTF );
+			key.Add( newColorMgmt.outputVirtualWhite );
+			key.Add( newColorMgmt.chromaticAdaptationMode );
+			key.Add( newColorMgmt.nightmode );
+			key.Add( flGain );
+			key.Add( get_color_mgmt_look_hash( nInputEOTF, pLook ? pSharedLook : nullptr ) );
+
+			if ( s_ColorMgmtLutCache.Lookup( key, outColorMgmtLuts[nInputEOTF] ) )
+			{
+				outColorMgmtLuts[nInputEOTF].bHasLut1D = true;
+				outColorMgmtLuts[nInputEOTF].bHasLut3D = true;
+
+				vulkan_update_luts(outColorMgmtLuts[nInputEOTF].vk_lut1d, outColorMgmtLuts[nInputEOTF].vk_lut3d, outColorMgmtLuts[nInputEOTF].lut1d, outColorMgmtLuts[nInputEOTF].lut3d);
+				continue;
+			}
+
+			// KMS needs the CPU copy of the 3D LUT, otherwise it can be
+			// evaluated straight into the image. The shaper is cheap and
+			// needed for the 3D LUT's edges anyway, that stays here.
+			const bool bGpuLut3D = cv_color_mgmt_gpu_lut3d && vulkan_supports_color_lut3d_compute() && !GetBackend()->NeedsColorMgmtLutData();
+
+			calcColorTransform<s_nLutEdgeSize3d>( &g_tmpLut1d, s_nLutSize1d, bGpuLut3D ? nullptr : &g_tmpLut3d, inputColorimetry, inputEOTF,
 				outputEncodingColorimetry, newColorMgmt.outputEncodingEOTF,
 				newColorMgmt.outputVirtualWhite, newColorMgmt.chromaticAdaptationMode,
 				colorMapping, newColorMgmt.nightmode, tonemapping, pLook, flGain );
@@ -436,6 +614,35 @@ create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_col
 				outColorMgmtLuts[nInputEOTF].lut1d[4*i+3] = 0;
 			}
 
+			if ( bGpuLut3D )
+			{
+				colorlut3d_compute_params_t params;
+				calcColorTransformComputeParams( &params, &g_tmpLut1d, inputColorimetry, inputEOTF,
+					outputEncodingColorimetry, newColorMgmt.outputEncodingEOTF,
+					newColorMgmt.outputVirtualWhite, newColorMgmt.chromaticAdaptationMode,
+					colorMapping, newColorMgmt.nightmode, tonemapping, pLook, flGain );
+
+				if ( !pLook )
+				{
+					outColorMgmtLuts[nInputEOTF].pVkLookSource = nullptr;
+					outColorMgmtLuts[nInputEOTF].vk_look = nullptr;
+				}
+				else if ( outColorMgmtLuts[nInputEOTF].pVkLookSource != pSharedLook )
+				{
+					outColorMgmtLuts[nInputEOTF].pVkLookSource = pSharedLook;
+					outColorMgmtLuts[nInputEOTF].vk_look = vulkan_create_look_lut( *pLook );
+					if ( !outColorMgmtLuts[nInputEOTF].vk_look )
+						outColorMgmtLuts[nInputEOTF].pVkLookSource = nullptr;
+				}
+
+				// Nothing to cache, the CPU copy of the 3D LUT is never filled in.
+				outColorMgmtLuts[nInputEOTF].bHasLut1D = true;
+				outColorMgmtLuts[nInputEOTF].bHasLut3D = true;
+
+				vulkan_update_luts_compute(outColorMgmtLuts[nInputEOTF].vk_lut1d, outColorMgmtLuts[nInputEOTF].vk_lut3d, outColorMgmtLuts[nInputEOTF].lut1d, params, outColorMgmtLuts[nInputEOTF].vk_look);
+				continue;
+			}
+
 			for ( size_t i=0, end = g_tmpLut3d.data.size(); i<end; ++i )
 			{
 				outColorMgmtLuts[nInputEOTF].lut3d[4*i+0] = quantize_lut_value_16bit( g_tmpLut3d.data[i].r );
@@ -443,6 +650,8 @@ create_color_mgmt_luts(const gamescope_color_mgmt_t& newColorMgmt, gamescope_col
 				outColorMgmtLuts[nInputEOTF].lut3d[4*i+2] = quantize_lut_value_16bit( g_tmpLut3d.data[i].b );
 				outColorMgmtLuts[nInputEOTF].lut3d[4*i+3] = 0;
 			}
+
+			s_ColorMgmtLutCache.Store( std::move( key ), outColorMgmtLuts[nInputEOTF] );
 		}
 
 		outColorMgmtLuts[nInputEOTF].bHasLut1D = true;
@@ -1030,6 +1239,7 @@ gamescope::ConCommand cc_debug_set_fps_limit( "debug_set_fps_limit", "Set refres
 });
 
 static int g_nRuntimeInfoFd = -1;
+static GamescopeLayerClient::ControlPage *g_pRuntimeInfoPage = nullptr;
 
 bool g_bFSRActive = false;
 
@@ -1039,7 +1249,7 @@ unsigned int g_BlurFadeDuration = 0;
 int g_BlurRadius = 5;
 unsigned int g_BlurFadeStartTime = 0;
 
-pid_t focusWindow_pid, sdFocusWindow_pid;
+pid_t focusWindow_pid;
 std::atomic<std::shared_ptr<std::string>> focusWindow_engine = nullptr;
 
 focus_t g_steamcompmgr_xdg_focus;
@@ -1326,19 +1536,15 @@ bool xwayland_ctx_t::HasQueuedEvents()
 static steamcompmgr_win_t *
 find_win(xwayland_ctx_t *ctx, Window id, bool find_children = true)
 {
-	steamcompmgr_win_t	*w;
-
 	if (id == None)
 	{
 		return NULL;
 	}
 
-	for (w = ctx->list; w; w = w->xwayland().next)
+	auto iter = ctx->windowsByID.find( id );
+	if ( iter != ctx->windowsByID.end() )
 	{
-		if (w->xwayland().id == id)
-		{
-			return w;
-		}
+		return iter->second;
 	}
 
 	if ( !find_children )
@@ -1390,9 +1596,12 @@ import_commit (
 	std::vector<struct wl_resource*> presentation_feedbacks,
 	std::optional<uint32_t> present_id,
 	uint64_t desired_present_time,
-	bool fifo )
+	bool fifo,
+	const gamescope::DamageRegion &damage,
+	std::shared_ptr<gamescope::CAcquireTimelinePoint> &pUploadPoint )
 {
 	gamescope::Rc<commit_t> commit = new commit_t;
+	GAMESCOPE_TRACE_SPAN( "import_commit", commit->commitID );
 
 	commit->win_seq = w->seq;
 	commit->surf = surf;
@@ -1411,6 +1620,9 @@ import_commit (
 		commit->fifo = false;
 	}
 
+	if ( w->ulLastImportedCommitID && w->pLastImportedCommitSurface == surf )
+		commit->damageHistory = w->lastImportedDamageHistory.Chain( w->ulLastImportedCommitID, damage );
+
 	if ( gamescope::OwningRc<CVulkanTexture> pTexture = s_BufferMemos.LookupVulkanTexture( buf ) )
 	{
 		// Going from OwningRc -> Rc now.
@@ -1424,6 +1636,23 @@ import_commit (
 	{
 		pBackendFb = GetBackend()->ImportDmabufToBackend( &dmabuf );
 	}
+	else
+	{
+		// The contents of a shm buffer change under the same wlr_buffer from
+		// commit to commit, so don't memoize these, upload them into the
+		// window's pool instead. Only the damage since whatever a pooled
+		// texture last held gets copied.
+		if ( !w->pShmTexturePool )
+			w->pShmTexturePool = std::make_shared<CVulkanShmTexturePool>();
+
+		uint64_t ulUploadPoint = 0;
+		commit->vulkanTex = w->pShmTexturePool->Upload( buf, commit->commitID, commit->damageHistory, &ulUploadPoint );
+		if ( commit->vulkanTex == nullptr )
+			return nullptr;
+
+		pUploadPoint = std::make_shared<gamescope::CAcquireTimelinePoint>( w->pShmTexturePool->GetUploadTimeline(), ulUploadPoint );
+		return commit;
+	}
 
 	gamescope::OwningRc<CVulkanTexture> pOwnedTexture = vulkan_create_texture_from_wlr_buffer( buf, std::move( pBackendFb ) );
 	commit->vulkanTex = pOwnedTexture;
@@ -1575,20 +1804,12 @@ MouseCursor::MouseCursor(xwayland_ctx_t *ctx)
 
 void MouseCursor::UpdatePosition()
 {
-	wlserver_lock();
-	struct wlr_pointer_constraint_v1 *pConstraint = wlserver.GetCursorConstraint();
-	m_bConstrained = !!pConstraint;
-	if ( pConstraint && pConstraint->current.cursor_hint.enabled )
-	{
-		m_x = pConstraint->current.cursor_hint.x;
-		m_y = pConstraint->current.cursor_hint.y;
-	}
-	else
-	{
-		m_x = wlserver.mouse_surface_cursorx;
-		m_y = wlserver.mouse_surface_cursory;
-	}
-	wlserver_unlock();
+	// Published by wlserver whenever its lock is released, no need to
+	// contend on the big lock just to read the cursor position.
+	wlserver_t::CursorPositionSnapshot position = wlserver.GetCursorPositionSnapshot();
+	m_bConstrained = position.bConstrained;
+	m_x = position.x;
+	m_y = position.y;
 }
 
 void MouseCursor::checkSuspension()
@@ -2037,6 +2258,8 @@ paint_cached_base_layer(const gamescope::Rc<commit_t>& commit, const BaseLayerIn
 	if (layer->colorspace == GAMESCOPE_APP_TEXTURE_COLORSPACE_SCRGB)
 		layer->ctm = s_scRGB709To2020Matrix;
 	layer->tex = commit->vulkanTex;
+	layer->ulCommitID = commit->commitID;
+	layer->damageHistory = commit->damageHistory;
 
 	layer->filter = base.filter;
 	layer->eAlphaBlendingMode = base.eAlphaBlendingMode;
@@ -2067,6 +2290,13 @@ wlserver_vk_swapchain_feedback* steamcompmgr_get_base_layer_swapchain_feedback()
 }
 
 gamescope::ConVar<bool> cv_paint_debug_pause_base_plane( "paint_debug_pause_base_plane", false, "Pause updates to the base plane." );
+gamescope::ConVar<bool> cv_paint_debug_count_heap_allocations( "paint_debug_count_heap_allocations", false, "Count the heap allocations the compositor thread makes for each painted frame, into paint_debug_heap_allocations. Needs a build with -Dheap_stats=true.",
+[]( gamescope::ConVar<bool> &cvar )
+{
+	if ( cvar && !gamescope::HeapAllocationCountingAvailable() )
+		xwm_log.errorf( "paint_debug_count_heap_allocations: gamescope was built without heap_stats, nothing will be counted." );
+});
+gamescope::ConVar<uint64_t> cv_paint_debug_heap_allocations( "paint_debug_heap_allocations", 0, "Heap allocations made by the compositor thread in paint_all for the last painted frame, if paint_debug_count_heap_allocations is set." );
 
 static FrameInfo_t::Layer_t *
 paint_window_commit( const gamescope::Rc<commit_t> &lastCommit, steamcompmgr_win_t *w, steamcompmgr_win_t *scaleW, struct FrameInfo_t *frameInfo,
@@ -2106,6 +2336,11 @@ paint_window_commit( const gamescope::Rc<commit_t> &lastCommit, steamcompmgr_win
 	layer->filter = ( flags & PaintWindowFlag::NoFilter ) ? GamescopeUpscaleFilter::LINEAR : g_upscaleFilter;
 
 	layer->tex = lastCommit->GetTexture( layer->filter, g_upscaleScaler, layer->colorspace );
+	if ( layer->tex == lastCommit->vulkanTex )
+	{
+		layer->ulCommitID = lastCommit->commitID;
+		layer->damageHistory = lastCommit->damageHistory;
+	}
 
 	if ( flags & PaintWindowFlag::NoScale )
 	{
@@ -2348,10 +2583,10 @@ static void paint_pipewire()
 		static focus_t s_PipewireFocus{};
 		if ( s_PipewireFocus.IsDirty() || bAppIdChange )
 		{
-			std::vector<steamcompmgr_win_t *> vecPossibleFocusWindows = GetGlobalPossibleFocusWindows();
+			gamescope::FrameVector< steamcompmgr_win_t* > vecPossibleFocusWindows = GetGlobalPossibleFocusWindows();
 
-			std::vector<uint32_t> vecAppIds{ uint32_t( ulFocusAppId ) };
-			pick_primary_focus_and_override( &s_PipewireFocus, None, vecPossibleFocusWindows, false, vecAppIds, 0, gamescope::VirtualConnectorStrategies::SteamControlled );
+			const uint32_t uAppId = uint32_t( ulFocusAppId );
+			pick_primary_focus_and_override( &s_PipewireFocus, None, vecPossibleFocusWindows, false, std::span<const uint32_t>{ &uAppId, 1 }, 0, gamescope::VirtualConnectorStrategies::SteamControlled );
 		}
 		pFocus = &s_PipewireFocus;
 	}
@@ -2494,6 +2729,8 @@ paint_all( global_focus_t *pFocus, bool async )
 	if ( !pFocus )
 		return;
 
+	GAMESCOPE_TRACE_SPAN( "paint_all" );
+
 	gamescope::IBackendConnector *pConnector = pFocus->pVirtualConnector.get();
 	if ( !pConnector )
 		pConnector = GetBackend()->GetCurrentConnector();
@@ -3464,9 +3701,9 @@ static bool
 pick_primary_focus_and_override(
 	focus_t *out,
 	Window focusControlWindow,
-	const std::vector<steamcompmgr_win_t*>& vecPossibleFocusWindows,
+	const gamescope::FrameVector< steamcompmgr_win_t* >& vecPossibleFocusWindows,
 	bool globalFocus,
-	const std::vector<uint32_t>& ctxFocusControlAppIDs,
+	std::span<const uint32_t> ctxFocusControlAppIDs,
 	uint64_t ulVirtualFocusKey,
 	gamescope::VirtualConnectorStrategy eStrategy )
 {
@@ -3676,9 +3913,17 @@ found:;
 	return localGameFocused;
 }
 
- std::vector< steamcompmgr_win_t* > xwayland_ctx_t::GetPossibleFocusWindows()
+ gamescope::FrameVector< steamcompmgr_win_t* > xwayland_ctx_t::GetPossibleFocusWindows()
  {
-	std::vector<steamcompmgr_win_t*> vecPossibleFocusWindows;
+	// The candidates only change when something makes focus dirty, so only
+	// go through all of the windows and sort them again when the serial moves,
+	// not for every focus that gets recomputed.
+	const uint64_t ulFocusSerial = GetFocusSerial();
+	if ( ulPossibleFocusWindowsSerial == ulFocusSerial )
+		return gamescope::FrameVector< steamcompmgr_win_t* >( vecCachedPossibleFocusWindows.begin(), vecCachedPossibleFocusWindows.end() );
+
+	std::vector< steamcompmgr_win_t* > &vecPossibleFocusWindows = vecCachedPossibleFocusWindows;
+	vecPossibleFocusWindows.clear();
 
 	for (steamcompmgr_win_t *w = this->list; w; w = w->xwayland().next)
 	{
@@ -3715,7 +3960,9 @@ found:;
 
 	std::stable_sort( vecPossibleFocusWindows.begin(), vecPossibleFocusWindows.end(), is_focus_priority_greater );
 
-	return vecPossibleFocusWindows;
+	ulPossibleFocusWindowsSerial = ulFocusSerial;
+
+	return gamescope::FrameVector< steamcompmgr_win_t* >( vecPossibleFocusWindows.begin(), vecPossibleFocusWindows.end() );
  }
 
 static void set_wm_state( xwayland_ctx_t *ctx, Window win, uint32_t state )
@@ -3726,7 +3973,7 @@ static void set_wm_state( xwayland_ctx_t *ctx, Window win, uint32_t state )
 				sizeof(wmState) / sizeof(wmState[0]));
 }
 
-void xwayland_ctx_t::DetermineAndApplyFocus( const std::vector< steamcompmgr_win_t* > &vecPossibleFocusWindows )
+void xwayland_ctx_t::DetermineAndApplyFocus( const gamescope::FrameVector< steamcompmgr_win_t* > &vecPossibleFocusWindows )
 {
 	xwayland_ctx_t *ctx = this;
 
@@ -4028,10 +4275,11 @@ const char *get_win_display_name(steamcompmgr_win_t *window)
 }
 
 
-static std::vector< steamcompmgr_win_t* >
+static gamescope::FrameVector< steamcompmgr_win_t* >
 steamcompmgr_xdg_get_possible_focus_windows()
 {
-	std::vector< steamcompmgr_win_t* > windows;
+	gamescope::FrameVector< steamcompmgr_win_t* > windows;
+	windows.reserve( g_steamcompmgr_xdg_wins.size() );
 	for ( auto &win : g_steamcompmgr_xdg_wins )
 	{
 		// Always skip system tray icons and overlays
@@ -4045,32 +4293,75 @@ steamcompmgr_xdg_get_possible_focus_windows()
 	return windows;
 }
 
-static std::vector< steamcompmgr_win_t* > GetGlobalPossibleFocusWindows()
+// Tell the VRAM arbiter who is who, see CVRAMArbiter.
+static void update_vram_clients( const global_focus_t *pFocus, const gamescope::FrameVector< steamcompmgr_win_t* > &vecPossibleFocusWindows )
+{
+	std::vector<gamescope::VRAMClient_t> clients;
+	auto addClient = [&]( steamcompmgr_win_t *w, gamescope::VRAMTier eTier )
+	{
+		if ( !w || w->pid <= 0 )
+			return;
+
+		for ( gamescope::VRAMClient_t &client : clients )
+		{
+			if ( client.pid == w->pid )
+			{
+				client.eTier = std::min( client.eTier, eTier );
+				return;
+			}
+		}
+
+		clients.emplace_back( gamescope::VRAMClient_t{ .pid = w->pid, .uAppID = w->appID, .eTier = eTier } );
+	};
+
+	addClient( pFocus->focusWindow, gamescope::VRAMTier::Focused );
+	addClient( pFocus->overlayWindow, gamescope::VRAMTier::Overlay );
+	addClient( pFocus->externalOverlayWindow, gamescope::VRAMTier::Overlay );
+	addClient( pFocus->notificationWindow, gamescope::VRAMTier::Overlay );
+	for ( steamcompmgr_win_t *w : vecPossibleFocusWindows )
+		addClient( w, window_is_steam( w ) ? gamescope::VRAMTier::Steam : gamescope::VRAMTier::Background );
+
+	gamescope::CVRAMArbiter::Get().SetClients( std::move( clients ) );
+}
+
+static gamescope::FrameVector< steamcompmgr_win_t* > GetGlobalPossibleFocusWindows()
 {
-	std::vector< steamcompmgr_win_t* > vecPossibleFocusWindows;
+	// Same as for the per-context ones, this gets asked for by every focus
+	// and the virtual connector bookkeeping, but only changes with the serial.
+	static std::vector< steamcompmgr_win_t* > s_vecCachedPossibleFocusWindows;
+	static uint64_t s_ulPossibleFocusWindowsSerial = UINT64_MAX;
+
+	const uint64_t ulFocusSerial = GetFocusSerial();
+	if ( s_ulPossibleFocusWindowsSerial == ulFocusSerial )
+		return gamescope::FrameVector< steamcompmgr_win_t* >( s_vecCachedPossibleFocusWindows.begin(), s_vecCachedPossibleFocusWindows.end() );
+
+	std::vector< steamcompmgr_win_t* > &vecPossibleFocusWindows = s_vecCachedPossibleFocusWindows;
+	vecPossibleFocusWindows.clear();
 
 	{
 		gamescope_xwayland_server_t *server = NULL;
 		for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
 		{
-			std::vector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = server->ctx->GetPossibleFocusWindows();
+			gamescope::FrameVector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = server->ctx->GetPossibleFocusWindows();
 			vecPossibleFocusWindows.insert( vecPossibleFocusWindows.end(), vecLocalPossibleFocusWindows.begin(), vecLocalPossibleFocusWindows.end() );
 		}
 	}
 
 	{
-		std::vector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = steamcompmgr_xdg_get_possible_focus_windows();
+		gamescope::FrameVector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = steamcompmgr_xdg_get_possible_focus_windows();
 		vecPossibleFocusWindows.insert( vecPossibleFocusWindows.end(), vecLocalPossibleFocusWindows.begin(), vecLocalPossibleFocusWindows.end() );
 	}
 
 	// Determine global primary focus
 	std::stable_sort( vecPossibleFocusWindows.begin(), vecPossibleFocusWindows.end(), is_focus_priority_greater );
 
-	return vecPossibleFocusWindows;
+	s_ulPossibleFocusWindowsSerial = ulFocusSerial;
+
+	return gamescope::FrameVector< steamcompmgr_win_t* >( vecPossibleFocusWindows.begin(), vecPossibleFocusWindows.end() );
 }
 
 static void
-steamcompmgr_xdg_determine_and_apply_focus( const std::vector< steamcompmgr_win_t* > &vecPossibleFocusWindows )
+steamcompmgr_xdg_determine_and_apply_focus( const gamescope::FrameVector< steamcompmgr_win_t* > &vecPossibleFocusWindows )
 {
 	for ( auto &window : g_steamcompmgr_xdg_wins )
 	{
@@ -4093,6 +4384,8 @@ uint32_t g_focusedBaseAppId = 0;
 static void
 determine_and_apply_focus( global_focus_t *pFocus )
 {
+	GAMESCOPE_TRACE_SPAN( "focus" );
+
 	gamescope_xwayland_server_t *root_server = wlserver_get_xwayland_server(0);
 	xwayland_ctx_t *root_ctx = root_server->ctx.get();
 	global_focus_t previousLocalFocus = *pFocus;
@@ -4105,15 +4398,15 @@ determine_and_apply_focus( global_focus_t *pFocus )
 
 	focus_log.debugf( "Rerolling global focus..." );
 
-	std::vector< unsigned long > focusable_appids;
-	std::vector< unsigned long > focusable_windows;
+	gamescope::FrameVector< unsigned long > focusable_appids;
+	gamescope::FrameVector< unsigned long > focusable_windows;
 
 	// Apply focus to the XWayland contexts.
 	{
 		gamescope_xwayland_server_t *server = NULL;
 		for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
 		{
-			std::vector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = server->ctx->GetPossibleFocusWindows();
+			gamescope::FrameVector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = server->ctx->GetPossibleFocusWindows();
 			if ( server->ctx->focus.IsDirty() )
 				server->ctx->DetermineAndApplyFocus( vecLocalPossibleFocusWindows );
 		}
@@ -4121,13 +4414,13 @@ determine_and_apply_focus( global_focus_t *pFocus )
 
 	// Apply focus to XDG contexts (TODO merge me with some nice abstraction of "environments")
 	{
-		std::vector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = steamcompmgr_xdg_get_possible_focus_windows();
+		gamescope::FrameVector< steamcompmgr_win_t* > vecLocalPossibleFocusWindows = steamcompmgr_xdg_get_possible_focus_windows();
 		if ( g_steamcompmgr_xdg_focus.IsDirty() )
 			steamcompmgr_xdg_determine_and_apply_focus( vecLocalPossibleFocusWindows );
 	}
 
 	// Determine local context focuses
-	std::vector<steamcompmgr_win_t *> vecPossibleFocusWindows = GetGlobalPossibleFocusWindows();
+	gamescope::FrameVector< steamcompmgr_win_t* > vecPossibleFocusWindows = GetGlobalPossibleFocusWindows();
 
 	for ( steamcompmgr_win_t *focusable_window : vecPossibleFocusWindows )
 	{
@@ -4403,17 +4696,7 @@ determine_and_apply_focus( global_focus_t *pFocus )
 		s_ulPreviousGlobalFocusKey = pFocus->ulVirtualFocusKey;
 	}
 
-	pid_t newFocusedWindowPID = pFocus->focusWindow ? pFocus->focusWindow->pid : 0;
-	if (sdFocusWindow_pid != newFocusedWindowPID) {
-		const char *unfocusedWindowCGroup = cgroupPathFromPID(sdFocusWindow_pid);
-		const char *focusedWindowCGroup = cgroupPathFromPID(newFocusedWindowPID);
-		bool sameUnit = unfocusedWindowCGroup && focusedWindowCGroup && !strcmp(unfocusedWindowCGroup, focusedWindowCGroup);
-
-		if (unfocusedWindowCGroup && !sameUnit)
-			setDMemMemoryLow(unfocusedWindowCGroup, false);
-		if (focusedWindowCGroup && !sameUnit)
-			setDMemMemoryLow(focusedWindowCGroup, true);
-	}
+	update_vram_clients( pFocus, vecPossibleFocusWindows );
 
 	if ( pFocus->pVirtualConnector && pFocus->inputFocusWindow )
 	{
@@ -4434,7 +4717,6 @@ determine_and_apply_focus( global_focus_t *pFocus )
 		focusedBaseAppId = pFocus->focusWindow->appID;
 		focusedAppId = pFocus->inputFocusWindow->appID;
 		focused_display = get_win_display_name(pFocus->focusWindow);
-		sdFocusWindow_pid = pFocus->focusWindow->pid;
 	}
 
 	g_focusedBaseAppId = (uint32_t)focusedAppId;
@@ -5170,6 +5452,9 @@ add_win(xwayland_ctx_t *ctx, Window id, Window prev, unsigned long sequence)
 		std::unique_lock lock( ctx->list_mutex );
 		new_win->xwayland().next = *p;
 		*p = new_win;
+
+		ctx->windowsByID[ id ] = new_win;
+		ctx->windowsBySeq[ new_win->seq ] = new_win;
 	}
 	if (new_win->xwayland().a.map_state == IsViewable)
 		map_win(ctx, id, sequence);
@@ -5302,6 +5587,11 @@ finish_destroy_win(xwayland_ctx_t *ctx, Window id, bool gone)
 			{
 				std::unique_lock lock( ctx->list_mutex );
 				*prev = w->xwayland().next;
+
+				auto iter = ctx->windowsByID.find( w->xwayland().id );
+				if ( iter != ctx->windowsByID.end() && iter->second == w )
+					ctx->windowsByID.erase( iter );
+				ctx->windowsBySeq.erase( w->seq );
 			}
 			if (w->xwayland().damage != None)
 			{
@@ -5749,7 +6039,28 @@ update_runtime_info()
 		return;
 
 	uint32_t limiter_enabled = g_nSteamCompMgrTargetFPS != 0 ? 1 : 0;
-	pwrite( g_nRuntimeInfoFd, &limiter_enabled, sizeof( limiter_enabled ), 0 );
+
+	if ( !g_pRuntimeInfoPage )
+	{
+		pwrite( g_nRuntimeInfoFd, &limiter_enabled, sizeof( limiter_enabled ), 0 );
+		return;
+	}
+
+	uint32_t uHints = 0;
+	if ( limiter_enabled )
+		uHints |= GamescopeLayerClient::ControlPageHint::ForceFifo;
+	if ( cv_tearing_enabled )
+		uHints |= GamescopeLayerClient::ControlPageHint::AllowTearing;
+	if ( GetBackend() && GetBackend()->GetCurrentConnector() && GetBackend()->GetCurrentConnector()->IsVRRActive() )
+		uHints |= GamescopeLayerClient::ControlPageHint::VRR;
+
+	g_pRuntimeInfoPage->Publish( GamescopeLayerClient::ControlPageSnapshot
+	{
+		.u32LimiterOverride  = limiter_enabled,
+		.u32PresentModeHints = uHints,
+		.ulRefreshCycle      = g_nSteamCompMgrTargetFPS && g_SteamCompMgrLimitedAppRefreshCycle ? g_SteamCompMgrLimitedAppRefreshCycle : g_SteamCompMgrAppRefreshCycle,
+		.ulNextVBlank        = g_SteamCompMgrVBlankTime.schedule.ulTargetVBlank,
+	} );
 }
 
 static void
@@ -5760,6 +6071,25 @@ init_runtime_info()
 		return;
 
 	g_nRuntimeInfoFd = open( path, O_CREAT | O_RDWR , 0644 );
+	if ( g_nRuntimeInfoFd < 0 )
+		return;
+
+	// Publish the full control page so the WSI layer can read it with plain
+	// loads. If this fails, fall back to just the legacy limiter value.
+	if ( ftruncate( g_nRuntimeInfoFd, sizeof( GamescopeLayerClient::ControlPage ) ) == 0 )
+	{
+		void *pMapping = mmap( nullptr, sizeof( GamescopeLayerClient::ControlPage ), PROT_READ | PROT_WRITE, MAP_SHARED, g_nRuntimeInfoFd, 0 );
+		if ( pMapping != MAP_FAILED )
+		{
+			g_pRuntimeInfoPage = reinterpret_cast<GamescopeLayerClient::ControlPage *>( pMapping );
+			g_pRuntimeInfoPage->u32Version = GamescopeLayerClient::ControlPage::k_u32Version;
+			update_runtime_info();
+			g_pRuntimeInfoPage->u32Magic.store( GamescopeLayerClient::ControlPage::k_u32Magic, std::memory_order_release );
+			return;
+		}
+		xwm_log.errorf_errno( "Failed to map runtime info page" );
+	}
+
 	update_runtime_info();
 }
 
@@ -6943,15 +7273,13 @@ void handle_done_commits_xwayland( xwayland_ctx_t *ctx, bool vblank, uint64_t vb
 	{
 		bool entry_vblank = vblank;
 
+		auto winIter = ctx->windowsBySeq.find( entry.winSeq );
+		steamcompmgr_win_t *w = winIter != ctx->windowsBySeq.end() ? winIter->second : nullptr;
+
 		if ( GetBackend()->GetCurrentConnector() && GetBackend()->GetCurrentConnector()->IsVRRActive() )
 		{
-			for ( steamcompmgr_win_t *w = ctx->list; w; w = w->xwayland().next )
-			{
-				if (w->seq != entry.winSeq)
-					continue;
-
+			if ( w )
 				entry_vblank = entry_vblank && steamcompmgr_should_vblank_window( true, vblank_idx, w, now );
-			}
 		}
 		else
 		{
@@ -6976,16 +7304,10 @@ void handle_done_commits_xwayland( xwayland_ctx_t *ctx, bool vblank, uint64_t vb
 			continue;
 		}
 
-		for ( steamcompmgr_win_t *w = ctx->list; w; w = w->xwayland().next )
+		if ( w && handle_done_commit(w, ctx, entry.commitID, entry.earliestPresentTime, entry.earliestLatchTime) )
 		{
-			if (w->seq != entry.winSeq)
-				continue;
-			if (handle_done_commit(w, ctx, entry.commitID, entry.earliestPresentTime, entry.earliestLatchTime))
-			{
-				if (entry.fifo)
-					fifo_win_seqs.insert(entry.winSeq);
-				break;
-			}
+			if (entry.fifo)
+				fifo_win_seqs.insert(entry.winSeq);
 		}
 	}
 
@@ -7050,6 +7372,39 @@ void handle_done_commits_xdg( bool vblank, uint64_t vblank_idx )
 }
 
 gamescope::ConVar<bool> cv_mangoapp_use_output_timing{ "mangoapp_use_output_timing", true };
+gamescope::ConVar<bool> cv_virtual_connector_optimal_extent_hints{ "virtual_connector_optimal_extent_hints", true, "Hint clients shown on virtual connectors smaller than their window to render at the connector's size instead." };
+
+// The extent a window's content actually ends up being shown at, if that is
+// smaller than the window itself. {0, 0} if there is nothing to hint.
+static VkExtent2D get_window_optimal_extent( steamcompmgr_win_t *w )
+{
+	if ( !cv_virtual_connector_optimal_extent_hints )
+		return VkExtent2D{};
+
+	auto iter = g_VirtualConnectorFocuses.find( w->GetVirtualConnectorKey( gamescope::cv_backend_virtual_connector_strategy ) );
+	if ( iter == g_VirtualConnectorFocuses.end() || !iter->second.pVirtualConnector )
+		return VkExtent2D{};
+
+	std::optional<VkExtent2D> oConnectorExtent = iter->second.pVirtualConnector->GetOutputExtent();
+	if ( !oConnectorExtent || !oConnectorExtent->width || !oConnectorExtent->height )
+		return VkExtent2D{};
+
+	const int32_t nWidth = w->GetGeometry().nWidth;
+	const int32_t nHeight = w->GetGeometry().nHeight;
+	if ( nWidth <= 0 || nHeight <= 0 )
+		return VkExtent2D{};
+
+	if ( uint32_t( nWidth ) <= oConnectorExtent->width && uint32_t( nHeight ) <= oConnectorExtent->height )
+		return VkExtent2D{};
+
+	// Keep the window's aspect ratio, we scale-to-fit afterwards anyway.
+	float flScale = std::min( oConnectorExtent->width / float( nWidth ), oConnectorExtent->height / float( nHeight ) );
+	return VkExtent2D
+	{
+		.width  = std::max<uint32_t>( uint32_t( roundf( nWidth * flScale ) ), 1u ),
+		.height = std::max<uint32_t>( uint32_t( roundf( nHeight * flScale ) ), 1u ),
+	};
+}
 
 void handle_presented_for_window( steamcompmgr_win_t* w )
 {
@@ -7117,6 +7472,14 @@ void handle_presented_for_window( steamcompmgr_win_t* w )
 				wlserver_refresh_cycle(surface, refresh_cycle);
 			}
 		}
+
+		VkExtent2D optimalExtent = get_window_optimal_extent( w );
+		if ( info != nullptr && ( info->last_optimal_width != optimalExtent.width || info->last_optimal_height != optimalExtent.height ) )
+		{
+			info->last_optimal_width = optimalExtent.width;
+			info->last_optimal_height = optimalExtent.height;
+			wlserver_optimal_extent( surface, optimalExtent.width, optimalExtent.height );
+		}
 	}
 }
 
@@ -7161,6 +7524,12 @@ void ClearUpscaleImages()
 	g_pUpscaleImages.clear();
 }
 
+// Under VRAM pressure, GetTempUpscaleImage makes new ones as needed.
+static void ReleaseUnusedUpscaleImages()
+{
+	std::erase_if( g_pUpscaleImages, []( const TempUpscaleImage_t &image ) { return !image.pTexture->IsInUse(); } );
+}
+
 static TempUpscaleImage_t *GetTempUpscaleImage( uint32_t uWidth, uint32_t uHeight, uint32_t uDrmFormat )
 {
 	if ( g_pUpscaleImages.size() )
@@ -7238,8 +7607,10 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 	bool bPossiblyBogus = reslistentry.buf->width <= 2 || reslistentry.buf->height <= 2;
 
 	// If the buffer has no damage, always prefer our override surface.
-	bool bHasDamage = ( reslistentry.surf->buffer_damage.extents.x2 - reslistentry.surf->buffer_damage.extents.x1 ) > 2 &&
-					  ( reslistentry.surf->buffer_damage.extents.y2 - reslistentry.surf->buffer_damage.extents.y1 ) > 2;
+	gamescope::DamageRegion::Rect_t damageExtents = reslistentry.damage.Extents();
+	bool bHasDamage = reslistentry.damage.IsFull() ||
+					  ( ( damageExtents.nX2 - damageExtents.nX1 ) > 2 &&
+					    ( damageExtents.nY2 - damageExtents.nY1 ) > 2 );
 
 	// If we have an override surface, make sure this commit is for the current surface
 	// or if the commit is probably bogus.
@@ -7270,6 +7641,10 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 
 	if ( already_exists && !reslistentry.feedback && reslistentry.presentation_feedbacks.empty() )
 	{
+		// The buffer we already have may have changed under us, so we can't
+		// trust anything chained off it anymore.
+		w->ulLastImportedCommitID = 0;
+
 		wlserver_lock();
 		wlr_buffer_unlock( buf );
 		wlserver_unlock();
@@ -7282,6 +7657,7 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 		return;
 	}
 
+	std::shared_ptr<gamescope::CAcquireTimelinePoint> pUploadPoint;
 	gamescope::Rc<commit_t> newCommit = import_commit(
 		w,
 		reslistentry.surf,
@@ -7291,11 +7667,17 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 		std::move(reslistentry.presentation_feedbacks),
 		reslistentry.present_id,
 		reslistentry.desired_present_time,
-		reslistentry.fifo );
+		reslistentry.fifo,
+		reslistentry.damage,
+		pUploadPoint );
 
 	int fence = -1;
 	if ( newCommit != nullptr )
 	{
+		w->ulLastImportedCommitID = newCommit->commitID;
+		w->pLastImportedCommitSurface = reslistentry.surf;
+		w->lastImportedDamageHistory = newCommit->damageHistory;
+
 		global_focus_t *pCurrentFocus = GetCurrentFocus();
 
 		static bool bMangoappSocketDisable = env_to_bool( getenv( "GAMESCOPE_MANGOAPP_SOCKET_DISABLE" ));
@@ -7338,8 +7720,8 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 			{
 				const uint64_t ulNextReleasePoint = ++pTempImage->ulLastPoint;
 
-				std::unique_ptr<CVulkanCmdBuffer> pCommandBuffer = g_device.commandBuffer();
-				
+				std::unique_ptr<CVulkanCmdBuffer> pCommandBuffer = g_device.commandBuffer( cv_upscale_preemptive_background_queue );
+
 				pCommandBuffer->AddDependency( reslistentry.pAcquirePoint->GetTimeline()->ToVkSemaphore(), reslistentry.pAcquirePoint->GetPoint() );
 				pCommandBuffer->AddSignal( pTempImage->pReleaseTimeline->ToVkSemaphore(), ulNextReleasePoint );
 
@@ -7392,9 +7774,16 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 			{
 				eventFd = reslistentry.pAcquirePoint->CreateEventFd();
 			}
+			else if ( pUploadPoint )
+			{
+				eventFd = pUploadPoint->CreateEventFd();
+			}
 		}
 
-		if ( gamescope::IBackendFb *pBackendFb = newCommit->vulkanTex->GetBackendFb() )
+		// Uploaded shm contents live in a pooled texture that outlives this
+		// buffer, so its fb must not hold on to the client's buffer.
+		gamescope::IBackendFb *pBackendFb = !pUploadPoint ? newCommit->vulkanTex->GetBackendFb() : nullptr;
+		if ( pBackendFb )
 		{
 			if ( reslistentry.pReleasePoint )
 				pBackendFb->SetReleasePoint( reslistentry.pReleasePoint );
@@ -7436,8 +7825,8 @@ void update_wayland_res(CommitDoneList_t *doneCommits, steamcompmgr_win_t *w, Re
 void check_new_xwayland_res(xwayland_ctx_t *ctx)
 {
 	// When importing buffer, we'll potentially need to perform operations with
-	// a wlserver lock (e.g. wlr_buffer_lock). We can't do this with a
-	// wayland_commit_queue lock because that causes deadlocks.
+	// a wlserver lock (e.g. wlr_buffer_lock), so drain the whole queue first
+	// and then process it.
 	std::vector<ResListEntry_t>& tmp_queue = ctx->xwayland_server->retrieve_commits();
 
 	for ( uint32_t i = 0; i < tmp_queue.size(); i++ )
@@ -7449,7 +7838,7 @@ void check_new_xwayland_res(xwayland_ctx_t *ctx)
 
 void check_new_xdg_res()
 {
-	std::vector<ResListEntry_t> tmp_queue = wlserver_xdg_commit_queue();
+	std::vector<ResListEntry_t>& tmp_queue = wlserver_xdg_commit_queue();
 	for ( uint32_t i = 0; i < tmp_queue.size(); i++ )
 	{
 		for ( const auto& xdg_win : g_steamcompmgr_xdg_wins )
@@ -8468,24 +8857,13 @@ steamcompmgr_main(int argc, char **argv)
 	// ie. color.rgb = color.rgba * u_ctm[offsetLayerIdx];
 	s_scRGB709To2020Matrix = GetBackend()->CreateBackendBlob( glm::mat3x4( glm::transpose( k_2020_from_709 ) ) );
 
-	FILE *sysfs_caps = fopen("/sys/fs/cgroup/dmem.capacity", "r");
-	if (sysfs_caps != nullptr) {
-		char *line = NULL;
-		size_t size = 0;
-		while (getline(&line, &size, sysfs_caps) >= 0) {
-			char *capacity = strstr(line, " ");
-			if (capacity)
-				++capacity;
-			else
-				continue;
-			uint64_t vramSize = strtoull(capacity, NULL, 10);
-			std::string idString = std::string(line, (capacity - 1) - line);
-			g_vramCapacities.emplace(idString, vramSize);
-		}
-	}
+	gamescope::CVRAMArbiter::Get().Init();
 
 	for (;;)
 	{
+		// Nothing from the frame arena outlives an iteration.
+		gamescope::CFrameArena::Get().Reset();
+
 		{
 			gamescope_xwayland_server_t *server = NULL;
 			for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
@@ -8553,6 +8931,9 @@ steamcompmgr_main(int argc, char **argv)
 			g_VirtualConnectorFocuses.clear();
 			s_eLastVirtualConnectorStrategy = eVirtualConnectorStrategy;
 
+			// Which windows can be focused depends on the strategy.
+			MakeFocusDirty();
+
 			xwm_log.infof( "Late init of virtual connector stuff." );
 
 			// misyl: Make the virtual connector up-front if we are in a single-output mode.
@@ -8595,8 +8976,16 @@ steamcompmgr_main(int argc, char **argv)
 			// We could/should make this event driven rather than solving
 			// per-frame.
 
-			if ( !gamescope::VirtualConnectorIsSingleOutput() )
+			// The keys can only change when focus was dirtied, so don't bother
+			// going through the windows again otherwise.
+			static uint64_t s_ulLastVirtualConnectorKeysSerial = UINT64_MAX;
+			const uint64_t ulVirtualConnectorKeysSerial = GetFocusSerial();
+
+			if ( !gamescope::VirtualConnectorIsSingleOutput() &&
+				 ( ulVirtualConnectorKeysSerial != s_ulLastVirtualConnectorKeysSerial || !keysToClose.empty() || bBackendJustInitted ) )
 			{
+				s_ulLastVirtualConnectorKeysSerial = ulVirtualConnectorKeysSerial;
+
 				std::vector<gamescope::VirtualConnectorKey_t> newKeys;
 
 				auto focusWindows = GetGlobalPossibleFocusWindows();
@@ -8835,6 +9224,10 @@ steamcompmgr_main(int argc, char **argv)
 			}
 		}
 
+		// Keep the WSI layer's view of the refresh cycle and next vblank fresh.
+		if ( vblank )
+			update_runtime_info();
+
 		// Handle presentation-time stuff
 		//
 		// Notes:
@@ -9100,8 +9493,13 @@ steamcompmgr_main(int argc, char **argv)
 
 			if ( bShouldPaint )
 			{
+				const uint64_t ulPaintHeapAllocations = gamescope::GetThreadHeapAllocationCount();
+
 				paint_all( pPaintFocus, eFlipType == FlipType::Async );
 
+				if ( cv_paint_debug_count_heap_allocations )
+					cv_paint_debug_heap_allocations = gamescope::GetThreadHeapAllocationCount() - ulPaintHeapAllocations;
+
 				bPainted = true;
 			}
 		}
@@ -9164,6 +9562,12 @@ steamcompmgr_main(int argc, char **argv)
 
 		vulkan_garbage_collect();
 
+		if ( gamescope::CVRAMArbiter::Get().Update() )
+		{
+			vulkan_shrink_caches();
+			ReleaseUnusedUpscaleImages();
+		}
+
 		vblank = false;
 	}
 
@@ -7,9 +7,11 @@
 #include <wlr/util/box.h>
 
 #include "xwayland_ctx.hpp"
+#include "Utils/DamageRegion.h"
 #include "gamescope-control-protocol.h"
 
 struct commit_t;
+class CVulkanShmTexturePool;
 struct wlserver_vk_swapchain_feedback;
 
 struct wlserver_x11_surface_info
@@ -159,6 +161,13 @@ struct steamcompmgr_win_t {
 	std::shared_ptr<std::string> engineName;
 
 	std::vector< gamescope::Rc<commit_t> > commit_queue;
+
+	// The last commit we imported, so the next one can chain its damage onto it.
+	uint64_t ulLastImportedCommitID = 0;
+	struct wlr_surface *pLastImportedCommitSurface = nullptr;
+	gamescope::DamageHistory lastImportedDamageHistory;
+	// Destination textures for wl_shm buffers committed to this window.
+	std::shared_ptr<CVulkanShmTexturePool> pShmTexturePool;
 	std::shared_ptr<std::vector< uint32_t >> icon;
 
 	steamcompmgr_win_type_t		type;
@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include "gpuvis_trace_utils.h"
+#include "Utils/Trace.h"
 
 #include "vblankmanager.hpp"
 #include "steamcompmgr.hpp"
@@ -278,6 +279,7 @@ namespace gamescope
 			};
 
 			gpuvis_trace_printf( "vblank timerfd wakeup" );
+			gamescope::Trace::RecordInstant( "vblank timerfd wakeup" );
 
 			ITimerWaitable::DisarmTimer();
 		}
@@ -318,6 +320,7 @@ namespace gamescope
 			}
 
 			gpuvis_trace_printf( "got vblank" );
+			gamescope::Trace::RecordInstant( "got vblank" );
 			m_PendingVBlank = time;
 		}
 	}
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 
 #include <functional>
@@ -61,13 +62,16 @@ namespace gamescope
         }
     };
 
+    // Uses an eventfd rather than a pipe: nudges coalesce into a single
+    // counter, so a burst of them costs one wakeup and one read to drain.
     class CNudgeWaitable final : public IWaitable
     {
     public:
         CNudgeWaitable()
+            : m_nFD{ eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK ) }
         {
-            if ( pipe2( m_nFDs, O_CLOEXEC | O_NONBLOCK ) != 0 )
-                Shutdown();
+            if ( m_nFD < 0 )
+                g_WaitableLog.errorf_errno( "Failed to create eventfd for CNudgeWaitable" );
         }
 
         ~CNudgeWaitable()
@@ -77,19 +81,16 @@ namespace gamescope
 
         void Shutdown()
         {
-            for ( int i = 0; i < 2; i++ )
+            if ( m_nFD >= 0 )
             {
-                if ( m_nFDs[i] >= 0 )
-                {
-                    close( m_nFDs[i] );
-                    m_nFDs[i] = -1;
-                }
+                close( m_nFD );
+                m_nFD = -1;
             }
         }
 
         void Drain()
         {
-            IWaitable::Drain( m_nFDs[0] );
+            IWaitable::Drain( m_nFD );
         }
 
         void OnPollIn() final
@@ -99,12 +100,13 @@ namespace gamescope
 
         bool Nudge()
         {
-            return write( m_nFDs[1], "\n", 1 ) >= 0;
+            uint64_t ulValue = 1;
+            return write( m_nFD, &ulValue, sizeof( ulValue ) ) >= 0;
         }
 
-        int GetFD() final { return m_nFDs[0]; }
+        int GetFD() final { return m_nFD; }
     private:
-        int m_nFDs[2] = { -1, -1 };
+        int m_nFD = -1;
     };
 
 
@@ -67,6 +67,7 @@
 #include "commit.h"
 #include "Timeline.h"
 #include "Utils/NonCopyable.h"
+#include "Utils/Trace.h"
 
 #if HAVE_PIPEWIRE
 #include "pipewire.hpp"
@@ -75,6 +76,7 @@
 #include "gpuvis_trace_utils.h"
 
 #include <algorithm>
+#include <cinttypes>
 #include <list>
 #include <set>
 
@@ -117,15 +119,9 @@ extern std::atomic<bool> hasRepaint;
 
 std::vector<ResListEntry_t>& gamescope_xwayland_server_t::retrieve_commits()
 {
-	static std::vector<ResListEntry_t> commits;
-	commits.clear();
-	commits.reserve(16);
-
-	{
-		std::lock_guard<std::mutex> lock( wayland_commit_lock );
-		commits.swap(wayland_commit_queue);
-	}
-	return commits;
+	retrieved_commits.clear();
+	wayland_commit_queue.Drain( retrieved_commits );
+	return retrieved_commits;
 }
 
 gamescope::ConVar<bool> cv_drm_debug_syncobj_force_wait_on_commit( "drm_debug_syncobj_force_wait_on_commit", false, "Force a wait on DRM sync objects before committing buffers" );
@@ -152,6 +148,13 @@ std::optional<ResListEntry_t> PrepareCommit( struct wlr_surface *surf, struct wl
 		}
 	}
 
+	// buffer_damage is only valid during the commit, so grab it now.
+	gamescope::DamageRegion damage = gamescope::DamageRegion::Empty();
+	int nDamageRects = 0;
+	const pixman_box32_t *pDamageRects = pixman_region32_rectangles( &surf->buffer_damage, &nDamageRects );
+	for ( int i = 0; i < nDamageRects; i++ )
+		damage.Add( gamescope::DamageRegion::Rect_t{ pDamageRects[i].x1, pDamageRects[i].y1, pDamageRects[i].x2, pDamageRects[i].y2 } );
+
 	auto oNewEntry = std::optional<ResListEntry_t> {
 		std::in_place_t{},
 		surf,
@@ -163,7 +166,8 @@ std::optional<ResListEntry_t> PrepareCommit( struct wlr_surface *surf, struct wl
 		wl_surf->present_id,
 		wl_surf->desired_present_time,
 		std::move( pAcquirePoint ),
-		std::move( pReleasePoint )
+		std::move( pReleasePoint ),
+		damage
 	};
 	wl_surf->present_id = std::nullopt;
 	wl_surf->desired_present_time = 0;
@@ -185,12 +189,10 @@ void gamescope_xwayland_server_t::wayland_commit(struct wlr_surface *surf, struc
 	if ( !oEntry )
 		return;
 
-	{
-		std::lock_guard<std::mutex> lock( wayland_commit_lock );
-		wayland_commit_queue.emplace_back( std::move( *oEntry ) );
-	}
-
-	nudge_steamcompmgr();
+	// Only the first commit since steamcompmgr last drained the queue needs
+	// to wake it up.
+	if ( wayland_commit_queue.Push( std::move( *oEntry ) ) )
+		nudge_steamcompmgr();
 }
 
 struct PendingCommit_t
@@ -207,12 +209,8 @@ void wlserver_xdg_commit(struct wlr_surface *surf, struct wlr_buffer *buf)
 	if ( !oEntry )
 		return;
 
-	{
-		std::lock_guard<std::mutex> lock( wlserver.xdg_commit_lock );
-		wlserver.xdg_commit_queue.push_back( std::move( *oEntry ) );
-	}
-
-	nudge_steamcompmgr();
+	if ( wlserver.xdg_commit_queue.Push( std::move( *oEntry ) ) )
+		nudge_steamcompmgr();
 }
 
 void xwayland_surface_commit(struct wlr_surface *wlr_surface) {
@@ -1010,6 +1008,14 @@ static void gamescope_swapchain_factory_v2_create_swapchain( struct wl_client *c
 		wl_log.errorf("create_swapchain: Surface already had a gamescope_swapchain! Warning!");
 
 	wl_surface_info->gamescope_swapchains.emplace_back( gamescope_swapchain_resource );
+
+	// steamcompmgr only sends the hint when it changes, so a recreated
+	// swapchain would never hear about the one the surface already has.
+	if ( wl_surface_info->last_optimal_width && wl_surface_info->last_optimal_height &&
+		 wl_resource_get_version( gamescope_swapchain_resource ) >= GAMESCOPE_SWAPCHAIN_OPTIMAL_EXTENT_SINCE_VERSION )
+	{
+		gamescope_swapchain_send_optimal_extent( gamescope_swapchain_resource, wl_surface_info->last_optimal_width, wl_surface_info->last_optimal_height );
+	}
 }
 
 static const struct gamescope_swapchain_factory_v2_interface gamescope_swapchain_factory_v2_impl = {
@@ -1025,7 +1031,7 @@ static void gamescope_swapchain_factory_v2_bind( struct wl_client *client, void
 
 static void create_gamescope_swapchain_factory_v2( void )
 {
-	uint32_t version = 1;
+	uint32_t version = 2;
 	wl_global_create( wlserver.display, &gamescope_swapchain_factory_v2_interface, version, NULL, gamescope_swapchain_factory_v2_bind );
 }
 
@@ -1252,6 +1258,17 @@ void wlserver_app_presented( uint32_t app_id, uint64_t frametime_ns )
 	wlserver.app_perf_requests.erase( it );
 }
 
+void wlserver_send_app_vram_budget( uint32_t app_id, uint32_t usage_mib, uint32_t budget_mib )
+{
+	assert( wlserver_is_lock_held() );
+
+	for ( wl_resource *control : wlserver.gamescope_controls )
+	{
+		if ( wl_resource_get_version( control ) >= GAMESCOPE_CONTROL_APP_VRAM_BUDGET_SINCE_VERSION )
+			gamescope_control_send_app_vram_budget( control, app_id, usage_mib, budget_mib );
+	}
+}
+
 static const struct gamescope_control_interface gamescope_control_impl = {
 	.destroy = gamescope_control_handle_destroy,
 	.set_app_target_refresh_cycle = gamescope_control_set_app_target_refresh_cycle,
@@ -1330,6 +1347,7 @@ static void gamescope_control_bind( struct wl_client *client, void *data, uint32
 	gamescope_control_send_feature_support( resource, GAMESCOPE_CONTROL_FEATURE_MURA_CORRECTION, 1, 0 );
 	gamescope_control_send_feature_support( resource, GAMESCOPE_CONTROL_FEATURE_LOOK, 1, 0 );
 	gamescope_control_send_feature_support( resource, GAMESCOPE_CONTROL_FEATURE_PERF_QUERY, 1, 0 );
+	gamescope_control_send_feature_support( resource, GAMESCOPE_CONTROL_FEATURE_VRAM_BUDGET, 1, 0 );
 	gamescope_control_send_feature_support( resource, GAMESCOPE_CONTROL_FEATURE_DONE, 0, 0 );
 
 	wlserver_send_gamescope_control( resource );
@@ -1339,7 +1357,7 @@ static void gamescope_control_bind( struct wl_client *client, void *data, uint32
 
 static void create_gamescope_control( void )
 {
-	uint32_t version = 6;
+	uint32_t version = 7;
 	wl_global_create( wlserver.display, &gamescope_control_interface, version, NULL, gamescope_control_bind );
 }
 
@@ -1545,6 +1563,20 @@ void wlserver_refresh_cycle( struct wlr_surface *surface, uint64_t refresh_cycle
 	}
 }
 
+void wlserver_optimal_extent( struct wlr_surface *surface, uint32_t width, uint32_t height )
+{
+	wlserver_wl_surface_info *wl_info = get_wl_surface_info( surface );
+	if ( !wl_info )
+		return;
+
+	for (auto& swapchain : wl_info->gamescope_swapchains) {
+		if ( wl_resource_get_version( swapchain ) < GAMESCOPE_SWAPCHAIN_OPTIMAL_EXTENT_SINCE_VERSION )
+			continue;
+
+		gamescope_swapchain_send_optimal_extent( swapchain, width, height );
+	}
+}
+
 ///////////////////////
 
 #if HAVE_SESSION
@@ -2140,6 +2172,105 @@ bool wlserver_init( void ) {
 
 pthread_mutex_t waylock = PTHREAD_MUTEX_INITIALIZER;
 
+gamescope::ConVar<bool> cv_wlserver_lock_instrumentation( "wlserver_lock_instrumentation", false, "Track wait and hold times of the wlserver lock. See wlserver_lock_stats." );
+gamescope::ConVar<uint64_t> cv_wlserver_lock_trace_threshold_us( "wlserver_lock_trace_threshold_us", 1000, "Emit a gpuvis marker when the wlserver lock is held for longer than this (microseconds). Requires wlserver_lock_instrumentation." );
+
+struct WlserverLockStats_t
+{
+	std::atomic<uint64_t> ulCount = { 0 };
+	std::atomic<uint64_t> ulTotalWaitNs = { 0 };
+	std::atomic<uint64_t> ulMaxWaitNs = { 0 };
+	std::atomic<uint64_t> ulTotalHoldNs = { 0 };
+	std::atomic<uint64_t> ulMaxHoldNs = { 0 };
+
+	void Reset()
+	{
+		ulCount = 0;
+		ulTotalWaitNs = 0;
+		ulMaxWaitNs = 0;
+		ulTotalHoldNs = 0;
+		ulMaxHoldNs = 0;
+	}
+};
+
+enum WlserverLockHolder_t
+{
+	WLSERVER_LOCK_HOLDER_WLSERVER,
+	WLSERVER_LOCK_HOLDER_OTHER,
+
+	WLSERVER_LOCK_HOLDER_COUNT,
+};
+
+static WlserverLockStats_t s_WlserverLockStats[ WLSERVER_LOCK_HOLDER_COUNT ];
+static thread_local bool s_bIsWlserverThread = false;
+
+// Only touched with waylock held.
+static uint64_t s_ulWlserverLockAcquireTime = 0;
+
+static void UpdateMax( std::atomic<uint64_t> &ulMax, uint64_t ulValue )
+{
+	uint64_t ulCurrent = ulMax.load( std::memory_order_relaxed );
+	while ( ulValue > ulCurrent && !ulMax.compare_exchange_weak( ulCurrent, ulValue, std::memory_order_relaxed ) )
+		;
+}
+
+static WlserverLockStats_t &GetWlserverLockStats()
+{
+	return s_WlserverLockStats[ s_bIsWlserverThread ? WLSERVER_LOCK_HOLDER_WLSERVER : WLSERVER_LOCK_HOLDER_OTHER ];
+}
+
+static gamescope::ConCommand cc_wlserver_lock_stats( "wlserver_lock_stats", "Dump (and reset with 'reset') wlserver lock wait/hold time statistics.",
+[]( std::span<std::string_view> args )
+{
+	static constexpr const char *k_pszHolderNames[ WLSERVER_LOCK_HOLDER_COUNT ] = { "wlserver", "other" };
+
+	if ( !cv_wlserver_lock_instrumentation )
+		wl_log.infof( "wlserver_lock_instrumentation is disabled, stats may be stale." );
+
+	for ( uint32_t i = 0; i < WLSERVER_LOCK_HOLDER_COUNT; i++ )
+	{
+		WlserverLockStats_t &stats = s_WlserverLockStats[ i ];
+		uint64_t ulCount = stats.ulCount.load( std::memory_order_relaxed );
+		uint64_t ulDivisor = std::max<uint64_t>( ulCount, 1 );
+
+		wl_log.infof( "%s: %" PRIu64 " acquisitions, wait avg %.3fus max %.3fus, hold avg %.3fus max %.3fus",
+			k_pszHolderNames[ i ],
+			ulCount,
+			stats.ulTotalWaitNs.load( std::memory_order_relaxed ) / double( ulDivisor ) / 1'000.0,
+			stats.ulMaxWaitNs.load( std::memory_order_relaxed ) / 1'000.0,
+			stats.ulTotalHoldNs.load( std::memory_order_relaxed ) / double( ulDivisor ) / 1'000.0,
+			stats.ulMaxHoldNs.load( std::memory_order_relaxed ) / 1'000.0 );
+	}
+
+	if ( args.size() >= 2 && args[1] == "reset" )
+	{
+		for ( uint32_t i = 0; i < WLSERVER_LOCK_HOLDER_COUNT; i++ )
+			s_WlserverLockStats[ i ].Reset();
+	}
+});
+
+static void wlserver_publish_cursor_position()
+{
+	// waylock is held.
+	wlserver_t::CursorPositionSnapshot snapshot;
+
+	struct wlr_pointer_constraint_v1 *pConstraint = wlserver.mouse_constraint.load( std::memory_order_relaxed );
+	snapshot.bConstrained = !!pConstraint;
+	if ( pConstraint && pConstraint->current.cursor_hint.enabled )
+	{
+		snapshot.x = pConstraint->current.cursor_hint.x;
+		snapshot.y = pConstraint->current.cursor_hint.y;
+	}
+	else
+	{
+		snapshot.x = wlserver.mouse_surface_cursorx;
+		snapshot.y = wlserver.mouse_surface_cursory;
+	}
+
+	std::unique_lock lock( wlserver.cursor_position_lock );
+	wlserver.cursor_position = snapshot;
+}
+
 bool wlserver_is_lock_held(void)
 {
 	int err = pthread_mutex_trylock(&waylock);
@@ -2153,13 +2284,46 @@ bool wlserver_is_lock_held(void)
 
 void wlserver_lock(void)
 {
+	if ( !cv_wlserver_lock_instrumentation )
+	{
+		pthread_mutex_lock(&waylock);
+		s_ulWlserverLockAcquireTime = 0;
+		return;
+	}
+
+	uint64_t ulWaitStart = get_time_in_nanos();
 	pthread_mutex_lock(&waylock);
+	uint64_t ulAcquired = get_time_in_nanos();
+
+	s_ulWlserverLockAcquireTime = ulAcquired;
+
+	WlserverLockStats_t &stats = GetWlserverLockStats();
+	uint64_t ulWaitNs = ulAcquired - ulWaitStart;
+	stats.ulTotalWaitNs.fetch_add( ulWaitNs, std::memory_order_relaxed );
+	UpdateMax( stats.ulMaxWaitNs, ulWaitNs );
 }
 
 void wlserver_unlock(bool flush)
 {
     if (flush)
 	    wl_display_flush_clients(wlserver.display);
+
+	wlserver_publish_cursor_position();
+
+	if ( s_ulWlserverLockAcquireTime )
+	{
+		uint64_t ulHoldNs = get_time_in_nanos() - s_ulWlserverLockAcquireTime;
+		s_ulWlserverLockAcquireTime = 0;
+
+		WlserverLockStats_t &stats = GetWlserverLockStats();
+		stats.ulCount.fetch_add( 1, std::memory_order_relaxed );
+		stats.ulTotalHoldNs.fetch_add( ulHoldNs, std::memory_order_relaxed );
+		UpdateMax( stats.ulMaxHoldNs, ulHoldNs );
+
+		if ( ulHoldNs > cv_wlserver_lock_trace_threshold_us * 1'000ul )
+			gpuvis_trace_printf( "wlserver lock held for %.3fus (%s)", ulHoldNs / 1'000.0, s_bIsWlserverThread ? "wlserver" : "other" );
+	}
+
 	pthread_mutex_unlock(&waylock);
 }
 
@@ -2170,6 +2334,7 @@ static int g_wlserverNudgePipe[2] = {-1, -1};
 void wlserver_run(void)
 {
 	pthread_setname_np( pthread_self(), "gamescope-wl" );
+	s_bIsWlserverThread = true;
 
 	if ( pipe2( g_wlserverNudgePipe, O_CLOEXEC | O_NONBLOCK ) != 0 )
 	{
@@ -2211,8 +2376,12 @@ void wlserver_run(void)
 			// We have wayland stuff to do, do it while locked
 			wlserver_lock();
 
-			wl_display_flush_clients(wlserver.display);
-			int ret = wl_event_loop_dispatch(wlserver.event_loop, 0);
+			int ret;
+			{
+				GAMESCOPE_TRACE_SPAN( "wlserver_dispatch" );
+				wl_display_flush_clients(wlserver.display);
+				ret = wl_event_loop_dispatch(wlserver.event_loop, 0);
+			}
 			if (ret < 0) {
 				wlserver_unlock();
 				break;
@@ -2225,10 +2394,7 @@ void wlserver_run(void)
 	wlserver.bWaylandServerRunning = false;
 	wlserver.bWaylandServerRunning.notify_all();
 
-	{
-		std::unique_lock lock3(wlserver.xdg_commit_lock);
-		wlserver.xdg_commit_queue.clear();
-	}
+	wlserver.xdg_commit_queue.Clear();
 
 	{
 		std::unique_lock lock2(g_wlserver_xdg_shell_windows_lock);
@@ -3230,13 +3396,11 @@ bool wlserver_xdg_dirty()
 	return wlserver.xdg_dirty.exchange(false);
 }
 
-std::vector<ResListEntry_t> wlserver_xdg_commit_queue()
+std::vector<ResListEntry_t>& wlserver_xdg_commit_queue()
 {
-	std::vector<ResListEntry_t> commits;
-	{
-		std::lock_guard<std::mutex> lock( wlserver.xdg_commit_lock );
-		commits = std::move(wlserver.xdg_commit_queue);
-	}
+	static std::vector<ResListEntry_t> commits;
+	commits.clear();
+	wlserver.xdg_commit_queue.Drain( commits );
 	return commits;
 }
 
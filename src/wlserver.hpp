@@ -21,6 +21,8 @@
 #include "vulkan_include.h"
 
 #include "steamcompmgr_shared.hpp"
+#include "Utils/DamageRegion.h"
+#include "Utils/MPSCQueue.h"
 
 #if HAVE_DRM
 #define HAVE_SESSION 1
@@ -48,6 +50,8 @@ struct ResListEntry_t {
 	uint64_t desired_present_time;
 	std::shared_ptr<gamescope::CAcquireTimelinePoint> pAcquirePoint;
 	std::shared_ptr<gamescope::CReleaseTimelinePoint> pReleasePoint;
+	// Buffer damage of this commit, captured when it was committed.
+	gamescope::DamageRegion damage;
 };
 
 struct wlserver_content_override;
@@ -102,8 +106,8 @@ private:
 
 	int m_nIndex = 0;
 
-	std::mutex wayland_commit_lock;
-	std::vector<ResListEntry_t> wayland_commit_queue;
+	gamescope::BoundedMPSCQueue<ResListEntry_t> wayland_commit_queue;
+	std::vector<ResListEntry_t> retrieved_commits;
 };
 
 struct wlserver_t {
@@ -134,6 +138,24 @@ struct wlserver_t {
 	std::unordered_map<struct wlr_surface *, std::pair<int, int>> current_dropdown_surfaces;
 	double mouse_surface_cursorx = 0.0f;
 	double mouse_surface_cursory = 0.0f;
+
+	// Snapshot of the cursor position (with any constraint hint applied)
+	// published whenever the wlserver lock is released, so the compositor
+	// can read it without taking the big lock.
+	struct CursorPositionSnapshot
+	{
+		double x = 0.0;
+		double y = 0.0;
+		bool bConstrained = false;
+	};
+	std::mutex cursor_position_lock;
+	CursorPositionSnapshot cursor_position;
+
+	CursorPositionSnapshot GetCursorPositionSnapshot()
+	{
+		std::unique_lock lock( cursor_position_lock );
+		return cursor_position;
+	}
 	bool mouse_constraint_requires_warp = false;
 	pixman_region32_t confine;
 	std::atomic<struct wlr_pointer_constraint_v1 *> mouse_constraint = { nullptr };
@@ -185,8 +207,7 @@ struct wlserver_t {
 	struct wl_listener new_pointer_constraint;
 	std::vector<std::shared_ptr<steamcompmgr_win_t>> xdg_wins;
 	std::atomic<bool> xdg_dirty;
-	std::mutex xdg_commit_lock;
-	std::vector<ResListEntry_t> xdg_commit_queue;
+	gamescope::BoundedMPSCQueue<ResListEntry_t> xdg_commit_queue;
 
 	std::vector<wl_resource*> gamescope_controls;
 	std::unordered_map< uint32_t, std::vector<wl_resource*> > app_perf_requests;
@@ -201,7 +222,7 @@ struct wlserver_t {
 
 extern struct wlserver_t wlserver;
 
-std::vector<ResListEntry_t> wlserver_xdg_commit_queue();
+std::vector<ResListEntry_t>& wlserver_xdg_commit_queue();
 
 struct wlserver_pointer {
 	struct wlr_pointer *wlr;
@@ -288,8 +309,10 @@ void wlserver_presentation_feedback_discard( struct wlr_surface *surface, std::v
 
 void wlserver_past_present_timing( struct wlr_surface *surface, uint32_t present_id, uint64_t desired_present_time, uint64_t actual_present_time, uint64_t earliest_present_time, uint64_t present_margin );
 void wlserver_refresh_cycle( struct wlr_surface *surface, uint64_t refresh_cycle );
+void wlserver_optimal_extent( struct wlr_surface *surface, uint32_t width, uint32_t height );
 
 void wlserver_app_presented( uint32_t app_id, uint64_t frametime_ns );
+void wlserver_send_app_vram_budget( uint32_t app_id, uint32_t usage_mib, uint32_t budget_mib );
 
 void wlserver_shutdown();
 
@@ -2,9 +2,11 @@
 
 #include "backend.h"
 #include "waitable.h"
+#include "Utils/FrameArena.h"
 
 #include <mutex>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include <X11/Xlib.h>
@@ -68,6 +70,10 @@ struct xwayland_ctx_t final : public gamescope::IWaitable
 	// wlserver wants it.
 	std::mutex list_mutex;
 	steamcompmgr_win_t				*list;
+	// Lookups into list by X window and by seq, so event handling does not
+	// have to walk every window. Kept in sync with list under list_mutex.
+	std::unordered_map< Window, steamcompmgr_win_t* > windowsByID;
+	std::unordered_map< uint64_t, steamcompmgr_win_t* > windowsBySeq;
 	int				scr;
 	Window			root;
 	XserverRegion	allDamage;
@@ -97,8 +103,11 @@ struct xwayland_ctx_t final : public gamescope::IWaitable
 
 	bool bTouchPointerEmulation = false;
 
-	std::vector< steamcompmgr_win_t* > GetPossibleFocusWindows();
-	void DetermineAndApplyFocus( const std::vector< steamcompmgr_win_t* > &vecPossibleFocusWindows );
+	gamescope::FrameVector< steamcompmgr_win_t* > GetPossibleFocusWindows();
+	// What GetPossibleFocusWindows last came up with, and at which focus serial.
+	std::vector< steamcompmgr_win_t* > vecCachedPossibleFocusWindows;
+	uint64_t ulPossibleFocusWindowsSerial = UINT64_MAX;
+	void DetermineAndApplyFocus( const gamescope::FrameVector< steamcompmgr_win_t* > &vecPossibleFocusWindows );
 
 	struct {
 		Atom steamAtom;